@@ -0,0 +1,485 @@
+"""
+Asyncio client for the column stripper serial protocol.
+
+Unlike DeviceConnection, which polls the port one byte at a time, this client
+reads in bulk, parses frames incrementally and can keep several requests in
+flight on one link. Only in tagged COBS framing, where every response repeats
+the tag of its request, since a response lost on the line would otherwise hand
+each later response to the wrong request. In the untagged framings one request
+is in flight at a time; the device answers in order, so responses are matched
+first-in, first-out.
+
+A single event loop can drive many devices at once through DeviceFleet:
+
+    async def main():
+        fleet = DeviceFleet()
+        await fleet.add_serial('unit1', '/dev/ttyACM0')
+        await fleet.add_serial('unit2', '/dev/ttyACM1')
+        states = await fleet.gather(lambda dev: dev.get_device_state())
+        await fleet.close()
+
+    asyncio.run(main())
+"""
+
+import asyncio
+import itertools
+import zlib
+from collections import OrderedDict, deque
+from typing import Awaitable, Callable, Dict, Iterable, List, Optional
+
+from device_connection import (DeviceState, parse_run_log_records, parse_channel_states, parse_step_jitter,
+                               parse_pulsation, pack_pulsation)
+from framing import FRAMING_RESET, CobsFrameParser, encode_cobs_frame
+from protocol import (START_SEQUENCE, FRAMING_COBS, FRAMING_COBS_TAGGED, FRAMING_START_SEQUENCE, Command, PUMP_COMMAND, PROGRAM_BLOCK_REQUEST,
+                      PROGRAM_LENGTH, RUN_LOG_REQUEST, SET_FRAMING_REQUEST, STREAM_START_REQUEST, STREAM_STEPS_REQUEST,
+                      STREAM_STATUS, MAX_STREAM_STEPS_PER_FRAME, UNDERRUN_HOLD, STREAM_RUNNING, STREAM_HOLDING, MIX_STATS,
+                      CHANNEL_VALVE_COMMAND, CHANNEL_PUMP_COMMAND, VALVE_REQUEST, VALVE_STATS, STEP_JITTER_REQUEST,
+                      PULSATION_REQUEST)
+from program import Program, ProgramConverter, ProgramStep
+
+MAX_PIPELINE_DEPTH = 4  # firmware handles one frame per ~10 ms and buffers the rest in the UART RX FIFO
+STALE_RESPONSE_DRAIN = 0.2  # s a timed out request keeps the untagged link, so a late answer is not taken for the next one's
+
+
+class FrameParser:
+    """Incremental parser for START_SEQUENCE | len | payload | crc32 frames.
+
+    Bytes outside frames are the device's debug prints; they are collected into
+    text lines. Frames with a bad checksum are skipped one byte at a time, so a
+    start sequence appearing inside debug output cannot swallow a real frame.
+    """
+
+    def __init__(self, on_debug_line: Optional[Callable[[str], None]] = None):
+        self.buffer = bytearray()
+        self.text = bytearray()
+        self.on_debug_line = on_debug_line
+        self.checksum_errors = 0
+
+    def feed(self, data: bytes) -> List[bytes]:
+        """Add received bytes, return the payloads of all frames completed by them"""
+        self.buffer += data
+        frames = []
+        while True:
+            start = self.buffer.find(START_SEQUENCE)
+            if start < 0:
+                # Keep a trailing first start byte, the second one may still be on its way
+                keep = 1 if self.buffer.endswith(START_SEQUENCE[:1]) else 0
+                self._add_text(self.buffer[:len(self.buffer) - keep])
+                del self.buffer[:len(self.buffer) - keep]
+                break
+            if start > 0:
+                self._add_text(self.buffer[:start])
+                del self.buffer[:start]
+            if len(self.buffer) < 3:
+                break
+            datalen = self.buffer[2]
+            if datalen < 4:
+                del self.buffer[:1]
+                continue
+            if len(self.buffer) < 3 + datalen:
+                break
+            frame = bytes(self.buffer[3:3 + datalen])
+            if zlib.crc32(frame[:-4]) == int.from_bytes(frame[-4:], 'big'):
+                frames.append(frame[:-4])
+                del self.buffer[:3 + datalen]
+            else:
+                self.checksum_errors += 1
+                self._add_text(self.buffer[:1])
+                del self.buffer[:1]
+        return frames
+
+    def _add_text(self, data: bytes):
+        if not data:
+            return
+        self.text += data
+        while b'\n' in self.text:
+            line, _, rest = self.text.partition(b'\n')
+            self.text = bytearray(rest)
+            line = line.decode('utf-8', errors='replace').strip()
+            if line and self.on_debug_line:
+                self.on_debug_line(line)
+
+
+def encode_frame(command_id: int, payload: Optional[bytes] = None) -> bytes:
+    data = bytes([command_id])
+    if payload is not None:
+        data = data + bytes(payload)
+    data = data + zlib.crc32(data).to_bytes(4, 'big')
+    return START_SEQUENCE + bytes([len(data)]) + data
+
+
+class AsyncDeviceConnection:
+    """One device link over any asyncio stream (serial port, TCP socket, emulator pty)"""
+
+    def __init__(self, reader: asyncio.StreamReader, writer: asyncio.StreamWriter,
+                 name: str = "device", debug_callback: Optional[Callable[[str], None]] = None,
+                 pipeline_depth: int = MAX_PIPELINE_DEPTH):
+        self.name = name
+        self.reader = reader
+        self.writer = writer
+        self.debug_callback = debug_callback
+        self.pipeline_depth = pipeline_depth
+        self._use_framing(FRAMING_START_SEQUENCE)
+        self.pending: 'OrderedDict[int, asyncio.Future]' = OrderedDict()  # by tag, oldest first
+        self.tags = itertools.cycle(range(256))
+        self.write_lock = asyncio.Lock()
+        self.reader_task = asyncio.get_running_loop().create_task(self._read_loop())
+
+    @classmethod
+    async def open_serial(cls, port: str, baudrate: int = 115200, framing: int = FRAMING_COBS_TAGGED,
+                          **kwargs) -> 'AsyncDeviceConnection':
+        import serial_asyncio  # pyserial-asyncio, only needed for real serial ports
+        reader, writer = await serial_asyncio.open_serial_connection(url=port, baudrate=baudrate)
+        conn = cls(reader, writer, name=kwargs.pop('name', port), **kwargs)
+        await conn._check_open(framing)
+        return conn
+
+    @classmethod
+    async def open_tcp(cls, host: str, port: int, framing: int = FRAMING_COBS_TAGGED,
+                       **kwargs) -> 'AsyncDeviceConnection':
+        reader, writer = await asyncio.open_connection(host, port)
+        conn = cls(reader, writer, name=kwargs.pop('name', f"{host}:{port}"), **kwargs)
+        await conn._check_open(framing)
+        return conn
+
+    async def _check_open(self, framing: int):
+        # Back to start sequence frames in case an earlier session left the device in COBS framing
+        self.writer.write(FRAMING_RESET)
+        if not await self.ping():
+            await self.close()
+            raise ConnectionError(f"{self.name}: failed to open connection")
+        if framing != FRAMING_START_SEQUENCE:
+            try:
+                await self.set_framing(framing)
+            except ValueError:
+                if framing != FRAMING_COBS_TAGGED:
+                    await self.close()
+                    raise
+                # Firmware from before tagged framing: keep start sequence frames, one request at a time
+                self._log_debug("[CONN] Tagged framing not supported, requests are not pipelined")
+            except ConnectionError:
+                await self.close()
+                raise
+        self._log_debug(f"[CONN] Connection to {self.name} established")
+
+    def _use_framing(self, framing: int):
+        self.framing = framing
+        parser = FrameParser if framing == FRAMING_START_SEQUENCE else CobsFrameParser
+        self.parser = parser(on_debug_line=lambda line: self._log_debug(f"[DEVICE] {line}"))
+        self.slots = asyncio.Semaphore(self.pipeline_depth if framing == FRAMING_COBS_TAGGED else 1)
+
+    async def set_framing(self, framing: int, timeout: float = 10):
+        """Switch the link to FRAMING_COBS_TAGGED, FRAMING_COBS or FRAMING_START_SEQUENCE; call with no requests in flight.
+
+        The device acks in the old framing and switches after sending the ack.
+        If the ack is lost the device may have switched anyway, so a lost ack
+        is resolved by pinging in the new framing.
+        """
+        loop = asyncio.get_running_loop()
+        deadline = loop.time() + timeout
+        old = self.framing
+        while True:
+            try:
+                resp = await self._try_send_command(Command.SET_FRAMING, SET_FRAMING_REQUEST.pack(framing), 0.5)
+                if resp != b'\x00':
+                    raise ValueError(f"{self.name}: framing {framing} rejected")
+                self._use_framing(framing)
+                return
+            except ConnectionError:
+                self._use_framing(framing)
+                if await self.ping():
+                    return
+                self._use_framing(old)
+                if loop.time() > deadline:
+                    raise ConnectionError(f"{self.name}: timeout")
+
+    async def close(self):
+        self.reader_task.cancel()
+        try:
+            await self.reader_task
+        except (asyncio.CancelledError, ConnectionError):
+            pass
+        self.writer.close()
+        self._fail_pending(ConnectionError(f"{self.name}: connection closed"))
+
+    def _log_debug(self, message: str):
+        if self.debug_callback:
+            self.debug_callback(f"[{self.name}] {message}")
+
+    def _fail_pending(self, exc: Exception):
+        while self.pending:
+            _, future = self.pending.popitem(last=False)
+            if not future.done():
+                future.set_exception(exc)
+
+    def _take_pending(self, frame: bytes):
+        """The request a response frame answers and the response data, or None if no request is waiting for it"""
+        if self.framing != FRAMING_COBS_TAGGED:
+            return (self.pending.popitem(last=False)[1], frame) if self.pending else None
+        future = self.pending.pop(frame[0], None) if frame else None
+        return (future, frame[1:]) if future else None
+
+    async def _read_loop(self):
+        try:
+            while True:
+                data = await self.reader.read(4096)
+                if not data:
+                    raise ConnectionError(f"{self.name}: connection lost")
+                for frame in self.parser.feed(data):
+                    match = self._take_pending(frame)
+                    if match:
+                        future, response = match
+                        if not future.done():
+                            future.set_result(response)
+                    else:
+                        self._log_debug(f"[CONN] Unexpected frame: {frame.hex()}")
+        except ConnectionError as e:
+            self._fail_pending(e)
+            raise
+
+    async def _try_send_command(self, command_id: int, payload: Optional[bytes], timeout: float) -> bytes:
+        async with self.slots:
+            future = asyncio.get_running_loop().create_future()
+            async with self.write_lock:
+                tag = next(self.tags)
+                while tag in self.pending:
+                    tag = next(self.tags)
+                self.pending[tag] = future
+                if self.framing == FRAMING_COBS_TAGGED:
+                    self.writer.write(encode_cobs_frame(bytes([tag, command_id]) + bytes(payload or b'')))
+                elif self.framing == FRAMING_COBS:
+                    self.writer.write(encode_cobs_frame(bytes([command_id]) + bytes(payload or b'')))
+                else:
+                    self.writer.write(encode_frame(command_id, payload))
+                await self.writer.drain()
+            try:
+                return await asyncio.wait_for(asyncio.shield(future), timeout)
+            except asyncio.TimeoutError:
+                # The request or its answer was lost on the line (the firmware silently drops
+                # frames with a bad checksum), or the answer is late. Forget the request and
+                # let the caller retry. Tagged, a late answer finds no request with its tag.
+                # Untagged it would be taken for the next request's answer, so the link stays
+                # blocked until it has had time to arrive; with nothing pending it is dropped.
+                if self.pending.get(tag) is future:
+                    del self.pending[tag]
+                future.cancel()
+                if self.framing != FRAMING_COBS_TAGGED:
+                    await asyncio.sleep(STALE_RESPONSE_DRAIN)
+                raise ConnectionError("timeout")
+
+    async def send_command(self, command_id: int, payload: Optional[bytes] = None, timeout: float = 10) -> bytes:
+        """Send a command and wait for its response, retrying like DeviceConnection.send_command"""
+        loop = asyncio.get_running_loop()
+        deadline = loop.time() + timeout
+        while True:
+            try:
+                return await self._try_send_command(command_id, payload, 0.5)
+            except ConnectionError:
+                if self.reader_task.done():
+                    raise ConnectionError(f"{self.name}: connection lost")
+                if loop.time() > deadline:
+                    raise ConnectionError(f"{self.name}: timeout")
+
+    async def ping(self) -> bool:
+        try:
+            resp = await self.send_command(Command.PING, timeout=2)
+            return len(resp) > 0 and resp[0] == 0
+        except ConnectionError:
+            return False
+
+    async def valve_command(self, reagent_valve_id: int, column_valve_id: int):
+        await self.send_command(Command.SET_VALVES, bytes([reagent_valve_id, column_valve_id]))
+
+    async def pump_command(self, command: float, acceleration: float):
+        await self.send_command(Command.SET_PUMP, PUMP_COMMAND.pack(command, acceleration))
+
+    async def channel_valve_command(self, channel: int, reagent_valve_id: int, column_valve_id: int) -> bool:
+        """Set the valves of one channel (pump with its reagent and column valve); False if there is no such channel"""
+        data = CHANNEL_VALVE_COMMAND.pack(channel, reagent_valve_id, column_valve_id)
+        return await self.send_command(Command.SET_CHANNEL_VALVES, data) == b'\x00'
+
+    async def channel_pump_command(self, channel: int, command: float, acceleration: float) -> bool:
+        data = CHANNEL_PUMP_COMMAND.pack(channel, command, acceleration)
+        return await self.send_command(Command.SET_CHANNEL_PUMP, data) == b'\x00'
+
+    async def get_channel_states(self) -> List[dict]:
+        return parse_channel_states(await self.send_command(Command.GET_CHANNEL_STATES))
+
+    async def get_device_state(self) -> DeviceState:
+        return DeviceState.from_bytes(await self.send_command(Command.GET_DEVICE_STATE))
+
+    async def get_program_length(self) -> int:
+        return PROGRAM_LENGTH.unpack(await self.send_command(Command.GET_PROGRAM_LENGTH)).length
+
+    async def get_max_program_length(self) -> int:
+        return PROGRAM_LENGTH.unpack(await self.send_command(Command.GET_PROGRAM_LENGTH)).max_length
+
+    async def read_program_steps(self) -> List[ProgramStep]:
+        """Read back the steps of the program loaded on the device"""
+        converter = ProgramConverter()
+        length = await self.get_program_length()
+        n = converter.max_steps_per_block
+        blocks = []
+        for first in range(0, length, n):
+            blocks.append(await self.send_command(Command.READ_PROGRAM_BLOCK, PROGRAM_BLOCK_REQUEST.pack(first, min(n, length - first))))
+        return converter.convert_from_raw_bytes({}, {}, blocks).steps
+
+    async def get_mix_stats(self) -> dict:
+        """Reagent shares of the current (or last) mixing step, counted in pump steps per valve port"""
+        return MIX_STATS.unpack(await self.send_command(Command.GET_MIX_STATS))._asdict()
+
+    async def get_valve_stats(self, valve: int) -> dict:
+        """Home position checks of one valve axis (passes, drift corrections), its speed profile and the autotune state"""
+        return VALVE_STATS.unpack(await self.send_command(Command.GET_VALVE_STATS, VALVE_REQUEST.pack(valve)))._asdict()
+
+    async def autotune_valve(self, valve: int) -> bool:
+        """Start the speed autotune of one valve axis; False if there is no such valve or the device is not idle"""
+        return await self.send_command(Command.AUTOTUNE_VALVE, VALVE_REQUEST.pack(valve)) == b'\x00'
+
+    async def get_step_jitter(self, reset: bool = False):
+        """Lateness of the step interrupts of every axis and of the control loop ticks, as (summary, records)"""
+        return parse_step_jitter(await self.send_command(Command.GET_STEP_JITTER, STEP_JITTER_REQUEST.pack(int(reset))))
+
+    async def get_pulsation(self, pump: int) -> dict:
+        """Pulsation compensation table of one pump, with its rotor position (steps since boot, modulo a revolution)"""
+        return parse_pulsation(await self.send_command(Command.GET_PULSATION, PULSATION_REQUEST.pack(pump)))
+
+    async def set_pulsation(self, pump: int, corrections: Iterable[int], phase: int, enabled: bool = True) -> bool:
+        """Load a pulsation compensation table; False if the device refuses it (see DeviceConnection.set_pulsation)"""
+        return await self.send_command(Command.SET_PULSATION, pack_pulsation(pump, corrections, phase, enabled)) == b'\x00'
+
+    async def get_run_log(self, first: int = 0) -> List[dict]:
+        """Run log records from index first (oldest is 0) to the end"""
+        records = []
+        while True:
+            block = parse_run_log_records(await self.send_command(Command.READ_RUN_LOG, RUN_LOG_REQUEST.pack(first + len(records))))
+            if not block:
+                break
+            records += block
+        return records
+
+    async def write_program(self, program: Program):
+        """Upload a program. Blocks are pipelined; if any of them is lost the upload is redone one block at a time."""
+        try:
+            await self._upload_program(program, pipelined=True)
+        except ConnectionError as e:
+            self._log_debug(f"[PROG] Pipelined upload failed ({e}), retrying block by block")
+            await self._upload_program(program, pipelined=False)
+
+    async def _upload_program(self, program: Program, pipelined: bool):
+        converter = ProgramConverter()
+        await self.send_command(Command.INIT_PROGRAM_WRITE)
+        await self._set_names(Command.SET_REAGENTS, program.reagents, converter.max_reagents, converter.max_reagent_name_len)
+        await self._set_names(Command.SET_COLUMNS, program.columns, converter.max_columns, converter.max_column_name_len)
+        max_len = await self.get_max_program_length()
+        raw_data = converter.convert_to_raw_bytes(program)
+        if len(program.steps) > max_len:
+            raise ValueError(f"{self.name}: program too long ({len(program.steps)} > {max_len})")
+        if pipelined:
+            # The device appends blocks in arrival order, so pipelined blocks are never retried individually
+            await asyncio.gather(*(self._try_send_command(Command.WRITE_PROGRAM_BLOCK, block, 2.0) for block in raw_data))
+        else:
+            for block in raw_data:
+                await self.send_command(Command.WRITE_PROGRAM_BLOCK, block)
+        uploaded_len = await self.get_program_length()
+        if uploaded_len != len(program.steps):
+            raise ConnectionError(f"{self.name}: program upload failed ({uploaded_len} != {len(program.steps)})")
+
+    async def _set_names(self, command_id: int, names: Dict[int, str], n: int, m: int):
+        names_bytes = bytearray(b'\0' * n * m)
+        for i, name in sorted(names.items()):
+            firmware_index = i - 1  # 1-based UI index to 0-based firmware index
+            names_bytes[firmware_index*m:(firmware_index*m+len(name))] = name.encode('utf-8')
+        await self.send_command(command_id, bytes(names_bytes))
+
+    async def execute_program(self):
+        await self.send_command(Command.EXECUTE_PROGRAM)
+
+    async def abort_program(self):
+        await self.send_command(Command.ABORT_PROGRAM)
+
+    async def stream_program(self, steps: Iterable[ProgramStep], underrun_policy: int = UNDERRUN_HOLD,
+                             poll_interval: float = 0.05) -> dict:
+        """Run steps as a host-fed program, without an upload and without a length limit.
+
+        steps may be a generator that produces them while the run goes on. The
+        device keeps a look-ahead of the next steps and reports its free slots
+        (credits) in every StreamStatus; requests carry the stream index of
+        their first step, so a retried request is not appended twice. Returns
+        the last StreamStatus once the stream is ended (the device still runs
+        the steps in its look-ahead, see wait_program_finished()) or stopped.
+        """
+        status = STREAM_STATUS.unpack(await self.send_command(Command.START_STREAM, STREAM_START_REQUEST.pack(underrun_policy)))
+        steps = iter(steps)
+        pending = deque()  # packed steps from stream index status.received on
+        exhausted = False
+        while True:
+            while not exhausted and len(pending) < MAX_STREAM_STEPS_PER_FRAME:
+                step = next(steps, None)
+                if step is None:
+                    exhausted = True
+                else:
+                    pending.append(ProgramConverter.pack_step(step))
+            if status.state not in (STREAM_RUNNING, STREAM_HOLDING) or (exhausted and not pending):
+                break
+            n = min(len(pending), status.credits)
+            if n == 0:
+                await asyncio.sleep(poll_interval)  # look-ahead full, the request only polls the status
+            received = status.received
+            payload = STREAM_STEPS_REQUEST.pack(received) + b''.join(itertools.islice(pending, n))
+            status = STREAM_STATUS.unpack(await self.send_command(Command.STREAM_STEPS, payload))
+            for _ in range(status.received - received):
+                pending.popleft()
+        if status.state in (STREAM_RUNNING, STREAM_HOLDING):
+            status = STREAM_STATUS.unpack(await self.send_command(Command.END_STREAM))
+        return status._asdict()
+
+    async def stream_state(self, interval: float = 0.1):
+        """Telemetry stream: yields DeviceState every interval seconds"""
+        loop = asyncio.get_running_loop()
+        next_time = loop.time()
+        while True:
+            yield await self.get_device_state()
+            next_time += interval
+            await asyncio.sleep(max(0.0, next_time - loop.time()))
+
+    async def wait_program_finished(self, interval: float = 0.5,
+                                    progress_callback: Optional[Callable[[DeviceState], None]] = None) -> DeviceState:
+        async for state in self.stream_state(interval):
+            if progress_callback:
+                progress_callback(state)
+            if not state.running:
+                return state
+
+
+class DeviceFleet:
+    """A set of device connections driven concurrently from one event loop"""
+
+    def __init__(self, debug_callback: Optional[Callable[[str], None]] = None):
+        self.devices: Dict[str, AsyncDeviceConnection] = {}
+        self.debug_callback = debug_callback
+
+    async def add_serial(self, name: str, port: str, baudrate: int = 115200) -> AsyncDeviceConnection:
+        conn = await AsyncDeviceConnection.open_serial(port, baudrate, name=name, debug_callback=self.debug_callback)
+        self.devices[name] = conn
+        return conn
+
+    async def add_tcp(self, name: str, host: str, port: int) -> AsyncDeviceConnection:
+        conn = await AsyncDeviceConnection.open_tcp(host, port, name=name, debug_callback=self.debug_callback)
+        self.devices[name] = conn
+        return conn
+
+    async def remove(self, name: str):
+        conn = self.devices.pop(name, None)
+        if conn:
+            await conn.close()
+
+    async def gather(self, action: Callable[[AsyncDeviceConnection], Awaitable]) -> Dict[str, object]:
+        """Run action on every device concurrently. Failures are returned as exceptions, not raised."""
+        names = list(self.devices)
+        results = await asyncio.gather(*(action(self.devices[n]) for n in names), return_exceptions=True)
+        return dict(zip(names, results))
+
+    async def close(self):
+        await asyncio.gather(*(conn.close() for conn in self.devices.values()), return_exceptions=True)
+        self.devices.clear()
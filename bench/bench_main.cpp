@@ -0,0 +1,1553 @@
+// Host-side benchmarks for the firmware hot paths.
+//
+// Built by the native_bench PlatformIO environment against the HAL shim in
+// bench/shim, so the real headers from include/ are measured unchanged:
+//
+//   pio run -e native_bench && .pio/build/native_bench/program [results.json]
+//
+// Results are printed as JSON (and optionally written to a file) so runs from
+// different versions can be compared with bench/compare.py.
+
+#include <chrono>
+#include <vector>
+#include <string>
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+#include "connection.h"
+#include "circular_buffer.h"
+#include "multi_HX711.h"
+#include "request_arena.h"
+
+volatile uint8_t hal_pins[kHalNumPins] = {0};
+volatile uint8_t hal_pin_modes[kHalNumPins] = {0};
+volatile uint32_t hal_pin_rises[kHalNumPins] = {0};
+uint64_t hal_time_us = 0;
+bool hal_manual_time = false;
+HardwareSerial Serial;
+TwoWire Wire;
+LittleFSFS LittleFS;
+
+uint64_t hal_host_micros() {
+  using namespace std::chrono;
+  static const auto start = steady_clock::now();
+  return duration_cast<microseconds>(steady_clock::now() - start).count();
+}
+
+constexpr double kMinBenchTimeS = 0.2;
+constexpr int kBenchRepetitions = 5;
+
+struct BenchResult {
+  std::string name;
+  std::string unit;
+  uint64_t ops;
+  double ns_per_op;
+  double instructions_per_op; // < 0 if the hardware counter is unavailable
+};
+
+// Retired user-space instructions via perf_event_open. Host instruction counts are
+// not Xtensa counts, but they track code-size changes in the hot paths (e.g. config
+// loads and branches folded into immediates) much more stably than wall time.
+class InstructionCounter {
+  public:
+    InstructionCounter() {
+#ifdef __linux__
+      perf_event_attr attr;
+      memset(&attr, 0, sizeof(attr));
+      attr.type = PERF_TYPE_HARDWARE;
+      attr.size = sizeof(attr);
+      attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+      attr.disabled = 1;
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      fd_ = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#endif
+    }
+    bool available() const { return fd_ >= 0; }
+    void start() {
+#ifdef __linux__
+      if (fd_ >= 0) {
+        ioctl(fd_, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd_, PERF_EVENT_IOC_ENABLE, 0);
+      }
+#endif
+    }
+    uint64_t stop() {
+      uint64_t count = 0;
+#ifdef __linux__
+      if (fd_ >= 0) {
+        ioctl(fd_, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(fd_, &count, sizeof(count)) != sizeof(count)) {
+          count = 0;
+        }
+      }
+#endif
+      return count;
+    }
+  private:
+    int fd_ = -1;
+};
+
+static InstructionCounter instruction_counter;
+
+static std::vector<BenchResult> results;
+static volatile uint32_t sink;
+
+// Runs fn (which performs ops_per_call operations) until kMinBenchTimeS has passed,
+// kBenchRepetitions times, and keeps the fastest repetition.
+template <typename F>
+void run_bench(const char* name, const char* unit, uint64_t ops_per_call, F fn) {
+  using clock = std::chrono::steady_clock;
+  double best_ns = 1e300;
+  uint64_t best_ops = 0;
+  for (int rep = 0; rep < kBenchRepetitions; rep++) {
+    uint64_t ops = 0;
+    auto start = clock::now();
+    double elapsed_s = 0;
+    do {
+      for (int i = 0; i < 64; i++) {
+        fn();
+      }
+      ops += 64 * ops_per_call;
+      elapsed_s = std::chrono::duration<double>(clock::now() - start).count();
+    } while (elapsed_s < kMinBenchTimeS);
+    double ns = elapsed_s * 1e9 / ops;
+    if (ns < best_ns) {
+      best_ns = ns;
+      best_ops = ops;
+    }
+  }
+
+  double instructions = -1;
+  if (instruction_counter.available()) {
+    constexpr int kCountedCalls = 4096;
+    instruction_counter.start();
+    for (int i = 0; i < kCountedCalls; i++) {
+      fn();
+    }
+    instructions = (double)instruction_counter.stop() / (kCountedCalls * ops_per_call);
+  }
+
+  results.push_back({name, unit, best_ops, best_ns, instructions});
+  fprintf(stderr, "%-28s %10.2f ns/%s  %8.1f instr/%s\n", name, best_ns, unit, instructions, unit);
+}
+
+// Builds a protocol frame exactly like SerialConnection::send_data does
+static void append_frame(std::vector<uint8_t>& out, const uint8_t* payload, uint8_t len) {
+  out.push_back(kStartSeq[0]);
+  out.push_back(kStartSeq[1]);
+  out.push_back(len + 4);
+  out.insert(out.end(), payload, payload + len);
+  CRC32 crc;
+  crc.update(payload, len);
+  uint32_t c = crc.finalize();
+  out.push_back(c >> 24);
+  out.push_back(c >> 16);
+  out.push_back(c >> 8);
+  out.push_back(c);
+}
+
+static void bench_pump_step() {
+  device.pump.enable();
+  device.pump.set_pump(PumpCommand{.pump_cmd = 5.0, .acceleration = 1000.0});
+  device.pump.update_speed();
+  run_bench("pump_step", "step", 1, [] {
+    sink += device.pump.step();
+  });
+  // The same with a pulsation table: one bin lookup per half step
+  int16_t corrections[kPulsationBins] = {0};
+  corrections[0] = 500;
+  corrections[1] = -500;
+  device.pump.set_pulsation(corrections, 0, true);
+  run_bench("pump_step_compensated", "step", 1, [] {
+    sink += device.pump.step();
+  });
+  device.pump.set_pulsation(corrections, 0, false);
+}
+
+static void bench_pump_update_speed() {
+  device.pump.enable();
+  float cmd = 5.0;
+  device.pump.set_pump(PumpCommand{.pump_cmd = cmd, .acceleration = 5.0});
+  run_bench("pump_update_speed", "update", 1, [&] {
+    // Ramp back and forth between full speed in both directions, like the control loop does
+    if (device.pump.get_current_speed() == cmd) {
+      cmd = -cmd;
+      device.pump.set_pump(PumpCommand{.pump_cmd = cmd, .acceleration = 5.0});
+    }
+    device.pump.update_speed();
+  });
+}
+
+static void bench_valve_update() {
+  // Limit switch held active so homing completes on the first update
+  hal_pins[reagent_valve_config.limit_switch_pin] = HIGH;
+  uint8_t port = 0;
+  device.reagent_valve.set_position(port);
+  run_bench("valve_update", "update", 1, [&] {
+    if (device.reagent_valve.reached_target() && device.reagent_valve.get_state() == STATE_STOP) {
+      port = (port + 3) % kNumValvePorts;
+      device.reagent_valve.set_position(port);
+    }
+    sink += device.reagent_valve.update();
+  });
+}
+
+static void bench_receive_bytes(SerialConnection& connection) {
+  std::vector<uint8_t> stream;
+  uint8_t payload[17] = {2};
+  constexpr int kFrames = 256;
+  for (int i = 0; i < kFrames; i++) {
+    payload[1] = i;
+    stream.push_back('\n'); // debug output between frames must be skipped
+    append_frame(stream, payload, sizeof(payload));
+  }
+  // Frozen clock: the stream ends on a frame, so receive_packet never has to time out
+  hal_manual_time = true;
+  run_bench("receive_byte", "byte", stream.size(), [&] {
+    Serial.set_rx(stream.data(), stream.size());
+    uint8_t* data_ptr = nullptr;
+    int data_length = 0;
+    while (Serial.available() > 0) {
+      if (connection.receive_packet(0, &data_ptr, &data_length)) {
+        sink += data_ptr[1];
+      }
+    }
+  });
+  hal_manual_time = false;
+}
+
+static void bench_send_frame(SerialConnection& connection) {
+  uint8_t payload[sizeof(DeviceState)] = {0};
+  run_bench("send_frame", "frame", 1, [&] {
+    payload[0]++;
+    connection.send_data(payload, sizeof(payload));
+  });
+}
+
+// Full command path: frame receive, table dispatch, handler, response and service time statistics
+static void bench_handle_command(SerialConnection& connection, Program& program, ProgramLoader& program_loader,
+                                 ProgramExecutor& program_executor) {
+  std::vector<uint8_t> stream;
+  uint8_t payload[1] = {protocol::CMD_GET_DEVICE_STATE};
+  append_frame(stream, payload, sizeof(payload));
+  run_bench("handle_command", "command", 1, [&] {
+    Serial.set_rx(stream.data(), stream.size());
+    handle_communication(connection, program, program_loader, program_executor);
+  });
+}
+
+static void bench_filter_sample() {
+  static CircularBuffer filter(16);
+  float x = 0;
+  run_bench("filter_sample", "sample", 1, [&] {
+    x += 0.5f;
+    filter.push_back(x);
+    sink += (uint32_t)filter.get_average();
+  });
+}
+
+static void bench_hx711_conversion() {
+  static MultiHX711 hx711(config);
+  int32_t raw = 0x123456;
+  run_bench("hx711_raw_to_grams", "sample", kNumHX711, [&] {
+    raw ^= 0x55;
+    float sum = 0;
+    for (int i = 0; i < kNumHX711; i++) {
+      sum += hx711.raw_to_grams(raw, i);
+    }
+    sink += (uint32_t)sum;
+  });
+}
+
+static void bench_executor_tick(Program& program, ProgramExecutor& program_executor) {
+  ProgramStep step{.reagent_valve_id = 0xff, .column_valve_id = 0xff, .ramp_end_flow = 0,
+                   .flow_rate = 1.0, .volume = INFINITY, .duration = 1e6};
+  program.clear();
+  program.write_at(0, &step);
+  program_executor.execute();
+  run_bench("executor_tick", "tick", 1, [&] {
+    program_executor.step();
+  });
+  run_bench("control_loop_tick", "tick", 1, [&] {
+    device.update_speed();
+    device.update();
+    program_executor.step();
+    status_cache.update(device);
+  });
+  program_executor.abort();
+}
+
+// Rendering cost when the status changes every tick (pumping), paid once however many clients poll
+static void bench_status_render() {
+  float volume = 0;
+  run_bench("status_render", "render", 1, [&] {
+    device.device_state.pump_volume = volume += 0.075f;
+    sink += status_cache.update(device);
+  });
+}
+
+// Step interrupt overhead of the jitter counters
+static void bench_step_jitter_record() {
+  static StepJitter jitter;
+  uint32_t late = 0;
+  run_bench("step_jitter_record", "record", 1, [&] {
+    jitter.record(late++ & 63);
+  });
+  sink += jitter.samples();
+}
+
+// One web API request: a JSON document from the arena, shrunk to its content, then the response text
+static void bench_request_arena() {
+  static RequestArenaPool pool;
+  run_bench("request_arena", "request", 1, [&] {
+    RequestArena* arena = pool.acquire();
+    void* doc = arena->allocate(4096);
+    doc = arena->reallocate(doc, 1200);
+    sink += (uintptr_t)arena->allocate(900);
+    pool.release(arena);
+  });
+}
+
+// Alignment, growing and shrinking the last allocation only, exhaustion of one
+// arena and of the pool, and a soak of 100k requests with kRequestArenas of them
+// overlapping that must leave every arena free. Returns the number of mismatches.
+static int verify_request_arena() {
+  int errors = 0;
+  static RequestArenaPool pool;
+  RequestArena* arena = pool.acquire();
+  uint8_t* a = (uint8_t*)arena->allocate(3);
+  uint8_t* b = (uint8_t*)arena->allocate(10);
+  if (a == nullptr || b != a + kRequestArenaAlign || arena->used() != kRequestArenaAlign + 10) {
+    fprintf(stderr, "request arena: allocations not aligned to %zu bytes\n", kRequestArenaAlign);
+    errors++;
+  }
+  if (arena->reallocate(a, 64) != nullptr || arena->reallocate(b, 100) != b ||
+      arena->used() != kRequestArenaAlign + 100 || arena->reallocate(b, kRequestArenaSize) != nullptr) {
+    fprintf(stderr, "request arena: reallocate did not resize only the last allocation within the arena\n");
+    errors++;
+  }
+  if (arena->allocate(kRequestArenaSize) != nullptr || arena->allocate(kRequestArenaSize - 128) == nullptr ||
+      arena->allocate(SIZE_MAX) != nullptr) {
+    fprintf(stderr, "request arena: overflow not refused, or the free space not usable\n");
+    errors++;
+  }
+  for (uint8_t i = 1; i < kRequestArenas; i++) {
+    pool.acquire();
+  }
+  if (pool.acquire() != nullptr || pool.busy_rejects() != 1 || pool.in_use() != kRequestArenas) {
+    fprintf(stderr, "request arena: %u of %u arenas in use, %u rejects\n", pool.in_use(), kRequestArenas,
+            pool.busy_rejects());
+    errors++;
+  }
+  pool.release(arena);
+  RequestArena* again = pool.acquire();
+  if (again != arena || again->used() != 0) {
+    fprintf(stderr, "request arena: a released arena is not handed out again reset\n");
+    errors++;
+  }
+
+  // Requests released in the order they were taken, a connection closing while others are open
+  static RequestArenaPool soak;
+  RequestArena* open[kRequestArenas] = {nullptr};
+  for (uint32_t i = 0; i < 100000; i++) {
+    RequestArena*& slot = open[i % kRequestArenas];
+    if (slot != nullptr) {
+      soak.release(slot);
+    }
+    slot = soak.acquire();
+    size_t text = 200 + i % 3000;
+    void* doc = slot ? slot->allocate(4096) : nullptr;
+    if (doc == nullptr || slot->reallocate(doc, text) != doc || slot->allocate(text) == nullptr) {
+      fprintf(stderr, "request arena: request %u did not get its arena\n", i);
+      errors++;
+      break;
+    }
+  }
+  for (RequestArena* slot : open) {
+    soak.release(slot);
+  }
+  if (soak.in_use() != 0 || soak.busy_rejects() != 0 || soak.high_water() > kRequestArenaSize) {
+    fprintf(stderr, "request arena: soak left %u arenas in use, %u rejects\n", soak.in_use(), soak.busy_rejects());
+    errors++;
+  }
+  return errors;
+}
+
+// Counts, maximum and late steps of the jitter counters, and a reset requested
+// outside the interrupt taking effect at the next record. Returns the number of mismatches.
+static int verify_step_jitter() {
+  int errors = 0;
+  static StepJitter jitter;
+  for (uint32_t late_us : {10u, kLateStepUs + 10, 30u}) {
+    jitter.record(late_us);
+  }
+  if (jitter.samples() != 3 || jitter.max_us() != kLateStepUs + 10 || jitter.late() != 1 ||
+      fabsf(jitter.mean_us() - (50.0f + kLateStepUs) / 3) > 1e-3f || jitter.core() != xPortGetCoreID()) {
+    fprintf(stderr, "step jitter: %u samples, max %u us, %u late, mean %.2f us\n", jitter.samples(), jitter.max_us(),
+            jitter.late(), jitter.mean_us());
+    errors++;
+  }
+  jitter.reset();
+  if (jitter.samples() != 0 || jitter.max_us() != 0 || jitter.mean_us() != 0.0f) {
+    fprintf(stderr, "step jitter: counts still reported after reset\n");
+    errors++;
+  }
+  jitter.record(5);
+  if (jitter.samples() != 1 || jitter.max_us() != 5 || jitter.late() != 0 || jitter.mean_us() != 5.0f) {
+    fprintf(stderr, "step jitter: %u samples, max %u us after reset\n", jitter.samples(), jitter.max_us());
+    errors++;
+  }
+  return errors;
+}
+
+// The cache must render only on a change, flip slots on each render and produce
+// the same keys as DeviceState. Returns the number of mismatches.
+static int verify_status_cache() {
+  int errors = 0;
+  device.update();
+  status_cache.update(device);
+  const StatusSnapshot* first = &status_cache.front();
+  uint32_t generation = first->generation;
+  DeviceState first_state = first->state;
+  if (status_cache.update(device) || &status_cache.front() != first) {
+    fprintf(stderr, "status cache: rendered without a change\n");
+    errors++;
+  }
+  device.device_state.program_step_idx = 1234;
+  device.device_state.pump_volume = 123456789.0f;
+  if (!status_cache.update(device) || &status_cache.front() == first || status_cache.front().generation != generation + 1) {
+    fprintf(stderr, "status cache: change not rendered into the other slot\n");
+    errors++;
+  }
+  const StatusSnapshot& status = status_cache.front();
+  std::string json(status.json, status.json_len);
+  if (status.json_len >= kStatusJsonSize || json.find("\"program_step_idx\":1234,") == std::string::npos ||
+      json.find("\"pump_volume\":123456792.000,") == std::string::npos || json.find("\"channels\":[{") == std::string::npos ||
+      json.back() != '}' || memcmp(&status.state, &device.device_state, sizeof(DeviceState)) != 0) {
+    fprintf(stderr, "status cache: unexpected JSON %s\n", json.c_str());
+    errors++;
+  }
+  // The previous front slot may still be in a handler's copy: an unchanged tick must leave it alone
+  if (status_cache.update(device) || memcmp(&first->state, &first_state, sizeof(DeviceState)) != 0 ||
+      first->generation != generation) {
+    fprintf(stderr, "status cache: back slot rewritten without a change\n");
+    errors++;
+  }
+  device.device_state.program_step_idx = 0;
+  device.device_state.pump_volume = 0;
+  status_cache.update(device);
+  return errors;
+}
+
+static std::vector<uint8_t> byte_range(int first, int end) {
+  std::vector<uint8_t> v;
+  for (int b = first; b < end; b++) {
+    v.push_back(b);
+  }
+  return v;
+}
+
+static std::vector<uint8_t> concat(std::vector<uint8_t> a, const std::vector<uint8_t>& b) {
+  a.insert(a.end(), b.begin(), b.end());
+  return a;
+}
+
+static void append_cobs_frame(std::vector<uint8_t>& out, const uint8_t* payload, int len) {
+  uint8_t encoded[cobs_max_encoded_size(300)];
+  CobsEncoder encoder(encoded);
+  encoder.put(payload, len);
+  CRC32 crc;
+  crc.update(payload, len);
+  uint32_t c = crc.finalize();
+  uint8_t crc_bytes[4] = {(uint8_t)(c >> 24), (uint8_t)(c >> 16), (uint8_t)(c >> 8), (uint8_t)c};
+  encoder.put(crc_bytes, 4);
+  int n = encoder.finish();
+  out.push_back(0);
+  out.insert(out.end(), encoded, encoded + n);
+  out.push_back(0);
+}
+
+// Checks the COBS codec against the vectors in framing.py (COBS_VECTORS), which
+// bench/protocol_bench.py checks the host codec against, and the receiver's
+// recovery from line noise. Returns the number of mismatches.
+static int verify_cobs_framing(SerialConnection& connection) {
+  int errors = 0;
+  const std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t>>> kVectors = {
+    {{0x00}, {0x01, 0x01}},
+    {{0x00, 0x00}, {0x01, 0x01, 0x01}},
+    {{0x00, 0x11, 0x00}, {0x01, 0x02, 0x11, 0x01}},
+    {{0x11, 0x22, 0x00, 0x33}, {0x03, 0x11, 0x22, 0x02, 0x33}},
+    {{0x11, 0x22, 0x33, 0x44}, {0x05, 0x11, 0x22, 0x33, 0x44}},
+    {{0x11, 0x00, 0x00, 0x00}, {0x02, 0x11, 0x01, 0x01, 0x01}},
+    {byte_range(0x01, 0xff), concat({0xff}, byte_range(0x01, 0xff))},
+    {byte_range(0x00, 0xff), concat({0x01, 0xff}, byte_range(0x01, 0xff))},
+    {byte_range(0x01, 0x100), concat(concat({0xff}, byte_range(0x01, 0xff)), {0x02, 0xff})},
+    {concat(byte_range(0x02, 0x100), {0x00}), concat(concat({0xff}, byte_range(0x02, 0x100)), {0x01, 0x01})},
+    {concat(byte_range(0x03, 0x100), {0x00, 0x01}), concat(concat({0xfe}, byte_range(0x03, 0x100)), {0x02, 0x01})},
+  };
+  for (size_t i = 0; i < kVectors.size(); i++) {
+    const std::vector<uint8_t>& decoded = kVectors[i].first;
+    const std::vector<uint8_t>& encoded = kVectors[i].second;
+    uint8_t out[cobs_max_encoded_size(300)];
+    CobsEncoder encoder(out);
+    encoder.put(decoded.data(), decoded.size());
+    int n = encoder.finish();
+    if (std::vector<uint8_t>(out, out + n) != encoded) {
+      fprintf(stderr, "COBS vector %zu: encoding mismatch\n", i);
+      errors++;
+    }
+    uint8_t in[300];
+    CobsDecoder decoder(in, sizeof(in));
+    CobsDecoder::Result result = CobsDecoder::COBS_IN_PROGRESS;
+    for (uint8_t b : encoded) {
+      result = decoder.feed(b);
+    }
+    result = decoder.feed(0);
+    if (result != CobsDecoder::COBS_FRAME || std::vector<uint8_t>(in, in + decoder.length()) != decoded) {
+      fprintf(stderr, "COBS vector %zu: decoding mismatch\n", i);
+      errors++;
+    }
+  }
+
+  // Noise between and inside frames: only the frame it hits is lost
+  std::vector<uint8_t> stream;
+  uint8_t payload[17] = {2, 0, 0x21, 0x37, 0};
+  for (int i = 0; i < 8; i++) {
+    payload[1] = i;
+    append_cobs_frame(stream, payload, sizeof(payload));
+    if (i == 3) {
+      stream[stream.size() - 6] ^= 0x40;  // damaged frame
+      stream.push_back(0x21);             // noise that looks like a start sequence
+      stream.push_back(0x37);
+      stream.push_back(0xff);
+    }
+  }
+  connection.set_framing(protocol::kFramingCobs);
+  hal_manual_time = true;
+  Serial.set_rx(stream.data(), stream.size());
+  uint8_t* data_ptr = nullptr;
+  int data_length = 0;
+  int received = 0;
+  while (Serial.available() > 0) {
+    if (connection.receive_packet(0, &data_ptr, &data_length)) {
+      if (data_length != (int)sizeof(payload) + 4 || data_ptr[1] != received + (received >= 3)) {
+        fprintf(stderr, "COBS receiver: unexpected frame %d\n", data_ptr[1]);
+        errors++;
+      }
+      received++;
+    }
+  }
+  if (received != 7) {
+    fprintf(stderr, "COBS receiver: %d of 7 undamaged frames received\n", received);
+    errors++;
+  }
+
+  // Tagged framing: the tag is stripped from the request and leads the response
+  connection.set_framing(protocol::kFramingCobsTagged);
+  const uint8_t tagged[] = {0xa5, 0, 7};  // tag, command id, data
+  stream.clear();
+  append_cobs_frame(stream, tagged, sizeof(tagged));
+  Serial.set_rx(stream.data(), stream.size());
+  if (!connection.receive_packet(0, &data_ptr, &data_length) || data_length != 2 + 4 || data_ptr[0] != 0 || data_ptr[1] != 7) {
+    fprintf(stderr, "COBS receiver: tagged request not unwrapped\n");
+    errors++;
+  }
+  uint8_t sent[32];
+  Serial.set_tx(sent, sizeof(sent));
+  const uint8_t ack[] = {0};
+  connection.send_data(ack, sizeof(ack));
+  std::vector<uint8_t> expected;
+  const uint8_t tagged_ack[] = {0xa5, 0};
+  append_cobs_frame(expected, tagged_ack, sizeof(tagged_ack));
+  if (std::vector<uint8_t>(sent, sent + Serial.tx_len()) != expected) {
+    fprintf(stderr, "COBS sender: response does not echo the request tag\n");
+    errors++;
+  }
+  Serial.set_tx(nullptr, 0);
+  hal_manual_time = false;
+  connection.set_framing(protocol::kFramingStartSequence);
+  return errors;
+}
+
+// try_send_data(): in every framing, a frame goes out whole when the TX ring has
+// room for frame_size() bytes and is dropped untouched when it has not. Returns
+// the number of mismatches.
+static int verify_tx_backpressure(SerialConnection& connection) {
+  int errors = 0;
+  const int room = Serial.availableForWrite();
+  uint8_t data[255];
+  for (int i = 0; i < (int)sizeof(data); i++) {
+    data[i] = i % 3 ? i : 0;  // zeros make COBS code bytes
+  }
+  static uint8_t sent[kTxFrameSize];
+  for (uint8_t framing : {protocol::kFramingStartSequence, protocol::kFramingCobs, protocol::kFramingCobsTagged}) {
+    connection.set_framing(framing);
+    for (int len : {0, 1, 20, 254, 255}) {
+      Serial.setTxBufferSize(frame_size(framing, len));
+      Serial.set_tx(sent, sizeof(sent));
+      if (!connection.try_send_data(data, len) || Serial.tx_len() == 0 || (int)Serial.tx_len() > frame_size(framing, len)) {
+        fprintf(stderr, "try_send_data: framing %u, %d bytes: %zu of at most %d sent\n", framing, len, Serial.tx_len(),
+                frame_size(framing, len));
+        errors++;
+      }
+      uint32_t dropped = connection.tx_dropped();
+      Serial.setTxBufferSize(frame_size(framing, len) - 1);
+      Serial.set_tx(sent, sizeof(sent));
+      if (connection.try_send_data(data, len) || Serial.tx_len() != 0 || connection.tx_dropped() != dropped + 1) {
+        fprintf(stderr, "try_send_data: framing %u, %d bytes: full TX ring not reported\n", framing, len);
+        errors++;
+      }
+    }
+  }
+  Serial.set_tx(nullptr, 0);
+  Serial.setTxBufferSize(room);
+  connection.set_framing(protocol::kFramingStartSequence);
+  return errors;
+}
+
+// Drives a host-fed run through the executor on the manual clock: repeated and
+// out of order pushes, an underrun under both policies, the end of the stream
+// and a stored program run after an aborted stream. Returns the number of mismatches.
+static int verify_step_stream(Program& program, ProgramExecutor& program_executor) {
+  int errors = 0;
+  ProgramStep steps[4];
+  for (int i = 0; i < 4; i++) {
+    steps[i] = ProgramStep{.reagent_valve_id = 0xff, .column_valve_id = 0xff, .ramp_end_flow = 0,
+                           .flow_rate = 0.0, .volume = INFINITY, .duration = 0.01};
+  }
+  const uint8_t* data = (const uint8_t*)steps;
+  auto run_for_ms = [&](int ms) {
+    for (int i = 0; i < ms; i++) {
+      hal_time_us += 1000;
+      program_executor.step();
+    }
+  };
+  auto expect = [&](const char* what, uint8_t state, uint32_t received, uint32_t started, uint32_t underruns) {
+    uint8_t buffer[protocol::StreamStatusView::kSize];
+    program_executor.stream().get_status(buffer);
+    protocol::StreamStatusView status(buffer);
+    if (status.state() != state || status.received() != received || status.started() != started || status.underruns() != underruns) {
+      fprintf(stderr, "step stream %s: state %u received %u started %u underruns %u\n", what,
+              status.state(), status.received(), status.started(), status.underruns());
+      errors++;
+    }
+  };
+
+  hal_manual_time = true;
+  program_executor.execute_stream(protocol::kUnderrunHold);
+  program_executor.stream().push(0, data, 3);
+  program_executor.stream().push(0, data, 3);  // repeated after a lost response
+  program_executor.stream().push(5, data, 1);  // gap, nothing accepted
+  expect("push", protocol::kStreamHolding, 3, 0, 0);
+  run_for_ms(50);
+  expect("hold", protocol::kStreamHolding, 3, 3, 1);
+  program_executor.stream().push(3, data, 1);
+  program_executor.stream().end();
+  run_for_ms(50);
+  expect("end", protocol::kStreamFinished, 4, 4, 1);
+
+  program_executor.execute_stream(protocol::kUnderrunStop);
+  program_executor.stream().push(0, data, 1);
+  run_for_ms(50);
+  program_executor.stream().push(1, data, 1);  // too late, the run has stopped
+  expect("stop", protocol::kStreamStopped, 1, 1, 1);
+  if (program_executor.is_running()) {
+    fprintf(stderr, "step stream stop: still running\n");
+    errors++;
+  }
+
+  // Aborted while waiting for its first step: the stored program must run, not hold
+  ProgramStep stored{.reagent_valve_id = 0xff, .column_valve_id = 0xff, .ramp_end_flow = 0,
+                     .flow_rate = 0.0, .volume = INFINITY, .duration = 0.5};
+  program.clear();
+  program.write_at(0, &stored);
+  program_executor.execute_stream(protocol::kUnderrunHold);
+  program_executor.abort();
+  program_executor.execute();
+  run_for_ms(1000);
+  if (program_executor.is_running()) {
+    fprintf(stderr, "step stream abort: the stored program held instead of running\n");
+    errors++;
+    program_executor.abort();
+  }
+  hal_manual_time = false;
+  return errors;
+}
+
+// Checks the ramp_end_flow encoding and that the executor's set speed follows a
+// flow ramp. Returns the number of mismatches.
+static int verify_flow_ramp(Program& program, ProgramExecutor& program_executor) {
+  int errors = 0;
+  const float kFlows[][2] = {{0.0, 0.0}, {-0.5, -0.5}, {4.321, 4.321}, {10.0, 10.0}, {100.0, 32.767}, {-100.0, -32.767}};
+  for (auto& f : kFlows) {
+    uint16_t encoded = encode_ramp_end_flow(f[0]);
+    if (encoded == 0 || fabsf(decode_ramp_end_flow(encoded) - f[1]) > 0.0005f) {
+      fprintf(stderr, "ramp end flow %.3f: encoded %u, decoded %.4f\n", f[0], encoded, decode_ramp_end_flow(encoded));
+      errors++;
+    }
+  }
+
+  ProgramStep step{.reagent_valve_id = 0xff, .column_valve_id = 0xff, .ramp_end_flow = encode_ramp_end_flow(7.0),
+                   .flow_rate = 1.0, .volume = INFINITY, .duration = 10.0};
+  program.clear();
+  program.write_at(0, &step);
+  hal_manual_time = true;
+  program_executor.execute();
+  for (int t = 0; t <= 10000; t += 10) {
+    if (t == 5000 && fabsf(device.pump.get_current_speed() - 4.0f) > 0.1f) {
+      fprintf(stderr, "flow ramp: %.3f mL/min halfway, expected 4.0\n", device.pump.get_current_speed());
+      errors++;
+    }
+    hal_time_us += 10000;
+    device.update_speed();
+    device.update();
+    program_executor.step();
+  }
+  program_executor.abort();
+  hal_manual_time = false;
+  return errors;
+}
+
+// Next due time of each axis step timer, pumps first
+struct AxisTimers {
+  int64_t due[kMaxPumps + kMaxValves] = {0};
+};
+
+// Runs the control loop of d and the step timers of all its axes on the manual clock
+static void simulate_device(Device& d, AxisTimers& timers, int ms, ProgramExecutor* program_executor) {
+  int n_axes = d.num_pumps() + d.num_valves();
+  int64_t end = hal_time_us + int64_t(ms) * 1000;
+  while ((int64_t)hal_time_us < end) {
+    int64_t tick_end = hal_time_us + 10000;
+    for (int64_t t = hal_time_us; t < tick_end;) {
+      hal_time_us = t;
+      int64_t next = tick_end;
+      for (int i = 0; i < n_axes; i++) {
+        if (timers.due[i] <= t) {
+          timers.due[i] = t + (i < d.num_pumps() ? d.pump_axis(i)->step() : d.valve_axis(i - d.num_pumps())->update());
+        }
+        next = std::min(next, timers.due[i]);
+      }
+      t = next;
+    }
+    hal_time_us = tick_end;
+    d.update_speed();
+    d.update();
+    if (program_executor) {
+      program_executor->step();
+    }
+  }
+}
+
+static void simulate_control_loop(ProgramExecutor& program_executor, int ms) {
+  static AxisTimers timers;
+  simulate_device(device, timers, ms, &program_executor);
+}
+
+// Pump on free pins, with its step pin driven by LEDC and counted by PCNT at constant speed (pulse_output.h)
+constexpr PumpControlConfig bench_pulse_pump_config{
+  .enable_pin = 37, .direction_pin = 38, .step_pin = 39, .dt = 0.01, .invert_direction = true,
+  .steps_per_revolution = 200 * 8, .volume_per_step = 0.0752192, .direction_setup_us = 5,
+};
+
+struct PulseRun {
+  uint32_t steps = 0;               // PCNT count, or the software count without a pulse output
+  uint32_t cruise_interrupts = 0;   // step timer calls from 5 s to 25 s
+  uint32_t count_errors = 0;        // ticks at which the count differed from the edges on the pin
+  bool released = false;            // at the end the pump is stopped and LEDC no longer drives the pin
+};
+
+static uint32_t bench_targets_reached = 0;
+static float bench_target_volume = 0;
+static float bench_volume_at_target = 0;
+static PumpAxis* bench_target_pump = nullptr;
+
+static void bench_on_target() {
+  bench_targets_reached++;
+  bench_volume_at_target = bench_target_pump->get_volume();
+}
+
+// 5 mL/min for 40 s between two 0.5 s ramps, on the manual clock. The PCNT interrupt
+// is held off from 27 s to 31 s, over the first wrap of its counter; volume targets
+// are set at 10 s (within the counter window) and at 22.5 s (in the next one).
+template <typename Pump>
+static PulseRun run_pulse_pump(Pump& pump, PulseOutput* output) {
+  PulseRun run;
+  constexpr uint8_t kPin = bench_pulse_pump_config.step_pin;
+  hal_manual_time = true;
+  pump.initialize();
+  uint32_t edges_at_start = hal_pin_rises[kPin] + hal_ledc.pin_edges(kPin);
+  if (output) {
+    output->begin(kPin, LEDC_TIMER_2, LEDC_CHANNEL_2, PCNT_UNIT_2, &bench_on_target);
+    pump.attach_pulse_output(output);
+  }
+  pump.set_pump(PumpCommand{.pump_cmd = 5.0, .acceleration = 10.0});
+  int64_t due = hal_time_us;
+  int64_t start = hal_time_us;
+  for (int tick = 1; tick <= 4100; tick++) {
+    int64_t tick_end = start + int64_t(tick) * 10000;
+    while (due < tick_end) {
+      hal_time_us = due;
+      due += pump.step();
+      if (tick > 500 && tick <= 2500) {
+        run.cruise_interrupts++;
+      }
+    }
+    hal_time_us = tick_end;
+    if (tick < 2700 || tick > 3100) {
+      hal_pcnt_service();
+    }
+    if (tick == 1000 || tick == 2250) {
+      pump.reset_volume();
+      bench_target_volume = 1000.0f; // uL, about 12 s
+      pump.set_volume_target(bench_target_volume);
+    }
+    if (tick == 4000) {
+      pump.set_pump(PumpCommand{.pump_cmd = 0.0, .acceleration = 10.0});
+    }
+    pump.update_speed();
+    uint32_t edges = hal_pin_rises[kPin] + hal_ledc.pin_edges(kPin) - edges_at_start;
+    if (output && pump.get_total_steps() != edges) {
+      run.count_errors++;
+    }
+  }
+  hal_manual_time = false;
+  run.steps = output ? output->count() : pump.get_total_steps();
+  run.released = pump.is_stopped() && hal_ledc.pin_edges(kPin) == hal_ledc.edges[kPin] && !(output && output->running());
+  return run;
+}
+
+// LEDC stepping at constant speed must give the same steps as software stepping,
+// with a fraction of the step interrupts, and PCNT must count every step with its
+// interrupt held off over a wrap. Volume targets must call the handler once, at the
+// target. Returns the number of mismatches.
+static int verify_pulse_output() {
+  int errors = 0;
+  static PumpControl<bench_pulse_pump_config> software_pump;
+  static PumpControl<bench_pulse_pump_config> pulse_pump;
+  static PulseOutput output;
+  PulseRun software = run_pulse_pump(software_pump, nullptr);
+  bench_target_pump = &pulse_pump;
+  PulseRun pulse = run_pulse_pump(pulse_pump, &output);
+
+  int32_t diff = (int32_t)(pulse.steps - software.steps);
+  if (diff < -2 || diff > 2 || pulse.count_errors != 0) {
+    fprintf(stderr, "pulse output: %u steps, %u in software, %u ticks with a count not matching the pin\n",
+            pulse.steps, software.steps, pulse.count_errors);
+    errors++;
+  }
+  if (pulse.cruise_interrupts * 20 > software.cruise_interrupts || pulse.cruise_interrupts < 1900) {
+    fprintf(stderr, "pulse output: %u step interrupts at constant speed, %u in software\n", pulse.cruise_interrupts,
+            software.cruise_interrupts);
+    errors++;
+  }
+  if (!pulse.released) {
+    fprintf(stderr, "pulse output: LEDC still drives the step pin after stopping\n");
+    errors++;
+  }
+  float one_tick = 10000.0f / (2 * 451) * bench_pulse_pump_config.volume_per_step; // steps in a tick, in uL
+  if (bench_targets_reached != 2 || bench_volume_at_target < bench_target_volume ||
+      bench_volume_at_target > bench_target_volume + one_tick) {
+    fprintf(stderr, "pulse output: %u targets reached, at %.3f uL for %.3f uL\n", bench_targets_reached,
+            bench_volume_at_target, bench_target_volume);
+    errors++;
+  }
+
+  // A flow ramp retargets the speed every tick: LEDC must stay off until the speed holds still
+  uint32_t ramp_starts = 0;
+  bool was_running = false;
+  hal_manual_time = true;
+  int64_t due = hal_time_us;
+  for (int tick = 0; tick < 400; tick++) {
+    if (tick < 300) {
+      pulse_pump.set_pump(PumpCommand{.pump_cmd = 2.0f + tick * 0.01f, .acceleration = kDefaultPumpAcceleration});
+    }
+    pulse_pump.update_speed();
+    int64_t tick_end = hal_time_us + 10000;
+    while (due < tick_end) {
+      hal_time_us = due;
+      due += pulse_pump.step();
+    }
+    hal_time_us = tick_end;
+    hal_pcnt_service();
+    ramp_starts += output.running() && !was_running && tick < 300;
+    was_running = output.running();
+  }
+  if (ramp_starts != 0 || !output.running()) {
+    fprintf(stderr, "pulse output: LEDC started %u times during a ramp, %s after it\n", ramp_starts,
+            output.running() ? "running" : "stopped");
+    errors++;
+  }
+  pulse_pump.set_pump(PumpCommand{.pump_cmd = 0.0, .acceleration = 10.0});
+  for (int tick = 0; tick < 200; tick++) {
+    pulse_pump.update_speed();
+    int64_t tick_end = hal_time_us + 10000;
+    while (due < tick_end) {
+      hal_time_us = due;
+      due += pulse_pump.step();
+    }
+    hal_time_us = tick_end;
+    hal_pcnt_service();
+  }
+  hal_manual_time = false;
+  return errors;
+}
+
+// Peristaltic pump model of the pulsation check: three rollers, the volume of a step
+// dips by kBenchPulsationDepth each time one of them lifts off the tubing. The rotor
+// angle is kBenchRotorOffset steps off the step count, the phase a calibration finds.
+constexpr int kBenchRollers = 3;
+constexpr float kBenchPulsationDepth = 0.25f;
+constexpr uint16_t kBenchRotorOffset = 437;
+
+static float bench_step_volume(uint16_t rotor_position) {
+  constexpr uint32_t kSteps = bench_pulse_pump_config.steps_per_revolution;
+  float angle = 2 * M_PI * ((rotor_position + kSteps - kBenchRotorOffset) % kSteps) / kSteps;
+  return bench_pulse_pump_config.volume_per_step * (1 - kBenchPulsationDepth * cosf(kBenchRollers * angle));
+}
+
+// Corrections as a calibration of the model gives them: the relative volume of each bin's
+// steps, rounded, with the rounding remainder taken off the largest one so they add up to zero
+static void bench_pulsation_table(int16_t* corrections) {
+  constexpr uint32_t kStepsPerBin = bench_pulse_pump_config.steps_per_revolution / kPulsationBins;
+  int32_t sum = 0;
+  uint8_t largest = 0;
+  for (uint8_t bin = 0; bin < kPulsationBins; bin++) {
+    float volume = 0;
+    for (uint32_t i = 0; i < kStepsPerBin; i++) {
+      volume += bench_step_volume((kBenchRotorOffset + bin * kStepsPerBin + i) % bench_pulse_pump_config.steps_per_revolution);
+    }
+    float relative = volume / kStepsPerBin / bench_pulse_pump_config.volume_per_step;
+    corrections[bin] = (int16_t)lroundf((relative - 1) * kPulsationScale);
+    sum += corrections[bin];
+    if (abs(corrections[bin]) > abs(corrections[largest])) {
+      largest = bin;
+    }
+  }
+  corrections[largest] -= sum;
+}
+
+struct PulsationRun {
+  float ripple = 0;                 // (max - min) / mean of the volume per 100 ms from 2 s to 18 s
+  float volume = 0;                 // uL from 2 s to 18 s
+  uint32_t cruise_interrupts = 0;   // step timer calls from 2 s to 18 s
+  uint32_t position_errors = 0;     // ticks at which rotor_position() was not the steps counted since the start
+};
+
+// 5 mL/min for 19 s, on the manual clock, with the model's volume summed over the steps
+// taken; corrections == nullptr for an uncompensated pump. A pulse output uses the LEDC
+// timer, LEDC channel and PCNT unit numbered `unit`.
+template <typename Pump>
+static PulsationRun run_pulsation_pump(Pump& pump, PulseOutput* output, int unit, const int16_t* corrections) {
+  PulsationRun run;
+  constexpr uint8_t kPin = bench_pulse_pump_config.step_pin;
+  constexpr uint32_t kSteps = bench_pulse_pump_config.steps_per_revolution;
+  hal_manual_time = true;
+  pump.initialize();
+  if (output) {
+    output->begin(kPin, (ledc_timer_t)unit, (ledc_channel_t)unit, (pcnt_unit_t)unit, nullptr);
+    pump.attach_pulse_output(output);
+  }
+  if (corrections) {
+    pump.set_pulsation(corrections, kBenchRotorOffset, true);
+  }
+  pump.set_pump(PumpCommand{.pump_cmd = 5.0, .acceleration = 10.0});
+  uint32_t total_steps = pump.get_total_steps();
+  uint16_t position = pump.rotor_position();
+  float window = 0;
+  float window_min = INFINITY;
+  float window_max = 0;
+  int64_t due = hal_time_us;
+  int64_t start = hal_time_us;
+  for (int tick = 1; tick <= 2000; tick++) {
+    int64_t tick_end = start + int64_t(tick) * 10000;
+    while (due < tick_end) {
+      hal_time_us = due;
+      due += pump.step();
+      if (tick > 200 && tick <= 1800) {
+        run.cruise_interrupts++;
+      }
+    }
+    hal_time_us = tick_end;
+    hal_pcnt_service();
+    if (tick == 1900) {
+      pump.set_pump(PumpCommand{.pump_cmd = 0.0, .acceleration = 10.0});
+    }
+    pump.update_speed();
+
+    float volume = 0;
+    for (uint32_t n = pump.get_total_steps(); total_steps != n; total_steps++) {
+      position = (position + 1) % kSteps;
+      volume += bench_step_volume(position);
+    }
+    if (pump.rotor_position() != position) {
+      run.position_errors++;
+    }
+    if (tick > 200 && tick <= 1800) {
+      run.volume += volume;
+      window += volume;
+      if (tick % 10 == 0) {
+        window_min = std::min(window_min, window);
+        window_max = std::max(window_max, window);
+        window = 0;
+      }
+    }
+  }
+  hal_manual_time = false;
+  run.ripple = (window_max - window_min) / (run.volume / 160);
+  return run;
+}
+
+// Pulsation compensation must flatten the flow of the pump model, with software steps
+// and with LEDC steps, keep its average flow, and keep LEDC's few step interrupts;
+// tables not adding up to zero or out of range must be refused. Returns the number of
+// mismatches.
+static int verify_pulsation_compensation() {
+  int errors = 0;
+  int16_t corrections[kPulsationBins];
+  bench_pulsation_table(corrections);
+  static PumpControl<bench_pulse_pump_config> pumps[4];
+  static PulseOutput outputs[2];
+
+  int16_t refused[kPulsationBins] = {0};
+  refused[0] = 1;
+  bool sum_refused = !pumps[0].set_pulsation(refused, 0, true);
+  refused[0] = kPulsationMaxCorrection + 1;
+  refused[1] = -kPulsationMaxCorrection - 1;
+  bool range_refused = !pumps[0].set_pulsation(refused, 0, true);
+  bool phase_refused = !pumps[0].set_pulsation(corrections, bench_pulse_pump_config.steps_per_revolution, true);
+  if (!sum_refused || !range_refused || !phase_refused || pumps[0].pulsation().enabled()) {
+    fprintf(stderr, "pulsation: invalid tables accepted (sum %d, range %d, phase %d)\n", !sum_refused, !range_refused,
+            !phase_refused);
+    errors++;
+  }
+
+  PulsationRun plain = run_pulsation_pump(pumps[0], nullptr, 0, nullptr);
+  PulsationRun software = run_pulsation_pump(pumps[1], nullptr, 0, corrections);
+  PulsationRun pulse_plain = run_pulsation_pump(pumps[2], &outputs[0], 3, nullptr);
+  PulsationRun pulse = run_pulsation_pump(pumps[3], &outputs[1], 1, corrections);
+  const PulsationRun* runs[] = {&plain, &software, &pulse_plain, &pulse};
+  const char* names[] = {"software", "software, compensated", "LEDC", "LEDC, compensated"};
+  for (int i = 0; i < 4; i++) {
+    const PulsationRun& run = *runs[i];
+    const PulsationRun& reference = i < 2 ? plain : pulse_plain;
+    bool compensated = i % 2 == 1;
+    if (run.position_errors != 0 || fabsf(run.volume - reference.volume) > 0.005f * reference.volume ||
+        (compensated && run.ripple * 4 > reference.ripple)) {
+      fprintf(stderr, "pulsation, %s: ripple %.1f %% (uncompensated %.1f %%), %.1f uL (%.1f uL), %u rotor position errors\n",
+              names[i], run.ripple * 100, reference.ripple * 100, run.volume, reference.volume, run.position_errors);
+      errors++;
+    }
+  }
+  if (pulse.cruise_interrupts * 10 > software.cruise_interrupts) {
+    fprintf(stderr, "pulsation: %u step interrupts with LEDC, %u in software\n", pulse.cruise_interrupts,
+            software.cruise_interrupts);
+    errors++;
+  }
+  return errors;
+}
+
+// Second channel of a parallel stripper (pins as with PARALLEL_STRIPPER), next to the device's own axes
+constexpr PumpControlConfig bench_pump_1_config{
+  .enable_pin = 13, .direction_pin = 22, .step_pin = 21, .dt = 0.01, .invert_direction = true,
+  .steps_per_revolution = 200 * 8, .volume_per_step = 0.0752192, .direction_setup_us = 5,
+};
+constexpr RadialValveControlConfig bench_reagent_valve_1_config{
+  .enable_pin = 18, .direction_pin = 19, .step_pin = 15, .limit_switch_pin = 34, .steps_per_revolution = 200 * 8,
+  .invert_direction = true, .home_offset = 365, .position_mapping = {0, 5, 4, 3, 2, 1},
+};
+constexpr RadialValveControlConfig bench_column_valve_1_config{
+  .enable_pin = 23, .direction_pin = 19, .step_pin = 5, .limit_switch_pin = 35, .steps_per_revolution = 200 * 8,
+  .invert_direction = true, .home_offset = 365, .position_mapping = {3, 2, 1, 0, 5, 4},
+};
+static PumpControl<bench_pump_1_config> bench_pump_1;
+static RadialValveControl<bench_reagent_valve_1_config> bench_reagent_valve_1;
+static RadialValveControl<bench_column_valve_1_config> bench_column_valve_1;
+
+// Two channels pump at once; a valve change on channel 1 must stop only pump 1
+// while pump 0 keeps its flow. Returns the number of mismatches.
+static int verify_parallel_channels() {
+  int errors = 0;
+  constexpr DeviceConfig config{
+    .pumps = {&pump_0, &bench_pump_1},
+    .valves = {&reagent_valve_0, &column_valve_0, &bench_reagent_valve_1, &bench_column_valve_1},
+    .channels = {
+      {.pump = 0, .reagent_valve = 0, .column_valve = 1, .interlock = interlock_config},
+      {.pump = 1, .reagent_valve = 2, .column_valve = 3, .interlock = interlock_config},
+    },
+    .num_pumps = 2,
+    .num_valves = 4,
+    .num_channels = 2,
+  };
+  static Device parallel(config);
+  static AxisTimers timers;
+  for (uint8_t pin : {reagent_valve_config.limit_switch_pin, column_valve_config.limit_switch_pin,
+                      bench_reagent_valve_1_config.limit_switch_pin, bench_column_valve_1_config.limit_switch_pin}) {
+    hal_pins[pin] = HIGH;
+  }
+  parallel.initialize();
+  hal_manual_time = true;
+  parallel.channel(0).set_valves(1, 1);
+  parallel.channel(1).set_valves(4, 2);
+  parallel.channel(0).set_pump(PumpCommand{.pump_cmd = 2.0, .acceleration = 10.0});
+  parallel.channel(1).set_pump(PumpCommand{.pump_cmd = 3.0, .acceleration = 10.0});
+  simulate_device(parallel, timers, 10000, nullptr);
+
+  float volume_before = parallel.channel(0).pump().get_volume();
+  parallel.channel(1).set_valves(5, 3);
+  bool channel_1_stopped = false;
+  for (int t = 0; t < 20000 && !(channel_1_stopped && parallel.channel(1).is_pumping()); t += 10) {
+    simulate_device(parallel, timers, 10, nullptr);
+    channel_1_stopped |= parallel.channel(1).pump().is_stopped();
+    if (parallel.channel(0).pump().get_current_speed() != 2.0f || !parallel.channel(0).is_pumping()) {
+      fprintf(stderr, "parallel channels: pump 0 disturbed by channel 1 at %d ms\n", t);
+      errors++;
+      break;
+    }
+  }
+  simulate_device(parallel, timers, 2000, nullptr);
+  ChannelState state;
+  parallel.channel(1).get_state(&state);
+  if (!channel_1_stopped || state.reagent_valve_position != 5 || state.column_valve_position != 3 ||
+      state.pump_speed != 3.0f || parallel.channel(1).get_transition_stats().transitions != 2) {
+    fprintf(stderr, "parallel channels: channel 1 at %.2f mL/min, valves %u/%u, stopped %d\n", state.pump_speed,
+            state.reagent_valve_position, state.column_valve_position, channel_1_stopped);
+    errors++;
+  }
+  if (parallel.channel(0).pump().get_volume() <= volume_before || parallel.device_state.num_pumps != 2 ||
+      parallel.device_state.num_valves != 4) {
+    fprintf(stderr, "parallel channels: channel 0 volume %.1f uL, %u pumps, %u valves\n",
+            parallel.channel(0).pump().get_volume(), parallel.device_state.num_pumps, parallel.device_state.num_valves);
+    errors++;
+  }
+  for (uint8_t i = 0; i < parallel.num_channels(); i++) {
+    parallel.channel(i).set_pump(PumpCommand{.pump_cmd = 0, .acceleration = 1000.0});
+  }
+  simulate_device(parallel, timers, 100, nullptr);
+  hal_manual_time = false;
+  return errors;
+}
+
+// Runs a 30 % / 70 % mixing step through the executor with the valves and the
+// pump stepping, checks the ratio counted on each port. Returns the number of mismatches.
+static int verify_valve_mixing(Program& program, ProgramExecutor& program_executor) {
+  int errors = 0;
+  hal_pins[reagent_valve_config.limit_switch_pin] = HIGH;
+  hal_pins[column_valve_config.limit_switch_pin] = HIGH;
+  ProgramStep step{.reagent_valve_id = uint8_t(protocol::kMixStepFlag | 2 << 3 | 1), .column_valve_id = 3,
+                   .ramp_end_flow = 3000, .flow_rate = 2.0, .volume = 3.0, .duration = INFINITY};
+  program.clear();
+  program.write_at(0, &step);
+  hal_manual_time = true;
+  program_executor.execute();
+  for (int i = 0; i < 600 && program_executor.is_running(); i++) {
+    simulate_control_loop(program_executor, 1000);
+  }
+  hal_manual_time = false;
+  const ValveMixer& mixer = program_executor.mixer();
+  uint32_t total = mixer.steps_a() + mixer.steps_b();
+  float share = total > 0 ? float(mixer.steps_a()) / total : 0;
+  uint32_t cycles = total / kMixCycleSteps;
+  if (program_executor.is_running() || fabsf(share - 0.3f) > 0.01f || mixer.switches() + 2 < 2 * cycles) {
+    fprintf(stderr, "valve mixing: share %.4f of %u steps, %u switches, running %d\n", share, total, mixer.switches(),
+            program_executor.is_running());
+    errors++;
+  }
+  return errors;
+}
+
+// A valve with its enable and limit switch lines on the I/O expander
+constexpr RadialValveControlConfig bench_expander_valve_config{
+  .enable_pin = expander_pin(0), .direction_pin = 37, .step_pin = 38, .limit_switch_pin = expander_pin(8),
+  .steps_per_revolution = 200 * 8, .invert_direction = true, .home_offset = 365, .position_mapping = {0, 5, 4, 3, 2, 1},
+};
+
+// Drives a valve through homing on expander lines: the step timer path must not
+// touch the bus, output changes go out batched in one burst and the limit switch
+// is seen after one interrupt read. Returns the number of mismatches.
+static int verify_io_expander() {
+  int errors = 0;
+  static RadialValveControl<bench_expander_valve_config> valve;
+  if (!io_expander.begin(Wire)) {
+    fprintf(stderr, "io expander: begin failed\n");
+    return 1;
+  }
+  valve.initialize();
+  uint16_t iodir = Wire.regs[Mcp23017::kRegIodir] | Wire.regs[Mcp23017::kRegIodir + 1] << 8;
+  uint16_t gpinten = Wire.regs[0x04] | Wire.regs[0x05] << 8;
+  if ((iodir & 0x0101) != 0x0100 || (gpinten & 0x0101) != 0x0100 || !(Wire.outputs() & 0x0001)) {
+    fprintf(stderr, "io expander: iodir %04x, gpinten %04x, outputs %04x after initialize\n", iodir, gpinten, Wire.outputs());
+    errors++;
+  }
+
+  valve.set_position(2); // not homed: homing starts and enables the driver
+  size_t transactions = Wire.transactions;
+  for (int i = 0; i < 1000; i++) {
+    valve.update();
+  }
+  io_expander.write(3, HIGH);
+  io_expander.write(4, HIGH);
+  if (Wire.transactions != transactions || valve.get_state() != STATE_HOME) {
+    fprintf(stderr, "io expander: %zu bus transfers from the step path, state %u\n", Wire.transactions - transactions,
+            valve.get_state());
+    errors++;
+  }
+  bool flushed = io_expander.flush();
+  if (!flushed || Wire.transactions != transactions + 1 || (Wire.outputs() & 0x0019) != 0x0018 || io_expander.flush()) {
+    fprintf(stderr, "io expander: outputs %04x after %zu transfers, expected one burst\n", Wire.outputs(),
+            Wire.transactions - transactions);
+    errors++;
+  }
+
+  if (Wire.set_pins(0x0100)) {
+    io_expander.on_interrupt();
+  }
+  transactions = Wire.transactions;
+  if (!io_expander.service() || Wire.transactions != transactions + 1 || io_expander.service()) {
+    fprintf(stderr, "io expander: limit switch change not read in one transfer\n");
+    errors++;
+  }
+  valve.update();
+  io_expander.flush();
+  if (valve.get_state() != STATE_STOP || !(Wire.outputs() & 0x0001) || (Wire.regs[0x0e] | Wire.regs[0x0f]) != 0) {
+    fprintf(stderr, "io expander: valve state %u, outputs %04x after the limit switch\n", valve.get_state(), Wire.outputs());
+    errors++;
+  }
+  return errors;
+}
+
+// A valve driving the rotor model below
+constexpr RadialValveControlConfig bench_drift_valve_config{
+  .enable_pin = 6, .direction_pin = 7, .step_pin = 8, .limit_switch_pin = 9,
+  .steps_per_revolution = 200 * 8, .invert_direction = true, .home_offset = 365, .position_mapping = {0, 5, 4, 3, 2, 1},
+};
+static RadialValveControl<bench_drift_valve_config> bench_drift_valve;
+
+// Rotor of a valve motor: it follows the rising edges of the step line, except
+// those coming sooner than stall_step_time after the previous edge (the motor
+// stalls) and the next `drop` ones. The limit switch closes over 20 steps past home.
+struct RotorModel {
+  static constexpr const RadialValveControlConfig& kConfig = bench_drift_valve_config;
+  uint16_t position = 100;
+  uint32_t stall_step_time = 0;
+  uint32_t drop = 0;
+  uint32_t lost = 0;
+  uint32_t last_delay = UINT32_MAX;
+  int16_t switch_offset = 0;  // steps the limit switch is mounted late (negative: early)
+
+  // One step timer call
+  void tick(ValveAxis& valve) {
+    uint8_t before = hal_pins[kConfig.step_pin];
+    uint32_t delay = valve.update();
+    if (!before && hal_pins[kConfig.step_pin]) {
+      if (drop > 0 || last_delay < stall_step_time) {
+        drop -= drop > 0;
+        lost++;
+      } else {
+        position = (position + 1) % kConfig.steps_per_revolution;
+      }
+    }
+    last_delay = delay;
+    uint16_t edge = (kConfig.home_offset + kConfig.steps_per_revolution + switch_offset) % kConfig.steps_per_revolution;
+    hal_pins[kConfig.limit_switch_pin] =
+        (position + kConfig.steps_per_revolution - edge) % kConfig.steps_per_revolution < 20 ? HIGH : LOW;
+  }
+
+  void run_until_stopped(ValveAxis& valve) {
+    for (int i = 0; i < 100000; i++) {
+      tick(valve);
+      if (valve.reached_target()) {
+        return;
+      }
+    }
+  }
+
+  static uint16_t port_position(uint8_t port) {
+    return kConfig.position_mapping[port] * (kConfig.steps_per_revolution / kNumValvePorts);
+  }
+};
+
+// Loses steps on a valve and checks that the next pass of the limit switch
+// finds and corrects them, then autotunes it on a rotor that stalls below
+// 350 us: the stored profile must be the fastest one without drift plus the
+// margin. Returns the number of mismatches.
+static int verify_valve_drift() {
+  int errors = 0;
+  constexpr DeviceConfig config{
+    .pumps = {&pump_0},
+    .valves = {&reagent_valve_0, &column_valve_0, &bench_drift_valve},
+    .channels = {
+      {.pump = 0, .reagent_valve = 0, .column_valve = 1, .interlock = interlock_config},
+    },
+    .num_pumps = 1,
+    .num_valves = 3,
+    .num_channels = 1,
+  };
+  static Device tuned(config);
+  static RotorModel rotor;
+  ValveAxis& valve = bench_drift_valve;
+  valve.initialize();
+  valve.set_position(0); // homes first
+  rotor.run_until_stopped(valve);
+  for (uint8_t port : {3, 0, 3, 0}) {
+    valve.set_position(port);
+    rotor.run_until_stopped(valve);
+  }
+  ValveHealth health = valve.get_health();
+  if (rotor.position != RotorModel::port_position(0) || health.home_passes != 2 || health.drift_events != 0) {
+    fprintf(stderr, "valve drift: rotor at %u, %u home passes, %u drift events without lost steps\n", rotor.position,
+            health.home_passes, health.drift_events);
+    errors++;
+  }
+  rotor.drop = 7;
+  valve.set_position(3);
+  rotor.run_until_stopped(valve);
+  health = valve.get_health();
+  if (rotor.position != RotorModel::port_position(3) || health.drift_events != 1 || health.last_drift != 7 ||
+      health.missed_homes != 0) {
+    fprintf(stderr, "valve drift: rotor at %u instead of %u, %u drift events, last %d\n", rotor.position,
+            RotorModel::port_position(3), health.drift_events, health.last_drift);
+    errors++;
+  }
+
+  // Switch edges off by up to the tolerance are neither drift nor missed homes
+  for (int16_t offset : {-2, -1, 1, 2}) {
+    rotor.switch_offset = offset;
+    health = valve.get_health();
+    for (uint8_t port : {0, 3, 0, 3}) {
+      valve.set_position(port);
+      rotor.run_until_stopped(valve);
+    }
+    ValveHealth after = valve.get_health();
+    if (after.home_passes != health.home_passes + 2 || after.drift_events != health.drift_events ||
+        after.missed_homes != health.missed_homes) {
+      fprintf(stderr, "valve drift: switch %+d steps off: %u passes, %u drift events, %u missed homes\n", offset,
+              after.home_passes - health.home_passes, after.drift_events - health.drift_events,
+              after.missed_homes - health.missed_homes);
+      errors++;
+    }
+  }
+  rotor.switch_offset = 0;
+
+  rotor.stall_step_time = 350;
+  ValveSpeedProfile original = valve.get_speed_profile();
+  if (!valve_autotuner.request(tuned, 2) || valve_autotuner.request(tuned, 2) || valve_autotuner.request(tuned, 3)) {
+    fprintf(stderr, "valve autotune: request not accepted once\n");
+    return errors + 1;
+  }
+  for (int i = 0; i < 10000000 && (valve_autotuner.get_state() == protocol::kAutotuneRunning || !valve.reached_target()); i++) {
+    rotor.tick(valve);
+    if (i % 100 == 0) {
+      valve_autotuner.update(tuned, false);
+    }
+  }
+  ValveSpeedProfile result = valve.get_speed_profile();
+  ValveSpeedProfile stored = {0};
+  bool persisted = valve_autotuner.persist();
+  if (valve_autotuner.get_state() != protocol::kAutotuneDone || !persisted || !valve_profile_store.load(2, &stored) ||
+      memcmp(&stored, &result, sizeof(result)) != 0) {
+    fprintf(stderr, "valve autotune: state %u, persisted %d, stored %u us\n", valve_autotuner.get_state(), persisted,
+            stored.min_step_time);
+    errors++;
+  }
+  // 500, 425 and 361 us hold, 307 us stalls: 361 us plus 20 %
+  uint32_t expected = original.min_step_time;
+  while (expected * kAutotuneStepTimePercent / 100 >= rotor.stall_step_time) {
+    expected = expected * kAutotuneStepTimePercent / 100;
+  }
+  expected = expected * kAutotuneMarginPercent / 100;
+  if (result.min_step_time != expected || result.max_step_time != original.max_step_time ||
+      rotor.position != RotorModel::port_position(3) || rotor.lost == 7) {
+    fprintf(stderr, "valve autotune: %u us (expected %u), rotor at %u, %u steps lost\n", result.min_step_time, expected,
+            rotor.position, rotor.lost);
+    errors++;
+  }
+
+  // The tuned profile does not drift, and is loaded again after a reboot
+  health = valve.get_health();
+  for (uint8_t port : {0, 3, 0, 3}) {
+    valve.set_position(port);
+    rotor.run_until_stopped(valve);
+  }
+  valve.set_speed_profile(original.min_step_time, original.max_step_time, original.smoothness_factor);
+  valve_profile_store.apply(tuned);
+  if (valve.get_health().drift_events != health.drift_events || rotor.position != RotorModel::port_position(3) ||
+      valve.get_speed_profile().min_step_time != expected) {
+    fprintf(stderr, "valve autotune: drift with the tuned profile, or not reloaded\n");
+    errors++;
+  }
+
+  // A rotor that never stalls: the search stops at the shortest step time the ramp table reaches
+  rotor.stall_step_time = 0;
+  valve.set_speed_profile(original.min_step_time, original.max_step_time, original.smoothness_factor);
+  static ValveRampProfile longest;
+  longest.build(original.max_step_time, 1, original.smoothness_factor);
+  uint32_t fastest = original.min_step_time;
+  uint8_t trials = 1;
+  while (fastest * kAutotuneStepTimePercent / 100 >= longest.cruise_step_time()) {
+    fastest = fastest * kAutotuneStepTimePercent / 100;
+    trials++;
+  }
+  valve_autotuner.request(tuned, 2);
+  for (int i = 0; i < 10000000 && (valve_autotuner.get_state() == protocol::kAutotuneRunning || !valve.reached_target()); i++) {
+    rotor.tick(valve);
+    if (i % 100 == 0) {
+      valve_autotuner.update(tuned, false);
+    }
+  }
+  valve_autotuner.persist();
+  if (valve_autotuner.get_state() != protocol::kAutotuneDone || valve_autotuner.get_trials() != trials ||
+      valve.get_speed_profile().min_step_time != fastest * kAutotuneMarginPercent / 100) {
+    fprintf(stderr, "valve autotune: %u trials down to %u us (expected %u down to %u, the ramp ends at %u us)\n",
+            valve_autotuner.get_trials(), valve.get_speed_profile().min_step_time, trials, fastest,
+            longest.cruise_step_time());
+    errors++;
+  }
+  valve.set_speed_profile(original.min_step_time, original.max_step_time, original.smoothness_factor);
+  return errors;
+}
+
+// Checks the precomputed valve ramp tables against the analytic profile they replace,
+// and that a ramp too long for the table is cut short without a jump in step time.
+// Returns the number of mismatches.
+static int verify_motion_profiles() {
+  int errors = 0;
+
+  // Valve ramp: every table entry must equal the iterated speed_up_a_bit() formula.
+  // The last two do not fit: the ramp stops where the table ends (16841 and 228 us).
+  const uint16_t kValveProfiles[][3] = {{30000, 500, 100}, {30000, 200, 50}, {20000, 800, 10},
+                                        {60000, 100, 400}, {30000, 100, 100}};
+  for (auto& p : kValveProfiles) {
+    static ValveRampProfile profile;
+    bool complete = profile.build(p[0], p[1], p[2]);
+    uint32_t step_time = p[0];
+    int len = 1;
+    for (; step_time > p[1] && len < kMaxValveProfileLen; len++) {
+      step_time = ValveRampProfile::next_step_time(step_time, p[1], p[2]);
+    }
+    if (complete != (step_time == p[1]) || profile.length() != len || profile.cruise_step_time() != step_time) {
+      fprintf(stderr, "valve profile %u/%u/%u: complete %d, %u entries, cruise at %u us (expected %d, %d, %u)\n", p[0],
+              p[1], p[2], complete, profile.length(), profile.cruise_step_time(), step_time == p[1], len, step_time);
+      errors++;
+    }
+    step_time = p[0];
+    for (int i = 0; i < 4 * kMaxValveProfileLen; i++) {
+      if (profile.at(i) != step_time) {
+        fprintf(stderr, "valve profile %u/%u/%u mismatch at %d: %u != %u\n", p[0], p[1], p[2], i, profile.at(i), step_time);
+        errors++;
+        break;
+      }
+      if (i + 1 < profile.length()) {
+        step_time = ValveRampProfile::next_step_time(step_time, p[1], p[2]);
+      }
+    }
+  }
+  return errors;
+}
+
+static void write_results(FILE* f) {
+  fprintf(f, "{\n  \"benchmarks\": [\n");
+  for (size_t i = 0; i < results.size(); i++) {
+    const BenchResult& r = results[i];
+    fprintf(f, "    {\"name\": \"%s\", \"unit\": \"%s\", \"ops\": %llu, \"ns_per_op\": %.3f, \"instructions_per_op\": %.1f}%s\n",
+            r.name.c_str(), r.unit.c_str(), (unsigned long long)r.ops, r.ns_per_op, r.instructions_per_op,
+            i + 1 < results.size() ? "," : "");
+  }
+  fprintf(f, "  ]\n}\n");
+}
+
+static SerialConnection connection;
+static Program program;
+static ProgramExecutor program_executor(&program);
+static ProgramLoader program_loader(&program);
+
+int main(int argc, char** argv) {
+  device.initialize();
+
+  if (verify_motion_profiles() > 0) {
+    fprintf(stderr, "Motion profile tables do not match the analytic profiles\n");
+    return 1;
+  }
+  if (verify_cobs_framing(connection) > 0) {
+    fprintf(stderr, "COBS framing does not match the reference vectors\n");
+    return 1;
+  }
+  if (verify_tx_backpressure(connection) > 0) {
+    fprintf(stderr, "try_send_data does not report a full TX ring\n");
+    return 1;
+  }
+
+  if (verify_flow_ramp(program, program_executor) > 0) {
+    fprintf(stderr, "Flow ramps do not follow the step's time progress\n");
+    return 1;
+  }
+  if (verify_valve_mixing(program, program_executor) > 0) {
+    fprintf(stderr, "Valve time-slicing does not deliver the mixing ratio\n");
+    return 1;
+  }
+  if (verify_status_cache() > 0) {
+    fprintf(stderr, "Status responses are not cached per state change\n");
+    return 1;
+  }
+  if (verify_step_jitter() > 0) {
+    fprintf(stderr, "Step jitter counters do not add up\n");
+    return 1;
+  }
+  if (verify_request_arena() > 0) {
+    fprintf(stderr, "Web request arenas leak or overrun\n");
+    return 1;
+  }
+  if (verify_io_expander() > 0) {
+    fprintf(stderr, "I/O expander lines are not batched or cached\n");
+    return 1;
+  }
+  if (verify_valve_drift() > 0) {
+    fprintf(stderr, "Valve drift is not detected at the home position or not autotuned\n");
+    return 1;
+  }
+  if (verify_pulse_output() > 0) {
+    fprintf(stderr, "LEDC steps or PCNT counts do not match software stepping\n");
+    return 1;
+  }
+  if (verify_pulsation_compensation() > 0) {
+    fprintf(stderr, "Pulsation compensation does not flatten the flow of the pump model\n");
+    return 1;
+  }
+  if (verify_parallel_channels() > 0) {
+    fprintf(stderr, "Channels of a multi-pump device are not independent\n");
+    return 1;
+  }
+  if (verify_step_stream(program, program_executor) > 0) {
+    fprintf(stderr, "Streamed execution does not follow the stream protocol\n");
+    return 1;
+  }
+
+  bench_pump_step();
+  bench_pump_update_speed();
+  bench_valve_update();
+  bench_receive_bytes(connection);
+  bench_send_frame(connection);
+  bench_handle_command(connection, program, program_loader, program_executor);
+  bench_filter_sample();
+  bench_hx711_conversion();
+  bench_executor_tick(program, program_executor);
+  bench_status_render();
+  bench_step_jitter_record();
+  bench_request_arena();
+
+  write_results(stdout);
+  if (argc > 1) {
+    FILE* f = fopen(argv[1], "w");
+    if (!f) {
+      fprintf(stderr, "Failed to open %s for writing\n", argv[1]);
+      return 1;
+    }
+    write_results(f);
+    fclose(f);
+  }
+  return 0;
+}
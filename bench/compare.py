@@ -0,0 +1,64 @@
+#!/usr/bin/env python3
+"""
+Compares two benchmark result files written by the native_bench program.
+
+usage: python bench/compare.py baseline.json current.json [--threshold 10]
+
+Exits with status 1 if any benchmark got slower by more than the threshold (%).
+"""
+
+import sys
+import json
+import argparse
+
+
+def load_results(path):
+    with open(path, 'r') as file:
+        data = json.load(file)
+    return {b['name']: b for b in data['benchmarks']}
+
+
+def format_instructions(old, new):
+    """Instruction counts are only present when the host exposes hardware counters"""
+    old_instr = old.get('instructions_per_op', -1)
+    new_instr = new.get('instructions_per_op', -1)
+    if old_instr < 0 or new_instr < 0:
+        return "-"
+    return f"{old_instr:.1f} -> {new_instr:.1f}"
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Compare firmware benchmark results")
+    parser.add_argument('baseline')
+    parser.add_argument('current')
+    parser.add_argument('--threshold', type=float, default=10.0, help="allowed slowdown in percent")
+    args = parser.parse_args()
+
+    baseline = load_results(args.baseline)
+    current = load_results(args.current)
+
+    regressions = 0
+    print(f"{'benchmark':<28} {'baseline':>12} {'current':>12} {'change':>9} {'instr/op':>20}")
+    for name, result in current.items():
+        unit = result['unit']
+        if name not in baseline:
+            print(f"{name:<28} {'-':>12} {result['ns_per_op']:>9.2f} ns/{unit}")
+            continue
+        old = baseline[name]['ns_per_op']
+        new = result['ns_per_op']
+        change = (new - old) / old * 100.0 if old > 0 else 0.0
+        marker = ""
+        if change > args.threshold:
+            marker = "  REGRESSION"
+            regressions += 1
+        print(f"{name:<28} {old:>12.2f} {new:>12.2f} {change:>+8.1f}% {format_instructions(baseline[name], result):>20}{marker}")
+
+    for name in baseline:
+        if name not in current:
+            print(f"{name:<28} removed")
+
+    return 1 if regressions else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,166 @@
+#!/usr/bin/env python3
+"""
+Step timing jitter of the firmware on a real device, without and with Wi-Fi traffic.
+
+usage: python bench/jitter_bench.py PORT [--http http://chromatograf.local] [--flash] [--seconds 20] [--pump 3.0] [-o after.json]
+       python bench/jitter_bench.py --compare before.json after.json
+
+The pump of channel 0 runs and the valves of channel 0 are moved back and
+forth, while the device counts how late each step interrupt and control loop
+tick comes (GET_STEP_JITTER). This is done with the link idle, then with
+HTTP clients polling the web server as fast as it answers, and with --flash
+with clients saving the reagent configuration back to LittleFS, which
+disables the flash cache on every write. Flash the
+env esp32dev_legacy_cores build for the "before" numbers (control loop and
+esp_timer steps on core 0 with Wi-Fi) and esp32dev for the "after" ones.
+"""
+
+import argparse
+import json
+import os
+import sys
+import threading
+import time
+import urllib.parse
+import urllib.request
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), '..'))
+
+HTTP_PATHS = ['/api/status', '/api/diag/tasks', '/api/program/get']
+
+
+class HttpLoad:
+    """Clients fetching web server pages back to back, to keep Wi-Fi and LwIP busy"""
+
+    def __init__(self, base_url: str, clients: int):
+        self.base_url = base_url.rstrip('/')
+        self.clients = clients
+        self.requests = 0
+        self.errors = 0
+        self._stop = threading.Event()
+        self._threads = []
+
+    def _run(self, index: int):
+        i = index
+        while not self._stop.is_set():
+            try:
+                with urllib.request.urlopen(self.base_url + HTTP_PATHS[i % len(HTTP_PATHS)], timeout=2) as response:
+                    response.read()
+                self.requests += 1
+            except OSError:
+                self.errors += 1
+            i += 1
+
+    def __enter__(self):
+        self._threads = [threading.Thread(target=self._run, args=(i,), daemon=True) for i in range(self.clients)]
+        for thread in self._threads:
+            thread.start()
+        return self
+
+    def __exit__(self, *exc):
+        self._stop.set()
+        for thread in self._threads:
+            thread.join()
+
+
+class FlashLoad(HttpLoad):
+    """Clients saving the unchanged reagent configuration back to flash, back to back"""
+
+    def __enter__(self):
+        with urllib.request.urlopen(self.base_url + '/api/reagent-config/get', timeout=2) as response:
+            self.body = urllib.parse.urlencode({'config': response.read().decode()}).encode()
+        return super().__enter__()
+
+    def _run(self, index: int):
+        while not self._stop.is_set():
+            try:
+                with urllib.request.urlopen(self.base_url + '/api/reagent-config/save', data=self.body, timeout=2) as response:
+                    response.read()
+                self.requests += 1
+            except OSError:
+                self.errors += 1
+
+
+def measure(conn, seconds: float) -> list:
+    """Counts from a fresh start over `seconds`, with the valves of channel 0 moving every second"""
+    conn.get_step_jitter(reset=True)
+    end = time.monotonic() + seconds
+    port = 0
+    while time.monotonic() < end:
+        port = 3 - port
+        conn.valve_command(port, port)
+        time.sleep(min(1.0, max(0.0, end - time.monotonic())))
+    _, records = conn.get_step_jitter()
+    return records
+
+
+def run(args) -> dict:
+    from device_connection import DeviceConnection  # pyserial is not needed for --compare
+    conn = DeviceConnection(args.port)
+    conn.open()
+    try:
+        summary, _ = conn.get_step_jitter()
+        conn.pump_command(args.pump, 10.0)
+        time.sleep(2.0)  # past the acceleration ramp
+        phases = {'idle': measure(conn, args.seconds)}
+        if args.http:
+            with HttpLoad(args.http, args.clients) as load:
+                phases['wifi'] = measure(conn, args.seconds)
+            summary['http_requests'] = load.requests
+            summary['http_errors'] = load.errors
+            if args.flash:
+                with FlashLoad(args.http, args.clients) as load:
+                    phases['flash'] = measure(conn, args.seconds)
+                summary['flash_writes'] = load.requests
+                summary['flash_errors'] = load.errors
+        conn.pump_command(0.0, 10.0)
+    finally:
+        conn.close()
+    return {'label': args.label, 'summary': summary, 'phases': phases}
+
+
+def compare(before_path: str, after_path: str):
+    with open(before_path) as file:
+        before = json.load(file)
+    with open(after_path) as file:
+        after = json.load(file)
+    print(f"{'phase':<6} {'source':<10} {'before mean/max/late':>24} {'after mean/max/late':>24}")
+    for phase, records in after['phases'].items():
+        old = {(r['source'], r['axis']): r for r in before['phases'].get(phase, [])}
+        for record in records:
+            key = (record['source'], record['axis'])
+            name = f"{record['source']} {record['axis']}"
+            new = f"{record['mean_us']:.1f}/{record['max_us']}/{record['late']}"
+            prev = f"{old[key]['mean_us']:.1f}/{old[key]['max_us']}/{old[key]['late']}" if key in old else '-'
+            print(f"{phase:<6} {name:<10} {prev:>24} {new:>24}")
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Step interrupt jitter with and without Wi-Fi traffic")
+    parser.add_argument('port', nargs='?', help="serial port of the device")
+    parser.add_argument('--http', help="web server base URL; without it only the idle phase runs")
+    parser.add_argument('--flash', action='store_true', help="also measure with flash writes (needs --http)")
+    parser.add_argument('--clients', type=int, default=4, help="concurrent HTTP clients")
+    parser.add_argument('--seconds', type=float, default=20.0, help="duration of each phase")
+    parser.add_argument('--pump', type=float, default=3.0, help="pump flow rate during the test, mL/min")
+    parser.add_argument('--label', default='', help="stored with the results, e.g. the firmware env")
+    parser.add_argument('-o', '--output', help="also write the results to this file")
+    parser.add_argument('--compare', nargs=2, metavar=('BEFORE', 'AFTER'), help="print two result files side by side")
+    args = parser.parse_args()
+
+    if args.compare:
+        compare(*args.compare)
+        return 0
+    if not args.port:
+        parser.error("a serial port is required")
+    results = run(args)
+    text = json.dumps(results, indent=2)
+    print(text)
+    if args.output:
+        with open(args.output, 'w') as file:
+            file.write(text + '\n')
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
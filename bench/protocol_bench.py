@@ -0,0 +1,501 @@
+#!/usr/bin/env python3
+"""
+Serial protocol conformance check and throughput benchmark against the device emulator.
+
+usage: python bench/protocol_bench.py [results.json] [--baud 115200] [--latency-ms 1] [--rx-error-rate 0]
+
+The host clients are first checked against the emulated firmware (exit status
+1 on any mismatch), then request rates are measured over the emulated link.
+Results are printed as JSON in the layout of the native_bench program, so
+runs can be compared with bench/compare.py. The DeviceConnection (pyserial)
+benchmarks run over a pseudo-terminal and are skipped if pyserial is missing.
+"""
+
+import argparse
+import asyncio
+import json
+import math
+import os
+import sys
+import time
+import zlib
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), '..'))
+
+from async_device_connection import AsyncDeviceConnection, encode_frame  # noqa: E402
+from device_connection import parse_channel_states, parse_pulsation, pack_pulsation  # noqa: E402
+from device_emulator import FRAMINGS, EmulatedDevice, FirmwareFrameReceiver, LinkConfig, serve_pty, serve_tcp, server_port  # noqa: E402
+from program import ProgramConverter, ProgramStep, Program, time_to_volume  # noqa: E402
+from pulsation_calibration import learn_corrections, align_phase  # noqa: E402
+from framing import COBS_VECTORS, FRAMING_RESET, cobs_decode, cobs_encode, encode_cobs_frame  # noqa: E402
+from protocol import (FRAMING_COBS, FRAMING_COBS_TAGGED, FRAMING_START_SEQUENCE, Command, STREAM_STATUS, STREAM_STEPS_REQUEST,  # noqa: E402
+                      STREAM_START_REQUEST, STREAM_FINISHED, STREAM_STOPPED, UNDERRUN_STOP, PROGRAM_STEP, RUN_LOG_RECORD,
+                      MIX_STATS, CHANNEL_VALVE_COMMAND, CHANNEL_PUMP_COMMAND, DEVICE_STATE, VALVE_REQUEST,
+                      VALVE_STATS, AUTOTUNE_IDLE, AUTOTUNE_DONE, PULSATION_REQUEST, PULSATION_BINS,
+                      PULSATION_MAX_CORRECTION)
+
+EXAMPLE_PROGRAM = os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', 'example_program.yaml')
+
+
+class ConformanceError(Exception):
+    pass
+
+
+def expect(condition: bool, message: str):
+    if not condition:
+        raise ConformanceError(message)
+
+
+def long_program(n_steps: int) -> Program:
+    steps = [ProgramStep(i % 6, (i + 1) % 6, 0.5, float('inf'), 10.0) for i in range(n_steps)]
+    return Program(reagents={1: "a"}, columns={1: "b"}, steps=steps)
+
+
+def packed(steps) -> bytes:
+    return b''.join(ProgramConverter().convert_to_raw_bytes(Program({}, {}, steps)))
+
+
+def check_cobs_codec():
+    for decoded, encoded in COBS_VECTORS:
+        expect(cobs_encode(decoded) == encoded, f"COBS encoding of {decoded[:8].hex()}... differs")
+        expect(cobs_decode(encoded) == decoded, f"COBS decoding of {encoded[:8].hex()}... differs")
+
+
+def check_framing_reset():
+    # Whatever framing an earlier session left the device in, FRAMING_RESET brings it back to start sequence frames
+    for framing in FRAMINGS:
+        receiver, device = FirmwareFrameReceiver(), EmulatedDevice()
+        receiver.set_framing(framing)
+        for b in FRAMING_RESET:
+            payload = receiver.feed_byte(b)
+            if payload is None:
+                continue
+            if receiver.framing == FRAMING_COBS_TAGGED:
+                payload = payload[1:]
+            if payload[0] == Command.SET_FRAMING and device.handle_command(payload) == b'\x00':
+                receiver.set_framing(payload[1])
+        expect(receiver.framing == FRAMING_START_SEQUENCE, f"framing {framing} not reset")
+
+
+def check_flow_ramp():
+    # 1 -> 7 mL/min over 60 s, cut short by 2 mL: 1 t + 0.05 t^2 = 120 mL*s/min at t = 40 s
+    clock = [0.0]
+    device = EmulatedDevice(clock=lambda: clock[0])
+    device.steps = [PROGRAM_STEP.unpack(ProgramConverter.pack_step(ProgramStep(0xff, 0xff, 1.0, 2.0, 60.0, 7.0)))]
+    expect(abs(time_to_volume(1.0, 7.0, 60.0, 2.0) - 40.0) < 1e-9, "ramp time to volume")
+    device.execute()
+    clock[0] = 30.0
+    device.update()
+    expect(abs(device.pump_speed - 4.0) < 1e-3, f"ramp speed halfway: {device.pump_speed}")
+    clock[0] = 50.0
+    device.update()
+    step_end = RUN_LOG_RECORD.unpack(device.run_log[-2])
+    expect(not device.running and step_end.time_ms == 40000 and abs(step_end.volume - 2000.0) < 1e-3,
+           f"ramped step not ended by its volume: {step_end}")
+
+
+def check_valve_mixing():
+    # 3 mL of 30 % reagent 2 and 70 % reagent 5 (1-based 3 and 6) through column 1
+    step = ProgramStep(2, 1, 2.0, 3.0, float('inf'), mix_reagent_valve_id=5, mix_share=0.7)
+    unpacked = ProgramConverter.unpack_step(PROGRAM_STEP.unpack(ProgramConverter.pack_step(step)))
+    expect(unpacked == step, f"mixing step round trip: {unpacked}")
+    clock = [0.0]
+    device = EmulatedDevice(clock=lambda: clock[0])
+    device.steps = [PROGRAM_STEP.unpack(ProgramConverter.pack_step(step))]
+    device.execute()
+    expect(device.reagent_valve == 2 and device.column_valve == 1, "mixing step does not start on reagent A")
+    clock[0] = 100.0
+    device.update()
+    stats = MIX_STATS.unpack(device.handle_command(bytes([Command.GET_MIX_STATS])))
+    expect(not stats.active and (stats.reagent_a, stats.reagent_b) == (2, 5) and abs(stats.achieved_share_a - 0.3) < 0.01
+           and stats.switches > 0, f"mixing stats: {stats}")
+    mix_end = RUN_LOG_RECORD.unpack(device.run_log[-2])
+    expect(mix_end.type == 4 and abs(mix_end.volume + mix_end.overshoot - 3000.0) < 1.0
+           and mix_end.time_ms == stats.switches, f"mixing run log record: {mix_end}")
+
+
+def check_channels():
+    # Two pumps: channel 1 is set on its own while channel 0 keeps its flow
+    clock = [0.0]
+    device = EmulatedDevice(clock=lambda: clock[0], channels=2)
+    command = lambda command_id, data=b'': device.handle_command(bytes([command_id]) + data)
+    expect(command(Command.SET_CHANNEL_PUMP, CHANNEL_PUMP_COMMAND.pack(0, 1.0, 10.0)) == b'\x00', "channel 0 pump not set")
+    expect(command(Command.SET_CHANNEL_VALVES, CHANNEL_VALVE_COMMAND.pack(1, 4, 2)) == b'\x00', "channel 1 valves not set")
+    expect(command(Command.SET_CHANNEL_PUMP, CHANNEL_PUMP_COMMAND.pack(1, 3.0, 10.0)) == b'\x00', "channel 1 pump not set")
+    expect(command(Command.SET_CHANNEL_VALVES, CHANNEL_VALVE_COMMAND.pack(2, 0, 0)) == b'\x03', "missing channel not rejected")
+    clock[0] = 60.0
+    channels = parse_channel_states(command(Command.GET_CHANNEL_STATES))
+    expect(len(channels) == 2 and abs(channels[0]['pump_volume'] - 1000.0) < 1e-6
+           and abs(channels[1]['pump_volume'] - 3000.0) < 1e-6, f"channel volumes: {channels}")
+    expect((channels[1]['reagent_valve_position'], channels[1]['column_valve_position'], channels[1]['pump'],
+            channels[1]['reagent_valve'], channels[1]['column_valve']) == (4, 2, 1, 2, 3), f"channel 1: {channels[1]}")
+    state = DEVICE_STATE.unpack(command(Command.GET_DEVICE_STATE))
+    expect((state.num_pumps, state.num_valves, state.pump_speed) == (2, 4, 1.0), f"device state counts: {state}")
+
+
+def check_valve_autotune():
+    # Refused while a pump turns; afterwards the valve runs 15 % faster per trial until it stalls (350 us)
+    device = EmulatedDevice(clock=lambda: 0.0, channels=2)
+    command = lambda command_id, data=b'': device.handle_command(bytes([command_id]) + data)
+    stats = VALVE_STATS.unpack(command(Command.GET_VALVE_STATS, VALVE_REQUEST.pack(3)))
+    expect((stats.valve, stats.autotune_state, stats.min_step_time, stats.drift_events) == (3, AUTOTUNE_IDLE, 500, 0),
+           f"valve stats before autotune: {stats}")
+    expect(command(Command.GET_VALVE_STATS, VALVE_REQUEST.pack(4)) == b'\x03', "missing valve stats not rejected")
+    command(Command.SET_CHANNEL_PUMP, CHANNEL_PUMP_COMMAND.pack(1, 2.0, 10.0))
+    expect(command(Command.AUTOTUNE_VALVE, VALVE_REQUEST.pack(3)) == b'\x03', "autotune accepted with a pump running")
+    command(Command.SET_CHANNEL_PUMP, CHANNEL_PUMP_COMMAND.pack(1, 0.0, 10.0))
+    expect(command(Command.AUTOTUNE_VALVE, VALVE_REQUEST.pack(4)) == b'\x03', "autotune of a missing valve accepted")
+    expect(command(Command.AUTOTUNE_VALVE, VALVE_REQUEST.pack(3)) == b'\x00', "autotune not accepted")
+    stats = VALVE_STATS.unpack(command(Command.GET_VALVE_STATS, VALVE_REQUEST.pack(3)))
+    # 500, 425 and 361 us hold, 306 us stalls: 361 us + 20 %
+    expect((stats.autotune_state, stats.autotune_valve, stats.autotune_trials, stats.min_step_time, stats.max_step_time)
+           == (AUTOTUNE_DONE, 3, 4, 433, 30000), f"valve stats after autotune: {stats}")
+
+
+def check_pulsation():
+    # A pump with three rollers, its step volume dipping by 25 % at every lift-off, turned at 443 steps/s
+    # from rotor position 123 and weighed at 10 Hz to 0.1 mg: the learned table is that of the model
+    spr, start, rate = 1600, 123, 443.0
+    steps_per_bin = spr // PULSATION_BINS
+
+    def step_volume(position, offset):
+        return 1 - 0.25 * math.cos(3 * 2 * math.pi * ((position - offset) % spr) / spr)
+
+    def model_table(offset):
+        volumes = [sum(step_volume(b * steps_per_bin + i, offset) for i in range(steps_per_bin)) / steps_per_bin
+                   for b in range(PULSATION_BINS)]
+        return [round((v - 1) * 10000) for v in volumes]
+
+    cumulative = [0.0]
+    for k in range(int(60 * rate) + 2):
+        cumulative.append(cumulative[-1] + step_volume(start + k + 1, 437))
+
+    def mass(t):
+        steps = t * rate
+        k = int(steps)
+        return round((cumulative[k] + (steps - k) * step_volume(start + k + 1, 437)) * 1e-3, 4)
+
+    positions = [(i * 0.02, (start + int(i * 0.02 * rate)) % spr) for i in range(3000)]
+    masses = [(0.005 + i * 0.1, mass(0.005 + i * 0.1)) for i in range(598)]
+    learned = learn_corrections(masses, positions, spr)
+    errors = [abs(a - b) for a, b in zip(learned, model_table(437))]
+    expect(sum(learned) == 0 and max(errors) < 150, f"learned pulsation table off by up to {max(errors)}: {learned}")
+    # After a restart the rotor stands 5 bins further on: the stored table lines up there
+    expect(align_phase(learned, model_table(437 + 5 * steps_per_bin), spr) == 5 * steps_per_bin, "pulsation phase not found")
+
+    device = EmulatedDevice(clock=lambda: 0.0, channels=2)
+    command = lambda command_id, data=b'': device.handle_command(bytes([command_id]) + data)
+    expect(command(Command.SET_PULSATION, pack_pulsation(1, learned, 250)) == b'\x00', "pulsation table refused")
+    table = parse_pulsation(command(Command.GET_PULSATION, PULSATION_REQUEST.pack(1)))
+    expect((table['enabled'], table['phase'], table['steps_per_revolution'], table['corrections']) == (1, 250, spr, learned),
+           f"pulsation table read back differs: {table}")
+    unbalanced = [1] + [0] * (PULSATION_BINS - 1)
+    too_large = [PULSATION_MAX_CORRECTION + 1, -PULSATION_MAX_CORRECTION - 1] + [0] * (PULSATION_BINS - 2)
+    for pump, corrections, phase, what in ((0, unbalanced, 0, "not adding up to zero"), (0, too_large, 0, "out of range"),
+                                           (0, learned, spr, "with a phase past the revolution"),
+                                           (0, learned[1:], 0, "one bin short"), (2, learned, 0, "of a missing pump")):
+        expect(command(Command.SET_PULSATION, pack_pulsation(pump, corrections, phase)) == b'\x03',
+               f"pulsation table {what} accepted")
+    expect(command(Command.GET_PULSATION, PULSATION_REQUEST.pack(2)) == b'\x03', "missing pump's pulsation table not rejected")
+
+
+async def check_async_client(conn: AsyncDeviceConnection):
+    expect(await conn.ping(), "ping not acknowledged")
+    expect(await conn.send_command(99) == b'\x01', "unknown command not answered with ack 1")
+    expect(await conn.send_command(Command.SET_VALVES, b'\x01') == b'\x02', "short request not answered with ack 2")
+
+    # A frame with a bad checksum is dropped without a reply and must not desynchronise the receiver
+    if conn.framing != FRAMING_START_SEQUENCE:
+        bad = bytearray(encode_cobs_frame(bytes([1, 2, 3])))
+        bad[-2] ^= 0x01
+    else:
+        bad = bytearray(encode_frame(1, bytes([2, 3])))
+        bad[-1] ^= 0xff
+    conn.writer.write(bytes(bad))
+    expect(await conn.ping(), "no response after a damaged frame")
+    if conn.framing != FRAMING_START_SEQUENCE:
+        # Noise with a start sequence and a large length byte costs only itself: the next frame is answered at once
+        conn.writer.write(b'\x21\x37\xff' + bytes(range(1, 40)))
+        expect(await conn._try_send_command(Command.PING, None, 0.5) == b'\x00', "no resync at the next delimiter")
+
+    program = ProgramConverter().load_from_yaml(EXAMPLE_PROGRAM)
+    await conn.write_program(program)
+    expect(await conn.get_program_length() == len(program.steps), "program length mismatch")
+    expect(packed(await conn.read_program_steps()) == packed(program.steps), "program read back differs")
+    names = await conn.send_command(9)
+    expect(names[:len(program.reagents[1])] == program.reagents[1].encode(), "reagent names not stored")
+
+    log_start = len(await conn.get_run_log())
+    await conn.execute_program()
+    state = await conn.get_device_state()
+    expect(state.running == 1 and state.program_step_idx == 0, f"program not running after execute: {state}")
+    await conn.abort_program()
+    expect((await conn.get_device_state()).running == 0, "program still running after abort")
+    records = await conn.get_run_log(log_start)
+    expect([r['type'] for r in records] == ['run_start', 'run_end'] and records[-1]['aborted'],
+           f"unexpected run log records: {records}")
+
+    long = long_program(97)  # not a multiple of the block size
+    await conn.write_program(long)
+    expect(packed(await conn.read_program_steps()) == packed(long.steps), "long program read back differs")
+    stats = await conn.get_valve_stats(1)
+    expect(stats['valve'] == 1 and stats['max_step_time'] == 30000, f"valve stats: {stats}")
+    expect(not await conn.autotune_valve(2), "autotune of a missing valve accepted")
+    corrections = [100, -100] * (PULSATION_BINS // 2)
+    expect(await conn.set_pulsation(0, corrections, 10), "pulsation table refused")
+    table = await conn.get_pulsation(0)
+    expect(table['corrections'] == corrections and table['phase'] == 10, f"pulsation table: {table}")
+    expect(await conn.set_pulsation(0, corrections, 10, enabled=False), "pulsation off refused")
+    summary, records = await conn.get_step_jitter(reset=True)
+    expect(summary['control_core'] != summary['network_core'] and [r['source'] for r in records] == ['pump', 'valve', 'valve', 'control'],
+           f"step jitter layout: {summary} {records}")
+
+    await check_streaming(conn)
+
+
+async def check_streaming(conn: AsyncDeviceConnection):
+    # More steps than the look-ahead holds, produced by a generator while the run goes on
+    n = 150
+    log_start = len(await conn.get_run_log())
+    status = await conn.stream_program(ProgramStep(0xff, 0xff, 0.5, float('inf'), 0.002) for _ in range(n))
+    expect(status['received'] == n, f"streamed steps not all accepted: {status}")
+    state = await conn.wait_program_finished(interval=0.01)
+    expect(state.running == 0, "streamed run did not finish")
+    records = await conn.get_run_log(log_start)
+    expect(records[0]['type'] == 'run_start' and records[0]['streamed'], f"streamed run not flagged: {records[:1]}")
+    expect(sum(r['type'] == 'step_end' for r in records) == n and records[-1]['type'] == 'run_end'
+           and not records[-1]['aborted'], "streamed run log incomplete")
+    status = STREAM_STATUS.unpack(await conn.send_command(Command.END_STREAM))
+    expect(status.state == STREAM_FINISHED and status.started == n, f"unexpected final stream status: {status}")
+
+    # A repeated request (lost response) is not appended twice; underrun with UNDERRUN_STOP ends the run
+    step = packed([ProgramStep(0xff, 0xff, 0.5, float('inf'), 0.002)])
+    await conn.send_command(Command.START_STREAM, STREAM_START_REQUEST.pack(UNDERRUN_STOP))
+    for _ in range(2):
+        status = STREAM_STATUS.unpack(await conn.send_command(Command.STREAM_STEPS, STREAM_STEPS_REQUEST.pack(0) + step))
+    expect(status.received == 1, f"repeated stream request appended twice: {status}")
+    await asyncio.sleep(0.05)
+    status = STREAM_STATUS.unpack(await conn.send_command(Command.STREAM_STEPS, STREAM_STEPS_REQUEST.pack(1) + step))
+    expect(status.state == STREAM_STOPPED and status.underruns == 1 and status.received == 1,
+           f"underrun did not stop the stream: {status}")
+    expect(await conn.send_command(Command.START_STREAM, bytes([7])) == b'\x03', "invalid underrun policy not rejected")
+
+
+async def check_lost_responses(server, framing: int, n: int = 40):
+    """Responses dropped on a pipelined link: every request still gets its own answer (or an error)"""
+    conn = await AsyncDeviceConnection.open_tcp('127.0.0.1', server_port(server), pipeline_depth=4, framing=framing)
+    expect(conn.framing == framing, f"framing {framing} not in use")
+    mismatches = []
+
+    async def worker(command_id, size):
+        for _ in range(n // 4):
+            resp = await conn.send_command(command_id)
+            if len(resp) != size:
+                mismatches.append((command_id, resp))
+    try:
+        await asyncio.gather(worker(Command.PING, 1), worker(Command.GET_DEVICE_STATE, DEVICE_STATE.size),
+                             worker(Command.PING, 1), worker(Command.GET_DEVICE_STATE, DEVICE_STATE.size))
+    finally:
+        await conn.close()
+    expect(not mismatches, f"framing {framing}: {len(mismatches)} of {n} responses matched to the wrong request")
+
+
+def check_sync_client(port: str, framing: int = FRAMING_START_SEQUENCE):
+    from device_connection import DeviceConnection
+    conn = DeviceConnection(port, framing=framing)
+    conn.open()
+    try:
+        program = ProgramConverter().load_from_yaml(EXAMPLE_PROGRAM)
+        conn.write_program(program)
+        expect(packed(conn.read_program().steps) == packed(program.steps), "program read back differs (pyserial)")
+        expect(conn.get_device_state().running == 0, "unexpected running state (pyserial)")
+        summary, commands = conn.get_command_stats()
+        expect(len(commands) == summary['num_commands'] == len(Command), "command stats incomplete")
+        expect(summary['unknown_commands'] >= 1, f"unknown commands not counted: {summary}")
+        set_valves = commands[Command.SET_VALVES]
+        expect(set_valves['calls'] == set_valves['errors'] >= 1, f"rejected request not counted: {set_valves}")
+        expect(commands[Command.WRITE_PROGRAM_BLOCK]['calls'] > 0, "program upload not counted")
+        status = conn.stream_program([ProgramStep(0xff, 0xff, 0.5, float('inf'), 0.002)] * 80)
+        expect(status['received'] == 80, f"streamed steps not all accepted (pyserial): {status}")
+    finally:
+        conn.close()
+
+
+def result(name: str, unit: str, ops: int, seconds: float) -> dict:
+    return {'name': name, 'unit': unit, 'ops': ops, 'ns_per_op': seconds / ops * 1e9, 'instructions_per_op': -1}
+
+
+async def open_for_bench(server, attempts: int = 5, **kwargs) -> AsyncDeviceConnection:
+    """Open a connection on the benchmark link, where the framing reset, the ping and the framing switch can all be lost"""
+    for attempt in range(attempts):
+        try:
+            return await AsyncDeviceConnection.open_tcp('127.0.0.1', server_port(server), **kwargs)
+        except ConnectionError:
+            if attempt == attempts - 1:
+                raise
+
+
+async def bench_async(conn: AsyncDeviceConnection, name: str, command_id: int, n: int, depth: int, size: int) -> dict:
+    """Requests that fail after all retries (timeouts) or come back with the wrong size for command_id
+    (mismatches) on a faulty link are counted, not raised, and still count as ops"""
+    failures = {'timeouts': 0, 'mismatches': 0}
+
+    async def worker(count):
+        for _ in range(count):
+            try:
+                resp = await conn.send_command(command_id)
+            except ConnectionError:
+                failures['timeouts'] += 1
+                continue
+            if len(resp) != size:
+                failures['mismatches'] += 1
+    start = time.perf_counter()
+    await asyncio.gather(*(worker(n // depth) for _ in range(depth)))
+    return {**result(name, 'request', n // depth * depth, time.perf_counter() - start), **failures}
+
+
+async def bench_upload(conn: AsyncDeviceConnection, name: str, n: int) -> dict:
+    program = long_program(100)
+    failures = {'timeouts': 0, 'mismatches': 0}
+    start = time.perf_counter()
+    for _ in range(n):
+        try:
+            await conn.write_program(program)
+        except ConnectionError:
+            failures['timeouts'] += 1
+    return {**result(name, 'program', n, time.perf_counter() - start), **failures}
+
+
+async def run_benchmarks(server, n: int) -> list:
+    results = []
+    for depth in (1, 4):
+        conn = await open_for_bench(server, pipeline_depth=depth)
+        try:
+            results.append(await bench_async(conn, f"async_ping_depth{depth}", Command.PING, n, depth, 1))
+            results.append(await bench_async(conn, f"async_device_state_depth{depth}", Command.GET_DEVICE_STATE,
+                                             n, depth, DEVICE_STATE.size))
+        finally:
+            await conn.close()
+    # Untagged framing keeps one request in flight whatever the depth
+    conn = await open_for_bench(server, pipeline_depth=4, framing=FRAMING_START_SEQUENCE)
+    try:
+        results.append(await bench_async(conn, "async_device_state_depth4_untagged", Command.GET_DEVICE_STATE,
+                                         n, 4, DEVICE_STATE.size))
+    finally:
+        await conn.close()
+    conn = await open_for_bench(server)
+    try:
+        results.append(await bench_upload(conn, "async_program_upload_100_steps", 5))
+    finally:
+        await conn.close()
+    return results
+
+
+def bench_sync(port: str, n: int) -> list:
+    from device_connection import DeviceConnection
+    conn = DeviceConnection(port)
+    conn.open()
+    try:
+        results = []
+        for name, command_id, size in (('sync_ping', Command.PING, 1),
+                                       ('sync_device_state', Command.GET_DEVICE_STATE, DEVICE_STATE.size)):
+            failures = {'timeouts': 0, 'mismatches': 0}
+            start = time.perf_counter()
+            for _ in range(n):
+                try:
+                    resp = conn.send_command(command_id)
+                except ConnectionError:
+                    failures['timeouts'] += 1
+                    continue
+                if len(resp) != size:
+                    failures['mismatches'] += 1
+            results.append({**result(name, 'request', n, time.perf_counter() - start), **failures})
+        return results
+    finally:
+        conn.close()
+
+
+async def main():
+    parser = argparse.ArgumentParser(description="Protocol conformance and throughput against the device emulator")
+    parser.add_argument('output', nargs='?', help="also write the results to this file")
+    parser.add_argument('--baud', type=int, default=115200)
+    parser.add_argument('--latency-ms', type=float, default=1.0, help="emulated control loop time per command")
+    parser.add_argument('--rx-error-rate', type=float, default=0.0)
+    parser.add_argument('--tx-error-rate', type=float, default=0.0)
+    parser.add_argument('--requests', type=int, default=200)
+    args = parser.parse_args()
+
+    try:
+        import serial  # noqa: F401
+        have_pyserial = True
+    except ImportError:
+        have_pyserial = False
+
+    # Conformance on a clean, unthrottled link, in both framings
+    device = EmulatedDevice()
+    server, = await serve_tcp([device])
+    conn = await AsyncDeviceConnection.open_tcp('127.0.0.1', server_port(server), framing=FRAMING_START_SEQUENCE)
+    try:
+        check_cobs_codec()
+        check_framing_reset()
+        check_flow_ramp()
+        check_valve_mixing()
+        check_channels()
+        check_valve_autotune()
+        check_pulsation()
+        await check_async_client(conn)
+        await conn.close()
+        conn = await AsyncDeviceConnection.open_tcp('127.0.0.1', server_port(server), framing=FRAMING_COBS)
+        await check_async_client(conn)
+        await conn.close()
+        conn = await AsyncDeviceConnection.open_tcp('127.0.0.1', server_port(server))
+        await check_async_client(conn)
+        if have_pyserial:
+            port, _ = await serve_pty(device)
+            # The second session finds the device still in COBS framing and has to reset it
+            await asyncio.to_thread(check_sync_client, port, FRAMING_COBS)
+            await asyncio.to_thread(check_sync_client, port)
+        lossy, = await serve_tcp([EmulatedDevice()], config=LinkConfig(drop_response_rate=0.1, seed=1))
+        try:
+            for framing in (FRAMING_COBS_TAGGED, FRAMING_COBS, FRAMING_START_SEQUENCE):
+                await check_lost_responses(lossy, framing)
+        finally:
+            lossy.close()
+    except (ConformanceError, ConnectionError) as e:
+        print(f"conformance check failed: {e}", file=sys.stderr)
+        return 1
+    finally:
+        await conn.close()
+        server.close()
+
+    config = LinkConfig(latency=args.latency_ms / 1000.0, baudrate=args.baud,
+                        rx_error_rate=args.rx_error_rate, tx_error_rate=args.tx_error_rate)
+    device = EmulatedDevice()
+    server, = await serve_tcp([device], config=config)
+    try:
+        results = await run_benchmarks(server, args.requests)
+    except ConnectionError as e:
+        print(f"benchmark link unusable: {e}", file=sys.stderr)
+        return 1
+    finally:
+        server.close()
+    if have_pyserial:
+        port, _ = await serve_pty(EmulatedDevice(), config)
+        try:
+            results += await asyncio.to_thread(bench_sync, port, args.requests)
+        except ConnectionError as e:
+            print(f"benchmark link unusable: {e}", file=sys.stderr)
+            return 1
+
+    output = json.dumps({'link': {'baud': args.baud, 'latency_ms': args.latency_ms,
+                                  'rx_error_rate': args.rx_error_rate, 'tx_error_rate': args.tx_error_rate},
+                         'benchmarks': results}, indent=2)
+    print(output)
+    if args.output:
+        with open(args.output, 'w') as file:
+            file.write(output)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(asyncio.run(main()))
@@ -0,0 +1,98 @@
+#ifndef BENCH_SHIM_ARDUINO_H
+#define BENCH_SHIM_ARDUINO_H
+
+// Minimal Arduino-ESP32 HAL stand-in so the firmware headers compile on the host
+// for benchmarking. GPIO writes land in hal_pins[], time comes from the host clock
+// unless a benchmark drives hal_time_us by hand.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <math.h>
+#include <stdexcept>
+#include <algorithm>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#define HIGH 0x1
+#define LOW 0x0
+#define INPUT 0x01
+#define OUTPUT 0x03
+#define INPUT_PULLUP 0x05
+#define HEX 16
+#define DEC 10
+#define IRAM_ATTR
+
+using std::max;
+using std::min;
+
+constexpr int kHalNumPins = 40;
+extern volatile uint8_t hal_pins[kHalNumPins];
+extern volatile uint8_t hal_pin_modes[kHalNumPins];
+extern volatile uint32_t hal_pin_rises[kHalNumPins]; // low to high writes, seen by the PCNT stand-in
+extern uint64_t hal_time_us;     // used instead of the host clock when hal_manual_time is set
+extern bool hal_manual_time;
+
+inline void pinMode(uint8_t pin, uint8_t mode) { hal_pin_modes[pin] = mode; }
+inline void digitalWrite(uint8_t pin, uint8_t value) {
+  hal_pin_rises[pin] += value && !hal_pins[pin];
+  hal_pins[pin] = value;
+}
+inline int digitalRead(uint8_t pin) { return hal_pins[pin]; }
+
+uint64_t hal_host_micros();
+inline unsigned long micros() { return hal_manual_time ? hal_time_us : hal_host_micros(); }
+inline unsigned long millis() { return micros() / 1000; }
+inline void delayMicroseconds(uint32_t us) { if (hal_manual_time) hal_time_us += us; }
+inline void delay(uint32_t ms) { delayMicroseconds(ms * 1000); }
+
+class HardwareSerial {
+  public:
+    void begin(unsigned long) {}
+
+    // Received bytes are served from a buffer set by the benchmark
+    void set_rx(const uint8_t* data, size_t len) { rx_ = data; rx_len_ = len; rx_idx_ = 0; }
+    int available() { return rx_len_ - rx_idx_; }
+    int read() { return rx_idx_ < rx_len_ ? rx_[rx_idx_++] : -1; }
+
+    // Transmitted bytes are counted and discarded, unless the benchmark set a
+    // buffer to copy them into. The last byte is kept so the compiler cannot
+    // drop the work that produced it (e.g. the frame CRC).
+    size_t write(uint8_t b) { return write(&b, 1); }
+    size_t write(const uint8_t* data, size_t len) {
+      for (size_t i = 0; i < len && tx_len_ < tx_cap_; i++) tx_[tx_len_++] = data[i];
+      tx_bytes_ += len;
+      tx_last_ = data[len - 1];
+      return len;
+    }
+    size_t tx_bytes() const { return tx_bytes_; }
+    void set_tx(uint8_t* buffer, size_t cap) { tx_ = buffer; tx_cap_ = cap; tx_len_ = 0; }
+    size_t tx_len() const { return tx_len_; }
+    // The host never drains slower than it writes: the TX ring always has room
+    void setTxBufferSize(size_t size) { tx_buffer_size_ = size; }
+    int availableForWrite() { return tx_buffer_size_; }
+
+    template <typename T> size_t print(T) { return 0; }
+    template <typename T> size_t print(T, int) { return 0; }
+    template <typename T> size_t println(T) { return 0; }
+    template <typename T> size_t println(T, int) { return 0; }
+    size_t println() { return 0; }
+    size_t printf(const char*, ...) { return 0; }
+
+  private:
+    const uint8_t* rx_ = nullptr;
+    size_t rx_len_ = 0;
+    size_t rx_idx_ = 0;
+    size_t tx_bytes_ = 0;
+    volatile uint8_t tx_last_ = 0;
+    uint8_t* tx_ = nullptr;
+    size_t tx_cap_ = 0;
+    size_t tx_len_ = 0;
+    size_t tx_buffer_size_ = 128;
+};
+
+extern HardwareSerial Serial;
+
+#endif // BENCH_SHIM_ARDUINO_H
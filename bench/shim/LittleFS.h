@@ -0,0 +1,31 @@
+#ifndef BENCH_SHIM_LITTLEFS_H
+#define BENCH_SHIM_LITTLEFS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Benchmarks never touch flash: every open fails and nothing exists.
+class File {
+  public:
+    explicit operator bool() const { return false; }
+    size_t write(const uint8_t*, size_t) { return 0; }
+    size_t read(uint8_t*, size_t) { return 0; }
+    size_t size() const { return 0; }
+    bool seek(uint32_t) { return false; }
+    const char* name() const { return ""; }
+    File openNextFile() { return File(); }
+    void close() {}
+};
+
+class LittleFSFS {
+  public:
+    bool begin(bool = false) { return true; }
+    bool exists(const char*) { return false; }
+    File open(const char*, const char*) { return File(); }
+    bool remove(const char*) { return false; }
+    bool rename(const char*, const char*) { return false; }
+};
+
+extern LittleFSFS LittleFS;
+
+#endif // BENCH_SHIM_LITTLEFS_H
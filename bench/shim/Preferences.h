@@ -0,0 +1,60 @@
+#ifndef BENCH_SHIM_PREFERENCES_H
+#define BENCH_SHIM_PREFERENCES_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <map>
+#include <string>
+#include <vector>
+
+// Arduino Preferences (NVS) stand-in: namespaces of byte blobs kept in memory
+// for the whole process, so a second Preferences object sees earlier writes.
+class Preferences {
+  public:
+    static std::map<std::string, std::vector<uint8_t>>& storage() {
+      static std::map<std::string, std::vector<uint8_t>> nvs;
+      return nvs;
+    }
+
+    bool begin(const char* name, bool read_only = false) {
+      namespace_ = name;
+      read_only_ = read_only;
+      return true;
+    }
+
+    void end() {}
+
+    size_t getBytesLength(const char* key) {
+      auto it = storage().find(full_key(key));
+      return it == storage().end() ? 0 : it->second.size();
+    }
+
+    size_t getBytes(const char* key, void* buf, size_t max_len) {
+      auto it = storage().find(full_key(key));
+      if (it == storage().end() || it->second.size() > max_len) {
+        return 0;
+      }
+      memcpy(buf, it->second.data(), it->second.size());
+      return it->second.size();
+    }
+
+    size_t putBytes(const char* key, const void* value, size_t len) {
+      if (read_only_) {
+        return 0;
+      }
+      const uint8_t* bytes = (const uint8_t*)value;
+      storage()[full_key(key)] = std::vector<uint8_t>(bytes, bytes + len);
+      return len;
+    }
+
+  private:
+    std::string namespace_;
+    bool read_only_ = false;
+
+    std::string full_key(const char* key) const {
+      return namespace_ + "/" + key;
+    }
+};
+
+#endif // BENCH_SHIM_PREFERENCES_H
@@ -0,0 +1,96 @@
+#ifndef BENCH_SHIM_WIRE_H
+#define BENCH_SHIM_WIRE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Arduino TwoWire stand-in with one MCP23017 on the bus (any address answers).
+// Registers follow IOCON.BANK = 0 with sequential addressing: a write sets the
+// register pointer and stores the following bytes, a read continues from it.
+// Reading GPIO or INTCAP clears INTF, like the chip releasing its INT line.
+class TwoWire {
+  public:
+    uint8_t regs[0x16] = {0xff, 0xff}; // power-on state: IODIR all inputs
+    uint16_t pins = 0;                 // levels applied to the input lines
+    size_t transactions = 0;           // completed transfers (writes ended with a stop, reads)
+
+    void begin() {}
+    void setClock(uint32_t) {}
+
+    void beginTransmission(uint8_t) { tx_len_ = 0; }
+    size_t write(uint8_t b) { if (tx_len_ < sizeof(tx_)) tx_[tx_len_++] = b; return 1; }
+    size_t write(const uint8_t* data, size_t len) { for (size_t i = 0; i < len; i++) write(data[i]); return len; }
+
+    uint8_t endTransmission(bool stop = true) {
+      if (tx_len_ > 0) {
+        pointer_ = tx_[0];
+        for (size_t i = 1; i < tx_len_; i++) {
+          store(pointer_++, tx_[i]);
+        }
+      }
+      if (stop) {
+        transactions++;
+      }
+      return 0;
+    }
+
+    uint8_t requestFrom(uint8_t, uint8_t len) {
+      update_inputs();
+      rx_len_ = 0;
+      rx_idx_ = 0;
+      for (uint8_t i = 0; i < len && rx_len_ < sizeof(rx_); i++) {
+        uint8_t reg = pointer_++;
+        rx_[rx_len_++] = reg < sizeof(regs) ? regs[reg] : 0;
+        if (reg >= 0x10 && reg <= 0x13) {
+          regs[0x0e + (reg & 1)] = 0; // INTF cleared by reading INTCAP or GPIO
+        }
+      }
+      transactions++;
+      return rx_len_;
+    }
+
+    int read() { return rx_idx_ < rx_len_ ? rx_[rx_idx_++] : -1; }
+
+    // Applies new input levels; returns true if the INT line goes active
+    bool set_pins(uint16_t levels) {
+      uint16_t changed = (levels ^ pins) & (regs[0x04] | regs[0x05] << 8);
+      pins = levels;
+      if (changed) {
+        regs[0x0e] |= changed;
+        regs[0x0f] |= changed >> 8;
+        regs[0x10] = levels;  // INTCAP
+        regs[0x11] = levels >> 8;
+      }
+      update_inputs();
+      return (regs[0x0e] | regs[0x0f]) != 0;
+    }
+
+    uint16_t outputs() const { return regs[0x14] | regs[0x15] << 8; }
+
+  private:
+    uint8_t tx_[32];
+    size_t tx_len_ = 0;
+    uint8_t rx_[32];
+    uint8_t rx_len_ = 0;
+    uint8_t rx_idx_ = 0;
+    uint8_t pointer_ = 0;
+
+    void store(uint8_t reg, uint8_t value) {
+      if (reg < sizeof(regs) && reg != 0x0e && reg != 0x0f && reg != 0x10 && reg != 0x11) {
+        regs[reg] = value;
+      }
+      update_inputs();
+    }
+
+    // GPIO reads the pin levels on inputs and the latch on outputs
+    void update_inputs() {
+      uint16_t iodir = regs[0x00] | regs[0x01] << 8;
+      uint16_t gpio = (pins & iodir) | (outputs() & ~iodir);
+      regs[0x12] = gpio;
+      regs[0x13] = gpio >> 8;
+    }
+};
+
+extern TwoWire Wire;
+
+#endif // BENCH_SHIM_WIRE_H
@@ -0,0 +1,14 @@
+#ifndef BENCH_SHIM_DRIVER_GPIO_H
+#define BENCH_SHIM_DRIVER_GPIO_H
+
+#include "Arduino.h"
+
+typedef int gpio_num_t;
+typedef int esp_err_t;
+#define ESP_OK 0
+
+enum gpio_mode_t { GPIO_MODE_INPUT = 1, GPIO_MODE_OUTPUT = 2, GPIO_MODE_INPUT_OUTPUT = 3 };
+
+inline esp_err_t gpio_set_direction(gpio_num_t, gpio_mode_t) { return ESP_OK; }
+
+#endif // BENCH_SHIM_DRIVER_GPIO_H
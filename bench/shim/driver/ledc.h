@@ -0,0 +1,185 @@
+#ifndef BENCH_SHIM_DRIVER_LEDC_H
+#define BENCH_SHIM_DRIVER_LEDC_H
+
+#include "driver/gpio.h"
+#include "soc/gpio_sig_map.h"
+
+// LEDC stand-in for the high speed channels at 8 bit resolution from REF_TICK:
+// the timer divider is the pulse period in us. A channel puts rising edges on
+// its pin at the start of every period while its timer runs, its duty is not 0
+// and the GPIO matrix routes it to the pin (esp_rom_gpio.h); the edges are
+// counted in hal time, for the PCNT stand-in.
+
+enum ledc_mode_t { LEDC_HIGH_SPEED_MODE = 0, LEDC_LOW_SPEED_MODE };
+enum ledc_timer_t { LEDC_TIMER_0 = 0, LEDC_TIMER_1, LEDC_TIMER_2, LEDC_TIMER_3 };
+enum ledc_channel_t { LEDC_CHANNEL_0 = 0, LEDC_CHANNEL_1, LEDC_CHANNEL_2, LEDC_CHANNEL_3,
+                      LEDC_CHANNEL_4, LEDC_CHANNEL_5, LEDC_CHANNEL_6, LEDC_CHANNEL_7 };
+enum ledc_timer_bit_t { LEDC_TIMER_8_BIT = 8 };
+enum ledc_clk_cfg_t { LEDC_AUTO_CLK = 0, LEDC_USE_REF_TICK };
+enum ledc_clk_src_t { LEDC_REF_TICK = 0, LEDC_APB_CLK };
+enum ledc_intr_type_t { LEDC_INTR_DISABLE = 0 };
+
+struct ledc_timer_config_t {
+  ledc_mode_t speed_mode;
+  ledc_timer_bit_t duty_resolution;
+  ledc_timer_t timer_num;
+  uint32_t freq_hz;
+  ledc_clk_cfg_t clk_cfg;
+};
+
+struct ledc_channel_config_t {
+  int gpio_num;
+  ledc_mode_t speed_mode;
+  ledc_channel_t channel;
+  ledc_intr_type_t intr_type;
+  ledc_timer_t timer_sel;
+  uint32_t duty;
+  int hpoint;
+};
+
+constexpr int kHalLedcChannels = 8;
+constexpr int kHalLedcTimers = 4;
+
+struct HalLedcChannel {
+  int timer = 0;
+  int pin = -1;            // routed to by the GPIO matrix
+  uint32_t duty = 0;
+  bool active = false;
+  uint64_t since_us = 0;   // start of the current active stretch
+  uint32_t period_us = 0;
+};
+
+struct HalLedc {
+  HalLedcChannel channels[kHalLedcChannels];
+  uint32_t dividers[kHalLedcTimers] = {0};
+  bool running[kHalLedcTimers] = {false};
+  uint32_t edges[kHalNumPins] = {0}; // in closed active stretches
+
+  // A stretch can start in the future, at the first edge after a change of period
+  static uint32_t stretch_edges(uint64_t since_us, uint32_t period_us) {
+    return period_us && micros() >= since_us ? (micros() - since_us) / period_us + 1 : 0;
+  }
+
+  // Settings of a channel, its timer or its routing change between close() and open()
+  void close(int i) {
+    HalLedcChannel& c = channels[i];
+    if (c.active) {
+      edges[c.pin] += stretch_edges(c.since_us, c.period_us);
+      c.active = false;
+    }
+  }
+
+  void open(int i) {
+    HalLedcChannel& c = channels[i];
+    c.active = running[c.timer] && c.duty != 0 && c.pin >= 0;
+    c.since_us = micros();
+    c.period_us = dividers[c.timer];
+  }
+
+  template <typename Change>
+  void change_timer(int timer, Change change) {
+    for (int i = 0; i < kHalLedcChannels; i++) {
+      if (channels[i].timer == timer) {
+        close(i);
+      }
+    }
+    change();
+    for (int i = 0; i < kHalLedcChannels; i++) {
+      if (channels[i].timer == timer) {
+        open(i);
+      }
+    }
+  }
+
+  // A running timer takes a new divider at its next overflow: the next edge stays where
+  // it was, the ones after it follow the new period
+  void retime(int timer, uint32_t divider) {
+    uint64_t next_us[kHalLedcChannels];
+    bool active[kHalLedcChannels];
+    for (int i = 0; i < kHalLedcChannels; i++) {
+      HalLedcChannel& c = channels[i];
+      active[i] = c.timer == timer && c.active;
+      if (active[i]) {
+        next_us[i] = c.since_us + uint64_t(stretch_edges(c.since_us, c.period_us)) * c.period_us;
+      }
+    }
+    change_timer(timer, [&] { dividers[timer] = divider; });
+    for (int i = 0; i < kHalLedcChannels; i++) {
+      if (active[i] && channels[i].active) {
+        channels[i].since_us = next_us[i];
+      }
+    }
+  }
+
+  uint32_t pin_edges(int pin) const {
+    uint32_t n = edges[pin];
+    for (const HalLedcChannel& c : channels) {
+      if (c.active && c.pin == pin) {
+        n += stretch_edges(c.since_us, c.period_us);
+      }
+    }
+    return n;
+  }
+};
+
+inline HalLedc hal_ledc;
+
+inline esp_err_t ledc_timer_config(const ledc_timer_config_t* config) {
+  hal_ledc.change_timer(config->timer_num, [&] { hal_ledc.dividers[config->timer_num] = 1000000 / config->freq_hz; });
+  return ESP_OK;
+}
+
+inline esp_err_t ledc_channel_config(const ledc_channel_config_t* config) {
+  HalLedcChannel& c = hal_ledc.channels[config->channel];
+  hal_ledc.close(config->channel);
+  c.timer = config->timer_sel;
+  c.duty = config->duty;
+  c.pin = config->gpio_num;
+  hal_ledc.open(config->channel);
+  return ESP_OK;
+}
+
+inline esp_err_t ledc_timer_set(ledc_mode_t, ledc_timer_t timer, uint32_t divider, uint32_t, ledc_clk_src_t) {
+  if (hal_ledc.running[timer]) {
+    hal_ledc.retime(timer, divider);
+  } else {
+    hal_ledc.change_timer(timer, [&] { hal_ledc.dividers[timer] = divider; });
+  }
+  return ESP_OK;
+}
+
+// Restarts the period: the next rising edge is now
+inline esp_err_t ledc_timer_rst(ledc_mode_t, ledc_timer_t timer) {
+  hal_ledc.change_timer(timer, [] {});
+  return ESP_OK;
+}
+
+inline esp_err_t ledc_timer_pause(ledc_mode_t, ledc_timer_t timer) {
+  hal_ledc.change_timer(timer, [&] { hal_ledc.running[timer] = false; });
+  return ESP_OK;
+}
+
+inline esp_err_t ledc_timer_resume(ledc_mode_t, ledc_timer_t timer) {
+  hal_ledc.change_timer(timer, [&] { hal_ledc.running[timer] = true; });
+  return ESP_OK;
+}
+
+inline esp_err_t ledc_set_duty(ledc_mode_t, ledc_channel_t channel, uint32_t duty) {
+  hal_ledc.channels[channel].duty = duty; // applied by ledc_update_duty()
+  return ESP_OK;
+}
+
+inline esp_err_t ledc_update_duty(ledc_mode_t, ledc_channel_t channel) {
+  hal_ledc.close(channel);
+  hal_ledc.open(channel);
+  return ESP_OK;
+}
+
+inline esp_err_t ledc_stop(ledc_mode_t, ledc_channel_t channel, uint32_t) {
+  hal_ledc.close(channel);
+  hal_ledc.channels[channel].duty = 0;
+  hal_ledc.open(channel);
+  return ESP_OK;
+}
+
+#endif // BENCH_SHIM_DRIVER_LEDC_H
@@ -0,0 +1,144 @@
+#ifndef BENCH_SHIM_DRIVER_PCNT_H
+#define BENCH_SHIM_DRIVER_PCNT_H
+
+#include "driver/gpio.h"
+#include "driver/ledc.h"
+
+// PCNT stand-in counting the rising edges of its pin: those written through
+// digitalWrite() (hal_pin_rises) and those of LEDC channels routed to it. The
+// counter wraps to 0 at the high limit by itself; the interrupt handler only
+// runs when the benchmark calls hal_pcnt_service(), like an interrupt held off
+// until then, with the events since the last call.
+
+enum pcnt_unit_t { PCNT_UNIT_0 = 0, PCNT_UNIT_1, PCNT_UNIT_2, PCNT_UNIT_3,
+                   PCNT_UNIT_4, PCNT_UNIT_5, PCNT_UNIT_6, PCNT_UNIT_7 };
+enum pcnt_channel_t { PCNT_CHANNEL_0 = 0, PCNT_CHANNEL_1 };
+enum pcnt_ctrl_mode_t { PCNT_MODE_KEEP = 0, PCNT_MODE_REVERSE, PCNT_MODE_DISABLE };
+enum pcnt_count_mode_t { PCNT_COUNT_DIS = 0, PCNT_COUNT_INC, PCNT_COUNT_DEC };
+enum pcnt_evt_type_t { PCNT_EVT_THRES_1 = 0x04, PCNT_EVT_THRES_0 = 0x08, PCNT_EVT_L_LIM = 0x10,
+                       PCNT_EVT_H_LIM = 0x20, PCNT_EVT_ZERO = 0x40 };
+#define PCNT_PIN_NOT_USED (-1)
+#define ESP_ERR_INVALID_STATE 0x103
+
+struct pcnt_config_t {
+  int pulse_gpio_num;
+  int ctrl_gpio_num;
+  pcnt_ctrl_mode_t lctrl_mode;
+  pcnt_ctrl_mode_t hctrl_mode;
+  pcnt_count_mode_t pos_mode;
+  pcnt_count_mode_t neg_mode;
+  int16_t counter_h_lim;
+  int16_t counter_l_lim;
+  pcnt_unit_t unit;
+  pcnt_channel_t channel;
+};
+
+extern volatile uint32_t hal_pin_rises[kHalNumPins];
+
+constexpr int kHalPcntUnits = 8;
+
+struct HalPcntUnit {
+  int pin = -1;
+  int16_t h_lim = 0;
+  int16_t thres0 = 0;
+  uint32_t events = 0;   // enabled
+  uint32_t status = 0;   // of the interrupt being handled
+  uint32_t base = 0;     // raw edges at the last clear
+  uint32_t seen = 0;     // counts up to here were handled by the interrupt
+  void (*handler)(void*) = nullptr;
+  void* arg = nullptr;
+
+  uint32_t raw() const {
+    return pin < 0 ? 0 : hal_pin_rises[pin] + hal_ledc.pin_edges(pin) - base;
+  }
+};
+
+inline HalPcntUnit hal_pcnt[kHalPcntUnits];
+inline bool hal_pcnt_isr_service = false;
+
+// Runs the interrupt handlers for the wraps and the threshold crossed since the last call
+inline void hal_pcnt_service() {
+  for (HalPcntUnit& u : hal_pcnt) {
+    if (u.pin < 0 || u.handler == nullptr) {
+      continue;
+    }
+    uint32_t now = u.raw();
+    while ((u.events & PCNT_EVT_H_LIM) && u.seen / u.h_lim < now / u.h_lim) {
+      u.seen = (u.seen / u.h_lim + 1) * u.h_lim;
+      u.status = PCNT_EVT_H_LIM;
+      u.handler(u.arg);
+    }
+    uint32_t threshold = now / u.h_lim * u.h_lim + u.thres0;
+    if ((u.events & PCNT_EVT_THRES_0) && u.seen < threshold && now >= threshold) {
+      u.status = PCNT_EVT_THRES_0;
+      u.handler(u.arg);
+    }
+    u.seen = now;
+  }
+}
+
+inline esp_err_t pcnt_unit_config(const pcnt_config_t* config) {
+  HalPcntUnit& u = hal_pcnt[config->unit];
+  u.pin = config->pulse_gpio_num;
+  u.h_lim = config->counter_h_lim;
+  u.base = 0;
+  u.base = u.raw();
+  u.seen = 0;
+  return ESP_OK;
+}
+
+inline esp_err_t pcnt_set_filter_value(pcnt_unit_t, uint16_t) { return ESP_OK; }
+inline esp_err_t pcnt_filter_enable(pcnt_unit_t) { return ESP_OK; }
+inline esp_err_t pcnt_counter_pause(pcnt_unit_t) { return ESP_OK; }
+inline esp_err_t pcnt_counter_resume(pcnt_unit_t) { return ESP_OK; }
+
+inline esp_err_t pcnt_counter_clear(pcnt_unit_t unit) {
+  HalPcntUnit& u = hal_pcnt[unit];
+  u.base += u.raw();
+  u.seen = 0;
+  return ESP_OK;
+}
+
+inline esp_err_t pcnt_get_counter_value(pcnt_unit_t unit, int16_t* value) {
+  const HalPcntUnit& u = hal_pcnt[unit];
+  *value = u.raw() % u.h_lim;
+  return ESP_OK;
+}
+
+inline esp_err_t pcnt_event_enable(pcnt_unit_t unit, pcnt_evt_type_t event) {
+  hal_pcnt[unit].events |= event;
+  return ESP_OK;
+}
+
+inline esp_err_t pcnt_event_disable(pcnt_unit_t unit, pcnt_evt_type_t event) {
+  hal_pcnt[unit].events &= ~event;
+  return ESP_OK;
+}
+
+inline esp_err_t pcnt_set_event_value(pcnt_unit_t unit, pcnt_evt_type_t event, int16_t value) {
+  if (event == PCNT_EVT_THRES_0) {
+    hal_pcnt[unit].thres0 = value;
+  }
+  return ESP_OK;
+}
+
+inline esp_err_t pcnt_get_event_status(pcnt_unit_t unit, uint32_t* status) {
+  *status = hal_pcnt[unit].status;
+  return ESP_OK;
+}
+
+inline esp_err_t pcnt_isr_service_install(int) {
+  if (hal_pcnt_isr_service) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  hal_pcnt_isr_service = true;
+  return ESP_OK;
+}
+
+inline esp_err_t pcnt_isr_handler_add(pcnt_unit_t unit, void (*handler)(void*), void* arg) {
+  hal_pcnt[unit].handler = handler;
+  hal_pcnt[unit].arg = arg;
+  return ESP_OK;
+}
+
+#endif // BENCH_SHIM_DRIVER_PCNT_H
@@ -0,0 +1,13 @@
+#ifndef BENCH_SHIM_ESP_HEAP_CAPS_H
+#define BENCH_SHIM_ESP_HEAP_CAPS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define MALLOC_CAP_8BIT (1 << 2)
+
+inline size_t heap_caps_get_free_size(uint32_t) { return 0; }
+inline size_t heap_caps_get_largest_free_block(uint32_t) { return 0; }
+inline size_t heap_caps_get_minimum_free_size(uint32_t) { return 0; }
+
+#endif // BENCH_SHIM_ESP_HEAP_CAPS_H
@@ -0,0 +1,19 @@
+#ifndef BENCH_SHIM_ESP_ROM_GPIO_H
+#define BENCH_SHIM_ESP_ROM_GPIO_H
+
+#include "driver/ledc.h"
+
+// GPIO matrix output routing: an LEDC channel reaches the pin only while routed to it
+inline void esp_rom_gpio_connect_out_signal(uint32_t pin, uint32_t signal, bool, bool) {
+  for (int i = 0; i < kHalLedcChannels; i++) {
+    HalLedcChannel& c = hal_ledc.channels[i];
+    bool routed = signal == (uint32_t)(LEDC_HS_SIG_OUT0_IDX + i);
+    if (routed || c.pin == (int)pin) {
+      hal_ledc.close(i);
+      c.pin = routed ? (int)pin : -1;
+      hal_ledc.open(i);
+    }
+  }
+}
+
+#endif // BENCH_SHIM_ESP_ROM_GPIO_H
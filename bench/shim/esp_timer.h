@@ -0,0 +1,8 @@
+#ifndef BENCH_SHIM_ESP_TIMER_H
+#define BENCH_SHIM_ESP_TIMER_H
+
+#include "Arduino.h"
+
+inline int64_t esp_timer_get_time() { return micros(); }
+
+#endif // BENCH_SHIM_ESP_TIMER_H
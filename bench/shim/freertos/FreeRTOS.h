@@ -0,0 +1,21 @@
+#ifndef BENCH_SHIM_FREERTOS_H
+#define BENCH_SHIM_FREERTOS_H
+
+#include <stdint.h>
+
+typedef uint32_t UBaseType_t;
+typedef int32_t BaseType_t;
+typedef uint32_t TickType_t;
+
+#define configGENERATE_RUN_TIME_STATS 0
+#define pdMS_TO_TICKS(ms) ((TickType_t)(ms))
+
+struct portMUX_TYPE { uint32_t owner; };
+#define portMUX_INITIALIZER_UNLOCKED {0}
+#define portENTER_CRITICAL(mux) ((void)(mux))
+#define portEXIT_CRITICAL(mux) ((void)(mux))
+
+// The bench runs everything on one host thread, reported as the control core
+inline BaseType_t xPortGetCoreID() { return 1; }
+
+#endif // BENCH_SHIM_FREERTOS_H
@@ -0,0 +1,50 @@
+#ifndef BENCH_SHIM_QUEUE_H
+#define BENCH_SHIM_QUEUE_H
+
+#include <string.h>
+#include <vector>
+#include "FreeRTOS.h"
+
+#define pdTRUE 1
+#define pdFALSE 0
+#define portMAX_DELAY 0xffffffffUL
+
+// Single-threaded FIFO standing in for a FreeRTOS queue
+struct QueueDefinition {
+    std::vector<uint8_t> data;
+    UBaseType_t item_size;
+    UBaseType_t capacity;
+    UBaseType_t head;
+    UBaseType_t count;
+};
+typedef QueueDefinition* QueueHandle_t;
+
+inline QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size) {
+    return new QueueDefinition{std::vector<uint8_t>(length * item_size), item_size, length, 0, 0};
+}
+
+inline BaseType_t xQueueSend(QueueHandle_t q, const void* item, TickType_t) {
+    if (q->count == q->capacity) {
+        return pdFALSE;
+    }
+    UBaseType_t idx = (q->head + q->count) % q->capacity;
+    memcpy(&q->data[idx * q->item_size], item, q->item_size);
+    q->count++;
+    return pdTRUE;
+}
+
+inline BaseType_t xQueueReceive(QueueHandle_t q, void* item, TickType_t) {
+    if (q->count == 0) {
+        return pdFALSE;
+    }
+    memcpy(item, &q->data[q->head * q->item_size], q->item_size);
+    q->head = (q->head + 1) % q->capacity;
+    q->count--;
+    return pdTRUE;
+}
+
+inline UBaseType_t uxQueueMessagesWaiting(QueueHandle_t q) {
+    return q->count;
+}
+
+#endif // BENCH_SHIM_QUEUE_H
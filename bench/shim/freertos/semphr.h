@@ -0,0 +1,16 @@
+#ifndef BENCH_SHIM_SEMPHR_H
+#define BENCH_SHIM_SEMPHR_H
+
+#include "queue.h"
+
+// Benchmarks are single-threaded, a mutex never has to wait
+typedef int* SemaphoreHandle_t;
+
+inline SemaphoreHandle_t xSemaphoreCreateMutex() {
+    static int mutex;
+    return &mutex;
+}
+inline BaseType_t xSemaphoreTake(SemaphoreHandle_t, TickType_t) { return pdTRUE; }
+inline BaseType_t xSemaphoreGive(SemaphoreHandle_t) { return pdTRUE; }
+
+#endif // BENCH_SHIM_SEMPHR_H
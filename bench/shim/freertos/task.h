@@ -0,0 +1,28 @@
+#ifndef BENCH_SHIM_TASK_H
+#define BENCH_SHIM_TASK_H
+
+#include "FreeRTOS.h"
+
+typedef void* TaskHandle_t;
+
+enum eTaskState { eRunning = 0, eReady, eBlocked, eSuspended, eDeleted, eInvalid };
+
+struct TaskStatus_t {
+    TaskHandle_t xHandle;
+    const char* pcTaskName;
+    UBaseType_t xTaskNumber;
+    eTaskState eCurrentState;
+    UBaseType_t uxCurrentPriority;
+    UBaseType_t uxBasePriority;
+    uint32_t ulRunTimeCounter;
+    uint32_t usStackHighWaterMark;
+};
+
+inline UBaseType_t uxTaskGetSystemState(TaskStatus_t*, UBaseType_t, uint32_t* total_run_time) {
+    *total_run_time = 0;
+    return 0;
+}
+
+inline void vTaskDelay(TickType_t) {}
+
+#endif // BENCH_SHIM_TASK_H
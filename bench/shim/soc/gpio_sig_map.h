@@ -0,0 +1,8 @@
+#ifndef BENCH_SHIM_GPIO_SIG_MAP_H
+#define BENCH_SHIM_GPIO_SIG_MAP_H
+
+// GPIO matrix output signals used by the firmware, with the ESP32 values
+#define LEDC_HS_SIG_OUT0_IDX 71
+#define SIG_GPIO_OUT_IDX 256
+
+#endif // BENCH_SHIM_GPIO_SIG_MAP_H
@@ -0,0 +1,143 @@
+#!/usr/bin/env python3
+"""
+Heap fragmentation of the web server over a long run of API requests.
+
+usage: python bench/web_soak.py http://chromatograf.local [--requests 100000] [--clients 4] [-o after.json]
+       python bench/web_soak.py --compare before.json after.json
+
+Clients fetch the JSON endpoints of web_server.h back to back while the heap
+statistics of /api/diag/tasks (largest free block, free bytes, fragmentation)
+and the use of the request arenas are sampled every --sample-every requests.
+With handlers allocating their documents and response strings on the heap the
+largest free block shrinks as the run goes on; with the request arenas it
+should stay flat.
+"""
+
+import argparse
+import json
+import sys
+import threading
+import time
+import urllib.error
+import urllib.request
+
+API_PATHS = ['/api/status', '/api/program/get', '/api/reagent-config/get', '/api/runlog/info', '/api/diag/tasks']
+DIAG_PATH = '/api/diag/tasks'
+
+
+class Soak:
+    """Requests spread over `clients` threads, with a heap sample every `sample_every` requests"""
+
+    def __init__(self, base_url: str, requests: int, clients: int, sample_every: int, timeout: float):
+        self.base_url = base_url.rstrip('/')
+        self.requests = requests
+        self.clients = clients
+        self.sample_every = sample_every
+        self.timeout = timeout
+        self.done = 0
+        self.errors = {}
+        self.samples = []
+        self._lock = threading.Lock()
+        self._start = 0.0
+
+    def _get(self, path: str) -> bytes:
+        with urllib.request.urlopen(self.base_url + path, timeout=self.timeout) as response:
+            return response.read()
+
+    def _sample(self):
+        try:
+            diag = json.loads(self._get(DIAG_PATH))
+        except (OSError, ValueError) as e:
+            self._count_error(f"sample: {e}")
+            return
+        sample = {'requests': self.done, 'seconds': round(time.monotonic() - self._start, 1)}
+        sample.update(diag['heap'])
+        if 'request_arenas' in diag:
+            sample['arenas'] = diag['request_arenas']
+        self.samples.append(sample)
+
+    def _count_error(self, error: str):
+        with self._lock:
+            self.errors[error] = self.errors.get(error, 0) + 1
+
+    def _run(self, index: int):
+        i = index
+        while True:
+            with self._lock:
+                if self.done >= self.requests:
+                    return
+                self.done += 1
+                sample = self.done % self.sample_every == 0
+            try:
+                self._get(API_PATHS[i % len(API_PATHS)])
+            except urllib.error.HTTPError as e:
+                self._count_error(f"HTTP {e.code}")
+            except OSError as e:
+                self._count_error(type(e).__name__)
+            if sample:
+                self._sample()
+            i += 1
+
+    def run(self) -> dict:
+        self._start = time.monotonic()
+        self._sample()
+        threads = [threading.Thread(target=self._run, args=(i,), daemon=True) for i in range(self.clients)]
+        for thread in threads:
+            thread.start()
+        for thread in threads:
+            thread.join()
+        self._sample()
+        return {'requests': self.done, 'seconds': round(time.monotonic() - self._start, 1),
+                'errors': self.errors, 'summary': summarize(self.samples), 'samples': self.samples}
+
+
+def summarize(samples: list) -> dict:
+    if not samples:
+        return {}
+    blocks = [s['largest_free_block'] for s in samples]
+    return {'largest_free_block_first': blocks[0], 'largest_free_block_last': blocks[-1],
+            'largest_free_block_min': min(blocks), 'free_bytes_first': samples[0]['free_bytes'],
+            'free_bytes_last': samples[-1]['free_bytes'], 'fragmentation_max': max(s['fragmentation'] for s in samples),
+            'min_free_bytes': samples[-1]['min_free_bytes']}
+
+
+def compare(before_path: str, after_path: str):
+    with open(before_path) as file:
+        before = json.load(file)
+    with open(after_path) as file:
+        after = json.load(file)
+    print(f"{'':<26} {'before':>10} {'after':>10}")
+    for key in after['summary']:
+        print(f"{key:<26} {before['summary'].get(key, '-'):>10} {after['summary'][key]:>10}")
+    print(f"{'errors':<26} {sum(before['errors'].values()):>10} {sum(after['errors'].values()):>10}")
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Largest free heap block over a long run of web API requests")
+    parser.add_argument('url', nargs='?', help="web server base URL, e.g. http://chromatograf.local")
+    parser.add_argument('--requests', type=int, default=100000, help="API requests in total")
+    parser.add_argument('--clients', type=int, default=4, help="concurrent HTTP clients")
+    parser.add_argument('--sample-every', type=int, default=1000, help="requests between heap samples")
+    parser.add_argument('--timeout', type=float, default=5.0, help="per request, in seconds")
+    parser.add_argument('--label', default='', help="stored with the results, e.g. the firmware version")
+    parser.add_argument('-o', '--output', help="also write the results to this file")
+    parser.add_argument('--compare', nargs=2, metavar=('BEFORE', 'AFTER'), help="print two result files side by side")
+    args = parser.parse_args()
+
+    if args.compare:
+        compare(*args.compare)
+        return 0
+    if not args.url:
+        parser.error("a web server URL is required")
+    results = Soak(args.url, args.requests, args.clients, args.sample_every, args.timeout).run()
+    results['label'] = args.label
+    text = json.dumps(results, indent=2)
+    print(text)
+    if args.output:
+        with open(args.output, 'w') as file:
+            file.write(text + '\n')
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -285,10 +285,15 @@ class ChromatographyGUI(QMainWindow):
             if step.reagent_valve_id != 0xff and step.column_valve_id != 0xff:
                 reagent_name, column_name = self.get_valve_names(step.reagent_valve_id, step.column_valve_id)
                 if reagent_name and column_name:
+                    if step.mix_reagent_valve_id is not None:
+                        mix_name, _ = self.get_valve_names(step.mix_reagent_valve_id, step.column_valve_id)
+                        reagent_name = f"{reagent_name} {100 * (1 - step.mix_share):.0f}% + {mix_name} {100 * step.mix_share:.0f}%"
                     details.append(f"{reagent_name} → {column_name}")
             
             # Pump information
-            if step.flow_rate > 0:
+            if step.end_flow_rate is not None:
+                details.append(f"| pump: {step.flow_rate:.1f} → {step.end_flow_rate:.1f} ml/min")
+            elif step.flow_rate > 0:
                 details.append(f"| pump: {step.flow_rate:.1f} ml/min")
         
         # Duration
@@ -1,11 +1,77 @@
 import zlib
 import time
-import serial
-from program import Program, ProgramConverter
-from typing import List, Optional, Callable
-import struct
+import itertools
+from collections import deque
+from program import Program, ProgramConverter, ProgramStep
+from typing import Iterable, List, Optional, Callable
+from framing import FRAMING_RESET, CobsFrameParser, encode_cobs_frame
+from protocol import (START_SEQUENCE, FRAMING_COBS, FRAMING_START_SEQUENCE, SET_FRAMING_REQUEST, Command, PUMP_COMMAND, DEVICE_STATE, PROGRAM_STEP, HEAP_DIAGNOSTICS,
+                      TASK_DIAGNOSTICS, TRANSITION_STATS, RUN_LOG_RECORD, COMMAND_STATS_SUMMARY,
+                      COMMAND_STATS_RECORD, STREAM_START_REQUEST, STREAM_STEPS_REQUEST, STREAM_STATUS,
+                      MAX_STREAM_STEPS_PER_FRAME, UNDERRUN_HOLD, STREAM_RUNNING, STREAM_HOLDING, MIX_STATS,
+                      CHANNEL_VALVE_COMMAND, CHANNEL_PUMP_COMMAND, CHANNEL_STATES_SUMMARY, CHANNEL_STATE,
+                      VALVE_REQUEST, VALVE_STATS, STEP_JITTER_REQUEST, STEP_JITTER_SUMMARY, STEP_JITTER_RECORD,
+                      PULSATION_REQUEST, SET_PULSATION_REQUEST, PULSATION_TABLE, PULSATION_BIN, PULSATION_OFFSET)
+
+RUN_LOG_RECORD_TYPES = {1: 'run_start', 2: 'step_end', 3: 'run_end', 4: 'mix_end'}
+
+
+def parse_run_log_records(data: bytes) -> List[dict]:
+    """Parse READ_RUN_LOG response data (or a run log download) into records"""
+    records = []
+    for record in RUN_LOG_RECORD.iter_unpack(data):
+        if record.type == 4:
+            # Mixing step detail, right after its step_end
+            records.append({'type': 'mix_end', 'run_id': record.run_id, 'step_idx': record.step_idx,
+                            'switches': record.time_ms, 'volume_a_ul': record.volume, 'volume_b_ul': record.overshoot})
+            continue
+        records.append({
+            'type': RUN_LOG_RECORD_TYPES.get(record.type, record.type),
+            'run_id': record.run_id,
+            'step_idx': record.step_idx,
+            'time_ms': record.time_ms,
+            'volume_ul': record.volume,
+            'overshoot': record.overshoot,
+            'volume_limited': bool(record.flags & 0x01),
+            'aborted': bool(record.flags & 0x02),
+            'streamed': bool(record.flags & 0x04),
+        })
+    return records
+
+
+def parse_channel_states(data: bytes) -> List[dict]:
+    """Decode a GET_CHANNEL_STATES response"""
+    summary = CHANNEL_STATES_SUMMARY.unpack(data)
+    return [state._asdict() for state in CHANNEL_STATE.iter_unpack(data[CHANNEL_STATES_SUMMARY.size:])][:summary.num_channels]
+
+
+STEP_JITTER_SOURCES = {0: 'pump', 1: 'valve', 2: 'control'}
+
+
+def parse_step_jitter(data: bytes):
+    """Decode a GET_STEP_JITTER response into (summary, records)"""
+    summary = STEP_JITTER_SUMMARY.unpack(data)._asdict()
+    records = []
+    for record in list(STEP_JITTER_RECORD.iter_unpack(data, STEP_JITTER_SUMMARY.size))[:summary['num_records']]:
+        record = record._asdict()
+        record['source'] = STEP_JITTER_SOURCES.get(record['source'], record['source'])
+        records.append(record)
+    return summary, records
+
+
+def parse_pulsation(data: bytes) -> dict:
+    """Decode a GET_PULSATION response; corrections are in 1/PULSATION_SCALE of the step delay, one per bin"""
+    table = PULSATION_TABLE.unpack(data)._asdict()
+    bins = PULSATION_BIN.iter_unpack(data, PULSATION_TABLE.size)
+    table['corrections'] = [b.delay - PULSATION_OFFSET for b in bins][:table['num_bins']]
+    return table
+
+
+def pack_pulsation(pump: int, corrections: Iterable[int], phase: int, enabled: bool = True) -> bytes:
+    """SET_PULSATION request data"""
+    return SET_PULSATION_REQUEST.pack(pump, int(enabled), phase) + \
+        b''.join(PULSATION_BIN.pack(PULSATION_OFFSET + c) for c in corrections)
 
-START_SEQUENCE = b'\x21\x37'
 
 class DeviceState:
     def __init__(self):
@@ -19,24 +85,55 @@ class DeviceState:
         self.column_valve_state = 0
         self.running = 0
         self.program_step_progress = 0
+        self.num_pumps = 1
+        self.num_valves = 2
+
+    @classmethod
+    def from_bytes(cls, resp: bytes) -> 'DeviceState':
+        """Parse a GET_DEVICE_STATE response"""
+        state = cls()
+        if len(resp) >= DEVICE_STATE.size:
+            fields = DEVICE_STATE.unpack(resp)
+            state.pump_speed = fields.pump_speed
+            state.pump_volume = fields.pump_volume
+            state.program_step_idx = fields.program_step_idx
+            state.device_state = fields.device_state
+            state.reagent_valve_position = fields.reagent_valve_position
+            state.reagent_valve_state = fields.reagent_valve_state
+            state.column_valve_position = fields.column_valve_position
+            state.column_valve_state = fields.column_valve_state
+            state.running = fields.running
+            state.program_step_progress = fields.program_step_progress / 2.55
+            state.num_pumps = fields.num_pumps
+            state.num_valves = fields.num_valves
+        return state
     
     def __repr__(self):
         return f"DeviceState(pump_speed={self.pump_speed:.2f}, pump_volume={self.pump_volume:.2f}, program_step_idx={self.program_step_idx}, device_state={self.device_state}, reagent_valve_pos={self.reagent_valve_position}, reagent_valve_state={self.reagent_valve_state}, column_valve_pos={self.column_valve_position}, column_valve_state={self.column_valve_state}, running={self.running}, program_step_progress={self.program_step_progress})"
 
 class DeviceConnection:
-    def __init__(self, port, debug_callback: Optional[Callable[[str], None]] = None):
+    def __init__(self, port, debug_callback: Optional[Callable[[str], None]] = None, framing=FRAMING_START_SEQUENCE):
         self.port = port
         self.debug_callback = debug_callback
         self.ser = None
         self.debug_buffer = ""  # Buffer for accumulating debug output
         self.single_byte_message = ""
+        self.requested_framing = framing
+        self.framing = FRAMING_START_SEQUENCE
+        self.cobs_parser = None
     
     def open(self):
+        import serial  # pyserial, only needed for real serial ports
         self.ser = serial.Serial(self.port, 115200, timeout=1)
         self._log_debug(f"[CONN] Opened serial connection to {self.port}")
+        # Back to start sequence frames in case an earlier session left the device in COBS framing
+        self.framing = FRAMING_START_SEQUENCE
+        self.ser.write(FRAMING_RESET)
         if not self.ping():
             self._log_debug("[CONN] Ping failed - connection not established")
             raise ConnectionError("Failed to open connection")
+        if self.requested_framing != FRAMING_START_SEQUENCE:
+            self.set_framing(self.requested_framing)
         self._log_debug("[CONN] Connection established successfully")
     
     def check(self) -> bool:
@@ -61,14 +158,14 @@ class DeviceConnection:
         for i, block in enumerate(raw_data):
             self._log_debug(f"{prefix} Block {i+1}:")
             # Parse and display individual steps in this block
-            for j in range(0, len(block), 16):  # Each step is 16 bytes
-                step_bytes = block[j:j+16]
-                if len(step_bytes) == 16:
-                    step_data = struct.unpack('<BBBBfff', step_bytes)
-                    step_num = i*5 + j//16 + 1
+            for j in range(0, len(block), PROGRAM_STEP.size):
+                step_bytes = block[j:j+PROGRAM_STEP.size]
+                if len(step_bytes) == PROGRAM_STEP.size:
+                    step = PROGRAM_STEP.unpack(step_bytes)
+                    step_num = i*5 + j//PROGRAM_STEP.size + 1
                     # Format raw bytes with spaces between each byte
                     raw_hex_spaced = ' '.join(f'{b:02x}' for b in step_bytes)
-                    self._log_debug(f"{prefix}   Step {step_num}: reagent={step_data[0]}, column={step_data[1]}, flow={step_data[4]:.1f}, volume={step_data[5]:.1f}ml, duration={step_data[6]:.0f}s")
+                    self._log_debug(f"{prefix}   Step {step_num}: reagent={step.reagent_valve_id}, column={step.column_valve_id}, flow={step.flow_rate:.1f}, volume={step.volume:.1f}ml, duration={step.duration:.0f}s")
                     self._log_debug(f"{len(prefix) * ' '}   Raw: {raw_hex_spaced}")
                 else:
                     # Format incomplete step bytes with spaces
@@ -112,7 +209,33 @@ class DeviceConnection:
         """Clear the debug buffer"""
         self.debug_buffer = ""
 
+    def set_framing(self, framing):
+        """Switch to FRAMING_COBS or back to FRAMING_START_SEQUENCE. The device acks in the old framing.
+
+        FRAMING_COBS_TAGGED is for pipelining clients (AsyncDeviceConnection); this one waits for every response.
+        """
+        if framing not in (FRAMING_START_SEQUENCE, FRAMING_COBS):
+            raise ValueError(f"Framing {framing} not supported")
+        resp = self.send_command(Command.SET_FRAMING, SET_FRAMING_REQUEST.pack(framing))
+        if resp != b'\x00':
+            raise ValueError(f"Framing {framing} rejected")
+        self.framing = framing
+        self.cobs_parser = CobsFrameParser(on_debug_line=lambda line: self._log_debug(f"[DEVICE] {line}"))
+        self._log_debug(f"[CONN] Switched to framing {framing}")
+
+    def _receive_cobs_response(self, timeout):
+        start_time = time.time()
+        while True:
+            frames = self.cobs_parser.feed(self.ser.read(max(1, self.ser.in_waiting)))
+            if frames:
+                # One request in flight at a time: later frames are late answers to timed out requests
+                return frames[-1]
+            if time.time() - start_time > timeout:
+                raise ConnectionError("timeout")
+
     def receive_response(self, timeout=1):
+        if self.framing == FRAMING_COBS:
+            return self._receive_cobs_response(timeout)
         state = 0
         datalen = 0
         response = bytes([])
@@ -165,13 +288,17 @@ class DeviceConnection:
         data = bytes([command_id])
         if payload is not None:
             data = data + payload
-        checksum = zlib.crc32(data)
-        data = data + checksum.to_bytes(4, 'big')
-        datalen = bytes([len(data)])
-        self.ser.write(START_SEQUENCE + datalen + data)
+        if self.framing == FRAMING_COBS:
+            self.ser.write(encode_cobs_frame(data))
+        else:
+            checksum = zlib.crc32(data)
+            data = data + checksum.to_bytes(4, 'big')
+            datalen = bytes([len(data)])
+            self.ser.write(START_SEQUENCE + datalen + data)
         
         # Log command being sent (for debugging) - exclude ping commands
-        if self.debug_callback and command_id not in [0, 14]:  # Don't log ping commands and device state
+        if self.debug_callback and command_id not in [Command.PING, Command.GET_DEVICE_STATE, Command.GET_TASK_DIAGNOSTICS,
+                                                      Command.GET_TRANSITION_STATS, Command.READ_RUN_LOG, Command.GET_COMMAND_STATS, Command.STREAM_STEPS]:  # Don't log ping commands, device state and diagnostics
             cmd_name = self._get_command_name(command_id)
             self._log_debug(f"[CMD] Sending {cmd_name} (ID: {command_id})")
         
@@ -180,24 +307,10 @@ class DeviceConnection:
 
     def _get_command_name(self, command_id):
         """Get human-readable name for command ID"""
-        commands = {
-            0: "PING",
-            1: "VALVE_CMD",
-            2: "PUMP_CMD", 
-            4: "INIT_PROGRAM_WRITE",
-            5: "WRITE_PROGRAM_BLOCK",
-            6: "EXECUTE_PROGRAM",
-            7: "GET_PROGRAM_BLOCK",
-            8: "GET_PROGRAM_LENGTH",
-            9: "GET_REAGENTS",
-            10: "GET_COLUMNS",
-            11: "SET_REAGENTS",
-            12: "SET_COLUMNS",
-            13: "ABORT_PROGRAM",
-            14: "GET_DEVICE_STATE",
-            15: "TARE_WEIGHT_SENSOR"
-        }
-        return commands.get(command_id, f"UNKNOWN_CMD_{command_id}")
+        try:
+            return Command(command_id).name
+        except ValueError:
+            return f"UNKNOWN_CMD_{command_id}"
     
     def send_command(self, command_id, payload=None, timeout=10):
         start_time = time.time()
@@ -211,7 +324,7 @@ class DeviceConnection:
     
     def ping(self) -> bool:
         try:
-            resp = self.send_command(0)
+            resp = self.send_command(Command.PING)
             if resp[0] != 0:
                 return False
             return True
@@ -219,30 +332,41 @@ class DeviceConnection:
             return False
     
     def _init_program_write(self):
-        self.send_command(4)
+        self.send_command(Command.INIT_PROGRAM_WRITE)
     
     def _write_program_block(self, block):
-        self.send_command(5, block)
+        self.send_command(Command.WRITE_PROGRAM_BLOCK, block)
     
     def _get_program_length(self):
-        resp = self.send_command(8)
+        resp = self.send_command(Command.GET_PROGRAM_LENGTH)
         return int.from_bytes(resp[:2], 'big')
 
     def get_max_program_length(self):
-        resp = self.send_command(8)
+        resp = self.send_command(Command.GET_PROGRAM_LENGTH)
         return int.from_bytes(resp[2:], 'big')
     
     def _get_program_block(self, block_index, n_steps):
-        resp = self.send_command(7, block_index.to_bytes(2, 'big') + n_steps.to_bytes(2, 'big'))
+        resp = self.send_command(Command.READ_PROGRAM_BLOCK, block_index.to_bytes(2, 'big') + n_steps.to_bytes(2, 'big'))
         return resp
     
     def valve_command(self, reagent_valve_id, column_valve_id):
         """Set valves using the new protocol: reagent_valve_id and column_valve_id (0-5 for valves 1-6)"""
         # Send 0-based indices directly to firmware
-        self.send_command(1, bytes([reagent_valve_id, column_valve_id]))
+        self.send_command(Command.SET_VALVES, bytes([reagent_valve_id, column_valve_id]))
     
     def pump_command(self, command, acceleration):
-        self.send_command(2, struct.pack('ff', command, acceleration))
+        self.send_command(Command.SET_PUMP, PUMP_COMMAND.pack(command, acceleration))
+
+    def channel_valve_command(self, channel, reagent_valve_id, column_valve_id):
+        """Set the valves of one channel (pump with its reagent and column valve); channel 0 runs programs"""
+        return self.send_command(Command.SET_CHANNEL_VALVES, CHANNEL_VALVE_COMMAND.pack(channel, reagent_valve_id, column_valve_id)) == b'\x00'
+
+    def channel_pump_command(self, channel, command, acceleration):
+        return self.send_command(Command.SET_CHANNEL_PUMP, CHANNEL_PUMP_COMMAND.pack(channel, command, acceleration)) == b'\x00'
+
+    def get_channel_states(self):
+        """State of every channel, as a list of dicts"""
+        return parse_channel_states(self.send_command(Command.GET_CHANNEL_STATES))
     
     def write_program(self, program: Program):
         """Write program to device"""
@@ -272,11 +396,42 @@ class DeviceConnection:
 
     def execute_program(self):
         self._log_debug("[PROG] Executing program")
-        self.send_command(6)
+        self.send_command(Command.EXECUTE_PROGRAM)
+
+    def stream_program(self, steps: Iterable[ProgramStep], underrun_policy=UNDERRUN_HOLD, poll_interval=0.05):
+        """Run steps as a host-fed program, without an upload and without a length limit.
+        Steps are sent as the device's look-ahead frees up (credits); returns the last
+        StreamStatus once the stream is ended or stopped by an underrun."""
+        self._log_debug("[PROG] Starting streamed program")
+        status = STREAM_STATUS.unpack(self.send_command(Command.START_STREAM, STREAM_START_REQUEST.pack(underrun_policy)))
+        steps = iter(steps)
+        pending = deque()  # packed steps from stream index status.received on
+        exhausted = False
+        while True:
+            while not exhausted and len(pending) < MAX_STREAM_STEPS_PER_FRAME:
+                step = next(steps, None)
+                if step is None:
+                    exhausted = True
+                else:
+                    pending.append(ProgramConverter.pack_step(step))
+            if status.state not in (STREAM_RUNNING, STREAM_HOLDING) or (exhausted and not pending):
+                break
+            n = min(len(pending), status.credits)
+            if n == 0:
+                time.sleep(poll_interval)
+            received = status.received
+            payload = STREAM_STEPS_REQUEST.pack(received) + b''.join(itertools.islice(pending, n))
+            status = STREAM_STATUS.unpack(self.send_command(Command.STREAM_STEPS, payload))
+            for _ in range(status.received - received):
+                pending.popleft()
+        if status.state in (STREAM_RUNNING, STREAM_HOLDING):
+            status = STREAM_STATUS.unpack(self.send_command(Command.END_STREAM))
+        self._log_debug(f"[PROG] Stream ended: {status.received} steps sent, {status.underruns} underruns")
+        return status._asdict()
 
     def abort_program(self):
         self._log_debug("[PROG] Aborting program")
-        self.send_command(13)
+        self.send_command(Command.ABORT_PROGRAM)
 
     def read_program(self) -> Program:
         """Read program from device"""
@@ -312,14 +467,14 @@ class DeviceConnection:
         return program
     
     def get_reagents(self) -> List[str]:
-        resp = self.send_command(9)
+        resp = self.send_command(Command.GET_REAGENTS)
         m = ProgramConverter().max_reagent_name_len
         reagents = [resp[i:i+m].strip(b'\0').decode('utf-8') for i in range(0, len(resp), m)]
         # Convert to 1-based indexing for UI
         return {i+1: reagents[i] for i in range(ProgramConverter().max_reagents)}
     
     def get_columns(self) -> List[str]:
-        resp = self.send_command(10)
+        resp = self.send_command(Command.GET_COLUMNS)
         m = ProgramConverter().max_column_name_len
         columns = [resp[i:i+m].strip(b'\0').decode('utf-8') for i in range(0, len(resp), m)]
         # Convert to 1-based indexing for UI
@@ -334,7 +489,7 @@ class DeviceConnection:
             # Convert from 1-based UI index to 0-based firmware index
             firmware_index = i - 1
             reagents_bytes[firmware_index*m:(firmware_index*m+len(reagent))] = reagent.encode('utf-8')
-        self.send_command(11, reagents_bytes)
+        self.send_command(Command.SET_REAGENTS, reagents_bytes)
     
     def set_columns(self, columns):
         sorted_pairs = sorted(columns.items(), key=lambda x: x[0])
@@ -345,36 +500,93 @@ class DeviceConnection:
             # Convert from 1-based UI index to 0-based firmware index
             firmware_index = i - 1
             columns_bytes[firmware_index*m:(firmware_index*m+len(column))] = column.encode('utf-8')
-        self.send_command(12, columns_bytes)
+        self.send_command(Command.SET_COLUMNS, columns_bytes)
     
     def get_device_state(self):
         """Get current device state"""
-        resp = self.send_command(14)
-        state = DeviceState()
-        
-        # Parse the response according to the new DeviceState structure
-        # Structure order: pump_speed (4), pump_volume (4), program_step_idx (2), 
-        # device_state (1), reagent_valve_position (1), reagent_valve_state (1),
-        # column_valve_position (1), column_valve_state (1), running (1), 
-        # program_step_progress (1), padding (3)
-        
-        if len(resp) >= 20:  # Total size should be 20 bytes (17 data + 3 padding)
-            state.pump_speed = struct.unpack('<f', resp[0:4])[0]
-            state.pump_volume = struct.unpack('<f', resp[4:8])[0]
-            state.program_step_idx = struct.unpack('<H', resp[8:10])[0]  # uint16_t
-            state.device_state = resp[10]
-            state.reagent_valve_position = resp[11]
-            state.reagent_valve_state = resp[12]
-            state.column_valve_position = resp[13]
-            state.column_valve_state = resp[14]
-            state.running = resp[15]
-            state.program_step_progress = resp[16] / 2.55
-            # resp[17:20] contains padding bytes, ignore them
-        
-        return state
+        resp = self.send_command(Command.GET_DEVICE_STATE)
+        return DeviceState.from_bytes(resp)
     
     def tare_weight_sensor(self, channel):
         """Tare a specific weight sensor channel (0-7)"""
         if channel < 0 or channel > 7:
             raise ValueError("Channel must be between 0 and 7")
-        self.send_command(15, bytes([channel]))
+        self.send_command(Command.TARE_WEIGHT_SENSOR, bytes([channel]))
+
+    def get_task_diagnostics(self):
+        """Get FreeRTOS task statistics and heap figures sampled by the device"""
+        heap = None
+        tasks = []
+        while heap is None or len(tasks) < heap['num_tasks']:
+            resp = self.send_command(Command.GET_TASK_DIAGNOSTICS, bytes([len(tasks)]))
+            heap = HEAP_DIAGNOSTICS.unpack(resp)._asdict()
+            if len(resp) <= HEAP_DIAGNOSTICS.size:
+                break
+            for task in TASK_DIAGNOSTICS.iter_unpack(resp, HEAP_DIAGNOSTICS.size):
+                tasks.append({
+                    'name': task.name.split(b'\0')[0].decode('utf-8', errors='replace'),
+                    'cpu_percent': task.cpu_permille / 10.0,
+                    'priority': task.priority,
+                    'state': task.state,
+                    'stack_high_water': task.stack_high_water,
+                })
+        return heap, tasks
+
+    def get_transition_stats(self):
+        """Get timing of the last valve change: total duration and time saved by overlapping valve moves with pump deceleration"""
+        return TRANSITION_STATS.unpack(self.send_command(Command.GET_TRANSITION_STATS))._asdict()
+
+    def get_mix_stats(self):
+        """Get the reagent shares of the current (or last) mixing step, counted in pump steps per valve port"""
+        return MIX_STATS.unpack(self.send_command(Command.GET_MIX_STATS))._asdict()
+
+    def get_valve_stats(self, valve):
+        """Home position checks of one valve axis (passes, drift corrections), its speed profile and the autotune state"""
+        return VALVE_STATS.unpack(self.send_command(Command.GET_VALVE_STATS, VALVE_REQUEST.pack(valve)))._asdict()
+
+    def autotune_valve(self, valve):
+        """Start the speed autotune of one valve axis; False if there is no such valve or the device is not idle"""
+        return self.send_command(Command.AUTOTUNE_VALVE, VALVE_REQUEST.pack(valve)) == b'\x00'
+
+    def get_step_jitter(self, reset=False):
+        """Lateness of the step interrupts of every axis and of the control loop ticks, as (summary, records);
+        with reset, counting starts again after this read"""
+        return parse_step_jitter(self.send_command(Command.GET_STEP_JITTER, STEP_JITTER_REQUEST.pack(int(reset))))
+
+    def get_pulsation(self, pump):
+        """Pulsation compensation table of one pump, with its rotor position (steps since boot, modulo a revolution)"""
+        return parse_pulsation(self.send_command(Command.GET_PULSATION, PULSATION_REQUEST.pack(pump)))
+
+    def set_pulsation(self, pump, corrections, phase, enabled=True):
+        """Load a pulsation compensation table; False if there is no such pump, the phase is not a rotor
+        position, or the corrections are not PULSATION_BINS values within PULSATION_MAX_CORRECTION adding up to zero"""
+        return self.send_command(Command.SET_PULSATION, pack_pulsation(pump, corrections, phase, enabled)) == b'\x00'
+
+    def get_command_stats(self):
+        """Get per-command call and error counts and handler service times (us) measured by the device"""
+        summary = None
+        commands = []
+        while summary is None or len(commands) < summary['num_commands']:
+            resp = self.send_command(Command.GET_COMMAND_STATS, bytes([len(commands)]))
+            summary = COMMAND_STATS_SUMMARY.unpack(resp)._asdict()
+            block = [record._asdict() for record in COMMAND_STATS_RECORD.iter_unpack(resp, COMMAND_STATS_SUMMARY.size)]
+            if not block:
+                break
+            for record in block:
+                try:
+                    record['name'] = Command(record['command_id']).name
+                except ValueError:
+                    record['name'] = f"UNKNOWN_CMD_{record['command_id']}"
+            commands += block
+        return summary, commands
+
+    def get_run_log(self):
+        """Download the run log: RUN_START / STEP_END / RUN_END records, oldest first"""
+        records = []
+        while True:
+            resp = self.send_command(Command.READ_RUN_LOG, len(records).to_bytes(4, 'big'))
+            block = parse_run_log_records(resp)
+            if not block:
+                break
+            records += block
+        return records
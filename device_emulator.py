@@ -0,0 +1,840 @@
+"""
+Software stand-in for the column stripper firmware.
+
+EmulatedDevice implements the command set of handle_communication() and the
+program executor on a (optionally accelerated) clock, so host tools can be
+run without a board. Devices are served over local TCP ports (for
+AsyncDeviceConnection.open_tcp()) or over pseudo-terminals, which any serial
+tool (DeviceConnection, talker.py, the GUIs) opens like a USB port. The link
+can be given a line speed, a per-command latency and injected faults:
+
+    python device_emulator.py --devices 3 --port 7000 --time-scale 60
+    python device_emulator.py --pty --baud 115200 --latency-ms 10 --rx-error-rate 1e-4
+"""
+
+import argparse
+import asyncio
+import math
+import os
+import random
+import time
+import tty
+import zlib
+from collections import deque
+from dataclasses import dataclass
+from typing import Callable, List, Optional, Tuple
+
+from framing import encode_cobs_frame
+from program import decode_ramp_end_flow, has_ramp, time_to_volume
+from protocol import (START_SEQUENCE, FRAMING_COBS, FRAMING_COBS_TAGGED, FRAMING_START_SEQUENCE, Command, MAX_REAGENTS, MAX_COLUMNS, MAX_NAME_LEN, PUMP_COMMAND, PROGRAM_STEP,
+                      PROGRAM_BLOCK_REQUEST, PROGRAM_LENGTH, DEVICE_STATE, HEAP_DIAGNOSTICS, TASK_DIAGNOSTICS,
+                      TRANSITION_STATS, RUN_LOG_REQUEST, RUN_LOG_RECORD, COMMANDS, COMMAND_STATS_SUMMARY,
+                      COMMAND_STATS_RECORD, STREAM_START_REQUEST, STREAM_STEPS_REQUEST, STREAM_STATUS, UNDERRUN_HOLD,
+                      UNDERRUN_STOP, STREAM_IDLE, STREAM_RUNNING, STREAM_HOLDING, STREAM_FINISHED, STREAM_STOPPED,
+                      MIX_STEP_FLAG, MIX_SHARE_SCALE, MIX_STATS, CHANNEL_VALVE_COMMAND, CHANNEL_PUMP_COMMAND,
+                      CHANNEL_STATES_SUMMARY, CHANNEL_STATE, VALVE_REQUEST, VALVE_STATS, AUTOTUNE_IDLE, AUTOTUNE_DONE,
+                      STEP_JITTER_SUMMARY, STEP_JITTER_RECORD, JITTER_SOURCE_PUMP, JITTER_SOURCE_VALVE,
+                      JITTER_SOURCE_CONTROL, STEP_TIMER_HARDWARE, PULSATION_REQUEST, SET_PULSATION_REQUEST,
+                      PULSATION_TABLE, PULSATION_BIN, PULSATION_BINS, PULSATION_OFFSET, PULSATION_MAX_CORRECTION)
+
+MAX_PROGRAM_LEN = 65536 // PROGRAM_STEP.size  # Program::kMaxLen
+
+RUN_LOG_RUN_START = 1
+RUN_LOG_STEP_END = 2
+RUN_LOG_RUN_END = 3
+RUN_LOG_MIX_END = 4
+RUN_LOG_FLAG_VOLUME_LIMITED = 0x01
+RUN_LOG_FLAG_ABORTED = 0x02
+RUN_LOG_FLAG_STREAMED = 0x04
+RUN_LOG_RECORDS_PER_BLOCK = 12
+RECEIVE_BUFFER_SIZE = 2000  # kReceiveBufferSize
+FRAMINGS = (FRAMING_START_SEQUENCE, FRAMING_COBS, FRAMING_COBS_TAGGED)  # accepted by on_set_framing()
+COMMAND_STATS_PER_BLOCK = 10
+STREAM_CAPACITY = 64  # kStreamCapacity
+MIX_CYCLE_STEPS = 2000  # kMixCycleSteps
+PUMP_VOLUME_PER_STEP = 0.0752192  # pump_config.volume_per_step, uL
+PUMP_STEPS_PER_REVOLUTION = 200 * 8  # pump_config.steps_per_revolution
+VALVE_PROFILE = (500, 30000, 100)  # RadialValveControl min/max step time (us) and smoothness factor
+VALVE_STALL_STEP_TIME = 350  # emulated valves lose steps below this step time, us
+AUTOTUNE_STEP_TIME_PERCENT = 85  # kAutotuneStepTimePercent
+AUTOTUNE_MARGIN_PERCENT = 120  # kAutotuneMarginPercent
+AUTOTUNE_MIN_STEP_TIME = 100  # kAutotuneMinStepTime
+LATE_STEP_US = 50  # kLateStepUs
+
+
+class EmulatedDevice:
+    """Protocol-level model of one device: program storage, executor, run log and device state.
+
+    Execution is evaluated lazily: every command first advances the executor
+    to the current (emulated) time, finishing steps exactly at their end times.
+    The pump reaches its set speed instantly and valves move instantly.
+    """
+
+    def __init__(self, time_scale: float = 1.0, clock: Callable[[], float] = time.monotonic,
+                 debug_print: Optional[Callable[[str], None]] = None, channels: int = 1):
+        self.time_scale = time_scale
+        self.clock = clock
+        self.clock_start = clock()
+        self.debug_print = debug_print
+        self.reagents = bytearray(MAX_REAGENTS * MAX_NAME_LEN)
+        self.columns = bytearray(MAX_COLUMNS * MAX_NAME_LEN)
+        self.steps: List[tuple] = []
+        self.running = False
+        self.step_idx = 0
+        self.current_step: Optional[tuple] = None
+        self.ramp_end: Optional[float] = None  # end flow rate of the current step's ramp
+        # Mixing step, as kept by ValveMixer. Valves switch instantly here, so the
+        # counts are those of ideal slices without the pump's stopping overrun.
+        self.mix_active = False
+        self.mix_ports = (0, 0)
+        self.mix_share_a = 0.0
+        self.mix_counts = (0, 0, 0)  # steps on reagent A, on reagent B, valve switches
+        self.step_start = 0.0
+        self.pump_speed = 0.0  # mL/min
+        self.pump_volume = 0.0  # uL since the step started
+        self.last_update = 0.0
+        self.reagent_valve = 0
+        self.column_valve = 0
+        # Channels after the first (one pump with a reagent and a column valve each), driven
+        # only by set_channel_valves / set_channel_pump; channel 0 is the one above that runs programs
+        self.num_channels = channels
+        self.extra_channels = [{'pump_speed': 0.0, 'pump_volume': 0.0, 'reagent_valve': 0, 'column_valve': 0}
+                               for _ in range(channels - 1)]
+        # Per valve axis (reagent and column valve of each channel): speed profile; emulated valves never drift
+        self.valve_profiles = [list(VALVE_PROFILE) for _ in range(2 * channels)]
+        self.autotune = (AUTOTUNE_IDLE, 0, 0)  # state, valve, trials
+        # Per pump: pulsation compensation (enabled, phase, corrections); emulated pumps have no rotor, it stays at 0
+        self.pulsation = [(False, 0, [0] * PULSATION_BINS) for _ in range(channels)]
+        self.run_id = 0
+        self.run_start = 0.0
+        self.run_volume = 0.0
+        self.run_log: List[bytes] = []
+        # Per command id: [calls, errors, min_us, max_us, total_us], as kept by CommandStatistics
+        self.command_stats = [[0, 0, 0, 0, 0] for _ in range(len(Command))]
+        self.unknown_commands = 0
+        # Host-fed run, as kept by StepStream
+        self.streaming = False
+        self.holding = False
+        self.stream: deque = deque()
+        self.stream_state = STREAM_IDLE
+        self.stream_policy = UNDERRUN_HOLD
+        self.stream_received = 0
+        self.stream_started = 0
+        self.stream_underruns = 0
+        self.stream_ended = False
+
+    def now(self) -> float:
+        """Emulated seconds since boot"""
+        return (self.clock() - self.clock_start) * self.time_scale
+
+    def millis(self, t: float) -> int:
+        return int(t * 1000) & 0xffffffff
+
+    def _print(self, line: str):
+        if self.debug_print:
+            self.debug_print(line)
+
+    # --- executor ---
+
+    def _advance_pump(self, t: float):
+        speed = self.pump_speed
+        if self.running and not self.holding and self.ramp_end is not None:
+            # Linear in time, so the mean of the end point speeds integrates it exactly
+            _, _, _, flow_rate, _, duration = self.current_step
+            speed = flow_rate + (self.ramp_end - flow_rate) * min(1.0, (t - self.step_start) / duration)
+        self.pump_volume += (self.pump_speed + speed) / 2 * 1000.0 / 60.0 * (t - self.last_update)
+        for channel in self.extra_channels:
+            channel['pump_volume'] += channel['pump_speed'] * 1000.0 / 60.0 * (t - self.last_update)
+        self.pump_speed = speed
+        self.last_update = t
+
+    def _step_end_time(self) -> float:
+        _, _, _, flow_rate, volume, duration = self.current_step
+        end = self.step_start + duration if not math.isinf(duration) else math.inf
+        return min(end, self.step_start + time_to_volume(flow_rate, self.ramp_end, duration, volume))
+
+    def update(self):
+        t = self.now()
+        while self.running and not self.holding:
+            end = self._step_end_time()
+            if end > t:
+                break
+            self._advance_pump(end)
+            self._finish_step(end)
+        self._advance_pump(t)
+
+    def _enter_step(self, t: float):
+        reagent, column, ramp_end_flow, flow_rate, _, duration = self.current_step
+        mix = reagent != 0xff and bool(reagent & MIX_STEP_FLAG)
+        ramp_end = decode_ramp_end_flow(ramp_end_flow)
+        self.ramp_end = ramp_end if not mix and has_ramp(ramp_end, duration) else None
+        self.step_start = t
+        self.pump_volume = 0.0
+        if mix:
+            self.mix_active = True
+            self.mix_ports = (reagent & 0x07, (reagent >> 3) & 0x07)
+            self.mix_share_a = min(ramp_end_flow, MIX_SHARE_SCALE) / MIX_SHARE_SCALE
+            self.reagent_valve = self.mix_ports[0] if self.mix_share_a > 0 else self.mix_ports[1]
+            if column != 0xff:
+                self.column_valve = column
+        elif reagent != 0xff and column != 0xff:
+            self.reagent_valve = reagent
+            self.column_valve = column
+        self.pump_speed = flow_rate
+        self._print(f"Entered step: {reagent}, {column}, {flow_rate:.2f}")
+
+    def _finish_step(self, t: float):
+        _, _, _, _, volume, duration = self.current_step
+        volume_limited = self.pump_volume >= volume * 1000.0 - 1e-3
+        overshoot = self.pump_volume - volume * 1000.0 if volume_limited else (t - self.step_start - duration) * 1000.0
+        self._log(RUN_LOG_STEP_END, RUN_LOG_FLAG_VOLUME_LIMITED if volume_limited else 0, self.step_idx,
+                  self.millis(t - self.step_start), self.pump_volume, overshoot)
+        if self.mix_active:
+            self._stop_mix()
+            steps_a, steps_b, switches = self.mix_counts
+            self._log(RUN_LOG_MIX_END, 0, self.step_idx, switches, steps_a * PUMP_VOLUME_PER_STEP, steps_b * PUMP_VOLUME_PER_STEP)
+        self.run_volume += self.pump_volume
+        self.step_idx += 1
+        if self.streaming:
+            self._next_stream_step(t)
+            return
+        if self.step_idx >= len(self.steps):
+            self._finish_run(t)
+            return
+        self.current_step = self.steps[self.step_idx]
+        self._enter_step(t)
+
+    def _mix_slices(self) -> tuple:
+        """Steps per reagent and valve switches of ideal slices over the volume pumped in the step"""
+        total = int(self.pump_volume / PUMP_VOLUME_PER_STEP)
+        slice_a = round(self.mix_share_a * MIX_CYCLE_STEPS)
+        cycles, rest = divmod(total, MIX_CYCLE_STEPS)
+        steps_a = cycles * slice_a + min(rest, slice_a)
+        switches = 0
+        if 0 < slice_a < MIX_CYCLE_STEPS and total > 0:
+            # A -> B boundaries at slice_a + k * cycle, B -> A at k * cycle, passed before the last step
+            switches = (total - slice_a - 1) // MIX_CYCLE_STEPS + 1 if total > slice_a else 0
+            switches += (total - 1) // MIX_CYCLE_STEPS
+        return steps_a, total - steps_a, switches
+
+    def _stop_mix(self):
+        self.mix_counts = self._mix_slices()
+        self.mix_active = False
+
+    def mix_stats(self) -> bytes:
+        steps_a, steps_b, switches = self._mix_slices() if self.mix_active else self.mix_counts
+        total = steps_a + steps_b
+        return MIX_STATS.pack(int(self.mix_active), self.mix_ports[0], self.mix_ports[1], self.mix_share_a,
+                              steps_a / total if total else 0.0, steps_a, steps_b, switches)
+
+    def _finish_run(self, t: float):
+        self.running = False
+        self.pump_speed = 0.0
+        if self.streaming:
+            self.stream_state = STREAM_FINISHED
+        self._log(RUN_LOG_RUN_END, 0, self.step_idx, self.millis(t - self.run_start), self.run_volume, 0)
+        self._print("Program finished")
+
+    def _next_stream_step(self, t: float):
+        if self.stream:
+            self.current_step = self.stream.popleft()
+            self.stream_started += 1
+            self._enter_step(t)
+            return
+        if self.stream_ended:
+            self._finish_run(t)
+            return
+        self.stream_underruns += 1
+        self.pump_speed = 0.0
+        if self.stream_policy == UNDERRUN_STOP:
+            self.running = False
+            self.stream_state = STREAM_STOPPED
+            self._log(RUN_LOG_RUN_END, RUN_LOG_FLAG_ABORTED, self.step_idx, self.millis(t - self.run_start), self.run_volume, 0)
+            self._print("Stream underrun, program stopped")
+        else:
+            self.holding = True
+            self.stream_state = STREAM_HOLDING
+            self._print("Stream underrun, holding")
+
+    def _resume_stream(self):
+        """Leave the holding state once steps arrive (the firmware checks on its next tick)"""
+        if not (self.running and self.holding):
+            return
+        t = self.now()
+        if self.stream:
+            self.holding = False
+            self.stream_state = STREAM_RUNNING
+            self.current_step = self.stream.popleft()
+            self.stream_started += 1
+            self._enter_step(t)
+        elif self.stream_ended:
+            self._finish_run(t)
+
+    def _log(self, record_type: int, flags: int, step_idx: int, time_ms: int, volume: float, overshoot: float):
+        self.run_log.append(RUN_LOG_RECORD.pack(record_type, flags, step_idx & 0xffff, self.run_id, time_ms, volume, overshoot))
+
+    def execute(self):
+        self.abort()
+        if not self.steps:
+            return
+        t = self.now()
+        self.run_id += 1
+        self.streaming = False
+        self.running = True
+        self.step_idx = 0
+        self.run_start = t
+        self.run_volume = 0.0
+        self._log(RUN_LOG_RUN_START, 0, len(self.steps), self.millis(t), 0, 0)
+        self.current_step = self.steps[0]
+        self._enter_step(t)
+
+    def execute_stream(self, underrun_policy: int):
+        self.abort()
+        t = self.now()
+        self.run_id += 1
+        self.streaming = True
+        self.holding = True
+        self.stream.clear()
+        self.stream_state = STREAM_HOLDING
+        self.stream_policy = underrun_policy
+        self.stream_received = 0
+        self.stream_started = 0
+        self.stream_underruns = 0
+        self.stream_ended = False
+        self.running = True
+        self.step_idx = 0
+        self.run_start = t
+        self.run_volume = 0.0
+        self._log(RUN_LOG_RUN_START, RUN_LOG_FLAG_STREAMED, 0, self.millis(t), 0, 0)
+
+    def push_stream(self, first_step: int, data: bytes, offset: int = 0):
+        if self.stream_state not in (STREAM_RUNNING, STREAM_HOLDING):
+            return
+        for i, step in enumerate(PROGRAM_STEP.iter_unpack(data, offset)):
+            if first_step + i == self.stream_received and len(self.stream) < STREAM_CAPACITY and not self.stream_ended:
+                self.stream.append(step)
+                self.stream_received += 1
+        self._resume_stream()
+
+    def stream_status(self) -> bytes:
+        credits = 0 if self.stream_ended else STREAM_CAPACITY - len(self.stream)
+        return STREAM_STATUS.pack(self.stream_state, self.stream_policy, credits, self.stream_received,
+                                  self.stream_started, self.stream_underruns)
+
+    def abort(self):
+        if self.running:
+            t = self.now()
+            self._log(RUN_LOG_RUN_END, RUN_LOG_FLAG_ABORTED, self.step_idx, self.millis(t - self.run_start),
+                      self.run_volume + self.pump_volume, 0)
+            if self.streaming:
+                self.stream_state = STREAM_IDLE
+        if self.mix_active:
+            self._stop_mix()
+        self.running = False
+        self.pump_speed = 0.0
+
+    def device_state(self) -> bytes:
+        progress = 0
+        if self.running and not self.holding:
+            _, _, _, flow_rate, volume, duration = self.current_step
+            elapsed = self.now() - self.step_start
+            time_progress = elapsed / duration if not math.isinf(duration) and duration > 0 else 0
+            volume_progress = self.pump_volume / (volume * 1000.0) if not math.isinf(volume) and volume > 0 else 0
+            progress = int(255 * min(1.0, max(time_progress, volume_progress)))
+        return DEVICE_STATE.pack(self.pump_speed, self.pump_volume, self.step_idx & 0xffff,
+                                 1, self.reagent_valve, 0, self.column_valve, 0, int(self.running), progress,
+                                 self.num_channels, 2 * self.num_channels)
+
+    def channel_states(self) -> bytes:
+        states = [(self.pump_speed, self.pump_volume, self.reagent_valve, self.column_valve)]
+        states += [(c['pump_speed'], c['pump_volume'], c['reagent_valve'], c['column_valve']) for c in self.extra_channels]
+        data = CHANNEL_STATES_SUMMARY.pack(self.num_channels, self.num_channels, 2 * self.num_channels)
+        for i, (speed, volume, reagent, column) in enumerate(states):
+            data += CHANNEL_STATE.pack(speed, volume, 1, reagent, 0, column, 0, i, 2 * i, 2 * i + 1)
+        return data
+
+    def valve_stats(self, valve: int) -> bytes:
+        return VALVE_STATS.pack(valve, *self.autotune, 0, 0, 0, 0, *self.valve_profiles[valve])
+
+    def autotune_valve(self, valve: int) -> bool:
+        """ValveAutotuner at once: shorten min_step_time until the emulated valve stalls, keep the last one with the margin"""
+        idle = not self.running and self.pump_speed == 0 and all(c['pump_speed'] == 0 for c in self.extra_channels)
+        if valve >= len(self.valve_profiles) or not idle:
+            return False
+        profile = self.valve_profiles[valve]
+        best, trials = profile[0], 1
+        while True:
+            candidate = best * AUTOTUNE_STEP_TIME_PERCENT // 100
+            if candidate < AUTOTUNE_MIN_STEP_TIME or candidate == best:
+                break
+            trials += 1
+            if candidate < VALVE_STALL_STEP_TIME:
+                break
+            best = candidate
+        profile[0] = min(profile[0], best * AUTOTUNE_MARGIN_PERCENT // 100)
+        self.autotune = (AUTOTUNE_DONE, valve, trials)
+        return True
+
+    def set_pulsation(self, data: bytes) -> bool:
+        """PulsationCompensation::set(): one correction per bin, each in range, adding up to zero"""
+        request = SET_PULSATION_REQUEST.unpack(data)
+        corrections = [b.delay - PULSATION_OFFSET for b in PULSATION_BIN.iter_unpack(data, SET_PULSATION_REQUEST.size)]
+        if request.pump >= self.num_channels or len(corrections) != PULSATION_BINS or \
+                request.phase >= PUMP_STEPS_PER_REVOLUTION:
+            return False
+        if any(abs(c) > PULSATION_MAX_CORRECTION for c in corrections) or sum(corrections) != 0:
+            return False
+        self.pulsation[request.pump] = (bool(request.enabled), request.phase, corrections)
+        return True
+
+    def pulsation_table(self, pump: int) -> bytes:
+        enabled, phase, corrections = self.pulsation[pump]
+        data = PULSATION_TABLE.pack(pump, int(enabled), PULSATION_BINS, PUMP_STEPS_PER_REVOLUTION, phase, 0)
+        return data + b''.join(PULSATION_BIN.pack(PULSATION_OFFSET + c) for c in corrections)
+
+    def step_jitter(self) -> bytes:
+        """Layout of GET_STEP_JITTER: the emulator has no step interrupts, so nothing is ever counted"""
+        sources = [(JITTER_SOURCE_PUMP, i) for i in range(self.num_channels)]
+        sources += [(JITTER_SOURCE_VALVE, i) for i in range(2 * self.num_channels)]
+        sources += [(JITTER_SOURCE_CONTROL, 0)]
+        data = STEP_JITTER_SUMMARY.pack(len(sources), 1, 0, STEP_TIMER_HARDWARE, LATE_STEP_US)
+        for source, axis in sources:
+            data += STEP_JITTER_RECORD.pack(source, axis, 255, 0, 0.0, 0, 0)
+        return data
+
+    # --- protocol ---
+
+    def handle_command(self, payload: bytes) -> bytes:
+        """Execute one command frame payload and return the response payload.
+        Like the firmware dispatcher, requests shorter than their fixed part are rejected with ack 2."""
+        command_id, data = payload[0], payload[1:]
+        spec = COMMANDS.get(command_id)
+        if spec is None:
+            self.unknown_commands += 1
+            return b'\x01'
+        start = time.perf_counter()
+        short = spec.request is not None and len(data) < spec.request.size
+        response = b'\x02' if short else self._execute(command_id, data)
+        self._record(command_id, int((time.perf_counter() - start) * 1e6), short)
+        return response
+
+    def _record(self, command_id: int, service_us: int, error: bool):
+        stats = self.command_stats[command_id]
+        if stats[0] == 0 or service_us < stats[2]:
+            stats[2] = service_us
+        stats[3] = max(stats[3], service_us)
+        stats[4] += service_us
+        stats[0] += 1
+        stats[1] += int(error)
+
+    def command_stats_block(self, first: int) -> bytes:
+        records = []
+        for command_id in range(first, min(first + COMMAND_STATS_PER_BLOCK, len(self.command_stats))):
+            calls, errors, min_us, max_us, total_us = self.command_stats[command_id]
+            records.append(COMMAND_STATS_RECORD.pack(command_id, calls, errors, min_us,
+                                                     total_us // calls if calls else 0, max_us))
+        return COMMAND_STATS_SUMMARY.pack(len(self.command_stats), self.unknown_commands) + b''.join(records)
+
+    def _execute(self, command_id: int, data: bytes) -> bytes:
+        self.update()
+        if command_id in (Command.PING, Command.GET_WEIGHT, Command.TARE_WEIGHT_SENSOR):
+            return b'\x00'
+        if command_id == Command.SET_VALVES:
+            self.reagent_valve, self.column_valve = data[0], data[1]
+            return b'\x00'
+        if command_id == Command.SET_PUMP:
+            self.pump_speed = PUMP_COMMAND.unpack(data).pump_cmd
+            return b'\x00'
+        if command_id == Command.INIT_PROGRAM_WRITE:
+            self.abort()
+            self.steps = []
+            return b'\x00'
+        if command_id == Command.WRITE_PROGRAM_BLOCK:
+            for step in PROGRAM_STEP.iter_unpack(data):
+                if len(self.steps) < MAX_PROGRAM_LEN:
+                    self.steps.append(step)
+            return b'\x00'
+        if command_id == Command.EXECUTE_PROGRAM:
+            self.execute()
+            return b'\x00'
+        if command_id == Command.ABORT_PROGRAM:
+            self.abort()
+            return b'\x00'
+        if command_id == Command.READ_PROGRAM_BLOCK:
+            first, n = PROGRAM_BLOCK_REQUEST.unpack(data)
+            return b''.join(PROGRAM_STEP.pack(*step) for step in self.steps[first:first + n])
+        if command_id == Command.GET_PROGRAM_LENGTH:
+            return PROGRAM_LENGTH.pack(len(self.steps), MAX_PROGRAM_LEN)
+        if command_id == Command.GET_REAGENTS:
+            return bytes(self.reagents)
+        if command_id == Command.GET_COLUMNS:
+            return bytes(self.columns)
+        if command_id == Command.SET_REAGENTS:
+            self.reagents[:] = data[:len(self.reagents)].ljust(len(self.reagents), b'\0')
+            return b'\x00'
+        if command_id == Command.SET_COLUMNS:
+            self.columns[:] = data[:len(self.columns)].ljust(len(self.columns), b'\0')
+            return b'\x00'
+        if command_id == Command.GET_DEVICE_STATE:
+            return self.device_state()
+        if command_id == Command.GET_TASK_DIAGNOSTICS:
+            # One fake task per core, enough for clients to exercise the paging
+            tasks = [(b'loopTask', 350, 1, 0, 5120), (b'IDLE0', 650, 0, 1, 1024)][data[0]:]
+            heap = HEAP_DIAGNOSTICS.pack(200000, 110000, 180000, 45, 2)
+            return heap + b''.join(TASK_DIAGNOSTICS.pack(*task) for task in tasks)
+        if command_id == Command.GET_TRANSITION_STATS:
+            return TRANSITION_STATS.pack(0, 0, 0, 0)
+        if command_id == Command.READ_RUN_LOG:
+            first, = RUN_LOG_REQUEST.unpack(data)
+            return b''.join(self.run_log[first:first + RUN_LOG_RECORDS_PER_BLOCK])
+        if command_id == Command.GET_COMMAND_STATS:
+            return self.command_stats_block(data[0])
+        if command_id == Command.SET_FRAMING:
+            # The framing itself belongs to the link, see EmulatedLink.run()
+            return b'\x00' if data[0] in FRAMINGS else b'\x03'
+        if command_id in (Command.SET_CHANNEL_VALVES, Command.SET_CHANNEL_PUMP):
+            if data[0] >= self.num_channels:
+                return b'\x03'
+            if data[0] == 0:
+                # Channel 0 is the one set_valves / set_pump drive
+                return self._execute(Command.SET_VALVES, data[1:]) if command_id == Command.SET_CHANNEL_VALVES \
+                    else self._execute(Command.SET_PUMP, data[4:])
+            channel = self.extra_channels[data[0] - 1]
+            if command_id == Command.SET_CHANNEL_VALVES:
+                request = CHANNEL_VALVE_COMMAND.unpack(data)
+                channel['reagent_valve'], channel['column_valve'] = request.reagent_valve_id, request.column_valve_id
+            else:
+                channel['pump_speed'] = CHANNEL_PUMP_COMMAND.unpack(data).pump_cmd
+            return b'\x00'
+        if command_id == Command.GET_CHANNEL_STATES:
+            return self.channel_states()
+        if command_id == Command.GET_MIX_STATS:
+            return self.mix_stats()
+        if command_id == Command.GET_VALVE_STATS:
+            valve = VALVE_REQUEST.unpack(data).valve
+            return self.valve_stats(valve) if valve < len(self.valve_profiles) else b'\x03'
+        if command_id == Command.GET_STEP_JITTER:
+            return self.step_jitter()
+        if command_id == Command.AUTOTUNE_VALVE:
+            return b'\x00' if self.autotune_valve(VALVE_REQUEST.unpack(data).valve) else b'\x03'
+        if command_id == Command.SET_PULSATION:
+            return b'\x00' if self.set_pulsation(data) else b'\x03'
+        if command_id == Command.GET_PULSATION:
+            pump = PULSATION_REQUEST.unpack(data).pump
+            return self.pulsation_table(pump) if pump < self.num_channels else b'\x03'
+        if command_id == Command.START_STREAM:
+            policy = STREAM_START_REQUEST.unpack(data).underrun_policy
+            if policy not in (UNDERRUN_HOLD, UNDERRUN_STOP):
+                return b'\x03'
+            self.execute_stream(policy)
+            return self.stream_status()
+        if command_id == Command.STREAM_STEPS:
+            self.push_stream(STREAM_STEPS_REQUEST.unpack(data).first_step, data, STREAM_STEPS_REQUEST.size)
+            return self.stream_status()
+        if command_id == Command.END_STREAM:
+            self.stream_ended = True
+            self._resume_stream()
+            return self.stream_status()
+        return b'\x01'
+
+
+class FirmwareFrameReceiver:
+    """Port of SerialConnection::handle_receive_byte() and of its COBS
+    counterpart (CobsDecoder), including what they do with damaged frames.
+
+    Unlike FrameParser there is no resynchronisation in start sequence
+    framing: after a length byte the receiver consumes that many bytes
+    whatever they are. In COBS framing the next zero byte ends any frame.
+    Frames with a bad checksum are dropped without a reply.
+    """
+
+    WAIT_FOR_START1, WAIT_FOR_START2, RECEIVE_DATALEN, RECEIVE_DATA = range(4)
+
+    def __init__(self):
+        self.framing = FRAMING_START_SEQUENCE
+        self.state = self.WAIT_FOR_START1
+        self.datalen = 0
+        self.buffer = bytearray()
+        self.checksum_errors = 0
+        self.cobs_code = 0
+        self.cobs_left = 0
+        self.cobs_overflow = False
+
+    def set_framing(self, framing: int):
+        self.framing = framing
+        self.state = self.WAIT_FOR_START1
+        self.buffer = bytearray()
+        self.cobs_code = self.cobs_left = 0
+        self.cobs_overflow = False
+
+    def feed_byte(self, b: int) -> Optional[bytes]:
+        """Returns the payload (command id and data) once a frame with a valid checksum is complete"""
+        if self.framing != FRAMING_START_SEQUENCE:
+            return self._feed_cobs(b)
+        if self.state == self.WAIT_FOR_START1:
+            if b == START_SEQUENCE[0]:
+                self.state = self.WAIT_FOR_START2
+        elif self.state == self.WAIT_FOR_START2:
+            self.state = self.RECEIVE_DATALEN if b == START_SEQUENCE[1] else self.WAIT_FOR_START1
+        elif self.state == self.RECEIVE_DATALEN:
+            self.datalen = b
+            self.buffer = bytearray()
+            self.state = self.RECEIVE_DATA if b > 0 else self.WAIT_FOR_START1
+        else:
+            self.buffer.append(b)
+            if len(self.buffer) >= self.datalen:
+                self.state = self.WAIT_FOR_START1
+                if self.datalen >= 5 and zlib.crc32(self.buffer[:-4]) == int.from_bytes(self.buffer[-4:], 'big'):
+                    return bytes(self.buffer[:-4])
+                self.checksum_errors += 1
+        return None
+
+    def _feed_cobs(self, b: int) -> Optional[bytes]:
+        if b == 0:
+            frame, complete = self.buffer, self.cobs_left == 0 and len(self.buffer) > 0 and not self.cobs_overflow
+            self.set_framing(self.framing)
+            if not complete:
+                return None
+            if len(frame) >= (6 if self.framing == FRAMING_COBS_TAGGED else 5) and zlib.crc32(frame[:-4]) == int.from_bytes(frame[-4:], 'big'):
+                return bytes(frame[:-4])
+            self.checksum_errors += 1
+            return None
+        if self.cobs_left == 0:
+            if self.cobs_code not in (0, 0xff):
+                self._append(0)
+            self.cobs_code = b
+            self.cobs_left = b - 1
+        else:
+            self._append(b)
+            self.cobs_left -= 1
+        return None
+
+    def _append(self, b: int):
+        if len(self.buffer) < RECEIVE_BUFFER_SIZE:
+            self.buffer.append(b)
+        else:
+            self.cobs_overflow = True
+
+
+def encode_response(data: bytes, framing: int = FRAMING_START_SEQUENCE, tag: int = 0) -> bytes:
+    """Frame a response payload like SerialConnection::send_data()"""
+    if framing == FRAMING_COBS_TAGGED:
+        return encode_cobs_frame(bytes([tag]) + data)
+    if framing == FRAMING_COBS:
+        return encode_cobs_frame(data)
+    data = data + zlib.crc32(data).to_bytes(4, 'big')
+    return START_SEQUENCE + bytes([len(data)]) + data
+
+
+@dataclass
+class LinkConfig:
+    """Timing and faults of the emulated link. Rates are probabilities in [0, 1]."""
+    latency: float = 0.0                # s the control loop spends on each command
+    baudrate: Optional[int] = None      # None: bytes move as fast as the transport allows
+    rx_error_rate: float = 0.0          # per byte flipped on the way to the device
+    tx_error_rate: float = 0.0          # per byte flipped on the way to the host
+    drop_response_rate: float = 0.0     # per command, the response is never sent
+    disconnect_rate: float = 0.0        # per command, the link goes silent (pty) or is closed (TCP)
+    stall_time: float = 2.0             # s a silent pty link stays silent
+    seed: Optional[int] = None
+
+    def byte_time(self) -> float:
+        return 10.0 / self.baudrate if self.baudrate else 0.0  # 8N1: start + 8 data + stop bits
+
+
+@dataclass
+class LinkStats:
+    requests: int = 0
+    responses: int = 0
+    rx_bytes: int = 0
+    tx_bytes: int = 0
+    checksum_errors: int = 0
+    injected_faults: int = 0
+
+
+class EmulatedLink:
+    """Serves one device over an asyncio stream pair with the timing and faults of a LinkConfig.
+
+    Received bytes are timestamped at line speed and go through the firmware's
+    receive state machine; commands are handled one at a time after the
+    control loop latency, and responses occupy the TX line back to back, so
+    a pipelining client overlaps its requests with the device's work as it
+    would on a real UART.
+    """
+
+    def __init__(self, device: EmulatedDevice, config: LinkConfig, reader: asyncio.StreamReader,
+                 writer: asyncio.StreamWriter, close_on_disconnect: bool = True):
+        self.device = device
+        self.config = config
+        self.reader = reader
+        self.writer = writer
+        self.close_on_disconnect = close_on_disconnect
+        self.random = random.Random(config.seed)
+        self.receiver = FirmwareFrameReceiver()
+        self.stats = LinkStats()
+        self.frames: asyncio.Queue = asyncio.Queue()
+        self.rx_free_at = 0.0
+        self.tx_free_at = 0.0
+        self.silent_until = 0.0
+
+    async def run(self):
+        loop = asyncio.get_running_loop()
+        processor = loop.create_task(self._process())
+        try:
+            while True:
+                data = await self.reader.read(4096)
+                if not data:
+                    break
+                now = loop.time()
+                self.stats.rx_bytes += len(data)
+                self.rx_free_at = max(self.rx_free_at, now)
+                for b in self._inject(data, self.config.rx_error_rate):
+                    self.rx_free_at += self.config.byte_time()
+                    payload = self.receiver.feed_byte(b)
+                    if payload is not None:
+                        framing, tag = self.receiver.framing, 0
+                        if framing == FRAMING_COBS_TAGGED:
+                            tag, payload = payload[0], payload[1:]
+                        # The firmware answers in the framing the request came in and
+                        # switches before it reads the next byte
+                        self.frames.put_nowait((self.rx_free_at, payload, framing, tag))
+                        if len(payload) >= 2 and payload[0] == Command.SET_FRAMING and payload[1] in FRAMINGS:
+                            self.receiver.set_framing(payload[1])
+                self.stats.checksum_errors = self.receiver.checksum_errors
+        except ConnectionError:
+            pass
+        finally:
+            processor.cancel()
+            self.writer.close()
+
+    def _inject(self, data: bytes, rate: float) -> bytes:
+        if rate <= 0:
+            return data
+        data = bytearray(data)
+        for i in range(len(data)):
+            if self.random.random() < rate:
+                data[i] ^= 1 << self.random.randrange(8)
+                self.stats.injected_faults += 1
+        return bytes(data)
+
+    async def _process(self):
+        loop = asyncio.get_running_loop()
+        lines: List[str] = []
+        self.device.debug_print = lines.append
+        while True:
+            ready_at, payload, framing, tag = await self.frames.get()
+            await asyncio.sleep(max(0.0, ready_at - loop.time()) + self.config.latency)
+            if loop.time() < self.silent_until:
+                continue
+            self.stats.requests += 1
+            response = self.device.handle_command(payload)
+            # Debug prints of the command go out before its response, as on the board
+            out = b''.join(line.encode('utf-8') + b'\r\n' for line in lines)
+            lines.clear()
+            if self.random.random() < self.config.disconnect_rate:
+                self.stats.injected_faults += 1
+                if self.close_on_disconnect:
+                    self.writer.close()
+                    return
+                self.silent_until = loop.time() + self.config.stall_time
+                continue
+            if self.random.random() < self.config.drop_response_rate:
+                self.stats.injected_faults += 1
+            else:
+                out += encode_response(response, framing, tag)
+                self.stats.responses += 1
+            self._send(self._inject(out, self.config.tx_error_rate))
+
+    def _send(self, data: bytes):
+        if not data:
+            return
+        loop = asyncio.get_running_loop()
+        self.stats.tx_bytes += len(data)
+        self.tx_free_at = max(self.tx_free_at, loop.time()) + len(data) * self.config.byte_time()
+        if self.tx_free_at <= loop.time():
+            self.writer.write(data)
+        else:
+            # Delivered once its last byte would have left the UART; calls are ordered since tx_free_at only grows
+            loop.call_at(self.tx_free_at, self._write_later, data)
+
+    def _write_later(self, data: bytes):
+        if not self.writer.is_closing():
+            self.writer.write(data)
+
+
+async def serve_tcp(devices: List[EmulatedDevice], host: str = '127.0.0.1', port: int = 0,
+                    config: Optional[LinkConfig] = None) -> List[asyncio.AbstractServer]:
+    """Start one TCP server per device on consecutive ports (port 0: any free ports)"""
+    config = config or LinkConfig()
+    servers = []
+    for i, device in enumerate(devices):
+        async def serve(reader, writer, device=device):
+            try:
+                await EmulatedLink(device, config, reader, writer).run()
+            except asyncio.CancelledError:
+                # Connections still open when the event loop shuts down; asyncio would log
+                # the cancelled handler as an unhandled exception
+                pass
+        servers.append(await asyncio.start_server(serve, host, port + i if port else 0))
+    return servers
+
+
+def server_port(server: asyncio.AbstractServer) -> int:
+    return server.sockets[0].getsockname()[1]
+
+
+async def serve_pty(device: EmulatedDevice, config: Optional[LinkConfig] = None) -> Tuple[str, asyncio.Task]:
+    """Serve a device on a new pseudo-terminal. Returns the path to open as a serial port (e.g. /dev/pts/5)."""
+    master, slave = os.openpty()
+    tty.setraw(slave)  # no echo or newline translation: the line must be 8-bit clean like a UART
+    loop = asyncio.get_running_loop()
+    reader = asyncio.StreamReader()
+    await loop.connect_read_pipe(lambda: asyncio.StreamReaderProtocol(reader), os.fdopen(master, 'rb', buffering=0))
+    transport, protocol = await loop.connect_write_pipe(asyncio.Protocol, os.fdopen(os.dup(master), 'wb', buffering=0))
+    writer = asyncio.StreamWriter(transport, protocol, reader, loop)
+    link = EmulatedLink(device, config or LinkConfig(), reader, writer, close_on_disconnect=False)
+    # The slave end stays open here too, so the pty survives clients closing and reopening the port
+    path = os.ttyname(slave)
+    return path, loop.create_task(link.run())
+
+
+async def main():
+    parser = argparse.ArgumentParser(description="Emulate column stripper devices over TCP or pseudo-terminals")
+    parser.add_argument('--devices', type=int, default=1)
+    parser.add_argument('--channels', type=int, default=1, help="pumps per device, each with a reagent and a column valve")
+    parser.add_argument('--pty', action='store_true', help="serve on pseudo-terminals instead of TCP")
+    parser.add_argument('--host', default='127.0.0.1')
+    parser.add_argument('--port', type=int, default=7000, help="port of the first device")
+    parser.add_argument('--time-scale', type=float, default=1.0, help="emulated seconds per real second")
+    parser.add_argument('--latency-ms', type=float, default=0.0, help="control loop time per command")
+    parser.add_argument('--baud', type=int, default=None, help="emulated line speed (default: unlimited)")
+    parser.add_argument('--rx-error-rate', type=float, default=0.0, help="bit errors per received byte")
+    parser.add_argument('--tx-error-rate', type=float, default=0.0, help="bit errors per sent byte")
+    parser.add_argument('--drop-response-rate', type=float, default=0.0)
+    parser.add_argument('--disconnect-rate', type=float, default=0.0)
+    parser.add_argument('--seed', type=int, default=None)
+    args = parser.parse_args()
+
+    config = LinkConfig(latency=args.latency_ms / 1000.0, baudrate=args.baud, rx_error_rate=args.rx_error_rate,
+                        tx_error_rate=args.tx_error_rate, drop_response_rate=args.drop_response_rate,
+                        disconnect_rate=args.disconnect_rate, seed=args.seed)
+    devices = [EmulatedDevice(time_scale=args.time_scale, channels=args.channels) for _ in range(args.devices)]
+    if args.pty:
+        tasks = []
+        for device in devices:
+            path, task = await serve_pty(device, config)
+            print(f"emulated device on {path}")
+            tasks.append(task)
+        await asyncio.gather(*tasks)
+    else:
+        servers = await serve_tcp(devices, args.host, args.port, config)
+        for server in servers:
+            print(f"emulated device listening on {args.host}:{server_port(server)}")
+        await asyncio.gather(*(server.serve_forever() for server in servers))
+
+
+if __name__ == "__main__":
+    try:
+        asyncio.run(main())
+    except KeyboardInterrupt:
+        pass
@@ -0,0 +1,501 @@
+"""
+Runs a batch of strip jobs (YAML programs) across several devices at once.
+
+Units are reached over the serial protocol (USB ports, or TCP for emulated
+devices) or over the HTTP API of units found through mDNS. Jobs are handed
+out longest first to whichever unit becomes free first; how long a unit
+stays busy is estimated from the program it runs and the step index and
+progress it reports. A unit that drops its link is reconnected; if its run
+did not complete (checked in the device run log) the job is put back in the
+queue and retried, on any unit.
+
+    python fleet_orchestrator.py example_program.yaml cool_program.yaml --serial auto --mdns
+    python fleet_orchestrator.py example_program.yaml --repeat 6 --simulate 3 --time-scale 60
+"""
+
+import argparse
+import asyncio
+import heapq
+import json
+import math
+import socket
+import urllib.error
+import urllib.request
+from dataclasses import dataclass, field
+from typing import Callable, Dict, List, Optional
+
+from async_device_connection import AsyncDeviceConnection
+from device_connection import DeviceState, parse_run_log_records
+from program import Program, ProgramConverter, ProgramStep
+
+MDNS_BASE_NAME = "chromatograf"  # MDNS.begin() name in main.cpp, extra units use chromatograf-2, -3, ...
+MDNS_MAX_UNITS = 8
+POLL_INTERVAL = 1.0  # s
+RECONNECT_TIMEOUT = 60.0  # s, the unit is given up after this
+
+
+class UnitOffline(Exception):
+    pass
+
+
+def step_duration(step: ProgramStep) -> float:
+    """Nominal step duration (s): time limit, or volume / flow rate if that ends it first"""
+    return min(step.duration, step.time_to_volume())
+
+
+def program_duration(steps: List[ProgramStep]) -> float:
+    return sum(step_duration(step) for step in steps)
+
+
+def remaining_time(steps: List[ProgramStep], state: DeviceState) -> float:
+    """ETA (s) of the program a unit is running, from its reported step index and step progress"""
+    if not state.running or state.program_step_idx >= len(steps):
+        return 0.0
+    idx = state.program_step_idx
+    current = step_duration(steps[idx]) * (1.0 - state.program_step_progress / 100.0)
+    return current + program_duration(steps[idx + 1:])
+
+
+class Unit:
+    """A device the orchestrator can run programs on"""
+
+    def __init__(self, name: str):
+        self.name = name
+        self.run_log_cursor = 0
+        self.last_record: Optional[dict] = None
+
+    async def connect(self):
+        raise NotImplementedError
+
+    async def close(self):
+        pass
+
+    async def state(self) -> DeviceState:
+        raise NotImplementedError
+
+    async def load(self, program: Program):
+        raise NotImplementedError
+
+    async def start(self):
+        raise NotImplementedError
+
+    async def abort(self):
+        raise NotImplementedError
+
+    async def loaded_steps(self) -> List[ProgramStep]:
+        raise NotImplementedError
+
+    async def read_run_log(self, first: int) -> List[dict]:
+        raise NotImplementedError
+
+    async def sync_run_log(self) -> List[dict]:
+        """Run log records appended since the last call"""
+        first = max(self.run_log_cursor - 1, 0)
+        records = await self.read_run_log(first)
+        if self.last_record is not None:
+            if records[:1] == [self.last_record]:
+                records = records[1:]
+            else:
+                # The oldest segment was compacted or dropped (at a run boundary), so indices moved: rescan
+                last_run_id = self.last_record['run_id']
+                records = await self.read_run_log(0)
+                self.run_log_cursor = len([r for r in records if r['run_id'] <= last_run_id])
+                records = records[self.run_log_cursor:]
+        self.run_log_cursor += len(records)
+        if records:
+            self.last_record = records[-1]
+        return records
+
+
+class ProtocolUnit(Unit):
+    """Unit on the binary serial protocol: a USB serial port or a TCP stream (device emulator)"""
+
+    def __init__(self, name: str, address: str, debug_callback: Optional[Callable[[str], None]] = None):
+        super().__init__(name)
+        self.address = address
+        self.debug_callback = debug_callback
+        self.conn: Optional[AsyncDeviceConnection] = None
+
+    async def connect(self):
+        if self.address.startswith('tcp:'):
+            _, host, port = self.address.split(':')
+            self.conn = await AsyncDeviceConnection.open_tcp(host, int(port), name=self.name,
+                                                             debug_callback=self.debug_callback)
+        else:
+            self.conn = await AsyncDeviceConnection.open_serial(self.address, name=self.name,
+                                                                debug_callback=self.debug_callback)
+
+    async def close(self):
+        if self.conn:
+            await self.conn.close()
+            self.conn = None
+
+    def _link(self) -> AsyncDeviceConnection:
+        if self.conn is None:
+            raise ConnectionError(f"{self.name}: not connected")
+        return self.conn
+
+    async def state(self) -> DeviceState:
+        return await self._link().get_device_state()
+
+    async def load(self, program: Program):
+        await self._link().write_program(program)
+
+    async def start(self):
+        await self._link().execute_program()
+
+    async def abort(self):
+        await self._link().abort_program()
+
+    async def loaded_steps(self) -> List[ProgramStep]:
+        return await self._link().read_program_steps()
+
+    async def read_run_log(self, first: int) -> List[dict]:
+        return await self._link().get_run_log(first)
+
+
+class HttpUnit(Unit):
+    """Unit on its web API (handlers in web_server.h), e.g. one found through mDNS"""
+
+    def __init__(self, name: str, host: str, timeout: float = 5.0):
+        super().__init__(name)
+        self.base_url = f"http://{host}"
+        self.timeout = timeout
+
+    def _request_sync(self, path: str, data: Optional[bytes] = None, content_type: Optional[str] = None) -> bytes:
+        request = urllib.request.Request(self.base_url + path, data=data, method='POST' if data is not None else 'GET')
+        if content_type:
+            request.add_header('Content-Type', content_type)
+        try:
+            with urllib.request.urlopen(request, timeout=self.timeout) as response:
+                return response.read()
+        except (urllib.error.URLError, OSError) as e:
+            raise ConnectionError(f"{self.name}: {e}") from e
+
+    async def _request(self, path: str, data: Optional[bytes] = None, content_type: Optional[str] = None) -> bytes:
+        return await asyncio.to_thread(self._request_sync, path, data, content_type)
+
+    async def connect(self):
+        await self.state()
+
+    async def state(self) -> DeviceState:
+        status = json.loads(await self._request('/api/status'))
+        state = DeviceState()
+        for key, value in status.items():
+            setattr(state, key, value)
+        state.program_step_progress = status['program_step_progress'] / 2.55
+        return state
+
+    async def load(self, program: Program):
+        # The web API takes duration-limited steps only: volume limits become the equivalent duration
+        steps = []
+        for step in program.steps:
+            duration_ms = int(step_duration(step) * 1000)
+            if step.reagent_valve_id == 0xff:
+                steps.append({'type': 'wait', 'duration_ms': duration_ms})
+            else:
+                flush = {'type': 'flush', 'reagent': step.reagent_valve_id, 'column': step.column_valve_id,
+                         'pump_speed': step.flow_rate, 'duration_ms': duration_ms}
+                if step.end_flow_rate is not None:
+                    # A ramp cut short by its volume limit is the ramp to the flow reached at that point
+                    flush['end_pump_speed'] = step.flow_at(duration_ms / 1000.0)
+                if step.mix_reagent_valve_id is not None:
+                    flush['mix_reagent'] = step.mix_reagent_valve_id
+                    flush['mix_percent'] = 100.0 * step.mix_share
+                steps.append(flush)
+        await self._request('/api/program/upload', json.dumps(steps).encode('utf-8'), 'application/json')
+
+    async def start(self):
+        await self._request('/api/program/run', b'')
+
+    async def abort(self):
+        await self._request('/api/program/stop', b'')
+
+    async def loaded_steps(self) -> List[ProgramStep]:
+        steps = []
+        for step in json.loads(await self._request('/api/program/get')):
+            duration = step['duration_ms'] / 1000.0
+            if step['type'] == 'wait':
+                steps.append(ProgramStep(0xff, 0xff, 0.0, math.inf, duration))
+            else:
+                mix_percent = step.get('mix_percent', 0.0)
+                steps.append(ProgramStep(step['reagent'], step['column'], step['pump_speed'], math.inf, duration,
+                                         step.get('end_pump_speed'), step.get('mix_reagent'), mix_percent / 100.0))
+        return steps
+
+    async def read_run_log(self, first: int) -> List[dict]:
+        return parse_run_log_records(await self._request('/api/runlog/get'))[first:]
+
+
+@dataclass(order=True)
+class Job:
+    sort_key: float  # negative estimated duration: longest job first
+    name: str = field(compare=False)
+    program: Program = field(compare=False)
+    duration: float = field(compare=False)
+    attempts: int = field(default=0, compare=False)
+
+
+@dataclass
+class JobResult:
+    job: str
+    unit: Optional[str]
+    ok: bool
+    attempts: int
+    message: str = ""
+
+
+def load_job(path: str, name: Optional[str] = None) -> Job:
+    program = ProgramConverter().load_from_yaml(path)
+    duration = program_duration(program.steps)
+    if math.isinf(duration):
+        raise ValueError(f"{path}: program has a step with neither a time nor a volume limit")
+    return Job(-duration, name or path, program, duration)
+
+
+def plan(jobs: List[Job], free_at: Dict[str, float]) -> List[tuple]:
+    """Expected assignment: longest job first to the unit that frees up first. Returns (job, unit, start, end)."""
+    units = [(t, name) for name, t in free_at.items()]
+    heapq.heapify(units)
+    assignment = []
+    for job in sorted(jobs):
+        t, unit = heapq.heappop(units)
+        assignment.append((job.name, unit, t, t + job.duration))
+        heapq.heappush(units, (t + job.duration, unit))
+    return assignment
+
+
+class FleetOrchestrator:
+    def __init__(self, units: List[Unit], jobs: List[Job], max_attempts: int = 3,
+                 poll_interval: float = POLL_INTERVAL, reconnect_timeout: float = RECONNECT_TIMEOUT,
+                 log: Callable[[str], None] = print):
+        self.units = units
+        self.pending = sorted(jobs)
+        self.max_attempts = max_attempts
+        self.poll_interval = poll_interval
+        self.reconnect_timeout = reconnect_timeout
+        self.log = log
+        self.results: List[JobResult] = []
+        self.in_flight = 0
+        self.cond = asyncio.Condition()
+
+    async def unit_eta(self, unit: Unit) -> float:
+        """Seconds until the unit is free, from the program it is running and its progress"""
+        state = await unit.state()
+        if not state.running:
+            return 0.0
+        return remaining_time(await unit.loaded_steps(), state)
+
+    async def connect_all(self) -> Dict[str, float]:
+        """Connect every unit and return its ETA. Units that cannot be reached are dropped."""
+        async def connect(unit):
+            await unit.connect()
+            return await self.unit_eta(unit)
+        etas = await asyncio.gather(*(connect(unit) for unit in self.units), return_exceptions=True)
+        free_at = {}
+        for unit, eta in zip(list(self.units), etas):
+            if isinstance(eta, Exception):
+                self.log(f"[{unit.name}] unavailable: {eta}")
+                self.units.remove(unit)
+            else:
+                free_at[unit.name] = eta
+        return free_at
+
+    async def run(self) -> List[JobResult]:
+        free_at = await self.connect_all()
+        if not self.units:
+            raise ConnectionError("no units available")
+        for job, unit, start, end in plan(self.pending, free_at):
+            self.log(f"[PLAN] {job:<30} -> {unit:<16} {start:8.0f}s .. {end:8.0f}s")
+        await asyncio.gather(*(self._worker(unit) for unit in self.units))
+        for job in self.pending:
+            self.results.append(JobResult(job.name, None, False, job.attempts, "no unit left to run it"))
+        await asyncio.gather(*(unit.close() for unit in self.units), return_exceptions=True)
+        return self.results
+
+    async def _next_job(self) -> Optional[Job]:
+        async with self.cond:
+            # A job still running elsewhere may come back for a retry, so wait for it before quitting
+            while not self.pending and self.in_flight > 0:
+                await self.cond.wait()
+            if not self.pending:
+                return None
+            self.in_flight += 1
+            return self.pending.pop(0)
+
+    async def _job_done(self, job: Job, requeue: bool):
+        async with self.cond:
+            self.in_flight -= 1
+            if requeue:
+                self.pending.append(job)
+                self.pending.sort()
+            self.cond.notify_all()
+
+    async def _worker(self, unit: Unit):
+        try:
+            await self._wait_idle(unit)
+        except UnitOffline:
+            return
+        while True:
+            job = await self._next_job()
+            if job is None:
+                return
+            job.attempts += 1
+            try:
+                await self._run_job(unit, job)
+                self.results.append(JobResult(job.name, unit.name, True, job.attempts))
+                self.log(f"[{unit.name}] {job.name}: done")
+                await self._job_done(job, requeue=False)
+            except UnitOffline as e:
+                await self._retry_or_fail(unit, job, str(e))
+                return
+            except ConnectionError as e:
+                await self._retry_or_fail(unit, job, str(e))
+
+    async def _retry_or_fail(self, unit: Unit, job: Job, message: str):
+        if job.attempts < self.max_attempts:
+            self.log(f"[{unit.name}] {job.name}: attempt {job.attempts} failed ({message}), requeued")
+            await self._job_done(job, requeue=True)
+        else:
+            self.log(f"[{unit.name}] {job.name}: failed after {job.attempts} attempts ({message})")
+            self.results.append(JobResult(job.name, unit.name, False, job.attempts, message))
+            await self._job_done(job, requeue=False)
+
+    async def _wait_idle(self, unit: Unit):
+        """Wait for a program started outside the orchestrator to finish"""
+        while True:
+            try:
+                eta = await self.unit_eta(unit)
+            except ConnectionError:
+                await self._reconnect(unit)
+                continue
+            if eta <= 0:
+                return
+            self.log(f"[{unit.name}] busy, free in {eta:.0f}s")
+            await asyncio.sleep(min(max(eta, self.poll_interval), 30.0))
+
+    async def _reconnect(self, unit: Unit):
+        loop = asyncio.get_running_loop()
+        deadline = loop.time() + self.reconnect_timeout
+        delay = 1.0
+        self.log(f"[{unit.name}] link lost, reconnecting")
+        while loop.time() < deadline:
+            await unit.close()
+            try:
+                await unit.connect()
+                self.log(f"[{unit.name}] reconnected")
+                return
+            except (ConnectionError, OSError):
+                await asyncio.sleep(delay)
+                delay = min(delay * 2, 10.0)
+        raise UnitOffline(f"{unit.name}: offline")
+
+    async def _run_job(self, unit: Unit, job: Job):
+        loop = asyncio.get_running_loop()
+        try:
+            await unit.sync_run_log()
+            await unit.load(job.program)
+            await unit.start()
+        except ConnectionError:
+            # The program may or may not have started: make sure the unit is left idle before retrying
+            await self._reconnect(unit)
+            await unit.abort()
+            raise
+        self.log(f"[{unit.name}] {job.name}: started (attempt {job.attempts}, ~{job.duration:.0f}s)")
+        last_report = loop.time()
+        while True:
+            await asyncio.sleep(self.poll_interval)
+            try:
+                state = await unit.state()
+            except ConnectionError:
+                # The device keeps executing on its own while the link is down
+                await self._reconnect(unit)
+                continue
+            if not state.running:
+                break
+            if loop.time() - last_report >= 10 * self.poll_interval:
+                last_report = loop.time()
+                eta = remaining_time(job.program.steps, state)
+                self.log(f"[{unit.name}] {job.name}: step {state.program_step_idx + 1}/{len(job.program.steps)}, "
+                         f"ETA {eta:.0f}s")
+        run_ends = [r for r in await unit.sync_run_log() if r['type'] == 'run_end']
+        if run_ends and run_ends[-1]['aborted']:
+            raise ConnectionError(f"run aborted at step {run_ends[-1]['step_idx']}")
+
+
+async def discover_serial_units(debug_callback=None) -> List[Unit]:
+    """Serial ports with a device answering the ping command"""
+    from serial.tools import list_ports
+    units = []
+    for port in list_ports.comports():
+        unit = ProtocolUnit(port.device, port.device, debug_callback)
+        try:
+            await asyncio.wait_for(unit.connect(), 5.0)
+            units.append(unit)
+        except (ConnectionError, OSError, ImportError, asyncio.TimeoutError):
+            pass
+        finally:
+            await unit.close()
+    return units
+
+
+async def discover_mdns_units() -> List[Unit]:
+    """Units announcing themselves as chromatograf.local, chromatograf-2.local, ..."""
+    hostnames = [f"{MDNS_BASE_NAME}.local"] + [f"{MDNS_BASE_NAME}-{i}.local" for i in range(2, MDNS_MAX_UNITS + 1)]
+
+    async def resolve(hostname):
+        try:
+            await asyncio.wait_for(asyncio.get_running_loop().getaddrinfo(hostname, 80, type=socket.SOCK_STREAM), 3.0)
+            return hostname
+        except (OSError, asyncio.TimeoutError):
+            return None
+
+    found = await asyncio.gather(*(resolve(h) for h in hostnames))
+    return [HttpUnit(h.split('.')[0], h) for h in found if h]
+
+
+async def main():
+    parser = argparse.ArgumentParser(description="Run strip jobs across several devices")
+    parser.add_argument('programs', nargs='+', help="YAML program files, one job each")
+    parser.add_argument('--repeat', type=int, default=1, help="run every program this many times")
+    parser.add_argument('--serial', nargs='*', default=[], help="serial ports, or 'auto' to probe all ports")
+    parser.add_argument('--mdns', action='store_true', help="look for units on the network")
+    parser.add_argument('--host', nargs='*', default=[], help="units reached over HTTP, e.g. chromatograf.local")
+    parser.add_argument('--tcp', nargs='*', default=[], help="serial protocol over TCP, host:port (device emulator)")
+    parser.add_argument('--simulate', type=int, default=0, help="start this many emulated devices")
+    parser.add_argument('--time-scale', type=float, default=1.0, help="speed-up of emulated devices")
+    parser.add_argument('--retries', type=int, default=2)
+    parser.add_argument('--debug', action='store_true', help="print device debug output")
+    args = parser.parse_args()
+
+    debug_callback = print if args.debug else None
+    jobs = [load_job(path, f"{path}#{i + 1}" if args.repeat > 1 else path)
+            for path in args.programs for i in range(args.repeat)]
+
+    units: List[Unit] = []
+    if 'auto' in args.serial:
+        units += await discover_serial_units(debug_callback)
+    units += [ProtocolUnit(port, port, debug_callback) for port in args.serial if port != 'auto']
+    if args.mdns:
+        units += await discover_mdns_units()
+    units += [HttpUnit(host, host) for host in args.host]
+    units += [ProtocolUnit(address, f"tcp:{address}", debug_callback) for address in args.tcp]
+    if args.simulate:
+        from device_emulator import EmulatedDevice, serve_tcp, server_port
+        servers = await serve_tcp([EmulatedDevice(time_scale=args.time_scale) for _ in range(args.simulate)])
+        units += [ProtocolUnit(f"sim{i + 1}", f"tcp:127.0.0.1:{server_port(s)}", debug_callback)
+                  for i, s in enumerate(servers)]
+
+    orchestrator = FleetOrchestrator(units, jobs, max_attempts=args.retries + 1,
+                                     poll_interval=POLL_INTERVAL / max(args.time_scale, 1.0))
+    loop = asyncio.get_running_loop()
+    start = loop.time()
+    results = await orchestrator.run()
+    elapsed = loop.time() - start
+    print(f"\n{sum(r.ok for r in results)}/{len(results)} jobs done in {elapsed:.0f}s on {len(orchestrator.units)} units")
+    for r in results:
+        print(f"  {'OK  ' if r.ok else 'FAIL'} {r.job:<30} {r.unit or '-':<16} attempts: {r.attempts} {r.message}")
+
+
+if __name__ == "__main__":
+    asyncio.run(main())
@@ -0,0 +1,151 @@
+"""
+COBS framing of the serial protocol, the alternative to START_SEQUENCE | len frames.
+
+After a set_framing(FRAMING_COBS) command, frames on both directions are
+
+    0x00 | COBS(payload | crc32 big endian) | 0x00
+
+The encoded data contains no zero bytes, so every zero is a frame boundary:
+a damaged frame costs only itself, and bytes between frames (the device's
+debug prints) form chunks of their own that fail the checksum.
+
+FRAMING_COBS_TAGGED frames put a tag byte before the payload, and the device
+repeats the tag of a request in front of its response.
+
+The encoder and decoder match include/cobs.h byte for byte, including the
+reference behaviour of not opening a new block after a final 254 byte block.
+"""
+
+import zlib
+from typing import Callable, List, Optional
+
+from protocol import Command, SET_FRAMING_REQUEST, FRAMING_START_SEQUENCE
+
+# Known encodings (from the COBS paper / reference implementation) checked by
+# bench/protocol_bench.py against this module; bench/bench_main.cpp checks the
+# firmware codec against the same table.
+COBS_VECTORS = [
+    (bytes([0x00]), bytes([0x01, 0x01])),
+    (bytes([0x00, 0x00]), bytes([0x01, 0x01, 0x01])),
+    (bytes([0x00, 0x11, 0x00]), bytes([0x01, 0x02, 0x11, 0x01])),
+    (bytes([0x11, 0x22, 0x00, 0x33]), bytes([0x03, 0x11, 0x22, 0x02, 0x33])),
+    (bytes([0x11, 0x22, 0x33, 0x44]), bytes([0x05, 0x11, 0x22, 0x33, 0x44])),
+    (bytes([0x11, 0x00, 0x00, 0x00]), bytes([0x02, 0x11, 0x01, 0x01, 0x01])),
+    (bytes(range(0x01, 0xff)), bytes([0xff]) + bytes(range(0x01, 0xff))),
+    (bytes(range(0x00, 0xff)), bytes([0x01, 0xff]) + bytes(range(0x01, 0xff))),
+    (bytes(range(0x01, 0x100)), bytes([0xff]) + bytes(range(0x01, 0xff)) + bytes([0x02, 0xff])),
+    (bytes(range(0x02, 0x100)) + bytes([0x00]), bytes([0xff]) + bytes(range(0x02, 0x100)) + bytes([0x01, 0x01])),
+    (bytes(range(0x03, 0x100)) + bytes([0x00, 0x01]), bytes([0xfe]) + bytes(range(0x03, 0x100)) + bytes([0x02, 0x01])),
+]
+
+
+def cobs_encode(data: bytes) -> bytes:
+    out = bytearray([0])
+    code_idx = 0
+    code = 1
+    block_full = False
+    for b in data:
+        if block_full:
+            code_idx = len(out)
+            out.append(0)
+            code = 1
+            block_full = False
+        if b:
+            out.append(b)
+            code += 1
+            if code == 0xff:
+                out[code_idx] = code
+                block_full = True
+        else:
+            out[code_idx] = code
+            code_idx = len(out)
+            out.append(0)
+            code = 1
+    if not block_full:
+        out[code_idx] = code
+    return bytes(out)
+
+
+def cobs_decode(data: bytes) -> bytes:
+    """Decode one frame (without delimiters); raises ValueError if it is truncated or contains a zero"""
+    out = bytearray()
+    i = 0
+    while i < len(data):
+        code = data[i]
+        if code == 0 or i + code > len(data):
+            raise ValueError("invalid COBS data")
+        out += data[i + 1:i + code]
+        i += code
+        if code != 0xff and i < len(data):
+            out.append(0)
+    return bytes(out)
+
+
+def encode_cobs_frame(payload: bytes) -> bytes:
+    data = bytes(payload) + zlib.crc32(payload).to_bytes(4, 'big')
+    return b'\x00' + cobs_encode(data) + b'\x00'
+
+
+# Sent when opening a connection: a device left in either COBS framing by an
+# earlier session acks it and falls back to start sequence frames, a device
+# already using them sees only noise without a start sequence. The first frame
+# resets tagged framing (untagged, it asks for framing 20 and is refused), the
+# second one untagged framing (tagged, it is a ping).
+_RESET_REQUEST = bytes([Command.SET_FRAMING]) + SET_FRAMING_REQUEST.pack(FRAMING_START_SEQUENCE)
+FRAMING_RESET = encode_cobs_frame(bytes([Command.SET_FRAMING]) + _RESET_REQUEST) + encode_cobs_frame(_RESET_REQUEST)
+assert b'\x21\x37' not in FRAMING_RESET
+
+
+class CobsFrameParser:
+    """Incremental parser for COBS frames, with the interface of FrameParser.
+
+    Chunks between delimiters that do not decode to a frame with a valid
+    checksum are the device's debug prints (or line noise) and are collected
+    into text lines.
+    """
+
+    def __init__(self, on_debug_line: Optional[Callable[[str], None]] = None):
+        self.buffer = bytearray()
+        self.text = bytearray()
+        self.on_debug_line = on_debug_line
+        self.checksum_errors = 0
+
+    def feed(self, data: bytes) -> List[bytes]:
+        """Add received bytes, return the payloads of all frames completed by them"""
+        self.buffer += data
+        frames = []
+        while True:
+            end = self.buffer.find(b'\x00')
+            if end < 0:
+                break
+            chunk = bytes(self.buffer[:end])
+            del self.buffer[:end + 1]
+            if not chunk:
+                continue
+            frame = self._decode(chunk)
+            if frame is not None:
+                frames.append(frame)
+            else:
+                self._add_text(chunk)
+        return frames
+
+    def _decode(self, chunk: bytes) -> Optional[bytes]:
+        try:
+            frame = cobs_decode(chunk)
+        except ValueError:
+            return None
+        if len(frame) < 4 or zlib.crc32(frame[:-4]) != int.from_bytes(frame[-4:], 'big'):
+            # Debug text nearly always ends in '\n'; anything else that fails was a damaged frame
+            if not chunk.endswith(b'\n'):
+                self.checksum_errors += 1
+            return None
+        return frame[:-4]
+
+    def _add_text(self, data: bytes):
+        self.text += data
+        while b'\n' in self.text:
+            line, _, rest = self.text.partition(b'\n')
+            self.text = bytearray(rest)
+            line = line.decode('utf-8', errors='replace').strip()
+            if line and self.on_debug_line:
+                self.on_debug_line(line)
@@ -23,9 +23,9 @@ class CircularBuffer {
         return average_;
     }
   private:
-    float buffer_[kMaxCircularBufferSize];
+    float buffer_[kMaxCircularBufferSize] = {0};
     float average_ = 0;
-    int index_;
+    int index_ = 0;
     int size_;
 };
 
@@ -0,0 +1,136 @@
+#ifndef COBS_H
+#define COBS_H
+
+#include <stdint.h>
+
+// Consistent Overhead Byte Stuffing: the encoded data contains no zero bytes,
+// so a zero delimits frames and the receiver resynchronizes at the next one.
+
+// Upper bound of the encoded size of len bytes (one code byte per started 254 byte block)
+constexpr int cobs_max_encoded_size(int len) {
+    return len + len / 254 + 1;
+}
+
+class CobsEncoder {
+  /*
+  Streaming encoder, writes into out (at least cobs_max_encoded_size() bytes).
+  Bytes are put one at a time, so the frame checksum can be computed and
+  appended without a separate copy of the frame.
+  */
+  public:
+    explicit CobsEncoder(uint8_t* out) : out_(out) {}
+
+    void put(uint8_t b) {
+        if (block_full_) {
+            // A 254 byte block needs no trailing zero; only open the next block once more data follows
+            code_idx_ = length_++;
+            code_ = 1;
+            block_full_ = false;
+        }
+        if (b != 0) {
+            out_[length_++] = b;
+            code_++;
+            if (code_ == 0xff) {
+                out_[code_idx_] = code_;
+                block_full_ = true;
+            }
+        } else {
+            out_[code_idx_] = code_;
+            code_idx_ = length_++;
+            code_ = 1;
+        }
+    }
+
+    void put(const uint8_t* data, int len) {
+        for (int i = 0; i < len; i++) {
+            put(data[i]);
+        }
+    }
+
+    // Closes the last block and returns the encoded length (without delimiter)
+    int finish() {
+        if (!block_full_) {
+            out_[code_idx_] = code_;
+        }
+        return length_;
+    }
+
+  private:
+    uint8_t* out_;
+    int code_idx_ = 0;
+    int length_ = 1;
+    uint8_t code_ = 1;
+    bool block_full_ = false;
+};
+
+class CobsDecoder {
+  /*
+  Streaming decoder: bytes between two zero delimiters are decoded into out as
+  they arrive, so a frame is complete (and decoded in place) when its
+  delimiter is received.
+  */
+  public:
+    CobsDecoder(uint8_t* out, int capacity) : out_(out), capacity_(capacity) {}
+
+    enum Result {
+      COBS_IN_PROGRESS,
+      COBS_FRAME,       // delimiter received, length() bytes decoded
+      COBS_ERROR,       // delimiter received, frame truncated or too long for the buffer
+    };
+
+    Result feed(uint8_t b) {
+        if (b == 0) {
+            Result result = (left_ == 0 && length_ > 0 && !overflow_) ? COBS_FRAME : COBS_ERROR;
+            frame_length_ = length_;
+            reset();
+            return result;
+        }
+        if (left_ == 0) {
+            // Code byte; the previous block ended with a zero unless it was a full 254 byte block
+            if (code_ != 0 && code_ != 0xff) {
+                append(0);
+            }
+            code_ = b;
+            left_ = b - 1;
+        } else {
+            append(b);
+            left_--;
+        }
+        return COBS_IN_PROGRESS;
+    }
+
+    int length() const {
+        return frame_length_;
+    }
+
+    // True between the first byte of a frame and its delimiter
+    bool in_frame() const {
+        return code_ != 0;
+    }
+
+    void reset() {
+        length_ = 0;
+        code_ = 0;
+        left_ = 0;
+        overflow_ = false;
+    }
+
+  private:
+    void append(uint8_t b) {
+        if (length_ < capacity_) {
+            out_[length_++] = b;
+        } else {
+            overflow_ = true;
+        }
+    }
+
+    uint8_t* out_;
+    int capacity_;
+    int length_ = 0;
+    int frame_length_ = 0;
+    uint8_t code_ = 0;
+    uint8_t left_ = 0;
+    bool overflow_ = false;
+};
+
+#endif // COBS_H
@@ -0,0 +1,72 @@
+#ifndef COMMAND_STATS_H
+#define COMMAND_STATS_H
+
+#include <Arduino.h>
+#include "protocol.h"
+
+constexpr int kCommandStatsPerBlock = 10;
+
+struct CommandStats {
+    uint32_t calls;
+    uint32_t errors;
+    uint32_t min_us;
+    uint32_t max_us;
+    uint64_t total_us;
+};
+
+class CommandStatistics {
+  /*
+  Call counts, error counts and service times of the serial commands, indexed
+  by command id. Only touched by the communication task, so there is no locking.
+  */
+  public:
+    void record(uint8_t command_id, uint32_t service_us, bool error) {
+      CommandStats& s = stats_[command_id];
+      if (s.calls == 0 || service_us < s.min_us) {
+        s.min_us = service_us;
+      }
+      if (service_us > s.max_us) {
+        s.max_us = service_us;
+      }
+      s.total_us += service_us;
+      s.calls++;
+      if (error) {
+        s.errors++;
+      }
+    }
+
+    void record_unknown() {
+      unknown_commands_++;
+    }
+
+    // Writes a CommandStatsSummary followed by the records of the commands
+    // from first_command on, at most max_records. Returns the number of bytes.
+    int get(uint8_t first_command, uint8_t* buffer, int max_records) const {
+      protocol::CommandStatsSummaryWriter summary(buffer);
+      summary.set_num_commands(protocol::kNumCommandIds);
+      summary.clear_padding();
+      summary.set_unknown_commands(unknown_commands_);
+      int length = protocol::CommandStatsSummaryWriter::kSize;
+      for (int id = first_command; id < protocol::kNumCommandIds && max_records > 0; id++, max_records--) {
+        const CommandStats& s = stats_[id];
+        protocol::CommandStatsRecordWriter record(buffer + length);
+        record.set_command_id(id);
+        record.clear_padding();
+        record.set_calls(s.calls);
+        record.set_errors(s.errors);
+        record.set_min_us(s.min_us);
+        record.set_avg_us(s.calls > 0 ? s.total_us / s.calls : 0);
+        record.set_max_us(s.max_us);
+        length += protocol::CommandStatsRecordWriter::kSize;
+      }
+      return length;
+    }
+
+  private:
+    CommandStats stats_[protocol::kNumCommandIds] = {};
+    uint32_t unknown_commands_ = 0;
+};
+
+static CommandStatistics command_stats;
+
+#endif // COMMAND_STATS_H
@@ -2,32 +2,61 @@
 #define CONNECTION_H
 
 #include <CRC32.h>
+#include <esp_timer.h>
 #include "device.h"
 #include "program.h"
 #include "command_parse.h"
+#include "task_diagnostics.h"
+#include "protocol.h"
+#include "command_stats.h"
+#include "status_cache.h"
+#include "valve_autotune.h"
+#include "step_jitter.h"
+#include "core_affinity.h"
+#include "cobs.h"
 
 
 constexpr int kReceiveBufferSize = 2000;
 const uint8_t kStartSeq[] = {0x21, 0x37};
+// Largest frame send_data() can produce: COBS code bytes, delimiters, tag and
+// CRC (a start sequence frame is at most 2 + 1 + 255 + 4 bytes)
+constexpr int kTxFrameSize = cobs_max_encoded_size(1 + 255 + 4) + 2;
+// UART driver TX ring, drained by the UART interrupt. Room for a few full
+// frames, so writes only block when the host stops reading. Set in setup()
+// before the first Serial.begin(): the driver ignores it once installed.
+constexpr int kUartTxBufferSize = 1024;
+
+// Worst case size of the frame for data_length bytes of data
+constexpr int frame_size(uint8_t framing, int data_length) {
+    return framing == protocol::kFramingStartSequence ? data_length + 7
+           : cobs_max_encoded_size((framing == protocol::kFramingCobsTagged) + data_length + 4) + 2;
+}
+// Longest gap between two bytes of a frame (a byte takes 87 us at 115200 baud)
+constexpr uint32_t kFrameByteTimeoutMs = 50;
 
 class SerialConnection {
   public:
-    void init() {
-        Serial.begin(115200);
+    // Sends a frame with a single write into the UART TX ring. Blocks only
+    // while the ring has no room for the frame; used for command responses.
+    void send_data(const uint8_t* data, uint8_t data_length) {
+        Serial.write(tx_frame_, build_frame(data, data_length));
     }
 
-    void send_data(uint8_t* data, uint8_t data_length) {
-        uint8_t data_len[1] = {data_length+(uint8_t)4};
-        Serial.write(kStartSeq, 2);
-        Serial.write(data_len, 1);
-        Serial.write(data, data_length);
-        uint32_t crc = compute_crc(data, data_length);
-        uint8_t crc_bytes[4] = {0};
-        crc_bytes[0] = crc >> 24;
-        crc_bytes[1] = crc >> 16;
-        crc_bytes[2] = crc >> 8;
-        crc_bytes[3] = crc;
-        Serial.write(crc_bytes, 4);
+    // Non-blocking send for traffic that may be dropped (e.g. telemetry):
+    // returns false, without writing anything, if the TX ring has no room for
+    // the frame, so a host that stops reading never stalls the caller.
+    bool try_send_data(const uint8_t* data, uint8_t data_length) {
+        if (Serial.availableForWrite() < frame_size(framing_, data_length)) {
+            tx_dropped_++;
+            return false;
+        }
+        Serial.write(tx_frame_, build_frame(data, data_length));
+        return true;
+    }
+
+    // Frames try_send_data() dropped for lack of room
+    uint32_t tx_dropped() const {
+        return tx_dropped_;
     }
 
     void send_ack(int code) {
@@ -36,24 +65,64 @@ class SerialConnection {
         send_data(data, 1);
     }
 
+    /*
+    Switches between the 0x21 0x37 start sequence frames and COBS frames
+    delimited by zero bytes (protocol::kFraming*). Frames in progress are dropped.
+    In tagged COBS framing each request starts with a tag byte that the
+    response to it repeats.
+    */
+    void set_framing(uint8_t framing) {
+        framing_ = framing;
+        state = State::STATE_WAIT_FOR_START1;
+        cobs_decoder_.reset();
+    }
+
+    uint8_t framing() const {
+        return framing_;
+    }
+
+    /*
+    Waits up to timeout_ms for a frame, longer while one is arriving. Runs on
+    the network core next to IDLE0 and the priority 0 tasks, so it sleeps a
+    tick whenever the UART has nothing buffered instead of spinning. A frame
+    that stalls for kFrameByteTimeoutMs is dropped: a host stopping mid-frame
+    would otherwise keep it waiting for good.
+    */
     bool receive_packet(int timeout_ms, uint8_t** data_ptr, int* data_length) {
-        int timeout_start_ms = millis();
+        uint32_t timeout_start_ms = millis();
+        uint32_t last_byte_ms = timeout_start_ms;
 
         datalen = -1;
-        int data_idx = 0;
         state = State::STATE_WAIT_FOR_START1;
         while (true) {
-            if (state == State::STATE_WAIT_FOR_START1 && millis() - timeout_start_ms > timeout_ms) {
+            uint32_t now = millis();
+            if (frame_in_progress()) {
+                if (now - last_byte_ms > kFrameByteTimeoutMs) {
+                    set_framing(framing_); // drops the partial frame
+                    return false;
+                }
+            } else if (now - timeout_start_ms > (uint32_t)timeout_ms) {
                 return false;
             }
+            if (Serial.available() <= 0) {
+                vTaskDelay(1);
+                continue;
+            }
             while (Serial.available() > 0) {
                 uint8_t b = Serial.read();
-                if (handle_receive_byte(b)) {
+                bool complete = cobs_framing() ? handle_receive_byte_cobs(b) : handle_receive_byte(b);
+                if (complete) {
                     *data_ptr = receive_buffer;
                     *data_length = datalen;
+                    if (framing_ == protocol::kFramingCobsTagged) {
+                        tag_ = receive_buffer[0];
+                        (*data_ptr)++;
+                        (*data_length)--;
+                    }
                     return true;
                 }
             }
+            last_byte_ms = millis();
         }
         return false;
     }
@@ -74,6 +143,77 @@ class SerialConnection {
     int state = STATE_WAIT_FOR_START1;
     int datalen = 0;
     int data_idx = 0;
+    uint8_t framing_ = protocol::kFramingStartSequence;
+    uint8_t tag_ = 0; // of the last request, in tagged COBS framing
+    CobsDecoder cobs_decoder_{receive_buffer, kReceiveBufferSize};
+    uint8_t tx_frame_[kTxFrameSize];
+    uint32_t tx_dropped_ = 0;
+
+    bool cobs_framing() const {
+        return framing_ != protocol::kFramingStartSequence;
+    }
+
+    bool frame_in_progress() const {
+        return cobs_framing() ? cobs_decoder_.in_frame() : state != State::STATE_WAIT_FOR_START1;
+    }
+
+    // Frames are decoded straight into receive_buffer; any zero byte ends a
+    // frame, so line noise costs at most the frame it hits.
+    bool handle_receive_byte_cobs(uint8_t b) {
+        CobsDecoder::Result result = cobs_decoder_.feed(b);
+        if (result != CobsDecoder::COBS_FRAME) {
+            return false;
+        }
+        datalen = cobs_decoder_.length();
+        if (framing_ == protocol::kFramingCobsTagged && datalen < 6) {
+            return false; // no room for the tag, the command id and the CRC
+        }
+        return verify_checksum(receive_buffer, datalen) == ChecksumResult::CHECKSUM_OK;
+    }
+
+    // Assembles the frame in tx_frame_, computing the CRC while the data is
+    // copied, and returns its length
+    int build_frame(const uint8_t* data, uint8_t data_length) {
+        CRC32 crc;
+        if (cobs_framing()) {
+            // Leading delimiter too, so debug prints since the last frame end up in a chunk of their own
+            tx_frame_[0] = 0;
+            CobsEncoder encoder(tx_frame_ + 1);
+            if (framing_ == protocol::kFramingCobsTagged) {
+                encoder.put(tag_);
+                crc.update(tag_);
+            }
+            for (int i = 0; i < data_length; i++) {
+                encoder.put(data[i]);
+                crc.update(data[i]);
+            }
+            put_crc(encoder, crc.finalize());
+            int length = 1 + encoder.finish();
+            tx_frame_[length++] = 0;
+            return length;
+        }
+        tx_frame_[0] = kStartSeq[0];
+        tx_frame_[1] = kStartSeq[1];
+        tx_frame_[2] = data_length + 4;
+        uint8_t* out = tx_frame_ + 3;
+        for (int i = 0; i < data_length; i++) {
+            out[i] = data[i];
+            crc.update(data[i]);
+        }
+        uint32_t c = crc.finalize();
+        out[data_length] = c >> 24;
+        out[data_length + 1] = c >> 16;
+        out[data_length + 2] = c >> 8;
+        out[data_length + 3] = c;
+        return data_length + 7;
+    }
+
+    static void put_crc(CobsEncoder& encoder, uint32_t crc) {
+        encoder.put(crc >> 24);
+        encoder.put(crc >> 16);
+        encoder.put(crc >> 8);
+        encoder.put(crc);
+    }
 
 
     bool handle_receive_byte(uint8_t b) {
@@ -150,6 +290,342 @@ class SerialConnection {
 
 
 
+PROTOCOL_ASSERT_LAYOUTS()
+
+class CommandHandlers {
+  /*
+  One handler per command of protocol/protocol.yaml, called through the
+  generated protocol::kCommandTable. data points at the request in the receive
+  buffer, holds at least the fixed part of the request and is parsed in place
+  through the generated views.
+  */
+  public:
+    CommandHandlers(SerialConnection& connection, Program& program, ProgramLoader& program_loader, ProgramExecutor& program_executor)
+      : connection_(connection), program_(program), program_loader_(program_loader), program_executor_(program_executor) {}
+
+    void on_ping(const uint8_t* data, int length) {
+      connection_.send_ack(0);
+    }
+
+    void on_set_valves(const uint8_t* data, int length) {
+      protocol::ValveCommandView request(data);
+      device.set_valves(request.reagent_valve_id(), request.column_valve_id());
+      connection_.send_ack(0);
+    }
+
+    void on_set_pump(const uint8_t* data, int length) {
+      protocol::PumpCommandView request(data);
+      device.set_pump(PumpCommand{.pump_cmd = request.pump_cmd(), .acceleration = request.acceleration()});
+      connection_.send_ack(0);
+    }
+
+    void on_get_weight(const uint8_t* data, int length) {
+      connection_.send_ack(0);
+    }
+
+    void on_init_program_write(const uint8_t* data, int length) {
+      program_executor_.abort();
+      program_loader_.reset();
+      connection_.send_ack(0);
+    }
+
+    void on_write_program_block(const uint8_t* data, int length) {
+      program_loader_.load_from_buffer(data, length);
+      connection_.send_ack(0);
+    }
+
+    void on_execute_program(const uint8_t* data, int length) {
+      connection_.send_ack(0);
+      program_executor_.execute();
+    }
+
+    void on_read_program_block(const uint8_t* data, int length) {
+      protocol::ProgramBlockRequestView request(data);
+      uint16_t nSteps = request.n_steps();
+      uint8_t buffer[sizeof(ProgramStep) * nSteps];
+      program_.read_block(request.first_step(), nSteps, buffer);
+      connection_.send_data(buffer, sizeof(buffer));
+    }
+
+    void on_get_program_length(const uint8_t* data, int length) {
+      uint8_t buffer[protocol::ProgramLengthWriter::kSize];
+      protocol::ProgramLengthWriter response(buffer);
+      response.set_length(program_.length());
+      response.set_max_length(Program::kMaxLen);
+      connection_.send_data(buffer, sizeof(buffer));
+    }
+
+    void on_get_reagents(const uint8_t* data, int length) {
+      connection_.send_data((uint8_t*)program_.reagents, sizeof(program_.reagents));
+    }
+
+    void on_get_columns(const uint8_t* data, int length) {
+      connection_.send_data((uint8_t*)program_.columns, sizeof(program_.columns));
+    }
+
+    void on_set_reagents(const uint8_t* data, int length) {
+      program_.set_reagents(protocol::ReagentNamesView(data).names());
+      connection_.send_ack(0);
+    }
+
+    void on_set_columns(const uint8_t* data, int length) {
+      program_.set_columns(protocol::ColumnNamesView(data).names());
+      connection_.send_ack(0);
+    }
+
+    void on_abort_program(const uint8_t* data, int length) {
+      program_executor_.abort();
+      connection_.send_ack(0);
+    }
+
+    void on_get_device_state(const uint8_t* data, int length) {
+      connection_.send_data((const uint8_t*)&status_cache.front().state, sizeof(DeviceState));
+    }
+
+    void on_tare_weight_sensor(const uint8_t* data, int length) {
+      // tare weight sensor REMOVED
+      // device.tare_weight_sensor(protocol::TareRequestView(data).channel());
+      connection_.send_ack(0);
+    }
+
+    void on_get_task_diagnostics(const uint8_t* data, int length) {
+      HeapDiagnostics heap;
+      TaskDiagnostics tasks[kDiagTasksPerBlock];
+      int n = system_diagnostics.get(&heap, tasks, protocol::TaskDiagnosticsRequestView(data).first_task(), kDiagTasksPerBlock);
+      uint8_t buffer[sizeof(HeapDiagnostics) + sizeof(tasks)];
+      memcpy(buffer, &heap, sizeof(HeapDiagnostics));
+      memcpy(buffer + sizeof(HeapDiagnostics), tasks, n * sizeof(TaskDiagnostics));
+      connection_.send_data(buffer, sizeof(HeapDiagnostics) + n * sizeof(TaskDiagnostics));
+    }
+
+    void on_get_transition_stats(const uint8_t* data, int length) {
+      TransitionStats stats = device.get_transition_stats();
+      connection_.send_data((uint8_t*)&stats, sizeof(TransitionStats));
+    }
+
+    void on_read_run_log(const uint8_t* data, int length) {
+      RunLogRecord records[kRunLogRecordsPerBlock];
+      int n = run_log.read_records(protocol::RunLogRequestView(data).first_record(), records, kRunLogRecordsPerBlock);
+      connection_.send_data((uint8_t*)records, n * sizeof(RunLogRecord));
+    }
+
+    void on_set_framing(const uint8_t* data, int length) {
+      uint8_t framing = protocol::SetFramingRequestView(data).framing();
+      if (framing != protocol::kFramingStartSequence && framing != protocol::kFramingCobs && framing != protocol::kFramingCobsTagged) {
+        connection_.send_ack(3);
+        return;
+      }
+      connection_.send_ack(0); // still in the old framing, the host switches when it gets it
+      connection_.set_framing(framing);
+    }
+
+    void on_get_command_stats(const uint8_t* data, int length) {
+      uint8_t buffer[protocol::CommandStatsSummaryWriter::kSize + kCommandStatsPerBlock * protocol::CommandStatsRecordWriter::kSize];
+      int n = command_stats.get(protocol::CommandStatsRequestView(data).first_command(), buffer, kCommandStatsPerBlock);
+      connection_.send_data(buffer, n);
+    }
+
+    void on_start_stream(const uint8_t* data, int length) {
+      uint8_t policy = protocol::StreamStartRequestView(data).underrun_policy();
+      if (policy != protocol::kUnderrunHold && policy != protocol::kUnderrunStop) {
+        connection_.send_ack(3);
+        return;
+      }
+      program_executor_.execute_stream(policy);
+      send_stream_status();
+    }
+
+    void on_stream_steps(const uint8_t* data, int length) {
+      uint32_t first_step = protocol::StreamStepsRequestView(data).first_step();
+      int n_steps = (length - (int)protocol::StreamStepsRequestView::kSize) / (int)sizeof(ProgramStep);
+      program_executor_.stream().push(first_step, data + protocol::StreamStepsRequestView::kSize, n_steps);
+      send_stream_status();
+    }
+
+    void on_end_stream(const uint8_t* data, int length) {
+      program_executor_.stream().end();
+      send_stream_status();
+    }
+
+    void on_get_mix_stats(const uint8_t* data, int length) {
+      uint8_t buffer[protocol::MixStatsWriter::kSize];
+      program_executor_.mixer().get_stats(buffer);
+      connection_.send_data(buffer, sizeof(buffer));
+    }
+
+    void on_get_channel_states(const uint8_t* data, int length) {
+      uint8_t buffer[protocol::ChannelStatesSummaryWriter::kSize + kMaxChannels * sizeof(ChannelState)];
+      protocol::ChannelStatesSummaryWriter summary(buffer);
+      summary.clear_padding();
+      summary.set_num_channels(device.num_channels());
+      summary.set_num_pumps(device.num_pumps());
+      summary.set_num_valves(device.num_valves());
+      for (uint8_t i = 0; i < device.num_channels(); i++) {
+        ChannelState state;
+        device.channel(i).get_state(&state);
+        memcpy(buffer + protocol::ChannelStatesSummaryWriter::kSize + i * sizeof(ChannelState), &state, sizeof(ChannelState));
+      }
+      connection_.send_data(buffer, protocol::ChannelStatesSummaryWriter::kSize + device.num_channels() * sizeof(ChannelState));
+    }
+
+    void on_set_channel_valves(const uint8_t* data, int length) {
+      protocol::ChannelValveCommandView request(data);
+      if (request.channel() >= device.num_channels()) {
+        connection_.send_ack(3);
+        return;
+      }
+      device.channel(request.channel()).set_valves(request.reagent_valve_id(), request.column_valve_id());
+      connection_.send_ack(0);
+    }
+
+    void on_set_channel_pump(const uint8_t* data, int length) {
+      protocol::ChannelPumpCommandView request(data);
+      if (request.channel() >= device.num_channels()) {
+        connection_.send_ack(3);
+        return;
+      }
+      device.channel(request.channel()).set_pump(PumpCommand{.pump_cmd = request.pump_cmd(), .acceleration = request.acceleration()});
+      connection_.send_ack(0);
+    }
+
+    void on_get_valve_stats(const uint8_t* data, int length) {
+      protocol::ValveRequestView request(data);
+      if (request.valve() >= device.num_valves()) {
+        connection_.send_ack(3);
+        return;
+      }
+      ValveAxis* valve = device.valve_axis(request.valve());
+      ValveHealth health = valve->get_health();
+      ValveSpeedProfile profile = valve->get_speed_profile();
+      uint8_t buffer[protocol::ValveStatsWriter::kSize];
+      protocol::ValveStatsWriter stats(buffer);
+      stats.set_valve(request.valve());
+      stats.set_autotune_state(valve_autotuner.get_state());
+      stats.set_autotune_valve(valve_autotuner.get_valve());
+      stats.set_autotune_trials(valve_autotuner.get_trials());
+      stats.set_home_passes(health.home_passes);
+      stats.set_drift_events(health.drift_events);
+      stats.set_missed_homes(health.missed_homes);
+      stats.set_last_drift(health.last_drift);
+      stats.set_min_step_time(profile.min_step_time);
+      stats.set_max_step_time(profile.max_step_time);
+      stats.set_smoothness_factor(profile.smoothness_factor);
+      connection_.send_data(buffer, sizeof(buffer));
+    }
+
+    void on_autotune_valve(const uint8_t* data, int length) {
+      protocol::ValveRequestView request(data);
+      if (program_executor_.is_running() || !valve_autotuner.request(device, request.valve())) {
+        connection_.send_ack(3);
+        return;
+      }
+      connection_.send_ack(0);
+    }
+
+    void on_get_step_jitter(const uint8_t* data, int length) {
+      constexpr size_t kRecordSize = protocol::StepJitterRecordWriter::kSize;
+      uint8_t buffer[protocol::StepJitterSummaryWriter::kSize + (kMaxPumps + kMaxValves + 1) * kRecordSize];
+      uint8_t* records = buffer + protocol::StepJitterSummaryWriter::kSize;
+      uint8_t n = 0;
+      for (uint8_t i = 0; i < device.num_pumps(); i++) {
+        write_jitter_record(records + n++ * kRecordSize, protocol::kJitterSourcePump, i, pump_step_jitter[i]);
+      }
+      for (uint8_t i = 0; i < device.num_valves(); i++) {
+        write_jitter_record(records + n++ * kRecordSize, protocol::kJitterSourceValve, i, valve_step_jitter[i]);
+      }
+      write_jitter_record(records + n++ * kRecordSize, protocol::kJitterSourceControl, 0, control_tick_jitter);
+      protocol::StepJitterSummaryWriter summary(buffer);
+      summary.set_num_records(n);
+      summary.set_control_core(kControlCore);
+      summary.set_network_core(kNetworkCore);
+#ifdef LEGACY_CORE_LAYOUT
+      summary.set_step_timer(protocol::kStepTimerEspTimer);
+#else
+      summary.set_step_timer(protocol::kStepTimerHardware);
+#endif
+      summary.set_late_threshold_us(kLateStepUs);
+      connection_.send_data(buffer, protocol::StepJitterSummaryWriter::kSize + n * kRecordSize);
+      if (protocol::StepJitterRequestView(data).reset()) {
+        for (uint8_t i = 0; i < device.num_pumps(); i++) {
+          pump_step_jitter[i].reset();
+        }
+        for (uint8_t i = 0; i < device.num_valves(); i++) {
+          valve_step_jitter[i].reset();
+        }
+        control_tick_jitter.reset();
+      }
+    }
+
+    void on_set_pulsation(const uint8_t* data, int length) {
+      constexpr size_t kBinSize = protocol::PulsationBinView::kSize;
+      protocol::SetPulsationRequestView request(data);
+      int n_bins = (length - (int)protocol::SetPulsationRequestView::kSize) / (int)kBinSize;
+      if (request.pump() >= device.num_pumps() || n_bins != kPulsationBins) {
+        connection_.send_ack(3);
+        return;
+      }
+      int16_t corrections[kPulsationBins];
+      for (uint8_t i = 0; i < kPulsationBins; i++) {
+        protocol::PulsationBinView bin(data + protocol::SetPulsationRequestView::kSize + i * kBinSize);
+        corrections[i] = (int16_t)(int32_t(bin.delay()) - protocol::kPulsationOffset);
+      }
+      if (!device.pump_axis(request.pump())->set_pulsation(corrections, request.phase(), request.enabled())) {
+        connection_.send_ack(3);
+        return;
+      }
+      connection_.send_ack(0);
+    }
+
+    void on_get_pulsation(const uint8_t* data, int length) {
+      constexpr size_t kBinSize = protocol::PulsationBinWriter::kSize;
+      protocol::PulsationRequestView request(data);
+      if (request.pump() >= device.num_pumps()) {
+        connection_.send_ack(3);
+        return;
+      }
+      PumpAxis* pump = device.pump_axis(request.pump());
+      const PulsationCompensation& pulsation = pump->pulsation();
+      uint8_t buffer[protocol::PulsationTableWriter::kSize + kPulsationBins * kBinSize];
+      protocol::PulsationTableWriter table(buffer);
+      table.clear_padding();
+      table.set_pump(request.pump());
+      table.set_enabled(pulsation.enabled());
+      table.set_num_bins(kPulsationBins);
+      table.set_steps_per_revolution(pump->steps_per_revolution());
+      table.set_phase(pulsation.phase());
+      table.set_rotor_position(pump->rotor_position());
+      for (uint8_t i = 0; i < kPulsationBins; i++) {
+        protocol::PulsationBinWriter bin(buffer + protocol::PulsationTableWriter::kSize + i * kBinSize);
+        bin.set_delay(protocol::kPulsationOffset + pulsation.correction(i));
+      }
+      connection_.send_data(buffer, sizeof(buffer));
+    }
+
+  private:
+    SerialConnection& connection_;
+    Program& program_;
+    ProgramLoader& program_loader_;
+    ProgramExecutor& program_executor_;
+
+    static void write_jitter_record(uint8_t* buffer, uint8_t source, uint8_t axis, const StepJitter& jitter) {
+      protocol::StepJitterRecordWriter record(buffer);
+      record.clear_padding();
+      record.set_source(source);
+      record.set_axis(axis);
+      record.set_core(jitter.core());
+      record.set_samples(jitter.samples());
+      record.set_mean_us(jitter.mean_us());
+      record.set_max_us(jitter.max_us());
+      record.set_late(jitter.late());
+    }
+
+    void send_stream_status() {
+      uint8_t buffer[protocol::StreamStatusWriter::kSize];
+      program_executor_.stream().get_status(buffer);
+      connection_.send_data(buffer, sizeof(buffer));
+    }
+};
+
 void handle_communication(SerialConnection& connection, Program& program, ProgramLoader& program_loader, ProgramExecutor& program_executor) {
     uint8_t* data_ptr = nullptr;
     int data_length = 0;
@@ -157,83 +633,18 @@ void handle_communication(SerialConnection& connection, Program& program, Progra
     if (result) {
         command_t command;
         parse_command(data_ptr, data_length, &command);
-        if (command.command_id == 0) {
-            // ping
-            connection.send_ack(0);
-        } else if (command.command_id == 1) {
-            // set valves
-            uint8_t reagent_valve_id = command.data[0];
-            uint8_t column_valve_id = command.data[1];
-            device.set_valves(reagent_valve_id, column_valve_id);
-            connection.send_ack(0);
-        } else if (command.command_id == 2) {
-            // set pump
-            PumpCommand pump_cmd;
-            memcpy(&pump_cmd, command.data, sizeof(PumpCommand));
-            device.set_pump(pump_cmd);
-            connection.send_ack(0);
-        } else if (command.command_id == 3) {
-            // get weight
-            connection.send_ack(0);
-        } else if (command.command_id == 4) {
-            // init program write
-            program_executor.abort();
-            program_loader.reset();
-            connection.send_ack(0);
-        } else if (command.command_id == 5) {
-            // write program block
-            program_loader.load_from_buffer(command.data, command.data_length);
-            connection.send_ack(0);
-        } else if (command.command_id == 6) {
-            // execute program
-            connection.send_ack(0);
-            program_executor.execute();
-        } else if (command.command_id == 13) {
-            // abort program execution
-            program_executor.abort();
-            connection.send_ack(0);
-        } else if (command.command_id == 7) {
-            // read program block
-            uint16_t block_idx = (command.data[0] << 8) | command.data[1];
-            uint16_t nSteps = (command.data[2] << 8) | command.data[3];
-            uint8_t buffer[sizeof(ProgramStep) * nSteps];
-            program.read_block(block_idx, nSteps, buffer);
-            connection.send_data(buffer, sizeof(buffer));
-        } else if (command.command_id == 8) {
-            // get program length
-            uint16_t length = program.length();
-            uint8_t buffer[4] = {0};
-            buffer[0] = length >> 8;
-            buffer[1] = length & 0xff;
-            buffer[2] = Program::kMaxLen >> 8;
-            buffer[3] = Program::kMaxLen & 0xff;
-            connection.send_data(buffer, sizeof(buffer));
-        } else if (command.command_id == 9) {
-            // get reagents
-            connection.send_data((uint8_t*)program.reagents, sizeof(program.reagents));
-        } else if (command.command_id == 10) {
-            // get columns
-            connection.send_data((uint8_t*)program.columns, sizeof(program.columns));
-        } else if (command.command_id == 11) {
-            // set reagents
-            program.set_reagents(command.data);
-            connection.send_ack(0);
-        } else if (command.command_id == 12) {
-            // set columns
-            program.set_columns(command.data);
-            connection.send_ack(0);
-        } else if (command.command_id == 14) {
-            // get device state
-            connection.send_data((uint8_t*)&device.device_state, sizeof(DeviceState));
-        } else if (command.command_id == 15) {
-            // tare weight sensor REMOVED
-            // uint8_t channel = command.data[0];
-            // device.tare_weight_sensor(channel);
-            connection.send_ack(0);
-        } else {
-            // unknown command
+        CommandHandlers handlers(connection, program, program_loader, program_executor);
+        int64_t start_us = esp_timer_get_time();
+        protocol::DispatchResult dispatch = protocol::dispatch_command(handlers, command.command_id, command.data, command.data_length);
+        if (dispatch == protocol::DISPATCH_UNKNOWN_COMMAND) {
+            command_stats.record_unknown();
             connection.send_ack(1);
+            return;
+        }
+        if (dispatch == protocol::DISPATCH_SHORT_REQUEST) {
+            connection.send_ack(2);
         }
+        command_stats.record(command.command_id, esp_timer_get_time() - start_us, dispatch != protocol::DISPATCH_OK);
     } else {
 
     }
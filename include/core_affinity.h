@@ -0,0 +1,33 @@
+#ifndef CORE_AFFINITY_H
+#define CORE_AFFINITY_H
+
+#include <Arduino.h>
+
+/*
+Which core does what. The Arduino core runs the Wi-Fi driver, the LwIP
+tcpip task and the esp_timer task on core 0 (PRO_CPU), and none of them can
+be moved without rebuilding the framework. So the real-time path goes to
+core 1 (APP_CPU):
+
+- core 1: step timer interrupts (see step_timer.h: their ISRs are allocated
+  on the core that arms them, the control task), the control loop and the
+  I/O expander task, which drives valve lines. The step ISRs are integer
+  only (no FPU in an ISR) and in IRAM, so flash writes from core 0 don't
+  hold them off while the flash cache is disabled.
+- core 0: everything that may block on the network or on flash: AsyncTCP
+  and the web handlers (CONFIG_ASYNC_TCP_RUNNING_CORE in platformio.ini),
+  serial command handling, the run log and NVS writes, diagnostics.
+
+LEGACY_CORE_LAYOUT (env esp32dev_legacy_cores) restores the previous layout,
+control loop on core 0 with the steps dispatched by the esp_timer task, to
+measure the step jitter of both with bench/jitter_bench.py.
+*/
+#ifdef LEGACY_CORE_LAYOUT
+constexpr BaseType_t kControlCore = 0;
+constexpr BaseType_t kNetworkCore = 1;
+#else
+constexpr BaseType_t kControlCore = 1;
+constexpr BaseType_t kNetworkCore = 0;
+#endif
+
+#endif // CORE_AFFINITY_H
@@ -26,20 +26,98 @@ struct DeviceState {
     uint8_t column_valve_state;     // 0: idle, 1: homing, 2: stopped, 3: moving
     uint8_t running;                // 0: stopped, 1: running
     uint8_t program_step_progress;  // 0-255
-    uint8_t padding[3];             // 3 bytes for future use
+    uint8_t num_pumps;
+    uint8_t num_valves;
+    uint8_t padding;                // 1 byte for future use
 };
 
+// State of one channel (a pump with its reagent and column valve)
+struct ChannelState {
+    float pump_speed;
+    float pump_volume;
+    uint8_t device_state;           // as DeviceState::device_state
+    uint8_t reagent_valve_position;
+    uint8_t reagent_valve_state;
+    uint8_t column_valve_position;
+    uint8_t column_valve_state;
+    uint8_t pump;                   // axis indices from DeviceConfig
+    uint8_t reagent_valve;
+    uint8_t column_valve;
+};
+
+// Which actuators may move at the same time during a valve change. By default
+// the pump is stopped completely before any valve moves. A valve with a non-zero
+// overlap speed may start moving while the pump is still decelerating, once
+// |pump speed| has dropped to that value (mL/min), but only if the reagent
+// currently being pumped is marked as fed from a low-pressure reservoir.
+struct InterlockConfig {
+  float reagent_valve_overlap_speed; // mL/min, 0: wait for the pump to stop
+  float column_valve_overlap_speed;  // mL/min, 0: wait for the pump to stop
+  uint8_t low_pressure_reagents;     // bit i set: reagent port i is fed from a low-pressure reservoir
+};
+
+// Timing of the last valve change (stop pump, move valves, resume), measured in the control loop
+struct TransitionStats {
+  uint32_t last_transition_ms;  // from the valve change request until pumping resumed
+  uint32_t last_overlap_ms;     // time the first valve moved before the pump stopped (saved time)
+  uint32_t total_overlap_ms;
+  uint32_t transitions;
+};
+
+constexpr uint8_t kMaxPumps = 2;
+constexpr uint8_t kMaxValves = 2 * kMaxPumps;
+constexpr uint8_t kMaxChannels = kMaxPumps;
+
+// A fluid path: one pump drawing through a reagent valve and delivering through a column valve.
+// Channels are independent, each stops only its own pump for its own valve changes.
+struct ChannelConfig {
+  uint8_t pump;          // index into DeviceConfig::pumps
+  uint8_t reagent_valve; // index into DeviceConfig::valves
+  uint8_t column_valve;  // index into DeviceConfig::valves
+  InterlockConfig interlock;
+};
+
+// The axes are PumpControl / RadialValveControl objects specialised on their
+// constexpr configs below, listed here by index. Channel 0 runs the program.
 struct DeviceConfig {
-  PumpControlConfig pump_config;
-  RadialValveControlConfig reagent_valve_config;
-  RadialValveControlConfig column_valve_config;
+  PumpAxis* pumps[kMaxPumps];
+  ValveAxis* valves[kMaxValves];
+  ChannelConfig channels[kMaxChannels];
+  uint8_t num_pumps;
+  uint8_t num_valves;
+  uint8_t num_channels;
 };
 
+#ifdef IO_EXPANDER
+// Valve enable and limit switch lines on the MCP23017 (mcp23017.h). This frees
+// GPIOs 15, 4 and 2 for the weight sensor data lines (see weight_sensor.h).
+#ifdef PARALLEL_STRIPPER
+#error "PARALLEL_STRIPPER drives pump 1 on the I2C pins 21 and 22"
+#endif
+constexpr uint8_t kReagentValveEnablePin = expander_pin(0);  // GPA0
+constexpr uint8_t kColumnValveEnablePin = expander_pin(1);   // GPA1
+constexpr uint8_t kReagentValveLimitPin = expander_pin(8);   // GPB0
+constexpr uint8_t kColumnValveLimitPin = expander_pin(9);    // GPB1
+constexpr uint8_t kExpanderSdaPin = 21;
+constexpr uint8_t kExpanderSclPin = 22;
+constexpr uint8_t kExpanderIntPin = 36;  // INTA/INTB, open drain with an external pull-up
+#elif defined(PARALLEL_STRIPPER)
+constexpr uint8_t kReagentValveEnablePin = 14;
+constexpr uint8_t kColumnValveEnablePin = 4;
+constexpr uint8_t kReagentValveLimitPin = 39; // input only, external pull-up; GPIO15 steps channel 1's reagent valve
+constexpr uint8_t kColumnValveLimitPin = 2;
+#else
+constexpr uint8_t kReagentValveEnablePin = 14;
+constexpr uint8_t kColumnValveEnablePin = 4;
+constexpr uint8_t kReagentValveLimitPin = 15;
+constexpr uint8_t kColumnValveLimitPin = 2;
+#endif
+
 constexpr RadialValveControlConfig reagent_valve_config{
-  .enable_pin = 14,
+  .enable_pin = kReagentValveEnablePin,
   .direction_pin = 26,
   .step_pin = 27,
-  .limit_switch_pin = 15,
+  .limit_switch_pin = kReagentValveLimitPin,
   .steps_per_revolution = 200 * 8,
   .invert_direction = true,
   .home_offset = 365,
@@ -47,10 +125,10 @@ constexpr RadialValveControlConfig reagent_valve_config{
 };
 
 constexpr RadialValveControlConfig column_valve_config{
-  .enable_pin = 4,
+  .enable_pin = kColumnValveEnablePin,
   .direction_pin = 17,
   .step_pin = 16,
-  .limit_switch_pin = 2,
+  .limit_switch_pin = kColumnValveLimitPin,
   .steps_per_revolution = 200 * 8,
   .invert_direction = true,
   .home_offset = 365,
@@ -63,35 +141,147 @@ constexpr PumpControlConfig pump_config{
   .step_pin = 33,
   .dt = 0.01,
   .invert_direction = true,
+  .steps_per_revolution = 200 * 8, // 1.8 deg motor at 8 microsteps, as the valves (to be checked on the pump driver)
   .volume_per_step = 0.0752192, // uL / step (approximate value, need to be calibrated)
+  .direction_setup_us = 5,
 };
 
+constexpr InterlockConfig interlock_config{
+  .reagent_valve_overlap_speed = 0,
+  .column_valve_overlap_speed = 1.0,
+  .low_pressure_reagents = 0, // no reagent is marked low-pressure yet, so valve changes stay strictly sequential
+};
+
+static PumpControl<pump_config> pump_0;
+static RadialValveControl<reagent_valve_config> reagent_valve_0;
+static RadialValveControl<column_valve_config> column_valve_0;
+
+#ifdef PARALLEL_STRIPPER
+/*
+Second pump and valve pair, processing another column set at the same time.
+Two channels need more outputs than the ESP32 has non-strapping GPIOs, so the
+strapping pins 5 and 15 only carry step lines: at boot every enable line is
+on a plain GPIO and keeps its driver disabled, so a stray level on a step line
+moves nothing. GPIO12 (flash voltage) and GPIO0 stay unused. Its limit
+switches are on the input-only GPIOs 34 and 35, which have no internal
+pull-up: like GPIO39 they need an external one.
+
+These lines overlap the HX711 map in weight_sensor.h (clock 23, data 18, 19
+and 5), as the default layout's valve lines overlap its other data lines. The
+steppers win: this firmware creates no WeightSensor (GET_WEIGHT only acks),
+and a weight sensor needs the IO_EXPANDER layout, which excludes this one.
+*/
+constexpr RadialValveControlConfig reagent_valve_1_config{
+  .enable_pin = 18,
+  .direction_pin = 19, // shared with column_valve_1_config: the valves only turn one way
+  .step_pin = 15,
+  .limit_switch_pin = 34, // input only, external pull-up
+  .steps_per_revolution = 200 * 8,
+  .invert_direction = true,
+  .home_offset = 365,
+  .position_mapping = {0, 5, 4, 3, 2, 1},
+};
+
+constexpr RadialValveControlConfig column_valve_1_config{
+  .enable_pin = 23,
+  .direction_pin = 19,
+  .step_pin = 5,
+  .limit_switch_pin = 35, // input only, external pull-up
+  .steps_per_revolution = 200 * 8,
+  .invert_direction = true,
+  .home_offset = 365,
+  .position_mapping = {3, 2, 1, 0, 5, 4},
+};
+
+constexpr PumpControlConfig pump_1_config{
+  .enable_pin = 13,
+  .direction_pin = 22,
+  .step_pin = 21,
+  .dt = 0.01,
+  .invert_direction = true,
+  .steps_per_revolution = 200 * 8,
+  .volume_per_step = 0.0752192,
+  .direction_setup_us = 5,
+};
+
+static PumpControl<pump_1_config> pump_1;
+static RadialValveControl<reagent_valve_1_config> reagent_valve_1;
+static RadialValveControl<column_valve_1_config> column_valve_1;
+
+constexpr DeviceConfig device_config{
+  .pumps = {&pump_0, &pump_1},
+  .valves = {&reagent_valve_0, &column_valve_0, &reagent_valve_1, &column_valve_1},
+  .channels = {
+    {.pump = 0, .reagent_valve = 0, .column_valve = 1, .interlock = interlock_config},
+    {.pump = 1, .reagent_valve = 2, .column_valve = 3, .interlock = interlock_config},
+  },
+  .num_pumps = 2,
+  .num_valves = 4,
+  .num_channels = 2,
+};
+#else
 constexpr DeviceConfig device_config{
-  .pump_config = pump_config,
-  .reagent_valve_config = reagent_valve_config,
-  .column_valve_config = column_valve_config,
+  .pumps = {&pump_0},
+  .valves = {&reagent_valve_0, &column_valve_0},
+  .channels = {
+    {.pump = 0, .reagent_valve = 0, .column_valve = 1, .interlock = interlock_config},
+  },
+  .num_pumps = 1,
+  .num_valves = 2,
+  .num_channels = 1,
 };
+#endif
 
+// Step timer entry points (main.cpp): dispatched on the axis index to the named
+// axes, so the ISR calls the final classes directly, not through PumpAxis /
+// ValveAxis, and their constexpr pins stay immediates. Unused in translation
+// units other than main.cpp (the host benchmarks).
+static_assert(device_config.pumps[0] == &pump_0 && device_config.valves[0] == &reagent_valve_0 &&
+              device_config.valves[1] == &column_valve_0, "step dispatch does not match device_config");
+#ifdef PARALLEL_STRIPPER
+static_assert(device_config.pumps[1] == &pump_1 && device_config.valves[2] == &reagent_valve_1 &&
+              device_config.valves[3] == &column_valve_1, "step dispatch does not match device_config");
+#endif
 
-class Device {
-  public:
-    DeviceState device_state;
+[[maybe_unused]] static uint32_t IRAM_ATTR step_pump_axis(uint8_t axis) {
+#ifdef PARALLEL_STRIPPER
+  if (axis == 1) {
+    return pump_1.step();
+  }
+#endif
+  return pump_0.step();
+}
 
-    Device(DeviceConfig config) : 
-      config_(config),
-      pump(config.pump_config),
-      reagent_valve(config.reagent_valve_config),
-      column_valve(config.column_valve_config) {}
+[[maybe_unused]] static uint32_t IRAM_ATTR update_valve_axis(uint8_t axis) {
+  switch (axis) {
+#ifdef PARALLEL_STRIPPER
+    case 2: return reagent_valve_1.update();
+    case 3: return column_valve_1.update();
+#endif
+    case 1: return column_valve_0.update();
+    default: return reagent_valve_0.update();
+  }
+}
 
-    void initialize() {
-      pump.initialize();
-      reagent_valve.initialize();
-      column_valve.initialize();
+
+// Valve change sequencing of one channel: the pump is stopped (or slowed down,
+// see InterlockConfig) before its valves move and resumes once they are in place.
+class DeviceChannel {
+  public:
+    void configure(const DeviceConfig& config, uint8_t index) {
+      config_ = config.channels[index];
+      pump_ = config.pumps[config_.pump];
+      reagent_valve_ = config.valves[config_.reagent_valve];
+      column_valve_ = config.valves[config_.column_valve];
     }
 
     void set_valves(uint8_t reagent_valve_id, uint8_t column_valve_id) {
       reagent_valve_id_ = reagent_valve_id;
       column_valve_id_ = column_valve_id;
+      reagent_valve_started_ = false;
+      column_valve_started_ = false;
+      feeding_reagent_ = reagent_valve_->get_position();
+      transition_start_ms_ = millis();
       fsm_state_ = DEVICE_STATE_STOPPING;
     }
 
@@ -100,43 +290,229 @@ class Device {
     }
 
     void update() {
-      device_state.pump_speed = pump.get_current_speed();
-      device_state.pump_volume = pump.get_volume();
-      device_state.reagent_valve_position = reagent_valve.get_position();
-      device_state.reagent_valve_state = reagent_valve.get_state();
-      device_state.column_valve_position = column_valve.get_position();
-      device_state.column_valve_state = column_valve.get_state();
-      device_state.device_state = fsm_state_;
       switch (fsm_state_) {
         case DEVICE_STATE_PUMPING:
-          pump.set_pump(pump_cmd_);
+          pump_->set_pump(pump_cmd_);
           break;
-        case DEVICE_STATE_STOPPING:
-          pump.set_pump(PumpCommand{.pump_cmd = 0, .acceleration = 10.0});
-          if (pump.is_stopped()) {
+        case DEVICE_STATE_STOPPING: {
+          // One timestamp per tick, so a valve started in the same tick as the pump stop overlaps it by 0 ms
+          uint32_t now = millis();
+          pump_->set_pump(PumpCommand{.pump_cmd = 0, .acceleration = kValveChangeDeceleration});
+          start_valves_within_interlock(now);
+          if (pump_->is_stopped()) {
+            pump_stopped_ms_ = now;
+            start_valves(now);
             fsm_state_ = DEVICE_STATE_SETTING_VALVES;
-            reagent_valve.set_position(reagent_valve_id_);
-            column_valve.set_position(column_valve_id_);
           }
           break;
+        }
         case DEVICE_STATE_SETTING_VALVES:
-          if (reagent_valve.reached_target() && column_valve.reached_target()) {
+          if (reagent_valve_->reached_target() && column_valve_->reached_target()) {
+            finish_transition();
             fsm_state_ = DEVICE_STATE_PUMPING;
           }
           break;
       }
     }
 
-    PumpControl pump;
-    RadialValveControl reagent_valve;
-    RadialValveControl column_valve;
+    void get_state(ChannelState* state) {
+      state->pump_speed = pump_->get_current_speed();
+      state->pump_volume = pump_->get_volume();
+      state->device_state = fsm_state_;
+      state->reagent_valve_position = reagent_valve_->get_position();
+      state->reagent_valve_state = reagent_valve_->get_state();
+      state->column_valve_position = column_valve_->get_position();
+      state->column_valve_state = column_valve_->get_state();
+      state->pump = config_.pump;
+      state->reagent_valve = config_.reagent_valve;
+      state->column_valve = config_.column_valve;
+    }
+
+    PumpAxis& pump() { return *pump_; }
+    ValveAxis& reagent_valve() { return *reagent_valve_; }
+    ValveAxis& column_valve() { return *column_valve_; }
+
+    TransitionStats get_transition_stats() {
+      return transition_stats_;
+    }
+
+    bool is_pumping() const {
+      return fsm_state_ == DEVICE_STATE_PUMPING;
+    }
+
+    // Reagent port the pump draws from: during a valve change, the one it was drawing from before
+    uint8_t feeding_reagent() {
+      return fsm_state_ == DEVICE_STATE_PUMPING ? reagent_valve_->get_position() : feeding_reagent_;
+    }
+
+    // Pump steps still taken if a valve change started now, while decelerating from the current speed
+    uint32_t stopping_steps() const {
+      float speed = fabs(pump_->get_current_speed());
+      float volume_ul = speed * speed / (120.0f * kValveChangeDeceleration) * 1000.0f;
+      return volume_ul / pump_->volume_per_step();
+    }
 
   private:
-    DeviceConfig config_;
-    PumpCommand pump_cmd_;
+    ChannelConfig config_;
+    PumpAxis* pump_ = nullptr;
+    ValveAxis* reagent_valve_ = nullptr;
+    ValveAxis* column_valve_ = nullptr;
+    PumpCommand pump_cmd_ = {0, 0};
     uint8_t reagent_valve_id_;
     uint8_t column_valve_id_;
     uint8_t fsm_state_ = DEVICE_STATE_PUMPING;
+    bool reagent_valve_started_ = false;
+    bool column_valve_started_ = false;
+    uint8_t feeding_reagent_ = 255;  // reagent port the pump draws from while decelerating
+    uint32_t transition_start_ms_ = 0;
+    uint32_t first_valve_start_ms_ = 0;
+    uint32_t pump_stopped_ms_ = 0;
+    TransitionStats transition_stats_ = {0};
+
+    // Starts the valves the interlock model allows to move while the pump is still decelerating
+    void start_valves_within_interlock(uint32_t now) {
+      if (feeding_reagent_ >= kNumValvePorts || !(config_.interlock.low_pressure_reagents & (1 << feeding_reagent_))) {
+        return;
+      }
+      float speed = fabs(pump_->get_current_speed());
+      if (!reagent_valve_started_ && speed <= config_.interlock.reagent_valve_overlap_speed) {
+        start_reagent_valve(now);
+      }
+      if (!column_valve_started_ && speed <= config_.interlock.column_valve_overlap_speed) {
+        start_column_valve(now);
+      }
+    }
+
+    void start_valves(uint32_t now) {
+      if (!reagent_valve_started_) {
+        start_reagent_valve(now);
+      }
+      if (!column_valve_started_) {
+        start_column_valve(now);
+      }
+    }
+
+    void start_reagent_valve(uint32_t now) {
+      mark_valve_start(now);
+      reagent_valve_->set_position(reagent_valve_id_);
+      reagent_valve_started_ = true;
+    }
+
+    void start_column_valve(uint32_t now) {
+      mark_valve_start(now);
+      column_valve_->set_position(column_valve_id_);
+      column_valve_started_ = true;
+    }
+
+    void mark_valve_start(uint32_t now) {
+      if (!reagent_valve_started_ && !column_valve_started_) {
+        first_valve_start_ms_ = now;
+      }
+    }
+
+    void finish_transition() {
+      uint32_t now = millis();
+      // Time saved is how long the first valve was already moving when the pump came to a stop
+      uint32_t overlap = pump_stopped_ms_ - first_valve_start_ms_;
+      transition_stats_.last_transition_ms = now - transition_start_ms_;
+      transition_stats_.last_overlap_ms = overlap;
+      transition_stats_.total_overlap_ms += overlap;
+      transition_stats_.transitions++;
+    }
+};
+
+
+class Device {
+  public:
+    DeviceState device_state;
+
+    Device(const DeviceConfig& config)
+      : pump(*config.pumps[config.channels[0].pump]),
+        reagent_valve(*config.valves[config.channels[0].reagent_valve]),
+        column_valve(*config.valves[config.channels[0].column_valve]),
+        config_(config) {
+      for (uint8_t i = 0; i < config_.num_channels; i++) {
+        channels_[i].configure(config_, i);
+      }
+    }
+
+    void initialize() {
+      for (uint8_t i = 0; i < config_.num_pumps; i++) {
+        config_.pumps[i]->initialize();
+      }
+      for (uint8_t i = 0; i < config_.num_valves; i++) {
+        config_.valves[i]->initialize();
+      }
+    }
+
+    // Channel 0, the one the program runs on
+    void set_valves(uint8_t reagent_valve_id, uint8_t column_valve_id) {
+      channels_[0].set_valves(reagent_valve_id, column_valve_id);
+    }
+
+    void set_pump(PumpCommand pump_cmd) {
+      channels_[0].set_pump(pump_cmd);
+    }
+
+    // Speed ramps of all pumps, once per control loop period before update()
+    void update_speed() {
+      for (uint8_t i = 0; i < config_.num_pumps; i++) {
+        config_.pumps[i]->update_speed();
+      }
+    }
+
+    void update() {
+      for (uint8_t i = 0; i < config_.num_channels; i++) {
+        channels_[i].update();
+      }
+      ChannelState state;
+      channels_[0].get_state(&state);
+      device_state.pump_speed = state.pump_speed;
+      device_state.pump_volume = state.pump_volume;
+      device_state.reagent_valve_position = state.reagent_valve_position;
+      device_state.reagent_valve_state = state.reagent_valve_state;
+      device_state.column_valve_position = state.column_valve_position;
+      device_state.column_valve_state = state.column_valve_state;
+      device_state.device_state = state.device_state;
+      device_state.num_pumps = config_.num_pumps;
+      device_state.num_valves = config_.num_valves;
+    }
+
+    DeviceChannel& channel(uint8_t index) {
+      return channels_[index];
+    }
+
+    uint8_t num_channels() const { return config_.num_channels; }
+    uint8_t num_pumps() const { return config_.num_pumps; }
+    uint8_t num_valves() const { return config_.num_valves; }
+
+    PumpAxis* pump_axis(uint8_t index) { return config_.pumps[index]; }
+    ValveAxis* valve_axis(uint8_t index) { return config_.valves[index]; }
+
+    // Axes of channel 0
+    PumpAxis& pump;
+    ValveAxis& reagent_valve;
+    ValveAxis& column_valve;
+
+    TransitionStats get_transition_stats() {
+      return channels_[0].get_transition_stats();
+    }
+
+    bool is_pumping() const {
+      return channels_[0].is_pumping();
+    }
+
+    uint8_t feeding_reagent() {
+      return channels_[0].feeding_reagent();
+    }
+
+    uint32_t stopping_steps() const {
+      return channels_[0].stopping_steps();
+    }
+
+  private:
+    DeviceConfig config_;
+    DeviceChannel channels_[kMaxChannels];
 };
 
 static Device device(device_config);
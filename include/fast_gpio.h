@@ -0,0 +1,70 @@
+#ifndef FAST_GPIO_H
+#define FAST_GPIO_H
+
+#include <Arduino.h>
+#include "mcp23017.h"
+#ifdef ARDUINO_ARCH_ESP32
+#include "soc/gpio_struct.h"
+#endif
+
+/*
+Pin access with the pin number as a template parameter, for use in the step
+timer callbacks. On the ESP32 the pin mask and the register (pins 0-31 vs 32-39)
+are resolved at compile time, so a write is a single store to the W1TS/W1TC
+register instead of a call through digitalWrite(). Elsewhere (host benchmarks)
+it falls back to the Arduino API. Pins from kExpanderPinBase on are lines of
+the I/O expander and go to its register shadows (see mcp23017.h).
+*/
+
+template <uint8_t Pin>
+inline void fast_pin_mode(uint8_t mode) {
+  if constexpr (Pin >= kExpanderPinBase) {
+    io_expander.pin_mode(Pin - kExpanderPinBase, mode);
+  } else {
+    pinMode(Pin, mode);
+  }
+}
+
+template <uint8_t Pin>
+inline void IRAM_ATTR fast_digital_write(uint8_t value) {
+  if constexpr (Pin >= kExpanderPinBase) {
+    io_expander.write(Pin - kExpanderPinBase, value);
+  } else {
+#ifdef ARDUINO_ARCH_ESP32
+    if (Pin < 32) {
+      if (value) {
+        GPIO.out_w1ts = (1UL << (Pin & 31));
+      } else {
+        GPIO.out_w1tc = (1UL << (Pin & 31));
+      }
+    } else {
+      if (value) {
+        GPIO.out1_w1ts.val = (1UL << (Pin & 31));
+      } else {
+        GPIO.out1_w1tc.val = (1UL << (Pin & 31));
+      }
+    }
+#else
+    digitalWrite(Pin, value);
+#endif
+  }
+}
+
+template <uint8_t Pin>
+inline int IRAM_ATTR fast_digital_read() {
+  if constexpr (Pin >= kExpanderPinBase) {
+    return io_expander.read(Pin - kExpanderPinBase);
+  } else {
+#ifdef ARDUINO_ARCH_ESP32
+    if (Pin < 32) {
+      return (GPIO.in >> (Pin & 31)) & 0x1;
+    } else {
+      return (GPIO.in1.val >> (Pin & 31)) & 0x1;
+    }
+#else
+    return digitalRead(Pin);
+#endif
+  }
+}
+
+#endif // FAST_GPIO_H
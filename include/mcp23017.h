@@ -0,0 +1,196 @@
+#ifndef MCP23017_H
+#define MCP23017_H
+
+#include <Arduino.h>
+#include <Wire.h>
+
+/*
+MCP23017 16-bit I/O expander for lines that are not timing critical (valve
+enable, limit switches, sensors). All registers are shadowed, so:
+
+- write() only changes the shadow output latch. It is cheap enough for the
+  step timer callbacks; flush() then sends both OLAT bytes in one I2C burst,
+  and only if something changed.
+- read() returns the cached inputs. The expander's INTA/INTB (mirrored, open
+  drain, active low) signal an input change; the pin ISR calls on_interrupt()
+  and service() reads INTF, INTCAP and GPIO in one burst, which also clears
+  the interrupt.
+
+flush() and service() talk to the bus and run in a task (see main.cpp), never
+in the control loop or a timer callback.
+*/
+
+constexpr uint8_t kExpanderPinBase = 64; // pin numbers from here on are expander pins (GPA0-7, GPB0-7)
+constexpr uint8_t kExpanderAddress = 0x20;
+
+constexpr uint8_t expander_pin(uint8_t line) {
+  return kExpanderPinBase + line;
+}
+
+struct ExpanderStats {
+  uint32_t transactions;  // I2C transfers since begin()
+  uint32_t flushes;       // output bursts
+  uint32_t interrupts;    // input change interrupts serviced
+  uint32_t read_errors;   // failed input reads, retried at the next service()
+};
+
+class Mcp23017 {
+  public:
+    // Registers with IOCON.BANK = 0, A and B of each pair at consecutive addresses
+    static constexpr uint8_t kRegIodir = 0x00;
+    static constexpr uint8_t kRegIocon = 0x0A;
+    static constexpr uint8_t kRegGppu = 0x0C;
+    static constexpr uint8_t kRegIntf = 0x0E;
+    static constexpr uint8_t kRegGpio = 0x12;
+    static constexpr uint8_t kRegOlat = 0x14;
+    static constexpr uint8_t kIoconMirror = 0x40; // INTA and INTB both signal changes on either port
+    static constexpr uint8_t kIoconOdr = 0x04;    // open drain INT outputs, so they can share one pulled-up line
+
+    bool begin(TwoWire& wire, uint8_t address = kExpanderAddress) {
+      wire_ = &wire;
+      address_ = address;
+      uint8_t iocon = kIoconMirror | kIoconOdr;
+      if (!write_registers(kRegIocon, &iocon, 1)) {
+        wire_ = nullptr;
+        return false;
+      }
+      write_config();
+      written_olat_ = ~olat_; // force the first flush
+      flush();
+      if (!read_inputs()) {
+        interrupt_pending_ = true; // INT may already be asserted and would never fall again
+      }
+      return true;
+    }
+
+    // Lines are outputs or inputs; inputs raise the change interrupt
+    void pin_mode(uint8_t line, uint8_t mode) {
+      uint16_t bit = 1u << line;
+      if (mode == OUTPUT) {
+        iodir_ &= ~bit;
+        gpinten_ &= ~bit;
+      } else {
+        iodir_ |= bit;
+        gpinten_ |= bit;
+      }
+      gppu_ = mode == INPUT_PULLUP ? gppu_ | bit : gppu_ & ~bit;
+      if (wire_) {
+        flush(); // a line written before it became an output starts at that level
+        write_config();
+      }
+    }
+
+    void IRAM_ATTR write(uint8_t line, uint8_t value) {
+      portENTER_CRITICAL(&mux_);
+      olat_ = value ? olat_ | (1u << line) : olat_ & ~(1u << line);
+      portEXIT_CRITICAL(&mux_);
+    }
+
+    // Output lines read back their latch, input lines the state of the last service()
+    int IRAM_ATTR read(uint8_t line) const {
+      uint16_t bit = 1u << line;
+      return ((iodir_ & bit ? inputs_ : olat_) & bit) ? HIGH : LOW;
+    }
+
+    // Sends pending output changes; returns true if the bus was used
+    bool flush() {
+      portENTER_CRITICAL(&mux_);
+      uint16_t olat = olat_;
+      portEXIT_CRITICAL(&mux_);
+      if (!wire_ || olat == written_olat_) {
+        return false;
+      }
+      uint8_t data[2] = {uint8_t(olat), uint8_t(olat >> 8)};
+      if (write_registers(kRegOlat, data, 2)) {
+        written_olat_ = olat;
+        stats_.flushes++;
+      }
+      return true;
+    }
+
+    // For the INTA/INTB pin ISR
+    void IRAM_ATTR on_interrupt() {
+      interrupt_pending_ = true;
+    }
+
+    bool interrupt_pending() const {
+      return interrupt_pending_;
+    }
+
+    // Reads the inputs after an input change interrupt; returns true if the bus was used. A failed read
+    // leaves INT asserted, so no further edge would come: the interrupt stays pending and is retried.
+    bool service() {
+      if (!wire_ || !interrupt_pending_) {
+        return false;
+      }
+      interrupt_pending_ = false;
+      if (read_inputs()) {
+        stats_.interrupts++;
+      } else {
+        interrupt_pending_ = true;
+        stats_.read_errors++;
+      }
+      return true;
+    }
+
+    ExpanderStats get_stats() const {
+      return stats_;
+    }
+
+  private:
+    TwoWire* wire_ = nullptr;
+    uint8_t address_ = kExpanderAddress;
+    uint16_t iodir_ = 0xffff; // power-on state: all inputs
+    uint16_t gpinten_ = 0;
+    uint16_t gppu_ = 0;
+    volatile uint16_t olat_ = 0;
+    uint16_t written_olat_ = 0;
+    volatile uint16_t inputs_ = 0;
+    volatile bool interrupt_pending_ = false;
+    ExpanderStats stats_ = {0};
+    portMUX_TYPE mux_ = portMUX_INITIALIZER_UNLOCKED;
+
+    // IODIR, IPOL, GPINTEN, DEFVAL and INTCON (compare with the previous value) in one burst, then GPPU
+    void write_config() {
+      uint8_t config[10] = {uint8_t(iodir_), uint8_t(iodir_ >> 8), 0, 0,
+                            uint8_t(gpinten_), uint8_t(gpinten_ >> 8), 0, 0, 0, 0};
+      write_registers(kRegIodir, config, sizeof(config));
+      uint8_t pullups[2] = {uint8_t(gppu_), uint8_t(gppu_ >> 8)};
+      write_registers(kRegGppu, pullups, sizeof(pullups));
+    }
+
+    // INTF, INTCAP and GPIO in one burst. GPIO is the current state; reading it clears the interrupt.
+    bool read_inputs() {
+      uint8_t data[6];
+      if (!read_registers(kRegIntf, data, sizeof(data))) {
+        return false;
+      }
+      inputs_ = data[4] | data[5] << 8;
+      return true;
+    }
+
+    bool write_registers(uint8_t reg, const uint8_t* data, size_t len) {
+      wire_->beginTransmission(address_);
+      wire_->write(reg);
+      wire_->write(data, len);
+      stats_.transactions++;
+      return wire_->endTransmission() == 0;
+    }
+
+    bool read_registers(uint8_t reg, uint8_t* data, size_t len) {
+      wire_->beginTransmission(address_);
+      wire_->write(reg);
+      if (wire_->endTransmission(false) != 0 || wire_->requestFrom(address_, (uint8_t)len) != len) {
+        return false;
+      }
+      for (size_t i = 0; i < len; i++) {
+        data[i] = wire_->read();
+      }
+      stats_.transactions++;
+      return true;
+    }
+};
+
+static Mcp23017 io_expander;
+
+#endif // MCP23017_H
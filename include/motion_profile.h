@@ -0,0 +1,63 @@
+#ifndef MOTION_PROFILE_H
+#define MOTION_PROFILE_H
+
+#include <Arduino.h>
+
+constexpr int kMaxValveProfileLen = 512;
+
+class ValveRampProfile {
+  /*
+  Step times of the valve acceleration ramp, precomputed so the step timer
+  callback does a table lookup and an index increment instead of an integer
+  divide per step. Entry 0 is the start (slowest) step time, every next entry is
+  step_time - step_time / smoothness_factor, down to min_step_time which is the
+  last entry and is held once reached.
+  */
+  public:
+    // Returns false if the ramp does not get down to min_step_time within
+    // kMaxValveProfileLen entries. The table then ends at, and cruises at, the
+    // shortest step time it reached instead of jumping to min_step_time.
+    bool build(uint16_t max_step_time, uint16_t min_step_time, uint32_t smoothness_factor) {
+      uint16_t step_time = max_step_time;
+      len_ = 0;
+      table_[len_++] = step_time;
+      while (step_time > min_step_time && len_ < kMaxValveProfileLen) {
+        step_time = next_step_time(step_time, min_step_time, smoothness_factor);
+        table_[len_++] = step_time;
+      }
+      if (step_time > min_step_time) {
+        return false;
+      }
+      table_[len_ - 1] = min_step_time; // also when max_step_time is below it
+      return true;
+    }
+
+    // Analytic ramp, used to build the table (and to check it)
+    static uint32_t next_step_time(uint32_t step_time, uint32_t min_step_time, uint32_t smoothness_factor) {
+      if (step_time > min_step_time) {
+        step_time -= step_time / smoothness_factor;
+      }
+      if (step_time < min_step_time) {
+        step_time = min_step_time;
+      }
+      return step_time;
+    }
+
+    uint16_t IRAM_ATTR at(uint16_t idx) const {
+      return table_[idx < len_ ? idx : len_ - 1];
+    }
+
+    uint16_t IRAM_ATTR length() const {
+      return len_;
+    }
+
+    uint16_t cruise_step_time() const {
+      return table_[len_ - 1];
+    }
+
+  private:
+    uint16_t table_[kMaxValveProfileLen] = {0};
+    uint16_t len_ = 1;
+};
+
+#endif // MOTION_PROFILE_H
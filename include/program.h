@@ -5,20 +5,37 @@
 #include <Arduino.h>
 #include <LittleFS.h>
 #include "device.h"
+#include "run_log.h"
+#include "valve_mixer.h"
+#include "protocol.h"
 
-constexpr float kDefaultPumpAcceleration = 5.0;
 const char* PROGRAM_FILENAME = "/program.bin";
 const char* REAGENT_CONFIG_FILENAME = "/reagent_config.bin";
 
 struct ProgramStep {
     uint8_t reagent_valve_id; // set any of valve ids to 0xff to keep the current valve positions
     uint8_t column_valve_id;  
-    uint16_t unused;          // 2 bytes for future use and for float data alignment
+    uint16_t ramp_end_flow;   // 0 for constant flow, else the flow rate reached at the end of duration, see encode_ramp_end_flow()
     float flow_rate;          // mL/min.
     float volume;             // mL. Use float infinity for unlimited volume
     float duration;           // seconds. Use float infinity for unlimited time
 };
 
+// ProgramStep::ramp_end_flow: offset binary with 1 uL/min resolution, 0 is reserved for constant flow
+inline uint16_t encode_ramp_end_flow(float flow_rate) {
+    constexpr float kLimit = float(protocol::kRampFlowOffset - 1) / protocol::kRampFlowScale;
+    if (flow_rate > kLimit) {
+      flow_rate = kLimit;
+    } else if (flow_rate < -kLimit) {
+      flow_rate = -kLimit;
+    }
+    return protocol::kRampFlowOffset + lroundf(flow_rate * protocol::kRampFlowScale);
+}
+
+inline float decode_ramp_end_flow(uint16_t ramp_end_flow) {
+    return float(int32_t(ramp_end_flow) - protocol::kRampFlowOffset) / protocol::kRampFlowScale;
+}
+
 
 class Program {
   public: 
@@ -42,7 +59,7 @@ class Program {
     void read_block(uint16_t start_idx, uint16_t nSteps, uint8_t* buffer) {
       memcpy(buffer, steps + start_idx, nSteps * sizeof(ProgramStep));
     }
-    static void parse_step(uint8_t* buffer, ProgramStep* step) {
+    static void parse_step(const uint8_t* buffer, ProgramStep* step) {
       Serial.println(sizeof(ProgramStep));
       Serial.print("Step data: ");
       for (int i = 0; i < sizeof(ProgramStep); i++) {
@@ -50,12 +67,21 @@ class Program {
         Serial.print(" ");
       }
       Serial.println();
-      memcpy(step, buffer, sizeof(ProgramStep));
+      decode_step(buffer, step);
     }
-    void set_reagents(uint8_t* buffer) {
+    static void decode_step(const uint8_t* buffer, ProgramStep* step) {
+      protocol::ProgramStepView view(buffer);
+      step->reagent_valve_id = view.reagent_valve_id();
+      step->column_valve_id = view.column_valve_id();
+      step->ramp_end_flow = view.ramp_end_flow();
+      step->flow_rate = view.flow_rate();
+      step->volume = view.volume();
+      step->duration = view.duration();
+    }
+    void set_reagents(const uint8_t* buffer) {
       memcpy(reagents, buffer, sizeof(reagents));
     }
-    void set_columns(uint8_t* buffer) {
+    void set_columns(const uint8_t* buffer) {
       memcpy(columns, buffer, sizeof(columns));
     }
 
@@ -160,7 +186,7 @@ class Program {
 class ProgramLoader {
   public:
   ProgramLoader(Program* program) : program_(program) {}
-  void load_from_buffer(uint8_t* buffer, uint16_t len) {
+  void load_from_buffer(const uint8_t* buffer, uint16_t len) {
       uint16_t nSteps = len / sizeof(ProgramStep);
       Serial.print("loading ");
       Serial.print(nSteps);
@@ -196,50 +222,267 @@ class ProgramLoader {
     uint16_t step_idx;
 };
 
+constexpr int kStreamCapacity = 64; // look-ahead of a host-fed run, 1 KiB
+
+class StepStream {
+  /*
+  Look-ahead FIFO of a host-fed (streaming) run: the communication task
+  pushes steps as the host sends them, the executor pops them in the control
+  loop, so programs have no length limit and start without an upload. Steps
+  carry their index in the stream, so a request repeated after a lost
+  response is not appended twice.
+  */
+  public:
+    void start(uint8_t underrun_policy) {
+      portENTER_CRITICAL(&mux_);
+      head_ = 0;
+      count_ = 0;
+      received_ = 0;
+      started_ = 0;
+      underruns_ = 0;
+      ended_ = false;
+      underrun_policy_ = underrun_policy;
+      state_ = protocol::kStreamHolding;
+      portEXIT_CRITICAL(&mux_);
+    }
+
+    // Appends the steps from index first_step on that are new and fit
+    void push(uint32_t first_step, const uint8_t* data, int n_steps) {
+      if (state_ == protocol::kStreamIdle || state_ == protocol::kStreamFinished || state_ == protocol::kStreamStopped) {
+        return;
+      }
+      for (int i = 0; i < n_steps; i++) {
+        ProgramStep step;
+        Program::decode_step(data + i * sizeof(ProgramStep), &step);
+        portENTER_CRITICAL(&mux_);
+        bool accepted = first_step + i == received_ && count_ < kStreamCapacity && !ended_;
+        if (accepted) {
+          steps_[(head_ + count_) % kStreamCapacity] = step;
+          count_++;
+          received_++;
+        }
+        portEXIT_CRITICAL(&mux_);
+      }
+    }
+
+    bool pop(ProgramStep* step) {
+      portENTER_CRITICAL(&mux_);
+      bool available = count_ > 0;
+      if (available) {
+        *step = steps_[head_];
+        head_ = (head_ + 1) % kStreamCapacity;
+        count_--;
+        started_++;
+      }
+      portEXIT_CRITICAL(&mux_);
+      return available;
+    }
+
+    void end() { ended_ = true; }
+    bool ended() const { return ended_; }
+    uint8_t underrun_policy() const { return underrun_policy_; }
+    void set_state(uint8_t state) { state_ = state; }
+    void count_underrun() { underruns_++; }
+
+    void get_status(uint8_t* buffer) {
+      protocol::StreamStatusWriter status(buffer);
+      portENTER_CRITICAL(&mux_);
+      status.set_state(state_);
+      status.set_underrun_policy(underrun_policy_);
+      status.set_credits(ended_ ? 0 : kStreamCapacity - count_);
+      status.set_received(received_);
+      status.set_started(started_);
+      status.set_underruns(underruns_);
+      portEXIT_CRITICAL(&mux_);
+    }
+
+  private:
+    portMUX_TYPE mux_ = portMUX_INITIALIZER_UNLOCKED;
+    ProgramStep steps_[kStreamCapacity];
+    int head_ = 0;
+    int count_ = 0;
+    uint32_t received_ = 0;
+    uint32_t started_ = 0;
+    uint32_t underruns_ = 0;
+    volatile bool ended_ = false;
+    uint8_t underrun_policy_ = protocol::kUnderrunHold;
+    volatile uint8_t state_ = protocol::kStreamIdle;
+};
+
 class ProgramExecutor {
   public:
     ProgramExecutor(Program* program) : program_(program) {}
     void execute() {
+      abort(); // ends a run still active, streamed or not, with its RUN_END record
       running = true;
       step_idx = 0;
+      run_log.run_start(program_->length());
       program_->read_at(step_idx, &current_step);
       enter_step(&current_step);
     }
+    // Starts a host-fed run: steps come from stream(), the run ends once the
+    // host has ended the stream and the look-ahead is empty
+    void execute_stream(uint8_t underrun_policy) {
+      abort();
+      stream_.start(underrun_policy);
+      streaming = true;
+      holding = true;
+      step_idx = 0;
+      run_log.run_start(0, RUN_LOG_FLAG_STREAMED);
+      running = true;
+    }
     void step() {
       device.device_state.program_step_idx = step_idx;
       device.device_state.running = running;
       if (!running) {
         return;
       }
+      if (holding) {
+        if (stream_.pop(&current_step)) {
+          holding = false;
+          stream_.set_state(protocol::kStreamRunning);
+          enter_step(&current_step);
+        } else if (stream_.ended()) {
+          finish();
+        }
+        return;
+      }
       // uint8_t progress = 0;
-      if (check_step_termination(&current_step, &(device.device_state.program_step_progress))) {
-        ++step_idx;
-        if (step_idx >= program_->length()) {
-          running = false;
-          Serial.println("Program finished");
-          device.set_pump(PumpCommand{.pump_cmd = 0, .acceleration = kDefaultPumpAcceleration});
-          return;
+      if (!check_step_termination(&current_step, &(device.device_state.program_step_progress))) {
+        if (ramp) {
+          update_ramp();
         }
-        program_->read_at(step_idx, &current_step);
-        enter_step(&current_step);
+        if (mixer_.active()) {
+          update_mix();
+        }
+        return;
       }
+      log_step_end();
+      ++step_idx;
+      if (streaming) {
+        next_stream_step();
+        return;
+      }
+      if (step_idx >= program_->length()) {
+        finish();
+        return;
+      }
+      program_->read_at(step_idx, &current_step);
+      enter_step(&current_step);
     }
     void abort() {
+      if (running) {
+        run_log.run_end(step_idx, true);
+      }
+      if (running && streaming) {
+        stream_.set_state(protocol::kStreamIdle);
+      }
+      mixer_.stop();
       running = false;
+      streaming = false;
+      holding = false;
       device.set_pump(PumpCommand{.pump_cmd = 0, .acceleration = kDefaultPumpAcceleration});
     }
     bool is_running() { return running; }
+    StepStream& stream() { return stream_; }
+    const ValveMixer& mixer() const { return mixer_; }
   private:
     ProgramStep current_step;
     Program* program_;
-    uint16_t step_idx = 0;
+    StepStream stream_;
+    ValveMixer mixer_;
+    uint8_t mix_column = 0;
+    uint32_t step_idx = 0; // streamed runs have no length limit; DeviceState and the run log keep its low 16 bits
     bool running = false;
+    bool streaming = false;
+    bool holding = false;
+
+    void finish() {
+      running = false;
+      run_log.run_end(step_idx, false);
+      if (streaming) {
+        stream_.set_state(protocol::kStreamFinished);
+      }
+      Serial.println("Program finished");
+      device.set_pump(PumpCommand{.pump_cmd = 0, .acceleration = kDefaultPumpAcceleration});
+    }
+
+    void next_stream_step() {
+      if (stream_.pop(&current_step)) {
+        enter_step(&current_step);
+        return;
+      }
+      if (stream_.ended()) {
+        finish();
+        return;
+      }
+      // Underrun: the host did not keep the look-ahead filled
+      stream_.count_underrun();
+      if (stream_.underrun_policy() == protocol::kUnderrunStop) {
+        running = false;
+        run_log.run_end(step_idx, true);
+        stream_.set_state(protocol::kStreamStopped);
+        Serial.println("Stream underrun, program stopped");
+      } else {
+        holding = true;
+        stream_.set_state(protocol::kStreamHolding);
+        Serial.println("Stream underrun, holding");
+      }
+      device.set_pump(PumpCommand{.pump_cmd = 0, .acceleration = kDefaultPumpAcceleration});
+    }
     unsigned long step_end_time = 0;
+    unsigned long step_start_time = 0;
     float step_end_volume = 0;
+    bool ramp = false;
+    float ramp_delta = 0;  // end - start flow rate, mL/min
+    float ramp_inv_duration_ms = 0;
+
+    // Linear flow ramp: the set speed follows the step's time progress every tick,
+    // the pump's acceleration limit smooths the increments
+    void update_ramp() {
+      float fraction = float(millis() - step_start_time) * ramp_inv_duration_ms;
+      if (fraction > 1.0f) {
+        fraction = 1.0f;
+      }
+      device.set_pump(PumpCommand{.pump_cmd = current_step.flow_rate + ramp_delta * fraction, .acceleration = kDefaultPumpAcceleration});
+    }
+
+    // Reagent valve proportioning: switches ports as the mixer's slices end,
+    // only once the previous valve change has finished
+    void update_mix() {
+      uint8_t port = mixer_.update(device.pump.get_total_steps(), device.feeding_reagent(), device.stopping_steps());
+      if (device.is_pumping() && port != device.reagent_valve.get_position()) {
+        device.set_valves(port, mix_column);
+        mixer_.count_switch();
+      }
+    }
+
+    void log_step_end() {
+      unsigned long now = millis();
+      float volume = device.pump.get_volume();
+      bool volume_limited = volume >= step_end_volume;
+      float overshoot = volume_limited ? volume - step_end_volume : float(long(now - step_end_time));
+      run_log.step_end(step_idx, now - step_start_time, volume, overshoot, volume_limited);
+      if (mixer_.active()) {
+        mixer_.update(device.pump.get_total_steps(), device.feeding_reagent(), 0);
+        mixer_.stop();
+        run_log.mix_end(step_idx, mixer_.switches(), mixer_.steps_a() * device.pump.volume_per_step(),
+                        mixer_.steps_b() * device.pump.volume_per_step());
+      }
+    }
 
     void enter_step(ProgramStep* step) {
       device.pump.reset_volume();
-      if (step->reagent_valve_id != 0xff && step->column_valve_id != 0xff) {
+      step_start_time = millis();
+      if (is_mix_step(step->reagent_valve_id)) {
+        mix_column = step->column_valve_id != 0xff ? step->column_valve_id : device.column_valve.get_position();
+        mixer_.start(mix_reagent_a(step->reagent_valve_id), mix_reagent_b(step->reagent_valve_id), step->ramp_end_flow,
+                     device.pump.get_total_steps());
+        if (mixer_.port() != device.reagent_valve.get_position()) {
+          mixer_.count_switch();
+        }
+        device.set_valves(mixer_.port(), mix_column);
+      } else if (step->reagent_valve_id != 0xff && step->column_valve_id != 0xff) {
         device.set_valves(step->reagent_valve_id, step->column_valve_id);
       }
       device.set_pump(PumpCommand{.pump_cmd = step->flow_rate, .acceleration = kDefaultPumpAcceleration});
@@ -248,7 +491,15 @@ class ProgramExecutor {
       } else {
         step_end_time = millis() + uint32_t(step->duration * 1000.0f);
       }
+      // A ramp runs over the duration; steps without a finite one keep the start flow rate
+      ramp = step->ramp_end_flow != 0 && !is_mix_step(step->reagent_valve_id) && !isinf(step->duration) && step->duration > 0;
+      if (ramp) {
+        ramp_delta = decode_ramp_end_flow(step->ramp_end_flow) - step->flow_rate;
+        ramp_inv_duration_ms = 1.0f / (step->duration * 1000.0f);
+      }
       step_end_volume = step->volume * 1000.0f; // convert mL to uL
+      // With a pulse output its PCNT interrupt wakes the control loop at this volume (see main.cpp)
+      device.pump.set_volume_target(step_end_volume);
 
       Serial.print("Entered step: ");
       Serial.print(step->reagent_valve_id);
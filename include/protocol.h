@@ -0,0 +1,1153 @@
+// Generated by protocol/codegen.py from protocol/protocol.yaml. Do not edit.
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+namespace protocol {
+
+constexpr int kMaxReagents = 6;
+constexpr int kMaxColumns = 6;
+constexpr int kMaxNameLen = 40;
+constexpr int kMaxProgramStepsPerBlock = 5;
+constexpr int kDiagTaskNameLen = 12;
+constexpr int kFramingStartSequence = 0;
+constexpr int kFramingCobs = 1;
+constexpr int kFramingCobsTagged = 2;
+constexpr int kMaxStreamStepsPerFrame = 15;
+constexpr int kUnderrunHold = 0;
+constexpr int kUnderrunStop = 1;
+constexpr int kStreamIdle = 0;
+constexpr int kStreamRunning = 1;
+constexpr int kStreamHolding = 2;
+constexpr int kStreamFinished = 3;
+constexpr int kStreamStopped = 4;
+constexpr int kRampFlowOffset = 32768;
+constexpr int kRampFlowScale = 1000;
+constexpr int kMixStepFlag = 128;
+constexpr int kMixShareScale = 10000;
+constexpr int kAutotuneIdle = 0;
+constexpr int kAutotuneRunning = 1;
+constexpr int kAutotuneDone = 2;
+constexpr int kAutotuneFailed = 3;
+constexpr int kJitterSourcePump = 0;
+constexpr int kJitterSourceValve = 1;
+constexpr int kJitterSourceControl = 2;
+constexpr int kStepTimerEspTimer = 0;
+constexpr int kStepTimerHardware = 1;
+constexpr int kPulsationBins = 32;
+constexpr int kPulsationOffset = 32768;
+constexpr int kPulsationScale = 10000;
+constexpr int kPulsationMaxCorrection = 5000;
+
+enum CommandId : uint8_t {
+  CMD_PING = 0,
+  CMD_SET_VALVES = 1,
+  CMD_SET_PUMP = 2,
+  CMD_GET_WEIGHT = 3,
+  CMD_INIT_PROGRAM_WRITE = 4,
+  CMD_WRITE_PROGRAM_BLOCK = 5,
+  CMD_EXECUTE_PROGRAM = 6,
+  CMD_READ_PROGRAM_BLOCK = 7,
+  CMD_GET_PROGRAM_LENGTH = 8,
+  CMD_GET_REAGENTS = 9,
+  CMD_GET_COLUMNS = 10,
+  CMD_SET_REAGENTS = 11,
+  CMD_SET_COLUMNS = 12,
+  CMD_ABORT_PROGRAM = 13,
+  CMD_GET_DEVICE_STATE = 14,
+  CMD_TARE_WEIGHT_SENSOR = 15,
+  CMD_GET_TASK_DIAGNOSTICS = 16,
+  CMD_GET_TRANSITION_STATS = 17,
+  CMD_READ_RUN_LOG = 18,
+  CMD_GET_COMMAND_STATS = 19,
+  CMD_SET_FRAMING = 20,
+  CMD_START_STREAM = 21,
+  CMD_STREAM_STEPS = 22,
+  CMD_END_STREAM = 23,
+  CMD_GET_MIX_STATS = 24,
+  CMD_GET_CHANNEL_STATES = 25,
+  CMD_SET_CHANNEL_VALVES = 26,
+  CMD_SET_CHANNEL_PUMP = 27,
+  CMD_GET_VALVE_STATS = 28,
+  CMD_AUTOTUNE_VALVE = 29,
+  CMD_GET_STEP_JITTER = 30,
+  CMD_SET_PULSATION = 31,
+  CMD_GET_PULSATION = 32,
+};
+constexpr int kNumCommandIds = 33;
+
+// Unaligned little-endian access: both the ESP32 and the hosts are little-endian, and a
+// fixed-size memcpy compiles to plain loads and stores (no library call, no struct copy).
+template <typename T>
+inline T load_le(const uint8_t* p) {
+  T value;
+  memcpy(&value, p, sizeof(T));
+  return value;
+}
+
+template <typename T>
+inline void store_le(uint8_t* p, T value) {
+  memcpy(p, &value, sizeof(T));
+}
+
+template <typename T>
+inline T load_be(const uint8_t* p) {
+  T value = 0;
+  for (size_t i = 0; i < sizeof(T); i++) {
+    value = (T)((value << 8) | p[i]);
+  }
+  return value;
+}
+
+template <typename T>
+inline void store_be(uint8_t* p, T value) {
+  for (size_t i = 0; i < sizeof(T); i++) {
+    p[sizeof(T) - 1 - i] = (uint8_t)(value >> (8 * i));
+  }
+}
+
+// Ack: 1 byte, little endian
+class AckView {
+  public:
+    static constexpr size_t kSize = 1;
+    explicit AckView(const uint8_t* data) : data_(data) {}
+    uint8_t code() const { return load_le<uint8_t>(data_ + 0); }
+  private:
+    const uint8_t* data_;
+};
+
+class AckWriter {
+  public:
+    static constexpr size_t kSize = 1;
+    explicit AckWriter(uint8_t* data) : data_(data) {}
+    void set_code(uint8_t value) { store_le<uint8_t>(data_ + 0, value); }
+  private:
+    uint8_t* data_;
+};
+
+// ValveCommand: 2 bytes, little endian
+class ValveCommandView {
+  public:
+    static constexpr size_t kSize = 2;
+    explicit ValveCommandView(const uint8_t* data) : data_(data) {}
+    uint8_t reagent_valve_id() const { return load_le<uint8_t>(data_ + 0); }
+    uint8_t column_valve_id() const { return load_le<uint8_t>(data_ + 1); }
+  private:
+    const uint8_t* data_;
+};
+
+class ValveCommandWriter {
+  public:
+    static constexpr size_t kSize = 2;
+    explicit ValveCommandWriter(uint8_t* data) : data_(data) {}
+    void set_reagent_valve_id(uint8_t value) { store_le<uint8_t>(data_ + 0, value); }
+    void set_column_valve_id(uint8_t value) { store_le<uint8_t>(data_ + 1, value); }
+  private:
+    uint8_t* data_;
+};
+
+// PumpCommand: 8 bytes, little endian
+class PumpCommandView {
+  public:
+    static constexpr size_t kSize = 8;
+    explicit PumpCommandView(const uint8_t* data) : data_(data) {}
+    float pump_cmd() const { return load_le<float>(data_ + 0); }
+    float acceleration() const { return load_le<float>(data_ + 4); }
+  private:
+    const uint8_t* data_;
+};
+
+class PumpCommandWriter {
+  public:
+    static constexpr size_t kSize = 8;
+    explicit PumpCommandWriter(uint8_t* data) : data_(data) {}
+    void set_pump_cmd(float value) { store_le<float>(data_ + 0, value); }
+    void set_acceleration(float value) { store_le<float>(data_ + 4, value); }
+  private:
+    uint8_t* data_;
+};
+
+// ProgramStep: 16 bytes, little endian
+class ProgramStepView {
+  public:
+    static constexpr size_t kSize = 16;
+    explicit ProgramStepView(const uint8_t* data) : data_(data) {}
+    uint8_t reagent_valve_id() const { return load_le<uint8_t>(data_ + 0); }
+    uint8_t column_valve_id() const { return load_le<uint8_t>(data_ + 1); }
+    uint16_t ramp_end_flow() const { return load_le<uint16_t>(data_ + 2); }
+    float flow_rate() const { return load_le<float>(data_ + 4); }
+    float volume() const { return load_le<float>(data_ + 8); }
+    float duration() const { return load_le<float>(data_ + 12); }
+  private:
+    const uint8_t* data_;
+};
+
+class ProgramStepWriter {
+  public:
+    static constexpr size_t kSize = 16;
+    explicit ProgramStepWriter(uint8_t* data) : data_(data) {}
+    void set_reagent_valve_id(uint8_t value) { store_le<uint8_t>(data_ + 0, value); }
+    void set_column_valve_id(uint8_t value) { store_le<uint8_t>(data_ + 1, value); }
+    void set_ramp_end_flow(uint16_t value) { store_le<uint16_t>(data_ + 2, value); }
+    void set_flow_rate(float value) { store_le<float>(data_ + 4, value); }
+    void set_volume(float value) { store_le<float>(data_ + 8, value); }
+    void set_duration(float value) { store_le<float>(data_ + 12, value); }
+  private:
+    uint8_t* data_;
+};
+
+// ProgramBlockRequest: 4 bytes, big endian
+class ProgramBlockRequestView {
+  public:
+    static constexpr size_t kSize = 4;
+    explicit ProgramBlockRequestView(const uint8_t* data) : data_(data) {}
+    uint16_t first_step() const { return load_be<uint16_t>(data_ + 0); }
+    uint16_t n_steps() const { return load_be<uint16_t>(data_ + 2); }
+  private:
+    const uint8_t* data_;
+};
+
+class ProgramBlockRequestWriter {
+  public:
+    static constexpr size_t kSize = 4;
+    explicit ProgramBlockRequestWriter(uint8_t* data) : data_(data) {}
+    void set_first_step(uint16_t value) { store_be<uint16_t>(data_ + 0, value); }
+    void set_n_steps(uint16_t value) { store_be<uint16_t>(data_ + 2, value); }
+  private:
+    uint8_t* data_;
+};
+
+// ProgramLength: 4 bytes, big endian
+class ProgramLengthView {
+  public:
+    static constexpr size_t kSize = 4;
+    explicit ProgramLengthView(const uint8_t* data) : data_(data) {}
+    uint16_t length() const { return load_be<uint16_t>(data_ + 0); }
+    uint16_t max_length() const { return load_be<uint16_t>(data_ + 2); }
+  private:
+    const uint8_t* data_;
+};
+
+class ProgramLengthWriter {
+  public:
+    static constexpr size_t kSize = 4;
+    explicit ProgramLengthWriter(uint8_t* data) : data_(data) {}
+    void set_length(uint16_t value) { store_be<uint16_t>(data_ + 0, value); }
+    void set_max_length(uint16_t value) { store_be<uint16_t>(data_ + 2, value); }
+  private:
+    uint8_t* data_;
+};
+
+// ReagentNames: 240 bytes, little endian
+class ReagentNamesView {
+  public:
+    static constexpr size_t kSize = 240;
+    explicit ReagentNamesView(const uint8_t* data) : data_(data) {}
+    const uint8_t* names() const { return data_ + 0; } // 240 bytes
+  private:
+    const uint8_t* data_;
+};
+
+class ReagentNamesWriter {
+  public:
+    static constexpr size_t kSize = 240;
+    explicit ReagentNamesWriter(uint8_t* data) : data_(data) {}
+    uint8_t* names() { return data_ + 0; } // 240 bytes
+  private:
+    uint8_t* data_;
+};
+
+// ColumnNames: 240 bytes, little endian
+class ColumnNamesView {
+  public:
+    static constexpr size_t kSize = 240;
+    explicit ColumnNamesView(const uint8_t* data) : data_(data) {}
+    const uint8_t* names() const { return data_ + 0; } // 240 bytes
+  private:
+    const uint8_t* data_;
+};
+
+class ColumnNamesWriter {
+  public:
+    static constexpr size_t kSize = 240;
+    explicit ColumnNamesWriter(uint8_t* data) : data_(data) {}
+    uint8_t* names() { return data_ + 0; } // 240 bytes
+  private:
+    uint8_t* data_;
+};
+
+// TareRequest: 1 byte, little endian
+class TareRequestView {
+  public:
+    static constexpr size_t kSize = 1;
+    explicit TareRequestView(const uint8_t* data) : data_(data) {}
+    uint8_t channel() const { return load_le<uint8_t>(data_ + 0); }
+  private:
+    const uint8_t* data_;
+};
+
+class TareRequestWriter {
+  public:
+    static constexpr size_t kSize = 1;
+    explicit TareRequestWriter(uint8_t* data) : data_(data) {}
+    void set_channel(uint8_t value) { store_le<uint8_t>(data_ + 0, value); }
+  private:
+    uint8_t* data_;
+};
+
+// DeviceState: 20 bytes, little endian
+class DeviceStateView {
+  public:
+    static constexpr size_t kSize = 20;
+    explicit DeviceStateView(const uint8_t* data) : data_(data) {}
+    float pump_speed() const { return load_le<float>(data_ + 0); }
+    float pump_volume() const { return load_le<float>(data_ + 4); }
+    uint16_t program_step_idx() const { return load_le<uint16_t>(data_ + 8); }
+    uint8_t device_state() const { return load_le<uint8_t>(data_ + 10); }
+    uint8_t reagent_valve_position() const { return load_le<uint8_t>(data_ + 11); }
+    uint8_t reagent_valve_state() const { return load_le<uint8_t>(data_ + 12); }
+    uint8_t column_valve_position() const { return load_le<uint8_t>(data_ + 13); }
+    uint8_t column_valve_state() const { return load_le<uint8_t>(data_ + 14); }
+    uint8_t running() const { return load_le<uint8_t>(data_ + 15); }
+    uint8_t program_step_progress() const { return load_le<uint8_t>(data_ + 16); }
+    uint8_t num_pumps() const { return load_le<uint8_t>(data_ + 17); }
+    uint8_t num_valves() const { return load_le<uint8_t>(data_ + 18); }
+  private:
+    const uint8_t* data_;
+};
+
+class DeviceStateWriter {
+  public:
+    static constexpr size_t kSize = 20;
+    explicit DeviceStateWriter(uint8_t* data) : data_(data) {}
+    void set_pump_speed(float value) { store_le<float>(data_ + 0, value); }
+    void set_pump_volume(float value) { store_le<float>(data_ + 4, value); }
+    void set_program_step_idx(uint16_t value) { store_le<uint16_t>(data_ + 8, value); }
+    void set_device_state(uint8_t value) { store_le<uint8_t>(data_ + 10, value); }
+    void set_reagent_valve_position(uint8_t value) { store_le<uint8_t>(data_ + 11, value); }
+    void set_reagent_valve_state(uint8_t value) { store_le<uint8_t>(data_ + 12, value); }
+    void set_column_valve_position(uint8_t value) { store_le<uint8_t>(data_ + 13, value); }
+    void set_column_valve_state(uint8_t value) { store_le<uint8_t>(data_ + 14, value); }
+    void set_running(uint8_t value) { store_le<uint8_t>(data_ + 15, value); }
+    void set_program_step_progress(uint8_t value) { store_le<uint8_t>(data_ + 16, value); }
+    void set_num_pumps(uint8_t value) { store_le<uint8_t>(data_ + 17, value); }
+    void set_num_valves(uint8_t value) { store_le<uint8_t>(data_ + 18, value); }
+    void clear_padding() { memset(data_ + 19, 0, 1); }
+  private:
+    uint8_t* data_;
+};
+
+// ChannelValveCommand: 3 bytes, little endian
+class ChannelValveCommandView {
+  public:
+    static constexpr size_t kSize = 3;
+    explicit ChannelValveCommandView(const uint8_t* data) : data_(data) {}
+    uint8_t channel() const { return load_le<uint8_t>(data_ + 0); }
+    uint8_t reagent_valve_id() const { return load_le<uint8_t>(data_ + 1); }
+    uint8_t column_valve_id() const { return load_le<uint8_t>(data_ + 2); }
+  private:
+    const uint8_t* data_;
+};
+
+class ChannelValveCommandWriter {
+  public:
+    static constexpr size_t kSize = 3;
+    explicit ChannelValveCommandWriter(uint8_t* data) : data_(data) {}
+    void set_channel(uint8_t value) { store_le<uint8_t>(data_ + 0, value); }
+    void set_reagent_valve_id(uint8_t value) { store_le<uint8_t>(data_ + 1, value); }
+    void set_column_valve_id(uint8_t value) { store_le<uint8_t>(data_ + 2, value); }
+  private:
+    uint8_t* data_;
+};
+
+// ChannelPumpCommand: 12 bytes, little endian
+class ChannelPumpCommandView {
+  public:
+    static constexpr size_t kSize = 12;
+    explicit ChannelPumpCommandView(const uint8_t* data) : data_(data) {}
+    uint8_t channel() const { return load_le<uint8_t>(data_ + 0); }
+    float pump_cmd() const { return load_le<float>(data_ + 4); }
+    float acceleration() const { return load_le<float>(data_ + 8); }
+  private:
+    const uint8_t* data_;
+};
+
+class ChannelPumpCommandWriter {
+  public:
+    static constexpr size_t kSize = 12;
+    explicit ChannelPumpCommandWriter(uint8_t* data) : data_(data) {}
+    void set_channel(uint8_t value) { store_le<uint8_t>(data_ + 0, value); }
+    void set_pump_cmd(float value) { store_le<float>(data_ + 4, value); }
+    void set_acceleration(float value) { store_le<float>(data_ + 8, value); }
+    void clear_padding() { memset(data_ + 1, 0, 3); }
+  private:
+    uint8_t* data_;
+};
+
+// ChannelStatesSummary: 4 bytes, little endian
+class ChannelStatesSummaryView {
+  public:
+    static constexpr size_t kSize = 4;
+    explicit ChannelStatesSummaryView(const uint8_t* data) : data_(data) {}
+    uint8_t num_channels() const { return load_le<uint8_t>(data_ + 0); }
+    uint8_t num_pumps() const { return load_le<uint8_t>(data_ + 1); }
+    uint8_t num_valves() const { return load_le<uint8_t>(data_ + 2); }
+  private:
+    const uint8_t* data_;
+};
+
+class ChannelStatesSummaryWriter {
+  public:
+    static constexpr size_t kSize = 4;
+    explicit ChannelStatesSummaryWriter(uint8_t* data) : data_(data) {}
+    void set_num_channels(uint8_t value) { store_le<uint8_t>(data_ + 0, value); }
+    void set_num_pumps(uint8_t value) { store_le<uint8_t>(data_ + 1, value); }
+    void set_num_valves(uint8_t value) { store_le<uint8_t>(data_ + 2, value); }
+    void clear_padding() { memset(data_ + 3, 0, 1); }
+  private:
+    uint8_t* data_;
+};
+
+// ChannelState: 16 bytes, little endian
+class ChannelStateView {
+  public:
+    static constexpr size_t kSize = 16;
+    explicit ChannelStateView(const uint8_t* data) : data_(data) {}
+    float pump_speed() const { return load_le<float>(data_ + 0); }
+    float pump_volume() const { return load_le<float>(data_ + 4); }
+    uint8_t device_state() const { return load_le<uint8_t>(data_ + 8); }
+    uint8_t reagent_valve_position() const { return load_le<uint8_t>(data_ + 9); }
+    uint8_t reagent_valve_state() const { return load_le<uint8_t>(data_ + 10); }
+    uint8_t column_valve_position() const { return load_le<uint8_t>(data_ + 11); }
+    uint8_t column_valve_state() const { return load_le<uint8_t>(data_ + 12); }
+    uint8_t pump() const { return load_le<uint8_t>(data_ + 13); }
+    uint8_t reagent_valve() const { return load_le<uint8_t>(data_ + 14); }
+    uint8_t column_valve() const { return load_le<uint8_t>(data_ + 15); }
+  private:
+    const uint8_t* data_;
+};
+
+class ChannelStateWriter {
+  public:
+    static constexpr size_t kSize = 16;
+    explicit ChannelStateWriter(uint8_t* data) : data_(data) {}
+    void set_pump_speed(float value) { store_le<float>(data_ + 0, value); }
+    void set_pump_volume(float value) { store_le<float>(data_ + 4, value); }
+    void set_device_state(uint8_t value) { store_le<uint8_t>(data_ + 8, value); }
+    void set_reagent_valve_position(uint8_t value) { store_le<uint8_t>(data_ + 9, value); }
+    void set_reagent_valve_state(uint8_t value) { store_le<uint8_t>(data_ + 10, value); }
+    void set_column_valve_position(uint8_t value) { store_le<uint8_t>(data_ + 11, value); }
+    void set_column_valve_state(uint8_t value) { store_le<uint8_t>(data_ + 12, value); }
+    void set_pump(uint8_t value) { store_le<uint8_t>(data_ + 13, value); }
+    void set_reagent_valve(uint8_t value) { store_le<uint8_t>(data_ + 14, value); }
+    void set_column_valve(uint8_t value) { store_le<uint8_t>(data_ + 15, value); }
+  private:
+    uint8_t* data_;
+};
+
+// ValveRequest: 1 byte, little endian
+class ValveRequestView {
+  public:
+    static constexpr size_t kSize = 1;
+    explicit ValveRequestView(const uint8_t* data) : data_(data) {}
+    uint8_t valve() const { return load_le<uint8_t>(data_ + 0); }
+  private:
+    const uint8_t* data_;
+};
+
+class ValveRequestWriter {
+  public:
+    static constexpr size_t kSize = 1;
+    explicit ValveRequestWriter(uint8_t* data) : data_(data) {}
+    void set_valve(uint8_t value) { store_le<uint8_t>(data_ + 0, value); }
+  private:
+    uint8_t* data_;
+};
+
+// ValveStats: 28 bytes, little endian
+class ValveStatsView {
+  public:
+    static constexpr size_t kSize = 28;
+    explicit ValveStatsView(const uint8_t* data) : data_(data) {}
+    uint8_t valve() const { return load_le<uint8_t>(data_ + 0); }
+    uint8_t autotune_state() const { return load_le<uint8_t>(data_ + 1); }
+    uint8_t autotune_valve() const { return load_le<uint8_t>(data_ + 2); }
+    uint8_t autotune_trials() const { return load_le<uint8_t>(data_ + 3); }
+    uint32_t home_passes() const { return load_le<uint32_t>(data_ + 4); }
+    uint32_t drift_events() const { return load_le<uint32_t>(data_ + 8); }
+    uint32_t missed_homes() const { return load_le<uint32_t>(data_ + 12); }
+    int32_t last_drift() const { return load_le<int32_t>(data_ + 16); }
+    uint16_t min_step_time() const { return load_le<uint16_t>(data_ + 20); }
+    uint16_t max_step_time() const { return load_le<uint16_t>(data_ + 22); }
+    uint32_t smoothness_factor() const { return load_le<uint32_t>(data_ + 24); }
+  private:
+    const uint8_t* data_;
+};
+
+class ValveStatsWriter {
+  public:
+    static constexpr size_t kSize = 28;
+    explicit ValveStatsWriter(uint8_t* data) : data_(data) {}
+    void set_valve(uint8_t value) { store_le<uint8_t>(data_ + 0, value); }
+    void set_autotune_state(uint8_t value) { store_le<uint8_t>(data_ + 1, value); }
+    void set_autotune_valve(uint8_t value) { store_le<uint8_t>(data_ + 2, value); }
+    void set_autotune_trials(uint8_t value) { store_le<uint8_t>(data_ + 3, value); }
+    void set_home_passes(uint32_t value) { store_le<uint32_t>(data_ + 4, value); }
+    void set_drift_events(uint32_t value) { store_le<uint32_t>(data_ + 8, value); }
+    void set_missed_homes(uint32_t value) { store_le<uint32_t>(data_ + 12, value); }
+    void set_last_drift(int32_t value) { store_le<int32_t>(data_ + 16, value); }
+    void set_min_step_time(uint16_t value) { store_le<uint16_t>(data_ + 20, value); }
+    void set_max_step_time(uint16_t value) { store_le<uint16_t>(data_ + 22, value); }
+    void set_smoothness_factor(uint32_t value) { store_le<uint32_t>(data_ + 24, value); }
+  private:
+    uint8_t* data_;
+};
+
+// StepJitterRequest: 1 byte, little endian
+class StepJitterRequestView {
+  public:
+    static constexpr size_t kSize = 1;
+    explicit StepJitterRequestView(const uint8_t* data) : data_(data) {}
+    uint8_t reset() const { return load_le<uint8_t>(data_ + 0); }
+  private:
+    const uint8_t* data_;
+};
+
+class StepJitterRequestWriter {
+  public:
+    static constexpr size_t kSize = 1;
+    explicit StepJitterRequestWriter(uint8_t* data) : data_(data) {}
+    void set_reset(uint8_t value) { store_le<uint8_t>(data_ + 0, value); }
+  private:
+    uint8_t* data_;
+};
+
+// StepJitterSummary: 8 bytes, little endian
+class StepJitterSummaryView {
+  public:
+    static constexpr size_t kSize = 8;
+    explicit StepJitterSummaryView(const uint8_t* data) : data_(data) {}
+    uint8_t num_records() const { return load_le<uint8_t>(data_ + 0); }
+    uint8_t control_core() const { return load_le<uint8_t>(data_ + 1); }
+    uint8_t network_core() const { return load_le<uint8_t>(data_ + 2); }
+    uint8_t step_timer() const { return load_le<uint8_t>(data_ + 3); }
+    uint32_t late_threshold_us() const { return load_le<uint32_t>(data_ + 4); }
+  private:
+    const uint8_t* data_;
+};
+
+class StepJitterSummaryWriter {
+  public:
+    static constexpr size_t kSize = 8;
+    explicit StepJitterSummaryWriter(uint8_t* data) : data_(data) {}
+    void set_num_records(uint8_t value) { store_le<uint8_t>(data_ + 0, value); }
+    void set_control_core(uint8_t value) { store_le<uint8_t>(data_ + 1, value); }
+    void set_network_core(uint8_t value) { store_le<uint8_t>(data_ + 2, value); }
+    void set_step_timer(uint8_t value) { store_le<uint8_t>(data_ + 3, value); }
+    void set_late_threshold_us(uint32_t value) { store_le<uint32_t>(data_ + 4, value); }
+  private:
+    uint8_t* data_;
+};
+
+// StepJitterRecord: 20 bytes, little endian
+class StepJitterRecordView {
+  public:
+    static constexpr size_t kSize = 20;
+    explicit StepJitterRecordView(const uint8_t* data) : data_(data) {}
+    uint8_t source() const { return load_le<uint8_t>(data_ + 0); }
+    uint8_t axis() const { return load_le<uint8_t>(data_ + 1); }
+    uint8_t core() const { return load_le<uint8_t>(data_ + 2); }
+    uint32_t samples() const { return load_le<uint32_t>(data_ + 4); }
+    float mean_us() const { return load_le<float>(data_ + 8); }
+    uint32_t max_us() const { return load_le<uint32_t>(data_ + 12); }
+    uint32_t late() const { return load_le<uint32_t>(data_ + 16); }
+  private:
+    const uint8_t* data_;
+};
+
+class StepJitterRecordWriter {
+  public:
+    static constexpr size_t kSize = 20;
+    explicit StepJitterRecordWriter(uint8_t* data) : data_(data) {}
+    void set_source(uint8_t value) { store_le<uint8_t>(data_ + 0, value); }
+    void set_axis(uint8_t value) { store_le<uint8_t>(data_ + 1, value); }
+    void set_core(uint8_t value) { store_le<uint8_t>(data_ + 2, value); }
+    void set_samples(uint32_t value) { store_le<uint32_t>(data_ + 4, value); }
+    void set_mean_us(float value) { store_le<float>(data_ + 8, value); }
+    void set_max_us(uint32_t value) { store_le<uint32_t>(data_ + 12, value); }
+    void set_late(uint32_t value) { store_le<uint32_t>(data_ + 16, value); }
+    void clear_padding() { memset(data_ + 3, 0, 1); }
+  private:
+    uint8_t* data_;
+};
+
+// PulsationRequest: 1 byte, little endian
+class PulsationRequestView {
+  public:
+    static constexpr size_t kSize = 1;
+    explicit PulsationRequestView(const uint8_t* data) : data_(data) {}
+    uint8_t pump() const { return load_le<uint8_t>(data_ + 0); }
+  private:
+    const uint8_t* data_;
+};
+
+class PulsationRequestWriter {
+  public:
+    static constexpr size_t kSize = 1;
+    explicit PulsationRequestWriter(uint8_t* data) : data_(data) {}
+    void set_pump(uint8_t value) { store_le<uint8_t>(data_ + 0, value); }
+  private:
+    uint8_t* data_;
+};
+
+// SetPulsationRequest: 4 bytes, little endian
+class SetPulsationRequestView {
+  public:
+    static constexpr size_t kSize = 4;
+    explicit SetPulsationRequestView(const uint8_t* data) : data_(data) {}
+    uint8_t pump() const { return load_le<uint8_t>(data_ + 0); }
+    uint8_t enabled() const { return load_le<uint8_t>(data_ + 1); }
+    uint16_t phase() const { return load_le<uint16_t>(data_ + 2); }
+  private:
+    const uint8_t* data_;
+};
+
+class SetPulsationRequestWriter {
+  public:
+    static constexpr size_t kSize = 4;
+    explicit SetPulsationRequestWriter(uint8_t* data) : data_(data) {}
+    void set_pump(uint8_t value) { store_le<uint8_t>(data_ + 0, value); }
+    void set_enabled(uint8_t value) { store_le<uint8_t>(data_ + 1, value); }
+    void set_phase(uint16_t value) { store_le<uint16_t>(data_ + 2, value); }
+  private:
+    uint8_t* data_;
+};
+
+// PulsationTable: 10 bytes, little endian
+class PulsationTableView {
+  public:
+    static constexpr size_t kSize = 10;
+    explicit PulsationTableView(const uint8_t* data) : data_(data) {}
+    uint8_t pump() const { return load_le<uint8_t>(data_ + 0); }
+    uint8_t enabled() const { return load_le<uint8_t>(data_ + 1); }
+    uint8_t num_bins() const { return load_le<uint8_t>(data_ + 2); }
+    uint16_t steps_per_revolution() const { return load_le<uint16_t>(data_ + 4); }
+    uint16_t phase() const { return load_le<uint16_t>(data_ + 6); }
+    uint16_t rotor_position() const { return load_le<uint16_t>(data_ + 8); }
+  private:
+    const uint8_t* data_;
+};
+
+class PulsationTableWriter {
+  public:
+    static constexpr size_t kSize = 10;
+    explicit PulsationTableWriter(uint8_t* data) : data_(data) {}
+    void set_pump(uint8_t value) { store_le<uint8_t>(data_ + 0, value); }
+    void set_enabled(uint8_t value) { store_le<uint8_t>(data_ + 1, value); }
+    void set_num_bins(uint8_t value) { store_le<uint8_t>(data_ + 2, value); }
+    void set_steps_per_revolution(uint16_t value) { store_le<uint16_t>(data_ + 4, value); }
+    void set_phase(uint16_t value) { store_le<uint16_t>(data_ + 6, value); }
+    void set_rotor_position(uint16_t value) { store_le<uint16_t>(data_ + 8, value); }
+    void clear_padding() { memset(data_ + 3, 0, 1); }
+  private:
+    uint8_t* data_;
+};
+
+// PulsationBin: 2 bytes, little endian
+class PulsationBinView {
+  public:
+    static constexpr size_t kSize = 2;
+    explicit PulsationBinView(const uint8_t* data) : data_(data) {}
+    uint16_t delay() const { return load_le<uint16_t>(data_ + 0); }
+  private:
+    const uint8_t* data_;
+};
+
+class PulsationBinWriter {
+  public:
+    static constexpr size_t kSize = 2;
+    explicit PulsationBinWriter(uint8_t* data) : data_(data) {}
+    void set_delay(uint16_t value) { store_le<uint16_t>(data_ + 0, value); }
+  private:
+    uint8_t* data_;
+};
+
+// TaskDiagnosticsRequest: 1 byte, little endian
+class TaskDiagnosticsRequestView {
+  public:
+    static constexpr size_t kSize = 1;
+    explicit TaskDiagnosticsRequestView(const uint8_t* data) : data_(data) {}
+    uint8_t first_task() const { return load_le<uint8_t>(data_ + 0); }
+  private:
+    const uint8_t* data_;
+};
+
+class TaskDiagnosticsRequestWriter {
+  public:
+    static constexpr size_t kSize = 1;
+    explicit TaskDiagnosticsRequestWriter(uint8_t* data) : data_(data) {}
+    void set_first_task(uint8_t value) { store_le<uint8_t>(data_ + 0, value); }
+  private:
+    uint8_t* data_;
+};
+
+// HeapDiagnostics: 16 bytes, little endian
+class HeapDiagnosticsView {
+  public:
+    static constexpr size_t kSize = 16;
+    explicit HeapDiagnosticsView(const uint8_t* data) : data_(data) {}
+    uint32_t free_bytes() const { return load_le<uint32_t>(data_ + 0); }
+    uint32_t largest_free_block() const { return load_le<uint32_t>(data_ + 4); }
+    uint32_t min_free_bytes() const { return load_le<uint32_t>(data_ + 8); }
+    uint8_t fragmentation() const { return load_le<uint8_t>(data_ + 12); }
+    uint8_t num_tasks() const { return load_le<uint8_t>(data_ + 13); }
+  private:
+    const uint8_t* data_;
+};
+
+class HeapDiagnosticsWriter {
+  public:
+    static constexpr size_t kSize = 16;
+    explicit HeapDiagnosticsWriter(uint8_t* data) : data_(data) {}
+    void set_free_bytes(uint32_t value) { store_le<uint32_t>(data_ + 0, value); }
+    void set_largest_free_block(uint32_t value) { store_le<uint32_t>(data_ + 4, value); }
+    void set_min_free_bytes(uint32_t value) { store_le<uint32_t>(data_ + 8, value); }
+    void set_fragmentation(uint8_t value) { store_le<uint8_t>(data_ + 12, value); }
+    void set_num_tasks(uint8_t value) { store_le<uint8_t>(data_ + 13, value); }
+    void clear_padding() { memset(data_ + 14, 0, 2); }
+  private:
+    uint8_t* data_;
+};
+
+// TaskDiagnostics: 20 bytes, little endian
+class TaskDiagnosticsView {
+  public:
+    static constexpr size_t kSize = 20;
+    explicit TaskDiagnosticsView(const uint8_t* data) : data_(data) {}
+    const uint8_t* name() const { return data_ + 0; } // 12 bytes
+    uint16_t cpu_permille() const { return load_le<uint16_t>(data_ + 12); }
+    uint8_t priority() const { return load_le<uint8_t>(data_ + 14); }
+    uint8_t state() const { return load_le<uint8_t>(data_ + 15); }
+    uint32_t stack_high_water() const { return load_le<uint32_t>(data_ + 16); }
+  private:
+    const uint8_t* data_;
+};
+
+class TaskDiagnosticsWriter {
+  public:
+    static constexpr size_t kSize = 20;
+    explicit TaskDiagnosticsWriter(uint8_t* data) : data_(data) {}
+    uint8_t* name() { return data_ + 0; } // 12 bytes
+    void set_cpu_permille(uint16_t value) { store_le<uint16_t>(data_ + 12, value); }
+    void set_priority(uint8_t value) { store_le<uint8_t>(data_ + 14, value); }
+    void set_state(uint8_t value) { store_le<uint8_t>(data_ + 15, value); }
+    void set_stack_high_water(uint32_t value) { store_le<uint32_t>(data_ + 16, value); }
+  private:
+    uint8_t* data_;
+};
+
+// TransitionStats: 16 bytes, little endian
+class TransitionStatsView {
+  public:
+    static constexpr size_t kSize = 16;
+    explicit TransitionStatsView(const uint8_t* data) : data_(data) {}
+    uint32_t last_transition_ms() const { return load_le<uint32_t>(data_ + 0); }
+    uint32_t last_overlap_ms() const { return load_le<uint32_t>(data_ + 4); }
+    uint32_t total_overlap_ms() const { return load_le<uint32_t>(data_ + 8); }
+    uint32_t transitions() const { return load_le<uint32_t>(data_ + 12); }
+  private:
+    const uint8_t* data_;
+};
+
+class TransitionStatsWriter {
+  public:
+    static constexpr size_t kSize = 16;
+    explicit TransitionStatsWriter(uint8_t* data) : data_(data) {}
+    void set_last_transition_ms(uint32_t value) { store_le<uint32_t>(data_ + 0, value); }
+    void set_last_overlap_ms(uint32_t value) { store_le<uint32_t>(data_ + 4, value); }
+    void set_total_overlap_ms(uint32_t value) { store_le<uint32_t>(data_ + 8, value); }
+    void set_transitions(uint32_t value) { store_le<uint32_t>(data_ + 12, value); }
+  private:
+    uint8_t* data_;
+};
+
+// RunLogRequest: 4 bytes, big endian
+class RunLogRequestView {
+  public:
+    static constexpr size_t kSize = 4;
+    explicit RunLogRequestView(const uint8_t* data) : data_(data) {}
+    uint32_t first_record() const { return load_be<uint32_t>(data_ + 0); }
+  private:
+    const uint8_t* data_;
+};
+
+class RunLogRequestWriter {
+  public:
+    static constexpr size_t kSize = 4;
+    explicit RunLogRequestWriter(uint8_t* data) : data_(data) {}
+    void set_first_record(uint32_t value) { store_be<uint32_t>(data_ + 0, value); }
+  private:
+    uint8_t* data_;
+};
+
+// RunLogRecord: 20 bytes, little endian
+class RunLogRecordView {
+  public:
+    static constexpr size_t kSize = 20;
+    explicit RunLogRecordView(const uint8_t* data) : data_(data) {}
+    uint8_t type() const { return load_le<uint8_t>(data_ + 0); }
+    uint8_t flags() const { return load_le<uint8_t>(data_ + 1); }
+    uint16_t step_idx() const { return load_le<uint16_t>(data_ + 2); }
+    uint32_t run_id() const { return load_le<uint32_t>(data_ + 4); }
+    uint32_t time_ms() const { return load_le<uint32_t>(data_ + 8); }
+    float volume() const { return load_le<float>(data_ + 12); }
+    float overshoot() const { return load_le<float>(data_ + 16); }
+  private:
+    const uint8_t* data_;
+};
+
+class RunLogRecordWriter {
+  public:
+    static constexpr size_t kSize = 20;
+    explicit RunLogRecordWriter(uint8_t* data) : data_(data) {}
+    void set_type(uint8_t value) { store_le<uint8_t>(data_ + 0, value); }
+    void set_flags(uint8_t value) { store_le<uint8_t>(data_ + 1, value); }
+    void set_step_idx(uint16_t value) { store_le<uint16_t>(data_ + 2, value); }
+    void set_run_id(uint32_t value) { store_le<uint32_t>(data_ + 4, value); }
+    void set_time_ms(uint32_t value) { store_le<uint32_t>(data_ + 8, value); }
+    void set_volume(float value) { store_le<float>(data_ + 12, value); }
+    void set_overshoot(float value) { store_le<float>(data_ + 16, value); }
+  private:
+    uint8_t* data_;
+};
+
+// SetFramingRequest: 1 byte, little endian
+class SetFramingRequestView {
+  public:
+    static constexpr size_t kSize = 1;
+    explicit SetFramingRequestView(const uint8_t* data) : data_(data) {}
+    uint8_t framing() const { return load_le<uint8_t>(data_ + 0); }
+  private:
+    const uint8_t* data_;
+};
+
+class SetFramingRequestWriter {
+  public:
+    static constexpr size_t kSize = 1;
+    explicit SetFramingRequestWriter(uint8_t* data) : data_(data) {}
+    void set_framing(uint8_t value) { store_le<uint8_t>(data_ + 0, value); }
+  private:
+    uint8_t* data_;
+};
+
+// StreamStartRequest: 1 byte, little endian
+class StreamStartRequestView {
+  public:
+    static constexpr size_t kSize = 1;
+    explicit StreamStartRequestView(const uint8_t* data) : data_(data) {}
+    uint8_t underrun_policy() const { return load_le<uint8_t>(data_ + 0); }
+  private:
+    const uint8_t* data_;
+};
+
+class StreamStartRequestWriter {
+  public:
+    static constexpr size_t kSize = 1;
+    explicit StreamStartRequestWriter(uint8_t* data) : data_(data) {}
+    void set_underrun_policy(uint8_t value) { store_le<uint8_t>(data_ + 0, value); }
+  private:
+    uint8_t* data_;
+};
+
+// StreamStepsRequest: 4 bytes, little endian
+class StreamStepsRequestView {
+  public:
+    static constexpr size_t kSize = 4;
+    explicit StreamStepsRequestView(const uint8_t* data) : data_(data) {}
+    uint32_t first_step() const { return load_le<uint32_t>(data_ + 0); }
+  private:
+    const uint8_t* data_;
+};
+
+class StreamStepsRequestWriter {
+  public:
+    static constexpr size_t kSize = 4;
+    explicit StreamStepsRequestWriter(uint8_t* data) : data_(data) {}
+    void set_first_step(uint32_t value) { store_le<uint32_t>(data_ + 0, value); }
+  private:
+    uint8_t* data_;
+};
+
+// StreamStatus: 16 bytes, little endian
+class StreamStatusView {
+  public:
+    static constexpr size_t kSize = 16;
+    explicit StreamStatusView(const uint8_t* data) : data_(data) {}
+    uint8_t state() const { return load_le<uint8_t>(data_ + 0); }
+    uint8_t underrun_policy() const { return load_le<uint8_t>(data_ + 1); }
+    uint16_t credits() const { return load_le<uint16_t>(data_ + 2); }
+    uint32_t received() const { return load_le<uint32_t>(data_ + 4); }
+    uint32_t started() const { return load_le<uint32_t>(data_ + 8); }
+    uint32_t underruns() const { return load_le<uint32_t>(data_ + 12); }
+  private:
+    const uint8_t* data_;
+};
+
+class StreamStatusWriter {
+  public:
+    static constexpr size_t kSize = 16;
+    explicit StreamStatusWriter(uint8_t* data) : data_(data) {}
+    void set_state(uint8_t value) { store_le<uint8_t>(data_ + 0, value); }
+    void set_underrun_policy(uint8_t value) { store_le<uint8_t>(data_ + 1, value); }
+    void set_credits(uint16_t value) { store_le<uint16_t>(data_ + 2, value); }
+    void set_received(uint32_t value) { store_le<uint32_t>(data_ + 4, value); }
+    void set_started(uint32_t value) { store_le<uint32_t>(data_ + 8, value); }
+    void set_underruns(uint32_t value) { store_le<uint32_t>(data_ + 12, value); }
+  private:
+    uint8_t* data_;
+};
+
+// MixStats: 24 bytes, little endian
+class MixStatsView {
+  public:
+    static constexpr size_t kSize = 24;
+    explicit MixStatsView(const uint8_t* data) : data_(data) {}
+    uint8_t active() const { return load_le<uint8_t>(data_ + 0); }
+    uint8_t reagent_a() const { return load_le<uint8_t>(data_ + 1); }
+    uint8_t reagent_b() const { return load_le<uint8_t>(data_ + 2); }
+    float target_share_a() const { return load_le<float>(data_ + 4); }
+    float achieved_share_a() const { return load_le<float>(data_ + 8); }
+    uint32_t steps_a() const { return load_le<uint32_t>(data_ + 12); }
+    uint32_t steps_b() const { return load_le<uint32_t>(data_ + 16); }
+    uint32_t switches() const { return load_le<uint32_t>(data_ + 20); }
+  private:
+    const uint8_t* data_;
+};
+
+class MixStatsWriter {
+  public:
+    static constexpr size_t kSize = 24;
+    explicit MixStatsWriter(uint8_t* data) : data_(data) {}
+    void set_active(uint8_t value) { store_le<uint8_t>(data_ + 0, value); }
+    void set_reagent_a(uint8_t value) { store_le<uint8_t>(data_ + 1, value); }
+    void set_reagent_b(uint8_t value) { store_le<uint8_t>(data_ + 2, value); }
+    void set_target_share_a(float value) { store_le<float>(data_ + 4, value); }
+    void set_achieved_share_a(float value) { store_le<float>(data_ + 8, value); }
+    void set_steps_a(uint32_t value) { store_le<uint32_t>(data_ + 12, value); }
+    void set_steps_b(uint32_t value) { store_le<uint32_t>(data_ + 16, value); }
+    void set_switches(uint32_t value) { store_le<uint32_t>(data_ + 20, value); }
+    void clear_padding() { memset(data_ + 3, 0, 1); }
+  private:
+    uint8_t* data_;
+};
+
+// CommandStatsRequest: 1 byte, little endian
+class CommandStatsRequestView {
+  public:
+    static constexpr size_t kSize = 1;
+    explicit CommandStatsRequestView(const uint8_t* data) : data_(data) {}
+    uint8_t first_command() const { return load_le<uint8_t>(data_ + 0); }
+  private:
+    const uint8_t* data_;
+};
+
+class CommandStatsRequestWriter {
+  public:
+    static constexpr size_t kSize = 1;
+    explicit CommandStatsRequestWriter(uint8_t* data) : data_(data) {}
+    void set_first_command(uint8_t value) { store_le<uint8_t>(data_ + 0, value); }
+  private:
+    uint8_t* data_;
+};
+
+// CommandStatsSummary: 8 bytes, little endian
+class CommandStatsSummaryView {
+  public:
+    static constexpr size_t kSize = 8;
+    explicit CommandStatsSummaryView(const uint8_t* data) : data_(data) {}
+    uint8_t num_commands() const { return load_le<uint8_t>(data_ + 0); }
+    uint32_t unknown_commands() const { return load_le<uint32_t>(data_ + 4); }
+  private:
+    const uint8_t* data_;
+};
+
+class CommandStatsSummaryWriter {
+  public:
+    static constexpr size_t kSize = 8;
+    explicit CommandStatsSummaryWriter(uint8_t* data) : data_(data) {}
+    void set_num_commands(uint8_t value) { store_le<uint8_t>(data_ + 0, value); }
+    void set_unknown_commands(uint32_t value) { store_le<uint32_t>(data_ + 4, value); }
+    void clear_padding() { memset(data_ + 1, 0, 3); }
+  private:
+    uint8_t* data_;
+};
+
+// CommandStatsRecord: 24 bytes, little endian
+class CommandStatsRecordView {
+  public:
+    static constexpr size_t kSize = 24;
+    explicit CommandStatsRecordView(const uint8_t* data) : data_(data) {}
+    uint8_t command_id() const { return load_le<uint8_t>(data_ + 0); }
+    uint32_t calls() const { return load_le<uint32_t>(data_ + 4); }
+    uint32_t errors() const { return load_le<uint32_t>(data_ + 8); }
+    uint32_t min_us() const { return load_le<uint32_t>(data_ + 12); }
+    uint32_t avg_us() const { return load_le<uint32_t>(data_ + 16); }
+    uint32_t max_us() const { return load_le<uint32_t>(data_ + 20); }
+  private:
+    const uint8_t* data_;
+};
+
+class CommandStatsRecordWriter {
+  public:
+    static constexpr size_t kSize = 24;
+    explicit CommandStatsRecordWriter(uint8_t* data) : data_(data) {}
+    void set_command_id(uint8_t value) { store_le<uint8_t>(data_ + 0, value); }
+    void set_calls(uint32_t value) { store_le<uint32_t>(data_ + 4, value); }
+    void set_errors(uint32_t value) { store_le<uint32_t>(data_ + 8, value); }
+    void set_min_us(uint32_t value) { store_le<uint32_t>(data_ + 12, value); }
+    void set_avg_us(uint32_t value) { store_le<uint32_t>(data_ + 16, value); }
+    void set_max_us(uint32_t value) { store_le<uint32_t>(data_ + 20, value); }
+    void clear_padding() { memset(data_ + 1, 0, 3); }
+  private:
+    uint8_t* data_;
+};
+
+// Fixed part of each request's data, by command id
+constexpr int kRequestSize[kNumCommandIds] = {0, 2, 8, 0, 0, 0, 0, 4, 0, 0, 0, 240, 240, 0, 0, 1, 1, 0, 4, 1, 1, 1, 4, 0, 0, 0, 3, 12, 1, 1, 1, 4, 1};
+// Size of the records repeated after the fixed part, 0 if there are none
+constexpr int kRequestItemSize[kNumCommandIds] = {0, 0, 0, 0, 0, 16, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 16, 0, 0, 0, 0, 0, 0, 0, 0, 2, 0};
+
+enum DispatchResult : uint8_t {
+  DISPATCH_OK,
+  DISPATCH_UNKNOWN_COMMAND,
+  DISPATCH_SHORT_REQUEST,  // less data than the fixed part of the request, handler not called
+};
+
+// A handler is only called with at least min_length bytes of request data
+template <typename Handlers>
+struct CommandDescriptor {
+  uint8_t id;
+  uint16_t min_length;
+  void (Handlers::*handler)(const uint8_t* data, int length);
+};
+
+// Indexed by command id, unassigned ids have no handler
+template <typename Handlers>
+constexpr CommandDescriptor<Handlers> kCommandTable[kNumCommandIds] = {
+  {CMD_PING, 0, &Handlers::on_ping},
+  {CMD_SET_VALVES, 2, &Handlers::on_set_valves},
+  {CMD_SET_PUMP, 8, &Handlers::on_set_pump},
+  {CMD_GET_WEIGHT, 0, &Handlers::on_get_weight},
+  {CMD_INIT_PROGRAM_WRITE, 0, &Handlers::on_init_program_write},
+  {CMD_WRITE_PROGRAM_BLOCK, 0, &Handlers::on_write_program_block},
+  {CMD_EXECUTE_PROGRAM, 0, &Handlers::on_execute_program},
+  {CMD_READ_PROGRAM_BLOCK, 4, &Handlers::on_read_program_block},
+  {CMD_GET_PROGRAM_LENGTH, 0, &Handlers::on_get_program_length},
+  {CMD_GET_REAGENTS, 0, &Handlers::on_get_reagents},
+  {CMD_GET_COLUMNS, 0, &Handlers::on_get_columns},
+  {CMD_SET_REAGENTS, 240, &Handlers::on_set_reagents},
+  {CMD_SET_COLUMNS, 240, &Handlers::on_set_columns},
+  {CMD_ABORT_PROGRAM, 0, &Handlers::on_abort_program},
+  {CMD_GET_DEVICE_STATE, 0, &Handlers::on_get_device_state},
+  {CMD_TARE_WEIGHT_SENSOR, 1, &Handlers::on_tare_weight_sensor},
+  {CMD_GET_TASK_DIAGNOSTICS, 1, &Handlers::on_get_task_diagnostics},
+  {CMD_GET_TRANSITION_STATS, 0, &Handlers::on_get_transition_stats},
+  {CMD_READ_RUN_LOG, 4, &Handlers::on_read_run_log},
+  {CMD_GET_COMMAND_STATS, 1, &Handlers::on_get_command_stats},
+  {CMD_SET_FRAMING, 1, &Handlers::on_set_framing},
+  {CMD_START_STREAM, 1, &Handlers::on_start_stream},
+  {CMD_STREAM_STEPS, 4, &Handlers::on_stream_steps},
+  {CMD_END_STREAM, 0, &Handlers::on_end_stream},
+  {CMD_GET_MIX_STATS, 0, &Handlers::on_get_mix_stats},
+  {CMD_GET_CHANNEL_STATES, 0, &Handlers::on_get_channel_states},
+  {CMD_SET_CHANNEL_VALVES, 3, &Handlers::on_set_channel_valves},
+  {CMD_SET_CHANNEL_PUMP, 12, &Handlers::on_set_channel_pump},
+  {CMD_GET_VALVE_STATS, 1, &Handlers::on_get_valve_stats},
+  {CMD_AUTOTUNE_VALVE, 1, &Handlers::on_autotune_valve},
+  {CMD_GET_STEP_JITTER, 1, &Handlers::on_get_step_jitter},
+  {CMD_SET_PULSATION, 4, &Handlers::on_set_pulsation},
+  {CMD_GET_PULSATION, 1, &Handlers::on_get_pulsation},
+};
+
+// Calls handlers.on_<command>(data, length) through kCommandTable
+template <typename Handlers>
+DispatchResult dispatch_command(Handlers& handlers, uint8_t command_id, const uint8_t* data, int length) {
+  if (command_id >= kNumCommandIds || kCommandTable<Handlers>[command_id].handler == nullptr) {
+    return DISPATCH_UNKNOWN_COMMAND;
+  }
+  const CommandDescriptor<Handlers>& command = kCommandTable<Handlers>[command_id];
+  if (length < command.min_length) {
+    return DISPATCH_SHORT_REQUEST;
+  }
+  (handlers.*command.handler)(data, length);
+  return DISPATCH_OK;
+}
+
+} // namespace protocol
+
+// Expand where the firmware structs are visible to check them against the schema layouts
+#define PROTOCOL_ASSERT_LAYOUTS() \
+  static_assert(sizeof(PumpCommand) == protocol::PumpCommandView::kSize, "PumpCommand does not match the PumpCommand layout"); \
+  static_assert(offsetof(PumpCommand, pump_cmd) == 0, "PumpCommand::pump_cmd offset"); \
+  static_assert(offsetof(PumpCommand, acceleration) == 4, "PumpCommand::acceleration offset"); \
+  static_assert(sizeof(ProgramStep) == protocol::ProgramStepView::kSize, "ProgramStep does not match the ProgramStep layout"); \
+  static_assert(offsetof(ProgramStep, reagent_valve_id) == 0, "ProgramStep::reagent_valve_id offset"); \
+  static_assert(offsetof(ProgramStep, column_valve_id) == 1, "ProgramStep::column_valve_id offset"); \
+  static_assert(offsetof(ProgramStep, ramp_end_flow) == 2, "ProgramStep::ramp_end_flow offset"); \
+  static_assert(offsetof(ProgramStep, flow_rate) == 4, "ProgramStep::flow_rate offset"); \
+  static_assert(offsetof(ProgramStep, volume) == 8, "ProgramStep::volume offset"); \
+  static_assert(offsetof(ProgramStep, duration) == 12, "ProgramStep::duration offset"); \
+  static_assert(sizeof(DeviceState) == protocol::DeviceStateView::kSize, "DeviceState does not match the DeviceState layout"); \
+  static_assert(offsetof(DeviceState, pump_speed) == 0, "DeviceState::pump_speed offset"); \
+  static_assert(offsetof(DeviceState, pump_volume) == 4, "DeviceState::pump_volume offset"); \
+  static_assert(offsetof(DeviceState, program_step_idx) == 8, "DeviceState::program_step_idx offset"); \
+  static_assert(offsetof(DeviceState, device_state) == 10, "DeviceState::device_state offset"); \
+  static_assert(offsetof(DeviceState, reagent_valve_position) == 11, "DeviceState::reagent_valve_position offset"); \
+  static_assert(offsetof(DeviceState, reagent_valve_state) == 12, "DeviceState::reagent_valve_state offset"); \
+  static_assert(offsetof(DeviceState, column_valve_position) == 13, "DeviceState::column_valve_position offset"); \
+  static_assert(offsetof(DeviceState, column_valve_state) == 14, "DeviceState::column_valve_state offset"); \
+  static_assert(offsetof(DeviceState, running) == 15, "DeviceState::running offset"); \
+  static_assert(offsetof(DeviceState, program_step_progress) == 16, "DeviceState::program_step_progress offset"); \
+  static_assert(offsetof(DeviceState, num_pumps) == 17, "DeviceState::num_pumps offset"); \
+  static_assert(offsetof(DeviceState, num_valves) == 18, "DeviceState::num_valves offset"); \
+  static_assert(sizeof(ChannelState) == protocol::ChannelStateView::kSize, "ChannelState does not match the ChannelState layout"); \
+  static_assert(offsetof(ChannelState, pump_speed) == 0, "ChannelState::pump_speed offset"); \
+  static_assert(offsetof(ChannelState, pump_volume) == 4, "ChannelState::pump_volume offset"); \
+  static_assert(offsetof(ChannelState, device_state) == 8, "ChannelState::device_state offset"); \
+  static_assert(offsetof(ChannelState, reagent_valve_position) == 9, "ChannelState::reagent_valve_position offset"); \
+  static_assert(offsetof(ChannelState, reagent_valve_state) == 10, "ChannelState::reagent_valve_state offset"); \
+  static_assert(offsetof(ChannelState, column_valve_position) == 11, "ChannelState::column_valve_position offset"); \
+  static_assert(offsetof(ChannelState, column_valve_state) == 12, "ChannelState::column_valve_state offset"); \
+  static_assert(offsetof(ChannelState, pump) == 13, "ChannelState::pump offset"); \
+  static_assert(offsetof(ChannelState, reagent_valve) == 14, "ChannelState::reagent_valve offset"); \
+  static_assert(offsetof(ChannelState, column_valve) == 15, "ChannelState::column_valve offset"); \
+  static_assert(sizeof(HeapDiagnostics) == protocol::HeapDiagnosticsView::kSize, "HeapDiagnostics does not match the HeapDiagnostics layout"); \
+  static_assert(offsetof(HeapDiagnostics, free_bytes) == 0, "HeapDiagnostics::free_bytes offset"); \
+  static_assert(offsetof(HeapDiagnostics, largest_free_block) == 4, "HeapDiagnostics::largest_free_block offset"); \
+  static_assert(offsetof(HeapDiagnostics, min_free_bytes) == 8, "HeapDiagnostics::min_free_bytes offset"); \
+  static_assert(offsetof(HeapDiagnostics, fragmentation) == 12, "HeapDiagnostics::fragmentation offset"); \
+  static_assert(offsetof(HeapDiagnostics, num_tasks) == 13, "HeapDiagnostics::num_tasks offset"); \
+  static_assert(sizeof(TaskDiagnostics) == protocol::TaskDiagnosticsView::kSize, "TaskDiagnostics does not match the TaskDiagnostics layout"); \
+  static_assert(offsetof(TaskDiagnostics, name) == 0, "TaskDiagnostics::name offset"); \
+  static_assert(offsetof(TaskDiagnostics, cpu_permille) == 12, "TaskDiagnostics::cpu_permille offset"); \
+  static_assert(offsetof(TaskDiagnostics, priority) == 14, "TaskDiagnostics::priority offset"); \
+  static_assert(offsetof(TaskDiagnostics, state) == 15, "TaskDiagnostics::state offset"); \
+  static_assert(offsetof(TaskDiagnostics, stack_high_water) == 16, "TaskDiagnostics::stack_high_water offset"); \
+  static_assert(sizeof(TransitionStats) == protocol::TransitionStatsView::kSize, "TransitionStats does not match the TransitionStats layout"); \
+  static_assert(offsetof(TransitionStats, last_transition_ms) == 0, "TransitionStats::last_transition_ms offset"); \
+  static_assert(offsetof(TransitionStats, last_overlap_ms) == 4, "TransitionStats::last_overlap_ms offset"); \
+  static_assert(offsetof(TransitionStats, total_overlap_ms) == 8, "TransitionStats::total_overlap_ms offset"); \
+  static_assert(offsetof(TransitionStats, transitions) == 12, "TransitionStats::transitions offset"); \
+  static_assert(sizeof(RunLogRecord) == protocol::RunLogRecordView::kSize, "RunLogRecord does not match the RunLogRecord layout"); \
+  static_assert(offsetof(RunLogRecord, type) == 0, "RunLogRecord::type offset"); \
+  static_assert(offsetof(RunLogRecord, flags) == 1, "RunLogRecord::flags offset"); \
+  static_assert(offsetof(RunLogRecord, step_idx) == 2, "RunLogRecord::step_idx offset"); \
+  static_assert(offsetof(RunLogRecord, run_id) == 4, "RunLogRecord::run_id offset"); \
+  static_assert(offsetof(RunLogRecord, time_ms) == 8, "RunLogRecord::time_ms offset"); \
+  static_assert(offsetof(RunLogRecord, volume) == 12, "RunLogRecord::volume offset"); \
+  static_assert(offsetof(RunLogRecord, overshoot) == 16, "RunLogRecord::overshoot offset");
+
+#endif // PROTOCOL_H
@@ -0,0 +1,71 @@
+#ifndef PULSATION_COMPENSATION_H
+#define PULSATION_COMPENSATION_H
+
+#include <Arduino.h>
+#include "protocol.h"
+
+constexpr uint8_t kPulsationBins = protocol::kPulsationBins;
+constexpr int32_t kPulsationScale = protocol::kPulsationScale;
+constexpr int32_t kPulsationMaxCorrection = protocol::kPulsationMaxCorrection;
+
+/*
+Step delay corrections over one revolution of a peristaltic pump. The flow of
+a step depends on where the rollers are: it dips every time one lifts off the
+tubing. The revolution is split into kPulsationBins bins, starting at phase
+(a rotor position, in steps), and every step delay in a bin is stretched or
+shortened by its correction, in 1/kPulsationScale: steps that move more liquid
+are taken more slowly, so the flow stays flat.
+
+The corrections must add up to zero, so a revolution takes as long as without
+them and the average flow is that of the uncompensated pump. The rotor has no
+index sensor: positions count steps since boot, and the phase of a table only
+holds until the device restarts (see pulsation_calibration.py).
+
+set() runs in the communication task while the step timer reads the bins; a
+step timed half by the old and half by the new table is harmless.
+*/
+class PulsationCompensation {
+  public:
+    PulsationCompensation() {
+      for (uint8_t i = 0; i < kPulsationBins; i++) {
+        factors_[i] = kPulsationScale;
+      }
+    }
+
+    // false, and nothing changed, if a correction is out of range or they don't add up to zero
+    bool set(const int16_t* corrections, uint16_t phase, bool enabled) {
+      int32_t sum = 0;
+      for (uint8_t i = 0; i < kPulsationBins; i++) {
+        if (corrections[i] < -kPulsationMaxCorrection || corrections[i] > kPulsationMaxCorrection) {
+          return false;
+        }
+        sum += corrections[i];
+      }
+      if (sum != 0) {
+        return false;
+      }
+      enabled_ = false;
+      for (uint8_t i = 0; i < kPulsationBins; i++) {
+        factors_[i] = kPulsationScale + corrections[i];
+      }
+      phase_ = phase;
+      enabled_ = enabled;
+      return true;
+    }
+
+    bool IRAM_ATTR enabled() const { return enabled_; }
+    uint16_t IRAM_ATTR phase() const { return phase_; }
+    int16_t correction(uint8_t bin) const { return factors_[bin] - kPulsationScale; }
+
+    // The product fits in 32 bits for delays up to 286 ms, LEDC periods included
+    uint32_t IRAM_ATTR scale(uint32_t delay_us, uint8_t bin) const {
+      return delay_us * factors_[bin] / kPulsationScale;
+    }
+
+  private:
+    uint16_t factors_[kPulsationBins];
+    uint16_t phase_ = 0;
+    volatile bool enabled_ = false;
+};
+
+#endif // PULSATION_COMPENSATION_H
@@ -0,0 +1,287 @@
+#ifndef PULSE_OUTPUT_H
+#define PULSE_OUTPUT_H
+
+#include <Arduino.h>
+#include <freertos/FreeRTOS.h>
+#include <driver/gpio.h>
+#include <driver/ledc.h>
+#include <driver/pcnt.h>
+#include <esp_rom_gpio.h>
+#include <soc/gpio_sig_map.h>
+#ifdef ARDUINO_ARCH_ESP32
+#include <soc/ledc_struct.h>
+#include <soc/pcnt_struct.h>
+#endif
+
+constexpr uint32_t kPulseMinPeriodUs = 256;     // LEDC divider 1.0
+constexpr uint32_t kPulseMaxPeriodUs = 262143;  // largest 18-bit LEDC divider
+constexpr int16_t kPulseCountLimit = 32000;     // the PCNT counter wraps to 0 here
+constexpr uint16_t kPulseFilterApbCycles = 100; // PCNT ignores glitches shorter than 1.25 us
+constexpr uint32_t kPulseHalfDuty = 1 << (LEDC_TIMER_8_BIT - 1);
+
+// Called from the PCNT interrupt when the count reaches the target
+using PulseTargetHandler = void (*)();
+
+/*
+Step pulses from an LEDC channel, and every rising edge of the step pin
+counted by a PCNT unit, for pumping at constant speed without a step
+interrupt per step.
+
+LEDC runs from the 1 MHz REF_TICK with 8 bit duty resolution, so its Q10.8
+clock divider is the pulse period in microseconds, with the same resolution as
+the software half-step delays; the duty is 50%. start() and stop() switch the
+pin in the GPIO matrix between the LEDC signal and the GPIO output register,
+which the step timer writes in between (ramps, reversals). PCNT reads the pin
+through the matrix input whichever of them drives it, so the count is exact
+even if interrupts come late; only the wrap of its 16 bit counter needs one,
+every kPulseCountLimit steps.
+
+set_period() changes the period on the fly, for step timing that varies over
+a revolution (pulsation_compensation.h).
+
+start(), stop(), set_period() and count() run in the step timer interrupt.
+On the ESP32 they write the LEDC and PCNT registers directly, like
+fast_gpio.h does for GPIO: the LEDC and PCNT driver functions are in flash
+and take a spinlock. The GPIO matrix is switched with the ROM function.
+Elsewhere (host benchmarks) they go through the driver API.
+
+A count target is a PCNT threshold event, armed once the target falls within
+the current counter window. The threshold is written while the unit counts;
+callers still check the count themselves, the interrupt only gets them there
+sooner.
+
+The target is set from the control loop, on the same core as the interrupts.
+*/
+class PulseOutput {
+  public:
+    void begin(uint8_t pin, ledc_timer_t timer, ledc_channel_t channel, pcnt_unit_t unit, PulseTargetHandler on_target) {
+      pin_ = pin;
+      timer_ = timer;
+      channel_ = channel;
+      unit_ = unit;
+      on_target_ = on_target;
+
+      ledc_timer_config_t timer_config = {
+        .speed_mode = LEDC_HIGH_SPEED_MODE,
+        .duty_resolution = LEDC_TIMER_8_BIT,
+        .timer_num = timer_,
+        .freq_hz = 1000,
+        .clk_cfg = LEDC_USE_REF_TICK,
+      };
+      ledc_timer_config(&timer_config);
+      ledc_timer_pause(LEDC_HIGH_SPEED_MODE, timer_);
+      ledc_channel_config_t channel_config = {
+        .gpio_num = pin_,
+        .speed_mode = LEDC_HIGH_SPEED_MODE,
+        .channel = channel_,
+        .intr_type = LEDC_INTR_DISABLE,
+        .timer_sel = timer_,
+        .duty = 0,
+        .hpoint = 0,
+      };
+      ledc_channel_config(&channel_config);
+      ledc_stop(LEDC_HIGH_SPEED_MODE, channel_, 0);
+
+      pcnt_config_t pcnt_config = {
+        .pulse_gpio_num = pin_,
+        .ctrl_gpio_num = PCNT_PIN_NOT_USED,
+        .lctrl_mode = PCNT_MODE_KEEP,
+        .hctrl_mode = PCNT_MODE_KEEP,
+        .pos_mode = PCNT_COUNT_INC,
+        .neg_mode = PCNT_COUNT_DIS,
+        .counter_h_lim = kPulseCountLimit,
+        .counter_l_lim = 0,
+        .unit = unit_,
+        .channel = PCNT_CHANNEL_0,
+      };
+      pcnt_unit_config(&pcnt_config);
+      pcnt_set_filter_value(unit_, kPulseFilterApbCycles);
+      pcnt_filter_enable(unit_);
+      pcnt_event_enable(unit_, PCNT_EVT_H_LIM);
+      pcnt_counter_pause(unit_);
+      pcnt_counter_clear(unit_);
+      pcnt_isr_service_install(0); // shared by all units: fails harmlessly for the second one
+      pcnt_isr_handler_add(unit_, &PulseOutput::on_pcnt_event, this);
+
+      // PCNT made the pin an input: drive it again, from the GPIO register, low
+      gpio_set_direction((gpio_num_t)pin_, GPIO_MODE_INPUT_OUTPUT);
+      esp_rom_gpio_connect_out_signal(pin_, SIG_GPIO_OUT_IDX, false, false);
+      digitalWrite(pin_, LOW);
+      pcnt_counter_resume(unit_);
+    }
+
+    static constexpr bool period_supported(uint32_t period_us) {
+      return period_us >= kPulseMinPeriodUs && period_us <= kPulseMaxPeriodUs;
+    }
+
+    // Rising edge now, then one every period_us; the pin must be low
+    void IRAM_ATTR start(uint32_t period_us) {
+#ifdef ARDUINO_ARCH_ESP32
+      // What ledc_timer_set(), ledc_timer_rst(), ledc_set_duty(), ledc_update_duty() and ledc_timer_resume()
+      // write; tick_sel, the duty resolution and the idle level are set once in begin()
+      auto& timer = LEDC.timer_group[LEDC_HIGH_SPEED_MODE].timer[timer_];
+      auto& channel = LEDC.channel_group[LEDC_HIGH_SPEED_MODE].channel[channel_];
+      timer.conf.clock_divider = period_us;
+      timer.conf.rst = 1;
+      timer.conf.rst = 0;
+      channel.hpoint.hpoint = 0;
+      channel.duty.duty = kPulseHalfDuty << 4; // 4 fractional bits
+      channel.conf1.duty_inc = 1;
+      channel.conf1.duty_num = 1;
+      channel.conf1.duty_cycle = 1;
+      channel.conf1.duty_scale = 0;
+      channel.conf0.sig_out_en = 1;
+      channel.conf1.duty_start = 1;
+      timer.conf.pause = 0;
+#else
+      ledc_timer_set(LEDC_HIGH_SPEED_MODE, timer_, period_us, LEDC_TIMER_8_BIT, LEDC_REF_TICK);
+      ledc_timer_rst(LEDC_HIGH_SPEED_MODE, timer_);
+      ledc_set_duty(LEDC_HIGH_SPEED_MODE, channel_, kPulseHalfDuty);
+      ledc_update_duty(LEDC_HIGH_SPEED_MODE, channel_);
+      ledc_timer_resume(LEDC_HIGH_SPEED_MODE, timer_);
+#endif
+      esp_rom_gpio_connect_out_signal(pin_, LEDC_HS_SIG_OUT0_IDX + channel_, false, false);
+      started_us_ = micros();
+      period_us_ = period_us;
+    }
+
+    // Back to the GPIO register, low; a pulse in progress is cut short after its rising edge.
+    // Returns the time until LEDC's next rising edge, for the software steps to go on from there.
+    uint32_t IRAM_ATTR stop() {
+      esp_rom_gpio_connect_out_signal(pin_, SIG_GPIO_OUT_IDX, false, false);
+#ifdef ARDUINO_ARCH_ESP32
+      // ledc_stop() with idle level 0, then ledc_timer_pause()
+      auto& channel = LEDC.channel_group[LEDC_HIGH_SPEED_MODE].channel[channel_];
+      channel.conf0.sig_out_en = 0;
+      channel.conf1.duty_start = 0;
+      LEDC.timer_group[LEDC_HIGH_SPEED_MODE].timer[timer_].conf.pause = 1;
+#else
+      ledc_stop(LEDC_HIGH_SPEED_MODE, channel_, 0);
+      ledc_timer_pause(LEDC_HIGH_SPEED_MODE, timer_);
+#endif
+      uint32_t next_edge = next_edge_us();
+      period_us_ = 0;
+      return next_edge;
+    }
+
+    // The timer takes a new divider at its next overflow: the pulse in progress keeps
+    // its period and the new one starts with the next rising edge.
+    void IRAM_ATTR set_period(uint32_t period_us) {
+      if (period_us == period_us_) {
+        return;
+      }
+      uint32_t next_edge = next_edge_us();
+#ifdef ARDUINO_ARCH_ESP32
+      LEDC.timer_group[LEDC_HIGH_SPEED_MODE].timer[timer_].conf.clock_divider = period_us;
+#else
+      ledc_timer_set(LEDC_HIGH_SPEED_MODE, timer_, period_us, LEDC_TIMER_8_BIT, LEDC_REF_TICK);
+#endif
+      started_us_ = micros() + next_edge;
+      period_us_ = period_us;
+    }
+
+    // Time until the next rising edge while running
+    uint32_t IRAM_ATTR next_edge_us() const {
+      int32_t elapsed = (int32_t)(micros() - started_us_);
+      if (elapsed < 0) {
+        return -elapsed; // the first edge of a new period is still ahead
+      }
+      return period_us_ - (uint32_t)elapsed % period_us_;
+    }
+
+    bool IRAM_ATTR running() const { return period_us_ != 0; }
+    uint32_t period_us() const { return period_us_; }
+
+    // Rising edges since begin()
+    uint32_t IRAM_ATTR count() const {
+      int16_t value = 0;
+      uint32_t total;
+      do {
+        total = total_;
+#ifdef ARDUINO_ARCH_ESP32
+        value = (int16_t)PCNT.cnt_unit[unit_].cnt_val;
+#else
+        pcnt_get_counter_value(unit_, &value);
+#endif
+      } while (total != total_);
+      uint32_t count = total + value;
+      // The counter wrapped and its interrupt has not run yet: the count went back by a whole window
+      if ((int32_t)(count - last_count_) < -kPulseCountLimit / 2) {
+        count += kPulseCountLimit;
+      }
+      if ((int32_t)(count - last_count_) > 0) {
+        last_count_ = count;
+      }
+      return count;
+    }
+
+    // on_target is called once when count() reaches target; false if it already has
+    bool set_target(uint32_t target) {
+      portENTER_CRITICAL(&mux_);
+      target_ = target;
+      target_armed_ = (int32_t)(target - count()) > 0;
+      if (target_armed_) {
+        arm_threshold();
+      }
+      portEXIT_CRITICAL(&mux_);
+      return target_armed_;
+    }
+
+    void clear_target() {
+      portENTER_CRITICAL(&mux_);
+      target_armed_ = false;
+      pcnt_event_disable(unit_, PCNT_EVT_THRES_0);
+      portEXIT_CRITICAL(&mux_);
+    }
+
+  private:
+    uint8_t pin_ = 0;
+    ledc_timer_t timer_ = LEDC_TIMER_0;
+    ledc_channel_t channel_ = LEDC_CHANNEL_0;
+    pcnt_unit_t unit_ = PCNT_UNIT_0;
+    PulseTargetHandler on_target_ = nullptr;
+    volatile uint32_t period_us_ = 0;
+    uint32_t started_us_ = 0;            // a rising edge, every period_us_ from there on
+    volatile uint32_t total_ = 0;        // counter wraps so far, times kPulseCountLimit
+    mutable volatile uint32_t last_count_ = 0;
+    volatile uint32_t target_ = 0;
+    volatile bool target_armed_ = false;
+    portMUX_TYPE mux_ = portMUX_INITIALIZER_UNLOCKED;
+
+    // The threshold is a counter value, so only a target within the current window can be set
+    void arm_threshold() {
+      uint32_t offset = target_ - total_;
+      if (offset > 0 && offset < (uint32_t)kPulseCountLimit) {
+        pcnt_set_event_value(unit_, PCNT_EVT_THRES_0, (int16_t)offset);
+        pcnt_event_enable(unit_, PCNT_EVT_THRES_0);
+      } else {
+        pcnt_event_disable(unit_, PCNT_EVT_THRES_0);
+      }
+    }
+
+    static void IRAM_ATTR on_pcnt_event(void* arg) {
+      PulseOutput* self = (PulseOutput*)arg;
+      uint32_t status = 0;
+      pcnt_get_event_status(self->unit_, &status);
+      bool reached = false;
+      portENTER_CRITICAL(&self->mux_);
+      if (status & PCNT_EVT_H_LIM) {
+        self->total_ += kPulseCountLimit;
+      }
+      if (self->target_armed_) {
+        if ((int32_t)(self->count() - self->target_) >= 0) {
+          self->target_armed_ = false;
+          pcnt_event_disable(self->unit_, PCNT_EVT_THRES_0);
+          reached = true;
+        } else if (status & PCNT_EVT_H_LIM) {
+          self->arm_threshold(); // the next window may hold the target
+        }
+      }
+      portEXIT_CRITICAL(&self->mux_);
+      if (reached && self->on_target_ != nullptr) {
+        self->on_target_();
+      }
+    }
+};
+
+#endif // PULSE_OUTPUT_H
@@ -3,6 +3,9 @@
 
 #include <Arduino.h>
 #include "pumped_volume_counter.h"
+#include "fast_gpio.h"
+#include "pulse_output.h"
+#include "pulsation_compensation.h"
 
 struct PumpCommand {
   float pump_cmd;
@@ -12,6 +15,10 @@ struct PumpCommand {
 
 constexpr float kMaxSpeed = 10.0; // ml / min
 constexpr uint32_t kMaxStepDelayUs = 100000;
+constexpr uint32_t kPulsePollUs = 10000; // step timer period while LEDC steps: one control loop period
+constexpr uint8_t kPulseSteadyTicks = 10; // control ticks at an unchanged set speed before LEDC takes over
+constexpr float kDefaultPumpAcceleration = 5.0;  // mL/min/s, program steps
+constexpr float kValveChangeDeceleration = 10.0; // mL/min/s, pump stop before a valve change
 
 struct PumpControlConfig {
     uint8_t enable_pin;
@@ -19,23 +26,58 @@ struct PumpControlConfig {
     uint8_t step_pin;
     float dt;
     bool invert_direction;
-    uint32_t steps_per_revolution;
+    uint32_t steps_per_revolution; // of the rotor, microsteps included; a multiple of kPulsationBins
     float volume_per_step; // uL / step
+    uint32_t direction_setup_us; // driver's minimum time between a direction change and the next step edge
 };
 
-class PumpControl {
+// Pump axis as seen by the device FSM and the control loop, so a device can
+// drive any number of differently configured pumps (see DeviceConfig).
+class PumpAxis {
   public:
-    PumpControl(PumpControlConfig config) : config_(config) , volume_counter_(config.volume_per_step) {
-      step_time_to_speed_coeff_ = 30000 * config.volume_per_step; // Based on unit conversions
-    }
+    virtual void initialize() = 0;
+    virtual void set_pump(PumpCommand pump_cmd) = 0;
+    virtual void enable() = 0;
+    virtual void disable() = 0;
+    virtual void update_speed() = 0;
+    virtual uint32_t step() = 0;
+    virtual bool is_stopped() = 0;
+    virtual float get_volume() const = 0;
+    virtual void reset_volume() = 0;
+    virtual uint32_t get_total_steps() const = 0;
+    virtual float get_current_speed() const = 0;
+    virtual float volume_per_step() const = 0; // uL / step
+    virtual uint8_t step_pin() const = 0;
+    virtual void attach_pulse_output(PulseOutput* output) = 0;
+    virtual void set_volume_target(float volume_ul) = 0;
+    virtual uint16_t steps_per_revolution() const = 0;
+    virtual uint16_t rotor_position() const = 0;
+    virtual bool set_pulsation(const int16_t* corrections, uint16_t phase, bool enabled) = 0;
+    virtual const PulsationCompensation& pulsation() const = 0;
+};
 
-    void initialize() {
-      pinMode(config_.enable_pin, OUTPUT);
-      pinMode(config_.direction_pin, OUTPUT);
-      pinMode(config_.step_pin, OUTPUT);
+// Config is a constexpr PumpControlConfig (see device.h). Pins, polarity and
+// unit conversion constants are template constants, so the step timer callback
+// compiles down to immediates instead of loads and branches on a runtime copy.
+// The class is final: calls through the concrete type are not virtual.
+template <const PumpControlConfig& Config>
+class PumpControl final : public PumpAxis {
+    static_assert(Config.enable_pin < kExpanderPinBase && Config.direction_pin < kExpanderPinBase &&
+                  Config.step_pin < kExpanderPinBase, "pump lines must be native GPIOs: it steps right after enable()");
+    static_assert(Config.steps_per_revolution > 0 && Config.steps_per_revolution <= UINT16_MAX &&
+                  Config.steps_per_revolution % kPulsationBins == 0, "pulsation bins must split the revolution evenly");
+
+  public:
+    PumpControl() : volume_counter_(Config.volume_per_step) {}
+
+    void initialize() override {
+      pinMode(Config.enable_pin, OUTPUT);
+      pinMode(Config.direction_pin, OUTPUT);
+      pinMode(Config.step_pin, OUTPUT);
+      digitalWrite(Config.direction_pin, forward_ != Config.invert_direction);
     }
 
-    void set_pump(PumpCommand pump_cmd) {
+    void set_pump(PumpCommand pump_cmd) override {
       /*
       Don't call this method directly, it won't be synchronized with the valves
       Use device.set_pump() instead.
@@ -47,26 +89,31 @@ class PumpControl {
       } else if (pump_cmd.pump_cmd < -kMaxSpeed) {
         pump_cmd.pump_cmd = -kMaxSpeed;
       }
+      if (pump_cmd.pump_cmd != target_speed_) {
+        target_half_step_delay_us_ = half_step_delay_for_speed(pump_cmd.pump_cmd);
+        steady_ticks_ = 0;
+      }
       target_speed_ = pump_cmd.pump_cmd;
     }
 
-    void enable() {
-      digitalWrite(config_.enable_pin, LOW);
+    void enable() override {
+      digitalWrite(Config.enable_pin, LOW);
       enable_ = true;
     }
 
-    void disable() {
-      digitalWrite(config_.enable_pin, HIGH);
+    void disable() override {
+      digitalWrite(Config.enable_pin, HIGH);
       enable_ = false;
+      step_enabled_ = false;
     }
 
-    void update_speed() {
-      if (fabs(target_speed_ - current_speed_) < acceleration_ * config_.dt) {
+    void update_speed() override {
+      if (fabs(target_speed_ - current_speed_) < acceleration_ * Config.dt) {
         current_speed_ = target_speed_;
       } else if (target_speed_ > current_speed_) {
-        current_speed_ += acceleration_ * config_.dt;
+        current_speed_ += acceleration_ * Config.dt;
       } else if (target_speed_ < current_speed_) {
-        current_speed_ -= acceleration_ * config_.dt;
+        current_speed_ -= acceleration_ * Config.dt;
       }
 
       if (fabs(current_speed_) < 1e-6) {
@@ -78,67 +125,230 @@ class PumpControl {
         if (!enable_) {
           enable();
         }
-        uint32_t delay = step_time_to_speed_coeff_ / fabs(current_speed_);
-        if (delay > kMaxStepDelayUs) {
-          half_step_delay_us_ = kMaxStepDelayUs;
-        } else {
-          half_step_delay_us_ = delay;
-        }
+        // Ramping: one divide per control tick, the step timer callback only reads the result
+        half_step_delay_us_ = current_speed_ == target_speed_ ? target_half_step_delay_us_ // cruising, from set_pump()
+                                                              : half_step_delay_for_speed(current_speed_);
       }
 
+      // step() runs in the step timer interrupt and must not use the FPU: it only reads this integer state
+      step_forward_ = current_speed_ > 0;
+      step_enabled_ = enable_ && fabs(current_speed_) >= 1e-6;
+
+      // LEDC takes over the steps once cruising in the direction already set; step() does the hand-overs.
+      // A flow ramp within a program step moves the set speed every tick: the steps stay on the timer until it holds still.
+      if (current_speed_ != target_speed_) {
+        steady_ticks_ = 0;
+      } else if (steady_ticks_ < kPulseSteadyTicks) {
+        steady_ticks_++;
+      }
+      uint32_t period = 2 * target_half_step_delay_us_;
+      bool cruising = enable_ && steady_ticks_ >= kPulseSteadyTicks && fabs(target_speed_) >= 1e-6 &&
+                      (target_speed_ > 0) == forward_;
+      cruise_period_us_ = pulse_output_ != nullptr && cruising && PulseOutput::period_supported(period) ? period : 0;
     }
 
     // Returns the next delay in microseconds, or kMaxStepDelayUs if no step should be taken
-    uint32_t step() {
-        if (!enable_) {
-            return kMaxStepDelayUs; // Don't step if disabled
+    uint32_t IRAM_ATTR step() override {
+        if (pulse_output_ != nullptr && pulse_output_->running()) {
+            if (cruise_period_us_ == pulse_base_period_us_) {
+                return retime_pulses(); // nothing else to do until the speed changes
+            }
+            // Ramp, reversal or stop: software steps go on from a low pin, at LEDC's next rising edge
+            step_state_ = LOW;
+            uint32_t next_edge = pulse_output_->stop();
+            rotor_step_ = advance_rotor(pulse_rotor_start_, pulse_output_->count() - pulse_count_start_);
+            return next_edge;
         }
-        if (fabs(current_speed_) < 1e-6) {
-            return kMaxStepDelayUs; // Don't step if speed is too low
+        if (!step_enabled_) {
+            return kMaxStepDelayUs; // Don't step if disabled or the speed is too low
         }
-        
-        if (current_speed_ > 0) {
-            digitalWrite(config_.direction_pin, !config_.invert_direction);
-        } else {
-            digitalWrite(config_.direction_pin, config_.invert_direction);
+
+        // The direction pin is only touched on reversal. The step edge is then postponed
+        // by the driver's direction setup time so the first step in the new direction isn't lost.
+        bool forward = step_forward_;
+        if (forward != forward_) {
+            forward_ = forward;
+            fast_digital_write<Config.direction_pin>(forward != Config.invert_direction);
+            return Config.direction_setup_us;
         }
+
+        if (step_state_ == LOW && cruise_period_us_ != 0) {
+            // Its first rising edge is this step; PCNT counts the rotor's steps from here
+            pulse_rotor_start_ = rotor_step_;
+            pulse_count_start_ = pulse_output_->count();
+            pulse_base_period_us_ = cruise_period_us_;
+            pulse_output_->start(compensated(cruise_period_us_, advance_rotor(rotor_step_, 1)));
+            return retime_pulses();
+        }
+
         step_state_ = !step_state_;
-        digitalWrite(config_.step_pin, step_state_);
+        fast_digital_write<Config.step_pin>(step_state_);
 
         if (step_state_ == HIGH) {
-          volume_counter_.increment(); // only increment once per full step
+          if (pulse_output_ == nullptr) {
+            volume_counter_.increment(); // only increment once per full step; PCNT counts them otherwise
+          }
+          rotor_step_ = advance_rotor(rotor_step_, 1);
         }
 
         // Return next delay in microseconds
-        return half_step_delay_us_;
+        return compensated(half_step_delay_us_, rotor_step_);
     }
 
-    bool is_stopped() {
+    bool is_stopped() override {
       return fabs(current_speed_) < 1e-6;
     }
 
-    float get_volume() const {
+    float get_volume() const override {
+      if (pulse_output_ != nullptr) {
+        return (pulse_output_->count() - volume_base_steps_) * Config.volume_per_step;
+      }
       return volume_counter_.get_volume();
     }
 
-    void reset_volume() {
+    void reset_volume() override {
+      if (pulse_output_ != nullptr) {
+        volume_base_steps_ = pulse_output_->count();
+      }
       volume_counter_.reset();
     }
 
-    float get_current_speed() const {
+    uint32_t get_total_steps() const override {
+      return pulse_output_ != nullptr ? pulse_output_->count() : volume_counter_.get_total_steps();
+    }
+
+    float get_current_speed() const override {
       return current_speed_;
     }
 
+    float volume_per_step() const override {
+      return Config.volume_per_step;
+    }
+
+    uint8_t step_pin() const override {
+      return Config.step_pin;
+    }
+
+    // Before the step timer starts. From then on LEDC steps at constant speed and PCNT counts all steps.
+    void attach_pulse_output(PulseOutput* output) override {
+      pulse_output_ = output;
+      volume_base_steps_ = output->count();
+    }
+
+    // The pulse output's handler is called when get_volume() reaches volume_ul; INFINITY for none
+    void set_volume_target(float volume_ul) override {
+      if (pulse_output_ == nullptr) {
+        return;
+      }
+      if (isinf(volume_ul)) {
+        pulse_output_->clear_target();
+        return;
+      }
+      // Same float product as get_volume(), so the volume check passes at the target step
+      uint32_t steps = ceilf(volume_ul / Config.volume_per_step);
+      while (steps * Config.volume_per_step < volume_ul) {
+        steps++;
+      }
+      pulse_output_->set_target(volume_base_steps_ + steps);
+    }
+
+    uint16_t steps_per_revolution() const override {
+      return Config.steps_per_revolution;
+    }
+
+    // Steps since boot, modulo a revolution: the rotor angle up to the phase of the pulsation table
+    uint16_t IRAM_ATTR rotor_position() const override {
+      if (pulse_output_ != nullptr && pulse_output_->running()) {
+        return advance_rotor(pulse_rotor_start_, pulse_output_->count() - pulse_count_start_);
+      }
+      return rotor_step_;
+    }
+
+    // false if phase is not a rotor position or the corrections are refused (PulsationCompensation::set())
+    bool set_pulsation(const int16_t* corrections, uint16_t phase, bool enabled) override {
+      return phase < Config.steps_per_revolution && pulsation_.set(corrections, phase, enabled);
+    }
+
+    const PulsationCompensation& pulsation() const override {
+      return pulsation_;
+    }
+
   private:
+    static constexpr float kStepTimeToSpeedCoeff = 30000 * Config.volume_per_step; // uS / step, based on unit conversions
+
+    static uint32_t half_step_delay_for_speed(float speed) {
+      if (fabs(speed) < 1e-6) {
+        return kMaxStepDelayUs;
+      }
+      uint32_t delay = kStepTimeToSpeedCoeff / fabs(speed);
+      return delay > kMaxStepDelayUs ? kMaxStepDelayUs : delay;
+    }
+
     float target_speed_ = 0;
     float current_speed_ = 0;
     float acceleration_ = 0;
     uint32_t half_step_delay_us_ = kMaxStepDelayUs;
+    uint32_t target_half_step_delay_us_ = kMaxStepDelayUs;
+    uint8_t steady_ticks_ = 0; // control ticks cruising at target_speed_, up to kPulseSteadyTicks
     PumpedVolumeCounter volume_counter_;
-    PumpControlConfig config_;
     bool enable_ = false;
+    volatile bool step_enabled_ = false; // enabled and at a speed to step at, from update_speed()
+    volatile bool step_forward_ = true;  // sign of the current speed, from update_speed()
+    bool forward_ = true; // direction currently set on the direction pin
     uint8_t step_state_ = LOW;
-    float step_time_to_speed_coeff_; // uS / step
+    PulseOutput* pulse_output_ = nullptr;
+    uint32_t volume_base_steps_ = 0;     // PCNT count at the last reset_volume()
+    volatile uint32_t cruise_period_us_ = 0; // LEDC period to step at, 0: software steps
+    uint32_t pulse_base_period_us_ = 0;  // cruise period LEDC was started at, before compensation
+    uint16_t pulse_rotor_start_ = 0;     // rotor position and PCNT count when LEDC was started
+    uint32_t pulse_count_start_ = 0;
+    volatile uint16_t rotor_step_ = 0;   // rotor position of the last step taken in software
+    PulsationCompensation pulsation_;
+
+    static constexpr uint32_t kStepsPerBin = Config.steps_per_revolution / kPulsationBins;
+
+    // Rotor position `steps` steps further in the direction set
+    uint16_t IRAM_ATTR advance_rotor(uint16_t position, uint32_t steps) const {
+      steps %= Config.steps_per_revolution;
+      if (!forward_) {
+        steps = Config.steps_per_revolution - steps;
+      }
+      return (position + steps) % Config.steps_per_revolution;
+    }
+
+    // Position within the pulsation table, which starts at its phase
+    uint32_t IRAM_ATTR table_position(uint16_t rotor_position) const {
+      return (rotor_position + Config.steps_per_revolution - pulsation_.phase()) % Config.steps_per_revolution;
+    }
+
+    // Delay of the step at rotor_position, stretched or shortened by its bin's correction
+    uint32_t IRAM_ATTR compensated(uint32_t delay_us, uint16_t rotor_position) const {
+      if (!pulsation_.enabled()) {
+        return delay_us;
+      }
+      return pulsation_.scale(delay_us, table_position(rotor_position) / kStepsPerBin);
+    }
+
+    /*
+    While LEDC steps: sets the period of the step after the current one, which
+    takes effect at its rising edge, and returns when to do it again, i.e. half
+    a period into the last step of that step's bin (and at least every
+    kPulsePollUs, for speed changes). The period thus changes from one bin to
+    the next exactly at the bin boundary.
+    */
+    uint32_t IRAM_ATTR retime_pulses() {
+      if (!pulsation_.enabled()) {
+        pulse_output_->set_period(pulse_base_period_us_); // no-op unless compensation was just switched off
+        return kPulsePollUs;
+      }
+      uint16_t next = advance_rotor(rotor_position(), 1);
+      uint32_t period = compensated(pulse_base_period_us_, next);
+      pulse_output_->set_period(period);
+      uint32_t offset = table_position(next) % kStepsPerBin;
+      uint32_t steps_after = forward_ ? kStepsPerBin - 1 - offset : offset; // in the same bin
+      uint32_t delay = pulse_output_->next_edge_us() + steps_after * period + period / 2;
+      return delay < kPulsePollUs ? delay : kPulsePollUs;
+    }
 };
 
 #endif // PUMP_CONTROL_H
\ No newline at end of file
@@ -3,25 +3,33 @@
 
 #include <Arduino.h>
 
+// Counts steps only: increment() runs in the step timer interrupt, which must
+// not use the FPU, so the volume is computed by the reader.
 class PumpedVolumeCounter {
 
     public:
         PumpedVolumeCounter(float volume_per_step) : volume_per_step_(volume_per_step) {}
 
-        void increment() {
-            volume_ += volume_per_step_;
+        void IRAM_ATTR increment() {
+            total_steps_++;
         }
 
         void reset() {
-            volume_ = 0;
+            base_steps_ = total_steps_;
         }
 
         float get_volume() const {
-            return volume_;
+            return (total_steps_ - base_steps_) * volume_per_step_;
+        }
+
+        // Steps since boot, not cleared by reset(); for attributing steps to valve ports
+        uint32_t get_total_steps() const {
+            return total_steps_;
         }
 
     private:
-        float volume_ = 0;
+        volatile uint32_t total_steps_ = 0;
+        uint32_t base_steps_ = 0; // total_steps_ at the last reset()
         const float volume_per_step_;
 };
 
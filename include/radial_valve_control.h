@@ -2,6 +2,8 @@
 #define RADIAL_VALVE_CONTROL_H
 
 #include <Arduino.h>
+#include "fast_gpio.h"
+#include "motion_profile.h"
 
 #define STATE_RESET 0
 #define STATE_HOME 1
@@ -21,33 +23,84 @@ struct RadialValveControlConfig {
     uint8_t position_mapping[kNumValvePorts]; // Maps port numbers to position indices
 };
 
+// A rising limit switch edge further than this from home_offset is counted as drift. A switch on the
+// I/O expander is seen only after its interrupt was serviced, up to a couple of milliseconds later.
+constexpr uint8_t kHomeEdgeToleranceSteps = 2;
+constexpr uint8_t kExpanderHomeEdgeToleranceSteps = 8;
 
+struct ValveSpeedProfile {
+    uint16_t min_step_time;
+    uint16_t max_step_time;
+    uint32_t smoothness_factor;
+};
+
+// Closed loop check on every pass of the home position while moving (see RadialValveControl::check_home_edge)
+struct ValveHealth {
+    uint32_t home_passes;   // limit switch edges seen while moving
+    uint32_t drift_events;  // edges too far from home_offset (see kHomeEdgeToleranceSteps), each corrected
+    uint32_t missed_homes;  // passes of home_offset without an edge within half a revolution
+    int32_t last_drift;     // steps the position was ahead of the rotor at the last drift event
+};
+
+
+// Valve axis as seen by the device FSM and the control loop (see DeviceConfig)
+class ValveAxis {
+  public:
+    virtual void initialize() = 0;
+    virtual void set_speed_profile(uint16_t min_step_time, uint16_t max_step_time, uint32_t smoothness_factor) = 0;
+    virtual uint32_t update() = 0;
+    virtual void home() = 0;
+    virtual void set_position(uint8_t port) = 0;
+    virtual bool reached_target() = 0;
+    virtual uint8_t get_position() = 0;
+    virtual uint8_t get_state() = 0;
+    virtual ValveSpeedProfile get_speed_profile() = 0;
+    virtual ValveHealth get_health() = 0;
+};
+
+// Config is a constexpr RadialValveControlConfig (see device.h). Pins and
+// steps-per-position are template constants, so update() - called from the step
+// timer callback - works on immediates instead of a runtime copy of the config.
+template <const RadialValveControlConfig& Config>
+class RadialValveControl final : public ValveAxis {
+    // Enable and limit switch may be expander lines (the first step follows enable by a ramp step time)
+    static_assert(Config.direction_pin < kExpanderPinBase && Config.step_pin < kExpanderPinBase,
+                  "valve step and direction lines must be native GPIOs");
 
-class RadialValveControl {
   public:
-    RadialValveControl(RadialValveControlConfig config) : config_(config) {}
-    void initialize() {
-        pinMode(config_.enable_pin, OUTPUT);
-        pinMode(config_.direction_pin, OUTPUT);
-        pinMode(config_.step_pin, OUTPUT);
-        pinMode(config_.limit_switch_pin, INPUT);
-        digitalWrite(config_.enable_pin, HIGH);
-        digitalWrite(config_.direction_pin, config_.invert_direction);
-        steps_per_position_ = config_.steps_per_revolution / kNumValvePorts;
-    }
-
-    uint32_t update() {
+    void initialize() override {
+        fast_digital_write<Config.enable_pin>(HIGH); // disabled from the moment it becomes an output
+        fast_pin_mode<Config.enable_pin>(OUTPUT);
+        fast_pin_mode<Config.direction_pin>(OUTPUT);
+        fast_pin_mode<Config.step_pin>(OUTPUT);
+        fast_pin_mode<Config.limit_switch_pin>(INPUT);
+        fast_digital_write<Config.direction_pin>(Config.invert_direction);
+        ramp_.build(max_step_time_, min_step_time_, smoothness_factor_);
+    }
+
+    // Changes the acceleration ramp and rebuilds its step time table. Only call while the valve is not moving.
+    // A min_step_time the table cannot ramp down to is raised to the shortest one it reaches.
+    void set_speed_profile(uint16_t min_step_time, uint16_t max_step_time, uint32_t smoothness_factor) override {
+        min_step_time_ = min_step_time;
+        max_step_time_ = max_step_time;
+        smoothness_factor_ = smoothness_factor;
+        if (!ramp_.build(max_step_time_, min_step_time_, smoothness_factor_)) {
+            min_step_time_ = ramp_.cruise_step_time();
+        }
+    }
+
+    uint32_t IRAM_ATTR update() override {
         state_machine();
         return step_time_;
     }
 
-    void home() {
+    void home() override {
         state_ = STATE_HOME;
-        digitalWrite(config_.enable_pin, LOW);
-        step_time_ = max_step_time_; // Reset step time so that the valve starts slow
+        fast_digital_write<Config.enable_pin>(LOW);
+        reset_ramp(); // Reset step time so that the valve starts slow
     }
 
-    void set_position(uint8_t port) {
+    void set_position(uint8_t port) override {
         /*
         Don't call this method directly, it won't be synchronized with the pump
         Use device.set_valves() instead.
@@ -56,60 +109,80 @@ class RadialValveControl {
         if (!is_homed_) {
             home();
         }
-        step_time_ = max_step_time_; // Reset step time so that the valve starts slow
-        target_raw_position_ = position_to_raw(config_.position_mapping[port]);
+        reset_ramp(); // Reset step time so that the valve starts slow
+        target_raw_position_ = position_to_raw(Config.position_mapping[port]);
     }
 
-    bool reached_target() {
-        return state_ == STATE_STOP || state_ == STATE_RESET;
+    bool reached_target() override {
+        // Also compare positions: right after set_position() the step timer may not have left STATE_STOP yet
+        return (state_ == STATE_STOP && current_raw_position_ == target_raw_position_) || state_ == STATE_RESET;
     }
 
-    uint8_t get_position() {
+    uint8_t get_position() override {
         return position_;
     }
 
-    uint8_t get_state() {
+    uint8_t get_state() override {
         return state_;
     }
 
+    ValveSpeedProfile get_speed_profile() override {
+        return {min_step_time_, max_step_time_, smoothness_factor_};
+    }
+
+    ValveHealth get_health() override {
+        return health_;
+    }
+
   private:
+    static constexpr uint16_t kStepsPerPosition = Config.steps_per_revolution / kNumValvePorts;
+    static constexpr int32_t kEdgeTolerance =
+        Config.limit_switch_pin < kExpanderPinBase ? kHomeEdgeToleranceSteps : kExpanderHomeEdgeToleranceSteps;
+
     uint16_t current_raw_position_ = 0;
     uint16_t target_raw_position_ = 0;
-    uint16_t steps_per_position_ = 0;
     bool is_homed_ = false;
     bool step_state_ = false;
     uint8_t position_ = 255;
-    const uint32_t min_step_time_ = 500;
-    const uint32_t max_step_time_ = 30000;
-    const uint32_t smoothness_factor_ = 100;
+    uint16_t min_step_time_ = 500;
+    uint16_t max_step_time_ = 30000;
+    uint32_t smoothness_factor_ = 100;
     uint32_t step_time_ = max_step_time_;
+    ValveRampProfile ramp_;
+    uint16_t ramp_idx_ = 0;
     uint8_t state_ = 0;
-    RadialValveControlConfig config_;
+    bool limit_ = false;          // limit switch level at the previous step while moving
+    bool awaiting_edge_ = false;  // the position entered the edge window, the edge has not been seen yet
+    ValveHealth health_ = {0};
 
 
-    void step() {
+    void IRAM_ATTR step() {
         if (!step_state_) {
             // Only increment step once every step cycle
             ++current_raw_position_;
-            if (current_raw_position_ == config_.steps_per_revolution) {
+            if (current_raw_position_ == Config.steps_per_revolution) {
                 current_raw_position_ = 0;
             }
+            if (state_ == STATE_MOVE) {
+                track_home_pass();
+            }
         }
         step_state_ = !step_state_;
-        digitalWrite(config_.step_pin, step_state_);
+        fast_digital_write<Config.step_pin>(step_state_);
     }
 
-    void state_machine() {
+    void IRAM_ATTR state_machine() {
         switch (state_) {
             case STATE_RESET:
                 break;
 
             case STATE_HOME:
-                if (digitalRead(config_.limit_switch_pin) == HIGH) {
-                    digitalWrite(config_.enable_pin, HIGH);
+                if (fast_digital_read<Config.limit_switch_pin>() == HIGH) {
+                    fast_digital_write<Config.enable_pin>(HIGH);
                     state_ = STATE_STOP;
                     is_homed_ = true;
-                    current_raw_position_ = config_.home_offset;
+                    current_raw_position_ = Config.home_offset;
+                    awaiting_edge_ = false;
                 } else {
                     speed_up_a_bit();
                     step();
@@ -118,15 +191,17 @@ class RadialValveControl {
 
             case STATE_STOP:
                 if (current_raw_position_ != target_raw_position_) {
-                    digitalWrite(config_.enable_pin, LOW);
+                    fast_digital_write<Config.enable_pin>(LOW);
                     state_ = STATE_MOVE;
+                    limit_ = fast_digital_read<Config.limit_switch_pin>() == HIGH; // starting on the switch is not an edge
                 };
                 break;
 
             case STATE_MOVE:
+                check_home_edge();
                 if (current_raw_position_ == target_raw_position_) {
                     state_ = STATE_STOP;
-                    digitalWrite(config_.enable_pin, HIGH);
+                    fast_digital_write<Config.enable_pin>(HIGH);
                 } else {
                     speed_up_a_bit();
                     step();
@@ -135,18 +210,61 @@ class RadialValveControl {
         }
     }
 
-    void speed_up_a_bit() {
-        if (step_time_ > min_step_time_) {
-            step_time_ -= step_time_ / smoothness_factor_;
+    /*
+    The valve only turns one way, so every revolution passes the limit switch.
+    Its rising edge is sampled before each step, the same way homing does, so
+    it comes at exactly home_offset unless steps were lost (the position is
+    ahead of the rotor) or gained. Any larger difference is counted and the
+    position re-synced, which also corrects the move in progress.
+    */
+    void IRAM_ATTR check_home_edge() {
+        bool limit = fast_digital_read<Config.limit_switch_pin>() == HIGH;
+        if (limit && !limit_) {
+            int32_t error = (int32_t)current_raw_position_ - Config.home_offset;
+            if (error > Config.steps_per_revolution / 2) {
+                error -= Config.steps_per_revolution;
+            } else if (error <= -(Config.steps_per_revolution / 2)) {
+                error += Config.steps_per_revolution;
+            }
+            health_.home_passes++;
+            awaiting_edge_ = false;
+            if (error > kEdgeTolerance || error < -kEdgeTolerance) {
+                health_.drift_events++;
+                health_.last_drift = error;
+                current_raw_position_ = Config.home_offset;
+            }
+        }
+        limit_ = limit;
+    }
+
+    // A switch that stays low for half a revolution past home_offset is broken or far off. The
+    // check is armed where the tolerated edge window opens, so an edge that comes a little early
+    // has already been seen when the position reaches home_offset.
+    void IRAM_ATTR track_home_pass() {
+        if (current_raw_position_ == (Config.home_offset + Config.steps_per_revolution - kEdgeTolerance) % Config.steps_per_revolution) {
+            awaiting_edge_ = true;
+        } else if (awaiting_edge_ &&
+                   current_raw_position_ == (Config.home_offset + Config.steps_per_revolution / 2) % Config.steps_per_revolution) {
+            awaiting_edge_ = false;
+            health_.missed_homes++;
         }
-        if (step_time_ < min_step_time_) {
-            step_time_ = min_step_time_;
+    }
+
+    void reset_ramp() {
+        ramp_idx_ = 0;
+        step_time_ = ramp_.at(0);
+    }
+
+    void IRAM_ATTR speed_up_a_bit() {
+        if (ramp_idx_ < ramp_.length() - 1) {
+            ++ramp_idx_;
         }
+        step_time_ = ramp_.at(ramp_idx_);
     }
 
 
     uint16_t position_to_raw(uint8_t position) {
-        return position * steps_per_position_;
+        return position * kStepsPerPosition;
     }
 
 };
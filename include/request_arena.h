@@ -0,0 +1,129 @@
+#ifndef REQUEST_ARENA_H
+#define REQUEST_ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+constexpr size_t kRequestArenaSize = 8192; // a 4096 byte JSON document and its serialized text
+constexpr uint8_t kRequestArenas = 3;      // web requests that can hold an arena at the same time
+constexpr size_t kRequestArenaAlign = 4;
+
+/*
+Scratch memory of one web request: JSON documents and response text are
+bump-allocated from a static buffer and dropped all at once by reset(), so
+the API handlers never call malloc and cannot fragment the heap however long
+the device runs.
+*/
+class RequestArena {
+  public:
+    // nullptr if it does not fit
+    void* allocate(size_t size) {
+      size_t start = (used_ + kRequestArenaAlign - 1) & ~(kRequestArenaAlign - 1);
+      if (size > kRequestArenaSize || start > kRequestArenaSize - size) {
+        return nullptr;
+      }
+      last_ = start;
+      used_ = start + size;
+      if (used_ > high_water_) {
+        high_water_ = used_;
+      }
+      return buffer_ + start;
+    }
+
+    // Only the last allocation can change size (ArduinoJson shrinking or growing its pool)
+    void* reallocate(void* ptr, size_t size) {
+      if (ptr == nullptr) {
+        return allocate(size);
+      }
+      if ((uint8_t*)ptr != buffer_ + last_ || size > kRequestArenaSize - last_) {
+        return nullptr;
+      }
+      used_ = last_ + size;
+      if (used_ > high_water_) {
+        high_water_ = used_;
+      }
+      return ptr;
+    }
+
+    void reset() {
+      used_ = 0;
+      last_ = 0;
+    }
+
+    size_t used() const { return used_; }
+    size_t high_water() const { return high_water_; }
+
+  private:
+    alignas(8) uint8_t buffer_[kRequestArenaSize];
+    size_t used_ = 0;
+    size_t last_ = 0;
+    size_t high_water_ = 0;
+};
+
+/*
+The arenas of the web server. AsyncTCP runs every handler and every
+disconnect callback in its own task, so acquire() and release() are never
+concurrent. A request holds its arena until the client disconnects, because
+the response is sent from the arena after the handler returns.
+*/
+class RequestArenaPool {
+  public:
+    // A reset arena, or nullptr if all of them are in use (counted in busy_rejects())
+    RequestArena* acquire() {
+      for (uint8_t i = 0; i < kRequestArenas; i++) {
+        if (!(in_use_ & (1u << i))) {
+          in_use_ |= 1u << i;
+          arenas_[i].reset();
+          return &arenas_[i];
+        }
+      }
+      busy_rejects_++;
+      return nullptr;
+    }
+
+    void release(RequestArena* arena) {
+      for (uint8_t i = 0; i < kRequestArenas; i++) {
+        if (arena == &arenas_[i]) {
+          in_use_ &= ~(1u << i);
+        }
+      }
+    }
+
+    uint8_t in_use() const { return __builtin_popcount(in_use_); }
+    uint32_t busy_rejects() const { return busy_rejects_; }
+
+    size_t high_water() const {
+      size_t high_water = 0;
+      for (uint8_t i = 0; i < kRequestArenas; i++) {
+        if (arenas_[i].high_water() > high_water) {
+          high_water = arenas_[i].high_water();
+        }
+      }
+      return high_water;
+    }
+
+  private:
+    RequestArena arenas_[kRequestArenas];
+    uint8_t in_use_ = 0;
+    uint32_t busy_rejects_ = 0;
+};
+
+static RequestArenaPool request_arenas;
+
+// ArduinoJson 6 allocator over a request arena: BasicJsonDocument<ArenaJsonAllocator> doc(capacity, {arena})
+struct ArenaJsonAllocator {
+  RequestArena* arena = nullptr;
+
+  void* allocate(size_t size) {
+    return arena->allocate(size);
+  }
+
+  void deallocate(void*) {} // freed by RequestArena::reset()
+
+  void* reallocate(void* ptr, size_t size) {
+    return arena->reallocate(ptr, size);
+  }
+};
+
+#endif // REQUEST_ARENA_H
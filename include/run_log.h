@@ -0,0 +1,387 @@
+#ifndef RUN_LOG_H
+#define RUN_LOG_H
+
+#include <Arduino.h>
+#include <LittleFS.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
+
+constexpr int kRunLogQueueLen = 64;
+constexpr uint32_t kRunLogFlushPeriodMs = 2000;
+constexpr int kRunLogFlushThreshold = 32;     // flush early once this many records are waiting
+constexpr uint32_t kRunLogSegmentSize = 32768; // a new segment is started at the next run once exceeded
+constexpr int kRunLogMaxSegments = 4;          // segments kept in full; older ones are compacted into the archive
+constexpr uint32_t kRunLogArchiveSize = 32768; // size cap of the archive: its older half is dropped beyond this
+constexpr int kRunLogRecordsPerBlock = 12;
+constexpr int kRunLogPathLen = 24;
+
+#define RUN_LOG_RUN_START 1
+#define RUN_LOG_STEP_END 2
+#define RUN_LOG_RUN_END 3
+#define RUN_LOG_MIX_END 4  // after the STEP_END of a mixing step: time_ms is the valve switch count, volume / overshoot the reagent A / B volumes (uL)
+
+#define RUN_LOG_FLAG_VOLUME_LIMITED 0x01 // step ended on volume, overshoot is in uL (otherwise ms)
+#define RUN_LOG_FLAG_ABORTED 0x02
+#define RUN_LOG_FLAG_STREAMED 0x04       // RUN_START of a host-fed run, step_idx (length) is 0
+
+struct RunLogRecord {
+    uint8_t type;         // RUN_LOG_RUN_START, RUN_LOG_STEP_END, RUN_LOG_RUN_END, RUN_LOG_MIX_END
+    uint8_t flags;
+    uint16_t step_idx;    // RUN_START: program length; low 16 bits on streamed runs
+    uint32_t run_id;
+    uint32_t time_ms;     // RUN_START: start time since boot, STEP_END / RUN_END: duration
+    float volume;         // uL pumped in the step (STEP_END) or the whole run (RUN_END)
+    float overshoot;      // STEP_END: actual - planned volume (uL) or duration (ms)
+};
+
+class RunLog {
+  /*
+  Append-only log of program executions on LittleFS. The executor only pushes
+  fixed-size records into a queue (never blocking); flush() runs in a low
+  priority task and appends them to the active segment file in batches, so no
+  flash access happens in the control loop. Segments only rotate at run
+  boundaries, so a run never spans two of them.
+
+  compact() runs periodically in the same task: beyond kRunLogMaxSegments, the
+  oldest segment is folded into the archive, which keeps only its RUN_START
+  and RUN_END records (one run summary each instead of a record per step),
+  and the segment is removed. The archive is read before the segments, so
+  record indices stay oldest first, and is trimmed to its newer half once it
+  exceeds kRunLogArchiveSize. Indices of old records shift on compaction;
+  readers resynchronise on run_id.
+  */
+  public:
+    void begin() {
+      queue_ = xQueueCreate(kRunLogQueueLen, sizeof(RunLogRecord));
+      mutex_ = xSemaphoreCreateMutex();
+      first_segment_ = -1;
+      last_segment_ = -1;
+      if (!LittleFS.exists(kArchivePath) && LittleFS.exists(kArchiveTmpPath)) {
+        LittleFS.rename(kArchiveTmpPath, kArchivePath); // power lost while trimming, after the old archive was removed
+      }
+      File root = LittleFS.open("/", "r");
+      if (root) {
+        File file = root.openNextFile();
+        while (file) {
+          int segment;
+          const char* name = file.name();
+          if (name[0] == '/') {
+            name++;
+          }
+          if (sscanf(name, "runlog_%d.bin", &segment) == 1) {
+            if (first_segment_ < 0 || segment < first_segment_) {
+              first_segment_ = segment;
+            }
+            if (segment > last_segment_) {
+              last_segment_ = segment;
+            }
+          }
+          file.close();
+          file = root.openNextFile();
+        }
+        root.close();
+      }
+      if (last_segment_ < 0) {
+        first_segment_ = 0;
+        last_segment_ = 0;
+      }
+      // Runs are numbered across reboots so downloads can be matched up
+      RunLogRecord record;
+      uint32_t count = record_count();
+      if (count > 0 && read_records(count - 1, &record, 1) == 1) {
+        run_id_ = record.run_id;
+      }
+    }
+
+    // Called from the control loop and, via execute() / abort(), from the comm task: non-blocking, records
+    // are dropped (and counted) if the queue is full. The run state is only touched under mux_.
+    void run_start(uint16_t program_length, uint8_t flags = 0) {
+      uint32_t now = (uint32_t)millis();
+      portENTER_CRITICAL(&mux_);
+      RunLogRecord record = {RUN_LOG_RUN_START, flags, program_length, ++run_id_, now, 0, 0};
+      run_start_ms_ = now;
+      run_volume_ = 0;
+      portEXIT_CRITICAL(&mux_);
+      push(record);
+    }
+
+    void step_end(uint32_t step_idx, uint32_t duration_ms, float volume, float overshoot, bool volume_limited) {
+      portENTER_CRITICAL(&mux_);
+      RunLogRecord record = {RUN_LOG_STEP_END, (uint8_t)(volume_limited ? RUN_LOG_FLAG_VOLUME_LIMITED : 0),
+                             (uint16_t)step_idx, run_id_, duration_ms, volume, overshoot};
+      run_volume_ += volume;
+      portEXIT_CRITICAL(&mux_);
+      push(record);
+    }
+
+    void mix_end(uint32_t step_idx, uint32_t switches, float volume_a, float volume_b) {
+      portENTER_CRITICAL(&mux_);
+      RunLogRecord record = {RUN_LOG_MIX_END, 0, (uint16_t)step_idx, run_id_, switches, volume_a, volume_b};
+      portEXIT_CRITICAL(&mux_);
+      push(record);
+    }
+
+    void run_end(uint32_t step_idx, bool aborted) {
+      uint32_t now = (uint32_t)millis();
+      portENTER_CRITICAL(&mux_);
+      RunLogRecord record = {RUN_LOG_RUN_END, (uint8_t)(aborted ? RUN_LOG_FLAG_ABORTED : 0),
+                             (uint16_t)step_idx, run_id_, now - run_start_ms_, run_volume_, 0};
+      portEXIT_CRITICAL(&mux_);
+      push(record);
+    }
+
+    // Called periodically from the storage task. Writes queued records if enough are waiting or force is set.
+    void flush(bool force) {
+      if (queue_ == nullptr || (!force && uxQueueMessagesWaiting(queue_) < kRunLogFlushThreshold)) {
+        return;
+      }
+      RunLogRecord batch[kRunLogQueueLen];
+      int n = 0;
+      while (n < kRunLogQueueLen && xQueueReceive(queue_, &batch[n], 0) == pdTRUE) {
+        n++;
+      }
+      if (n == 0) {
+        return;
+      }
+
+      char path[kRunLogPathLen];
+      xSemaphoreTake(mutex_, portMAX_DELAY);
+      if (batch[0].type == RUN_LOG_RUN_START && segment_size(last_segment_) >= kRunLogSegmentSize) {
+        rotate();
+      }
+      segment_path(last_segment_, path);
+      File file = LittleFS.open(path, "a");
+      if (file) {
+        for (int i = 0; i < n; i++) {
+          // A run starting mid-batch may also need a fresh segment
+          if (i > 0 && batch[i].type == RUN_LOG_RUN_START && file.size() >= kRunLogSegmentSize) {
+            file.close();
+            rotate();
+            segment_path(last_segment_, path);
+            file = LittleFS.open(path, "a");
+            if (!file) {
+              break;
+            }
+          }
+          file.write((uint8_t*)&batch[i], sizeof(RunLogRecord));
+        }
+        file.close();
+      } else {
+        Serial.println("Failed to open run log segment for writing");
+      }
+      xSemaphoreGive(mutex_);
+    }
+
+    // Called periodically from the storage task: archives the segments beyond kRunLogMaxSegments, oldest first
+    void compact() {
+      if (mutex_ == nullptr) {
+        return;
+      }
+      char path[kRunLogPathLen];
+      xSemaphoreTake(mutex_, portMAX_DELAY);
+      while (last_segment_ - first_segment_ + 1 > kRunLogMaxSegments) {
+        segment_path(first_segment_, path);
+        if (!archive_segment(path)) {
+          break; // retried at the next call
+        }
+        LittleFS.remove(path);
+        first_segment_++;
+      }
+      if (file_size(kArchivePath) > kRunLogArchiveSize) {
+        trim_archive();
+      }
+      xSemaphoreGive(mutex_);
+    }
+
+    // Number of records on flash, over all segments
+    uint32_t record_count() {
+      if (mutex_ == nullptr) {
+        return 0;
+      }
+      xSemaphoreTake(mutex_, portMAX_DELAY);
+      uint32_t count = file_size(kArchivePath) / sizeof(RunLogRecord);
+      for (int i = first_segment_; i <= last_segment_; i++) {
+        count += segment_size(i) / sizeof(RunLogRecord);
+      }
+      xSemaphoreGive(mutex_);
+      return count;
+    }
+
+    // Reads up to max_records records starting at record index first (oldest is 0). Returns the number read.
+    int read_records(uint32_t first, RunLogRecord* records, int max_records) {
+      char path[kRunLogPathLen];
+      int n = 0;
+      if (mutex_ == nullptr) {
+        return 0;
+      }
+      xSemaphoreTake(mutex_, portMAX_DELAY);
+      bool more = read_file(kArchivePath, &first, records, max_records, &n);
+      for (int i = first_segment_; more && i <= last_segment_ && n < max_records; i++) {
+        segment_path(i, path);
+        more = read_file(path, &first, records, max_records, &n);
+      }
+      xSemaphoreGive(mutex_);
+      return n;
+    }
+
+    int first_segment() { return first_segment_; }
+    int last_segment() { return last_segment_; }
+    uint32_t dropped_records() { return dropped_; }
+
+    static void segment_path(int segment, char* path) {
+      snprintf(path, kRunLogPathLen, "/runlog_%d.bin", segment);
+    }
+
+  private:
+    // Segment ids grow monotonically and wrap here; the log is reset when they do
+    static constexpr int kRunLogMaxSegmentIds = 1000;
+    static constexpr const char* kArchivePath = "/runlog_archive.bin";
+    static constexpr const char* kArchiveTmpPath = "/runlog_archive.tmp";
+
+    QueueHandle_t queue_ = nullptr;
+    SemaphoreHandle_t mutex_ = nullptr;
+    portMUX_TYPE mux_ = portMUX_INITIALIZER_UNLOCKED; // run_id_, run_start_ms_, run_volume_ and dropped_
+    int first_segment_ = 0;
+    int last_segment_ = 0;
+    uint32_t run_id_ = 0;
+    uint32_t run_start_ms_ = 0;
+    float run_volume_ = 0;
+    volatile uint32_t dropped_ = 0;
+
+    uint32_t segment_size(int segment) {
+      char path[kRunLogPathLen];
+      segment_path(segment, path);
+      return file_size(path);
+    }
+
+    uint32_t file_size(const char* path) {
+      if (!LittleFS.exists(path)) {
+        return 0;
+      }
+      File file = LittleFS.open(path, "r");
+      if (!file) {
+        return 0;
+      }
+      uint32_t size = file.size();
+      file.close();
+      return size;
+    }
+
+    // Reads the records of one file from index *first on, after the *n already read, and moves *first past
+    // the file. Returns false if the file can't be read and the records after it must not be returned either.
+    bool read_file(const char* path, uint32_t* first, RunLogRecord* records, int max_records, int* n) {
+      uint32_t count = file_size(path) / sizeof(RunLogRecord);
+      if (*first >= count) {
+        *first -= count;
+        return true;
+      }
+      File file = LittleFS.open(path, "r");
+      if (!file) {
+        return false;
+      }
+      file.seek(*first * sizeof(RunLogRecord));
+      int to_read = min((uint32_t)(max_records - *n), count - *first);
+      *n += file.read((uint8_t*)(records + *n), to_read * sizeof(RunLogRecord)) / sizeof(RunLogRecord);
+      file.close();
+      *first = 0;
+      return true;
+    }
+
+    // Appends the run summaries (RUN_START, RUN_END) of a segment to the archive. Runs already in the
+    // archive are skipped, in case the segment survived a power loss after it was archived. Caller holds mutex_.
+    bool archive_segment(const char* path) {
+      if (!LittleFS.exists(path)) {
+        return true;
+      }
+      File src = LittleFS.open(path, "r");
+      if (!src) {
+        return false;
+      }
+      uint32_t archived_run_id = 0;
+      uint32_t archive_size = file_size(kArchivePath);
+      if (archive_size >= sizeof(RunLogRecord)) {
+        RunLogRecord last;
+        File archive = LittleFS.open(kArchivePath, "r");
+        if (archive && archive.seek(archive_size - sizeof(RunLogRecord)) &&
+            archive.read((uint8_t*)&last, sizeof(last)) == sizeof(last)) {
+          archived_run_id = last.run_id;
+        }
+        archive.close();
+      }
+      File dst = LittleFS.open(kArchivePath, "a");
+      if (!dst) {
+        src.close();
+        return false;
+      }
+      RunLogRecord block[kRunLogRecordsPerBlock];
+      int n;
+      while ((n = src.read((uint8_t*)block, sizeof(block)) / sizeof(RunLogRecord)) > 0) {
+        for (int i = 0; i < n; i++) {
+          if ((block[i].type == RUN_LOG_RUN_START || block[i].type == RUN_LOG_RUN_END) && block[i].run_id > archived_run_id) {
+            dst.write((uint8_t*)&block[i], sizeof(RunLogRecord));
+          }
+        }
+      }
+      src.close();
+      dst.close();
+      return true;
+    }
+
+    // Drops the older half of the archive, cutting at a run start. Caller holds mutex_.
+    void trim_archive() {
+      uint32_t size = file_size(kArchivePath);
+      File src = LittleFS.open(kArchivePath, "r");
+      if (!src) {
+        return;
+      }
+      File dst = LittleFS.open(kArchiveTmpPath, "w");
+      if (!dst) {
+        src.close();
+        return;
+      }
+      uint32_t cut = (size - kRunLogArchiveSize / 2) / sizeof(RunLogRecord) * sizeof(RunLogRecord);
+      src.seek(cut);
+      bool started = false;
+      RunLogRecord block[kRunLogRecordsPerBlock];
+      int n;
+      while ((n = src.read((uint8_t*)block, sizeof(block)) / sizeof(RunLogRecord)) > 0) {
+        for (int i = 0; i < n; i++) {
+          started = started || block[i].type == RUN_LOG_RUN_START;
+          if (started) {
+            dst.write((uint8_t*)&block[i], sizeof(RunLogRecord));
+          }
+        }
+      }
+      src.close();
+      dst.close();
+      LittleFS.remove(kArchivePath);
+      LittleFS.rename(kArchiveTmpPath, kArchivePath);
+    }
+
+    void push(RunLogRecord& record) {
+      if (queue_ == nullptr || xQueueSend(queue_, &record, 0) != pdTRUE) {
+        portENTER_CRITICAL(&mux_);
+        dropped_++;
+        portEXIT_CRITICAL(&mux_);
+      }
+    }
+
+    // Starts a new segment; compact() archives the oldest ones beyond kRunLogMaxSegments. Caller holds mutex_.
+    void rotate() {
+      last_segment_++;
+      if (last_segment_ >= kRunLogMaxSegmentIds) {
+        char path[kRunLogPathLen];
+        for (int i = first_segment_; i < kRunLogMaxSegmentIds; i++) {
+          segment_path(i, path);
+          LittleFS.remove(path);
+        }
+        first_segment_ = 0;
+        last_segment_ = 0;
+      }
+    }
+};
+
+static RunLog run_log;
+
+#endif // RUN_LOG_H
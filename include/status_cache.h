@@ -0,0 +1,89 @@
+#ifndef STATUS_CACHE_H
+#define STATUS_CACHE_H
+
+#include <Arduino.h>
+#include "device.h"
+
+constexpr size_t kStatusJsonSize = 384 + kMaxChannels * 256; // with room for 12-digit volumes
+
+// One rendering of the device status: the binary DeviceState and the /api/status JSON
+struct StatusSnapshot {
+  DeviceState state;
+  ChannelState channels[kMaxChannels];
+  uint8_t num_channels;
+  uint32_t generation;  // incremented on every change
+  uint16_t json_len;
+  char json[kStatusJsonSize];
+};
+
+/*
+Status responses rendered by the control loop once per tick in which the state
+changed, so the cost does not grow with the number of clients polling. There are
+two slots: update() samples the state into a scratch copy, and only on a change
+renders it into the back slot and flips. Handlers copy from front() - the UART
+frame buffer, or the request's arena for HTTP, since the web server sends the
+body after the handler returns. A slot is only rewritten on the second change
+after it stopped being the front one, at least one control tick later, which is
+much longer than such a copy takes.
+*/
+class StatusCache {
+  public:
+    // After device.update() and the executor, once per control tick. Returns true if the status changed.
+    bool update(Device& device) {
+      const StatusSnapshot& front = slots_[front_];
+      uint8_t num_channels = device.num_channels();
+      for (uint8_t i = 0; i < num_channels; i++) {
+        device.channel(i).get_state(&sample_channels_[i]);
+      }
+      if (generation_ > 0 && memcmp(&device.device_state, &front.state, sizeof(DeviceState)) == 0 &&
+          memcmp(sample_channels_, front.channels, num_channels * sizeof(ChannelState)) == 0) {
+        return false;
+      }
+      StatusSnapshot& back = slots_[front_ ^ 1];
+      back.state = device.device_state;
+      back.num_channels = num_channels;
+      memcpy(back.channels, sample_channels_, num_channels * sizeof(ChannelState));
+      back.generation = ++generation_;
+      back.json_len = render_json(back);
+      __sync_synchronize(); // the slot is complete before handlers can see it
+      front_ ^= 1;
+      return true;
+    }
+
+    const StatusSnapshot& front() const {
+      return slots_[front_];
+    }
+
+  private:
+    StatusSnapshot slots_[2] = {};
+    ChannelState sample_channels_[kMaxChannels]; // this tick's channel states, compared before a slot is touched
+    volatile uint8_t front_ = 0;
+    uint32_t generation_ = 0;
+
+    // Same keys as DeviceState, plus the state of every channel
+    static uint16_t render_json(StatusSnapshot& s) {
+      const DeviceState& d = s.state;
+      int n = snprintf(s.json, kStatusJsonSize,
+                       "{\"pump_speed\":%.3f,\"pump_volume\":%.3f,\"program_step_idx\":%u,\"device_state\":%u,"
+                       "\"reagent_valve_position\":%u,\"reagent_valve_state\":%u,\"column_valve_position\":%u,"
+                       "\"column_valve_state\":%u,\"running\":%u,\"program_step_progress\":%u,\"num_pumps\":%u,"
+                       "\"num_valves\":%u,\"channels\":[",
+                       d.pump_speed, d.pump_volume, d.program_step_idx, d.device_state, d.reagent_valve_position,
+                       d.reagent_valve_state, d.column_valve_position, d.column_valve_state, d.running,
+                       d.program_step_progress, d.num_pumps, d.num_valves);
+      for (uint8_t i = 0; i < s.num_channels; i++) {
+        const ChannelState& c = s.channels[i];
+        n += snprintf(s.json + n, kStatusJsonSize - n,
+                      "%s{\"pump_speed\":%.3f,\"pump_volume\":%.3f,\"device_state\":%u,\"reagent_valve_position\":%u,"
+                      "\"reagent_valve_state\":%u,\"column_valve_position\":%u,\"column_valve_state\":%u}",
+                      i ? "," : "", c.pump_speed, c.pump_volume, c.device_state, c.reagent_valve_position,
+                      c.reagent_valve_state, c.column_valve_position, c.column_valve_state);
+      }
+      n += snprintf(s.json + n, kStatusJsonSize - n, "]}");
+      return n;
+    }
+};
+
+static StatusCache status_cache;
+
+#endif // STATUS_CACHE_H
@@ -0,0 +1,60 @@
+#ifndef STEP_JITTER_H
+#define STEP_JITTER_H
+
+#include <Arduino.h>
+#include <freertos/FreeRTOS.h>
+#include "device.h"
+
+constexpr uint32_t kLateStepUs = 50; // a step this much after its due time counts as late
+
+/*
+How late the step callbacks of one axis (or the control loop ticks) run
+against their due time. record() is called from the step timer interrupt;
+reset() only raises a flag, the next record() clears the counts, so the
+interrupt stays the only writer.
+*/
+class StepJitter {
+  public:
+    void IRAM_ATTR record(uint32_t late_us) {
+      if (reset_) {
+        samples_ = 0;
+        total_us_ = 0;
+        max_us_ = 0;
+        late_ = 0;
+        reset_ = false;
+      }
+      samples_++;
+      total_us_ += late_us;
+      if (late_us > max_us_) {
+        max_us_ = late_us;
+      }
+      if (late_us > kLateStepUs) {
+        late_++;
+      }
+      core_ = xPortGetCoreID();
+    }
+
+    void reset() {
+      reset_ = true;
+    }
+
+    uint32_t samples() const { return reset_ ? 0 : samples_; }
+    uint32_t max_us() const { return reset_ ? 0 : max_us_; }
+    uint32_t late() const { return reset_ ? 0 : late_; }
+    float mean_us() const { return samples() ? float(total_us_) / samples_ : 0.0f; }
+    uint8_t core() const { return core_; }
+
+  private:
+    volatile uint32_t samples_ = 0;
+    uint64_t total_us_ = 0;
+    volatile uint32_t max_us_ = 0;
+    volatile uint32_t late_ = 0;
+    volatile bool reset_ = false;
+    volatile uint8_t core_ = 0xff; // none recorded yet
+};
+
+static StepJitter pump_step_jitter[kMaxPumps];
+static StepJitter valve_step_jitter[kMaxValves];
+static StepJitter control_tick_jitter; // deviation of the control loop period from 10 ms
+
+#endif // STEP_JITTER_H
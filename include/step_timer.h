@@ -0,0 +1,99 @@
+#ifndef STEP_TIMER_H
+#define STEP_TIMER_H
+
+#include <Arduino.h>
+#include <driver/timer.h>
+#include <esp_intr_alloc.h>
+#include "device.h"
+#include "step_jitter.h"
+
+// Step function of one axis: takes the axis index, returns the delay until its next call in us
+using StepFunction = uint32_t (*)(uint8_t axis);
+
+constexpr uint32_t kStepTimerDivider = 80; // 80 MHz APB clock: the counter runs in us
+constexpr uint32_t kStepTimerLeadUs = 2;   // an alarm must be at least this far ahead of the counter
+
+/*
+Step interrupts from one hardware timer of a timer group, for one or more axes.
+The interrupt is allocated on the core that calls begin(), which is how the
+step path gets onto the control core: the esp_timer task (and its interrupt)
+stay on core 0 with Wi-Fi, see core_affinity.h.
+
+Due times are absolute counter values, so a late interrupt does not push the
+later steps back the way re-arming a one-shot timer from its callback does.
+With several axes the timer fires at the earliest due time and steps every
+axis that is due by then.
+
+The interrupt is allocated with ESP_INTR_FLAG_IRAM, so LittleFS and NVS
+writes on core 0, which disable the flash cache, do not hold it off. Everything
+it reaches must then be in IRAM or DRAM: the step functions and what they call
+are IRAM_ATTR, including inline helpers in case the compiler keeps them out of
+line; the pulse output writes LEDC and PCNT registers instead of calling their
+drivers (pulse_output.h). New code on the step path must keep to this, or the
+first flash write while it runs crashes with a cache access error.
+*/
+class StepTimer {
+  public:
+    // Axes first_axis .. first_axis + num_axes - 1, with their jitter counters from `jitter`
+    void begin(timer_group_t group, timer_idx_t timer, StepFunction step, uint8_t first_axis, uint8_t num_axes,
+               StepJitter* jitter, uint32_t first_delay_us) {
+      group_ = group;
+      timer_ = timer;
+      step_ = step;
+      first_axis_ = first_axis;
+      num_axes_ = num_axes;
+      jitter_ = jitter;
+      timer_config_t config = {
+        .alarm_en = TIMER_ALARM_EN,
+        .counter_en = TIMER_PAUSE,
+        .intr_type = TIMER_INTR_LEVEL,
+        .counter_dir = TIMER_COUNT_UP,
+        .auto_reload = TIMER_AUTORELOAD_DIS,
+        .divider = kStepTimerDivider,
+      };
+      timer_init(group_, timer_, &config);
+      timer_set_counter_value(group_, timer_, 0);
+      for (uint8_t i = 0; i < num_axes_; i++) {
+        due_[i] = first_delay_us;
+      }
+      timer_set_alarm_value(group_, timer_, first_delay_us);
+      timer_enable_intr(group_, timer_);
+      timer_isr_callback_add(group_, timer_, &StepTimer::on_alarm, this, ESP_INTR_FLAG_IRAM);
+      timer_start(group_, timer_);
+    }
+
+  private:
+    timer_group_t group_ = TIMER_GROUP_0;
+    timer_idx_t timer_ = TIMER_0;
+    StepFunction step_ = nullptr;
+    uint8_t first_axis_ = 0;
+    uint8_t num_axes_ = 0;
+    StepJitter* jitter_ = nullptr;
+    uint64_t due_[kMaxValves] = {0};
+
+    // The driver clears the interrupt and re-enables the alarm after this returns
+    static bool IRAM_ATTR on_alarm(void* arg) {
+      StepTimer* self = (StepTimer*)arg;
+      uint64_t now = timer_group_get_counter_value_in_isr(self->group_, self->timer_);
+      uint64_t next = UINT64_MAX;
+      for (uint8_t i = 0; i < self->num_axes_; i++) {
+        if (self->due_[i] <= now) {
+          self->jitter_[i].record(now - self->due_[i]);
+          uint64_t due = self->due_[i] + self->step_(self->first_axis_ + i);
+          // More than a whole step behind: the schedule restarts from now instead of catching up in a burst
+          self->due_[i] = due > now ? due : now + (due - self->due_[i]);
+        }
+        if (self->due_[i] < next) {
+          next = self->due_[i];
+        }
+      }
+      now = timer_group_get_counter_value_in_isr(self->group_, self->timer_);
+      if (next < now + kStepTimerLeadUs) {
+        next = now + kStepTimerLeadUs;
+      }
+      timer_group_set_alarm_value_in_isr(self->group_, self->timer_, next);
+      return false;
+    }
+};
+
+#endif // STEP_TIMER_H
@@ -0,0 +1,122 @@
+#ifndef TASK_DIAGNOSTICS_H
+#define TASK_DIAGNOSTICS_H
+
+#include <Arduino.h>
+#include <esp_heap_caps.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+constexpr int kMaxDiagTasks = 24;
+constexpr int kDiagTaskNameLen = 12;
+constexpr uint32_t kDiagSamplePeriodMs = 1000;
+constexpr int kDiagTasksPerBlock = 10;
+
+struct TaskDiagnostics {
+    char name[kDiagTaskNameLen];
+    uint16_t cpu_permille;       // share of one core over the last sample period
+    uint8_t priority;
+    uint8_t state;               // eTaskState
+    uint32_t stack_high_water;   // bytes of stack never used since task start
+};
+
+struct HeapDiagnostics {
+    uint32_t free_bytes;
+    uint32_t largest_free_block;
+    uint32_t min_free_bytes;     // low-water mark since boot
+    uint8_t fragmentation;       // 0-100, 100 * (1 - largest_free_block / free_bytes)
+    uint8_t num_tasks;
+    uint16_t padding;
+};
+
+class SystemDiagnostics {
+  /*
+  Periodically samples FreeRTOS task run-time counters, stack high-water marks
+  and heap statistics. sample() is called from a low priority task, readers
+  (web server, serial command handler) get a consistent copy of the last sample.
+  */
+  public:
+    void sample() {
+      uint32_t total_run_time = 0;
+      UBaseType_t n = uxTaskGetSystemState(status_, kMaxDiagTasks, &total_run_time);
+      uint32_t elapsed = total_run_time - prev_total_run_time_;
+
+      TaskDiagnostics tasks[kMaxDiagTasks];
+      uint32_t run_times[kMaxDiagTasks];
+      TaskHandle_t handles[kMaxDiagTasks];
+      for (UBaseType_t i = 0; i < n; i++) {
+        TaskDiagnostics& t = tasks[i];
+        strncpy(t.name, status_[i].pcTaskName, kDiagTaskNameLen - 1);
+        t.name[kDiagTaskNameLen - 1] = '\0';
+        t.priority = status_[i].uxCurrentPriority;
+        t.state = status_[i].eCurrentState;
+        t.stack_high_water = status_[i].usStackHighWaterMark; // ESP-IDF reports bytes, not words
+
+        // Tasks can come and go between samples, so match counters by handle
+        uint32_t prev_run_time = 0;
+        for (int j = 0; j < prev_count_; j++) {
+          if (prev_handles_[j] == status_[i].xHandle) {
+            prev_run_time = prev_run_times_[j];
+            break;
+          }
+        }
+#if configGENERATE_RUN_TIME_STATS
+        run_times[i] = status_[i].ulRunTimeCounter;
+#else
+        run_times[i] = 0; // run-time stats disabled in sdkconfig, only stack and heap figures are valid
+#endif
+        uint32_t task_elapsed = run_times[i] - prev_run_time;
+        t.cpu_permille = elapsed > 0 ? (uint64_t)task_elapsed * 1000 / elapsed : 0;
+
+        handles[i] = status_[i].xHandle;
+      }
+
+      HeapDiagnostics heap;
+      heap.free_bytes = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+      heap.largest_free_block = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+      heap.min_free_bytes = heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT);
+      heap.fragmentation = heap.free_bytes > 0 ? 100 - (uint64_t)heap.largest_free_block * 100 / heap.free_bytes : 0;
+      heap.num_tasks = n;
+      heap.padding = 0;
+
+      memcpy(prev_run_times_, run_times, n * sizeof(uint32_t));
+      memcpy(prev_handles_, handles, n * sizeof(TaskHandle_t));
+      prev_count_ = n;
+      prev_total_run_time_ = total_run_time;
+
+      portENTER_CRITICAL(&mux_);
+      memcpy(tasks_, tasks, n * sizeof(TaskDiagnostics));
+      heap_ = heap;
+      portEXIT_CRITICAL(&mux_);
+    }
+
+    // Copies the last sample. Returns the number of tasks written to tasks (at most max_tasks).
+    int get(HeapDiagnostics* heap, TaskDiagnostics* tasks, int first_task, int max_tasks) {
+      portENTER_CRITICAL(&mux_);
+      *heap = heap_;
+      int n = heap_.num_tasks - first_task;
+      if (n > max_tasks) {
+        n = max_tasks;
+      }
+      if (n < 0) {
+        n = 0;
+      }
+      memcpy(tasks, tasks_ + first_task, n * sizeof(TaskDiagnostics));
+      portEXIT_CRITICAL(&mux_);
+      return n;
+    }
+
+  private:
+    TaskStatus_t status_[kMaxDiagTasks];
+    uint32_t prev_run_times_[kMaxDiagTasks] = {0};
+    TaskHandle_t prev_handles_[kMaxDiagTasks] = {nullptr};
+    int prev_count_ = 0;
+    uint32_t prev_total_run_time_ = 0;
+
+    portMUX_TYPE mux_ = portMUX_INITIALIZER_UNLOCKED;
+    TaskDiagnostics tasks_[kMaxDiagTasks];
+    HeapDiagnostics heap_ = {0};
+};
+
+static SystemDiagnostics system_diagnostics;
+
+#endif // TASK_DIAGNOSTICS_H
@@ -0,0 +1,235 @@
+#ifndef VALVE_AUTOTUNE_H
+#define VALVE_AUTOTUNE_H
+
+#include <Arduino.h>
+#include <Preferences.h>
+#include "device.h"
+#include "protocol.h"
+
+constexpr uint8_t kAutotuneMovesPerTrial = 8;      // half revolutions, so 4 passes of the limit switch
+constexpr uint8_t kAutotuneStepTimePercent = 85;   // each trial shortens min_step_time by 15%
+constexpr uint8_t kAutotuneMarginPercent = 120;    // the stored profile is 20% slower than the fastest reliable one
+constexpr uint16_t kAutotuneMinStepTime = 100;     // us, nothing is tried below this (nor below what the ramp table reaches)
+constexpr const char* kValveProfileNamespace = "valves";
+constexpr size_t kValveProfileKeyLen = 5;          // "v255" and the terminator
+
+// Speed profiles of the valves, one NVS key per valve index ("v0", "v1", ...)
+class ValveProfileStore {
+  public:
+    bool load(uint8_t valve, ValveSpeedProfile* profile) {
+      char key[kValveProfileKeyLen];
+      make_key(valve, key);
+      prefs_.begin(kValveProfileNamespace, true);
+      bool ok = prefs_.getBytesLength(key) == sizeof(ValveSpeedProfile) &&
+                prefs_.getBytes(key, profile, sizeof(ValveSpeedProfile)) == sizeof(ValveSpeedProfile);
+      prefs_.end();
+      return ok && profile->min_step_time > 0 && profile->min_step_time <= profile->max_step_time;
+    }
+
+    bool save(uint8_t valve, const ValveSpeedProfile& profile) {
+      char key[kValveProfileKeyLen];
+      make_key(valve, key);
+      prefs_.begin(kValveProfileNamespace, false);
+      bool ok = prefs_.putBytes(key, &profile, sizeof(profile)) == sizeof(profile);
+      prefs_.end();
+      return ok;
+    }
+
+    // At boot, after device.initialize()
+    void apply(Device& device) {
+      for (uint8_t i = 0; i < device.num_valves(); i++) {
+        ValveSpeedProfile profile;
+        if (load(i, &profile)) {
+          device.valve_axis(i)->set_speed_profile(profile.min_step_time, profile.max_step_time,
+                                                  profile.smoothness_factor);
+        }
+      }
+    }
+
+  private:
+    Preferences prefs_;
+
+    static void make_key(uint8_t valve, char* key) {
+      snprintf(key, kValveProfileKeyLen, "v%u", valve);
+    }
+};
+
+static ValveProfileStore valve_profile_store;
+
+/*
+Finds the fastest profile a valve turns reliably. Starting from its current
+profile, min_step_time is shortened trial by trial, each trial being a series
+of half-revolution moves. A trial fails as soon as the home check of
+RadialValveControl reports drift (which it also corrects) or a missed home.
+The last trial without any is kept, with a margin, and the valve is re-homed
+and returns to the port it started at. The search also ends at a
+min_step_time the ramp table cannot get down to (see ValveRampProfile): the
+valve would turn at the table's shortest step time instead, so that trial
+would only repeat an earlier one.
+
+update() runs in the control loop. The NVS write takes milliseconds, so it is
+left to persist(), called from the flash task.
+*/
+class ValveAutotuner {
+  public:
+    // From the command handler: checks the request, update() then starts it in the control loop.
+    // All pumps must be stopped and every channel idle; fails otherwise or if the valve does not exist.
+    bool request(Device& device, uint8_t valve) {
+      if (state_ == protocol::kAutotuneRunning || pending_valve_ >= 0 || valve >= device.num_valves() || !device_idle(device)) {
+        return false;
+      }
+      pending_valve_ = valve;
+      return true;
+    }
+
+    // Once per control tick, after device.update()
+    void update(Device& device, bool program_running) {
+      if (restore_pending_ && axis_->reached_target()) {
+        apply(original_);
+        restore_pending_ = false;
+      }
+      if (pending_valve_ >= 0) {
+        start(device, pending_valve_);
+        pending_valve_ = -1;
+      }
+      if (state_ != protocol::kAutotuneRunning) {
+        return;
+      }
+      if (program_running || !device_idle(device)) {
+        // Someone else needs the valve: give it back, at the old speed once it stops
+        state_ = protocol::kAutotuneFailed;
+        restore_pending_ = true;
+        return;
+      }
+      if (!axis_->reached_target()) {
+        return;
+      }
+      ValveHealth health = axis_->get_health();
+      if (health.drift_events != trial_start_.drift_events || health.missed_homes != trial_start_.missed_homes) {
+        finish();
+        return;
+      }
+      if (moves_left_ > 0) {
+        moves_left_--;
+        port_ = (port_ + kNumValvePorts / 2) % kNumValvePorts;
+        axis_->set_position(port_);
+        return;
+      }
+      best_ = candidate_;
+      uint16_t next = (uint32_t)candidate_ * kAutotuneStepTimePercent / 100;
+      if (next < kAutotuneMinStepTime || next == candidate_) {
+        finish();
+        return;
+      }
+      candidate_ = next;
+      if (!begin_trial()) {
+        finish();
+      }
+    }
+
+    // From the flash task; returns true if a profile was written
+    bool persist() {
+      if (!save_pending_) {
+        return false;
+      }
+      save_pending_ = false;
+      return valve_profile_store.save(valve_, result_);
+    }
+
+    uint8_t get_state() const { return pending_valve_ >= 0 ? protocol::kAutotuneRunning : state_; }
+    uint8_t get_valve() const { return pending_valve_ >= 0 ? pending_valve_ : valve_; }
+    uint8_t get_trials() const { return trials_; }
+    ValveSpeedProfile get_result() const { return result_; }
+
+  private:
+    uint8_t state_ = protocol::kAutotuneIdle;
+    uint8_t valve_ = 0;
+    ValveAxis* axis_ = nullptr;
+    ValveSpeedProfile original_ = {0};
+    ValveSpeedProfile result_ = {0};
+    ValveHealth trial_start_ = {0};
+    uint16_t candidate_ = 0;
+    uint16_t best_ = 0;   // fastest min_step_time without drift so far, 0 if none
+    uint8_t trials_ = 0;
+    uint8_t moves_left_ = 0;
+    uint8_t port_ = 0;
+    uint8_t start_port_ = 255;
+    volatile int16_t pending_valve_ = -1;
+    bool restore_pending_ = false;
+    volatile bool save_pending_ = false;
+
+    void start(Device& device, uint8_t valve) {
+      valve_ = valve;
+      if (restore_pending_ || !device_idle(device)) {
+        state_ = protocol::kAutotuneFailed;
+        return;
+      }
+      axis_ = device.valve_axis(valve);
+      original_ = axis_->get_speed_profile();
+      result_ = original_;
+      start_port_ = axis_->get_position();
+      port_ = start_port_ < kNumValvePorts ? start_port_ : 0;
+      candidate_ = original_.min_step_time;
+      best_ = 0;
+      trials_ = 0;
+      state_ = protocol::kAutotuneRunning;
+      if (!begin_trial()) {
+        finish();
+      }
+    }
+
+    static bool device_idle(Device& device) {
+      for (uint8_t i = 0; i < device.num_channels(); i++) {
+        if (!device.channel(i).is_pumping()) {
+          return false;
+        }
+      }
+      for (uint8_t i = 0; i < device.num_pumps(); i++) {
+        if (!device.pump_axis(i)->is_stopped()) {
+          return false;
+        }
+      }
+      return true;
+    }
+
+    void apply(const ValveSpeedProfile& profile) {
+      axis_->set_speed_profile(profile.min_step_time, profile.max_step_time, profile.smoothness_factor);
+    }
+
+    // False if the valve took a slower min_step_time than candidate_ (its ramp table ends before it)
+    bool begin_trial() {
+      apply({candidate_, original_.max_step_time, original_.smoothness_factor});
+      if (axis_->get_speed_profile().min_step_time != candidate_) {
+        return false;
+      }
+      trial_start_ = axis_->get_health();
+      moves_left_ = kAutotuneMovesPerTrial;
+      trials_++;
+      return true;
+    }
+
+    void finish() {
+      if (best_ == 0) {
+        apply(original_);
+        state_ = protocol::kAutotuneFailed;
+      } else {
+        uint32_t min_step_time = (uint32_t)best_ * kAutotuneMarginPercent / 100;
+        if (min_step_time > original_.min_step_time) {
+          min_step_time = original_.min_step_time;
+        }
+        result_ = {(uint16_t)min_step_time, original_.max_step_time, original_.smoothness_factor};
+        apply(result_);
+        save_pending_ = true;
+        state_ = protocol::kAutotuneDone;
+      }
+      // The last trial may have lost steps after its last pass of home: re-home on the way back
+      axis_->home();
+      if (start_port_ < kNumValvePorts) {
+        axis_->set_position(start_port_);
+      }
+    }
+};
+
+static ValveAutotuner valve_autotuner;
+
+#endif // VALVE_AUTOTUNE_H
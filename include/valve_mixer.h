@@ -0,0 +1,117 @@
+#ifndef VALVE_MIXER_H
+#define VALVE_MIXER_H
+
+#include <Arduino.h>
+#include "protocol.h"
+
+constexpr uint32_t kMixCycleSteps = 2000; // pump steps per reagent A + reagent B slice pair, about 150 uL
+
+// ProgramStep::reagent_valve_id of a mixing step: kMixStepFlag | reagent_b << 3 | reagent_a
+inline bool is_mix_step(uint8_t reagent_valve_id) {
+    return reagent_valve_id != 0xff && (reagent_valve_id & protocol::kMixStepFlag);
+}
+
+inline uint8_t mix_reagent_a(uint8_t reagent_valve_id) {
+    return reagent_valve_id & 0x07;
+}
+
+inline uint8_t mix_reagent_b(uint8_t reagent_valve_id) {
+    return (reagent_valve_id >> 3) & 0x07;
+}
+
+class ValveMixer {
+  /*
+  Time-slicing proportioning of two reagents through the reagent valve. Each
+  cycle of kMixCycleSteps pump steps is split into a reagent A and a reagent B
+  slice. Pump steps are attributed to the port the pump draws from, and a slice
+  ends when the cumulative count reaches its target, less the steps the pump
+  still takes while stopping for the valve change. Any remaining overrun is
+  taken off the next slice, so the ratio converges on the target instead of
+  accumulating errors.
+  */
+  public:
+    // share_a: of reagent A in 1/kMixShareScale; total_steps: the pump's step count now
+    void start(uint8_t reagent_a, uint8_t reagent_b, uint16_t share_a, uint32_t total_steps) {
+      ports_[0] = reagent_a;
+      ports_[1] = reagent_b;
+      share_a_ = share_a < protocol::kMixShareScale ? float(share_a) / protocol::kMixShareScale : 1.0f;
+      steps_[0] = 0;
+      steps_[1] = 0;
+      switches_ = 0;
+      last_total_steps_ = total_steps;
+      cycle_end_ = kMixCycleSteps;
+      slice_ = 0;
+      active_ = true;
+      advance(0);
+    }
+
+    // Called every control tick; returns the port the reagent valve should be at
+    uint8_t update(uint32_t total_steps, uint8_t feeding_port, uint32_t stopping_steps) {
+      uint32_t delta = total_steps - last_total_steps_;
+      last_total_steps_ = total_steps;
+      if (feeding_port == ports_[0]) {
+        steps_[0] += delta;
+      } else if (feeding_port == ports_[1]) {
+        steps_[1] += delta;
+      }
+      advance(stopping_steps);
+      return ports_[slice_];
+    }
+
+    uint8_t port() const { return ports_[slice_]; }
+    void count_switch() { switches_++; }
+    void stop() { active_ = false; }
+    bool active() const { return active_; }
+    uint32_t steps_a() const { return steps_[0]; }
+    uint32_t steps_b() const { return steps_[1]; }
+    uint32_t switches() const { return switches_; }
+
+    void get_stats(uint8_t* buffer) const {
+      protocol::MixStatsWriter stats(buffer);
+      uint32_t total = steps_[0] + steps_[1];
+      stats.set_active(active_);
+      stats.set_reagent_a(ports_[0]);
+      stats.set_reagent_b(ports_[1]);
+      stats.clear_padding();
+      stats.set_target_share_a(share_a_);
+      stats.set_achieved_share_a(total > 0 ? float(steps_[0]) / total : 0.0f);
+      stats.set_steps_a(steps_[0]);
+      stats.set_steps_b(steps_[1]);
+      stats.set_switches(switches_);
+    }
+
+  private:
+    uint8_t ports_[2] = {0, 0};
+    float share_a_ = 0;
+    uint32_t steps_[2] = {0, 0};
+    uint32_t switches_ = 0;
+    uint32_t last_total_steps_ = 0;
+    uint32_t cycle_end_ = 0;   // cumulative step count at the end of the current cycle
+    uint8_t slice_ = 0;        // 0: reagent A, 1: reagent B
+    bool active_ = false;
+
+    // Moves on past every slice whose target is reached (empty slices of 0 % / 100 % mixes included)
+    void advance(uint32_t stopping_steps) {
+      // Near full speed the pump runs on for a large part of a slice; leave the rest to the compensation
+      if (stopping_steps > kMixCycleSteps / 4) {
+        stopping_steps = kMixCycleSteps / 4;
+      }
+      while (true) {
+        if (slice_ == 0) {
+          uint32_t target_a = lroundf(share_a_ * cycle_end_);
+          if (steps_[0] + stopping_steps < target_a) {
+            return;
+          }
+          slice_ = 1;
+        } else {
+          if (steps_[0] + steps_[1] + stopping_steps < cycle_end_) {
+            return;
+          }
+          cycle_end_ += kMixCycleSteps;
+          slice_ = 0;
+        }
+      }
+    }
+};
+
+#endif // VALVE_MIXER_H
@@ -6,6 +6,10 @@
 #include <LittleFS.h>
 #include "device.h"
 #include "program.h"
+#include "task_diagnostics.h"
+#include "run_log.h"
+#include "status_cache.h"
+#include "request_arena.h"
 
 // Deklaracja, że obiekty istnieją w innym pliku (main.cpp)
 extern ProgramExecutor program_executor;
@@ -15,40 +19,88 @@ extern ProgramLoader program_loader;
 // Tworzymy obiekt serwera na porcie 80 (standardowy port HTTP)
 AsyncWebServer server(80);
 
+// Dokument JSON w arenie zapytania (request_arena.h) zamiast na stercie
+using ArenaJsonDocument = BasicJsonDocument<ArenaJsonAllocator>;
+
+/**
+ * @brief Wysyła stały tekst bez kopiowania go do String na stercie.
+ */
+void send_text(AsyncWebServerRequest *request, int code, const char *text) {
+    request->send(code, "text/plain", (const uint8_t*)text, strlen(text));
+}
+
+/**
+ * @brief Przydziela zapytaniu arenę, zwalnianą dopiero po rozłączeniu klienta (odpowiedź jest
+ * wysyłana z areny już po powrocie z handlera). Gdy wszystkie są zajęte, odpowiada 503 i zwraca nullptr.
+ */
+RequestArena* acquire_request_arena(AsyncWebServerRequest *request) {
+    RequestArena* arena = request_arenas.acquire();
+    if (arena == nullptr) {
+        send_text(request, 503, "Error: Server busy.");
+        return nullptr;
+    }
+    // Jeden przechwycony wskaźnik mieści się w std::function bez alokacji
+    request->onDisconnect([arena]() { request_arenas.release(arena); });
+    return arena;
+}
+
+/**
+ * @brief Serializuje dokument do areny i wysyła go bez kopii na stercie.
+ */
+void send_json(AsyncWebServerRequest *request, RequestArena *arena, ArenaJsonDocument& doc) {
+    doc.shrinkToFit(); // oddaje arenie niewykorzystaną część dokumentu, na tekst odpowiedzi
+    size_t len = measureJson(doc);
+    char *text = (char*)arena->allocate(len + 1);
+    if (text == nullptr) {
+        send_text(request, 500, "Error: Response too large.");
+        return;
+    }
+    serializeJson(doc, text, len + 1);
+    request->send(200, "application/json", (const uint8_t*)text, len);
+}
+
 /**
  * @brief Obsługuje zapytanie o aktualny status urządzenia.
- * Zwraca dane w formacie JSON, dokładnie odzwierciedlając strukturę DeviceState.
+ * Wysyła JSON wyrenderowany przez pętlę sterującą (status_cache.h), bez budowania
+ * dokumentu - koszt nie rośnie z liczbą odpytujących klientów. Tekst jest kopiowany
+ * do areny zapytania: serwer wysyła go po powrocie z handlera, a slot w pamięci
+ * podręcznej może być w tym czasie nadpisany.
  */
+static_assert(kStatusJsonSize <= kRequestArenaSize, "status JSON must fit in a fresh request arena");
 void handle_get_status(AsyncWebServerRequest *request) {
-    StaticJsonDocument<512> doc;
-    
-    doc["pump_speed"] = device.device_state.pump_speed;
-    doc["pump_volume"] = device.device_state.pump_volume;
-    doc["program_step_idx"] = device.device_state.program_step_idx;
-    doc["device_state"] = device.device_state.device_state;
-    doc["reagent_valve_position"] = device.device_state.reagent_valve_position;
-    doc["reagent_valve_state"] = device.device_state.reagent_valve_state;
-    doc["column_valve_position"] = device.device_state.column_valve_position;
-    doc["column_valve_state"] = device.device_state.column_valve_state;
-    doc["running"] = device.device_state.running;
-    doc["program_step_progress"] = device.device_state.program_step_progress;
-
-    String output;
-    serializeJson(doc, output);
-    request->send(200, "application/json", output);
+    RequestArena *arena = acquire_request_arena(request);
+    if (arena == nullptr) {
+        return;
+    }
+    const StatusSnapshot& status = status_cache.front();
+    uint16_t len = status.json_len;
+    char *text = (char*)arena->allocate(len);
+    memcpy(text, status.json, len);
+    request->send(200, "application/json", (const uint8_t*)text, len);
+}
+
+/**
+ * @brief Kanał z opcjonalnego parametru "channel" (domyślnie 0), -1 jeśli nie istnieje.
+ */
+int request_channel(AsyncWebServerRequest *request) {
+    int channel = request->hasParam("channel", true) ? request->getParam("channel", true)->value().toInt() : 0;
+    return channel >= 0 && channel < device.num_channels() ? channel : -1;
 }
 
 /**
  * @brief Obsługuje ręczne ustawianie pozycji zaworów.
  */
 void handle_set_valves(AsyncWebServerRequest *request) {
-    if (request->hasParam("reagent_valve_id", true) && request->hasParam("column_valve_id", true)) {
+    int channel = request_channel(request);
+    if (channel < 0) {
+        send_text(request, 400, "Error: No such channel.");
+    } else if (request->hasParam("reagent_valve_id", true) && request->hasParam("column_valve_id", true)) {
         uint8_t reagent_id = request->getParam("reagent_valve_id", true)->value().toInt();
         uint8_t column_id = request->getParam("column_valve_id", true)->value().toInt();
-        device.set_valves(reagent_id, column_id);
-        request->send(200, "text/plain", "OK: Valve position set.");
+        device.channel(channel).set_valves(reagent_id, column_id);
+        send_text(request, 200, "OK: Valve position set.");
     } else {
-        request->send(400, "text/plain", "Error: Missing parameters.");
+        send_text(request, 400, "Error: Missing parameters.");
     }
 }
 
@@ -56,14 +108,17 @@ void handle_set_valves(AsyncWebServerRequest *request) {
  * @brief Obsługuje ręczne sterowanie pompą.
  */
 void handle_set_pump(AsyncWebServerRequest *request) {
-    if (request->hasParam("pump_cmd", true) && request->hasParam("acceleration", true)) {
+    int channel = request_channel(request);
+    if (channel < 0) {
+        send_text(request, 400, "Error: No such channel.");
+    } else if (request->hasParam("pump_cmd", true) && request->hasParam("acceleration", true)) {
         PumpCommand cmd;
         cmd.pump_cmd = request->getParam("pump_cmd", true)->value().toFloat();
         cmd.acceleration = request->getParam("acceleration", true)->value().toFloat();
-        device.set_pump(cmd);
-        request->send(200, "text/plain", "OK: Pump command sent.");
+        device.channel(channel).set_pump(cmd);
+        send_text(request, 200, "OK: Pump command sent.");
     } else {
-        request->send(400, "text/plain", "Error: Missing parameters.");
+        send_text(request, 400, "Error: Missing parameters.");
     }
 }
 
@@ -79,11 +134,18 @@ void handle_program_upload(AsyncWebServerRequest *request, uint8_t *data, size_t
         program_loader.reset();
     }
 
-    DynamicJsonDocument doc(4096); // Zwiększony bufor na program
-    DeserializationError error = deserializeJson(doc, (const char*)data);
+    // Arena tylko na czas tego fragmentu - kroki są od razu kopiowane do programu
+    RequestArena* arena = request_arenas.acquire();
+    if (arena == nullptr) {
+        send_text(request, 503, "Error: Server busy.");
+        return;
+    }
+    ArenaJsonDocument doc(4096, {arena}); // Zwiększony bufor na program
+    DeserializationError error = deserializeJson(doc, (const char*)data, len);
 
     if (error) {
-        request->send(400, "text/plain", "Invalid JSON");
+        request_arenas.release(arena);
+        send_text(request, 400, "Invalid JSON");
         return;
     }
 
@@ -98,7 +160,15 @@ void handle_program_upload(AsyncWebServerRequest *request, uint8_t *data, size_t
             new_step.flow_rate = step_json["pump_speed"];
             new_step.duration = (float)step_json["duration_ms"].as<uint32_t>() / 1000.0f;
             new_step.volume = INFINITY;
-            new_step.unused = 0;
+            // Opcjonalny liniowy gradient przepływu do end_pump_speed w czasie trwania kroku
+            new_step.ramp_end_flow = step_json.containsKey("end_pump_speed") ? encode_ramp_end_flow(step_json["end_pump_speed"].as<float>()) : 0;
+            // Opcjonalne mieszanie z drugim odczynnikiem przez przełączanie zaworu (mix_percent to udział mix_reagent)
+            if (step_json.containsKey("mix_reagent")) {
+                float share_b = constrain(step_json["mix_percent"].as<float>(), 0.0f, 100.0f) / 100.0f;
+                new_step.reagent_valve_id = protocol::kMixStepFlag | (step_json["mix_reagent"].as<uint8_t>() & 0x07) << 3 |
+                                            (new_step.reagent_valve_id & 0x07);
+                new_step.ramp_end_flow = (uint16_t)lroundf((1.0f - share_b) * protocol::kMixShareScale);
+            }
             step_valid = true;
         } 
         else if (strcmp(step_json["type"], "wait") == 0) {
@@ -107,7 +177,7 @@ void handle_program_upload(AsyncWebServerRequest *request, uint8_t *data, size_t
             new_step.flow_rate = 0.0f;
             new_step.duration = (float)step_json["duration_ms"].as<uint32_t>() / 1000.0f;
             new_step.volume = INFINITY;
-            new_step.unused = 0;
+            new_step.ramp_end_flow = 0;
             step_valid = true;
         }
 
@@ -116,11 +186,12 @@ void handle_program_upload(AsyncWebServerRequest *request, uint8_t *data, size_t
             program.write_at(current_len, &new_step);
         }
     }
+    request_arenas.release(arena);
 
     // Po otrzymaniu ostatniego fragmentu danych, wysyłamy odpowiedź i zapisujemy program do pliku
     if (index + len == total) {
         program.saveToFile(); // ZAPIS DO PAMIĘCI FLASH
-        request->send(200, "text/plain", "Program uploaded and saved successfully");
+        send_text(request, 200, "Program uploaded and saved successfully");
     }
 }
 
@@ -129,7 +200,7 @@ void handle_program_upload(AsyncWebServerRequest *request, uint8_t *data, size_t
  */
 void handle_program_run(AsyncWebServerRequest *request) {
     program_executor.execute();
-    request->send(200, "text/plain", "Program started");
+    send_text(request, 200, "Program started");
 }
 
 /**
@@ -137,7 +208,7 @@ void handle_program_run(AsyncWebServerRequest *request) {
  */
 void handle_program_stop(AsyncWebServerRequest *request) {
     program_executor.abort();
-    request->send(200, "text/plain", "Program stopped");
+    send_text(request, 200, "Program stopped");
 }
 
 /**
@@ -145,11 +216,15 @@ void handle_program_stop(AsyncWebServerRequest *request) {
  */
 void handle_get_program(AsyncWebServerRequest *request) {
     if (program.length() == 0) {
-        request->send(200, "application/json", "[]");
+        request->send(200, "application/json", (const uint8_t*)"[]", 2);
+        return;
+    }
+    RequestArena* arena = acquire_request_arena(request);
+    if (arena == nullptr) {
         return;
     }
 
-    DynamicJsonDocument doc(4096);
+    ArenaJsonDocument doc(4096, {arena});
     JsonArray steps_array = doc.to<JsonArray>();
 
     for (uint16_t i = 0; i < program.length(); i++) {
@@ -162,32 +237,41 @@ void handle_get_program(AsyncWebServerRequest *request) {
             step_json["duration_ms"] = (uint32_t)(step.duration * 1000.0f);
         } else {
             step_json["type"] = "flush";
-            step_json["reagent"] = step.reagent_valve_id;
+            bool mix = is_mix_step(step.reagent_valve_id);
+            step_json["reagent"] = mix ? mix_reagent_a(step.reagent_valve_id) : step.reagent_valve_id;
             step_json["column"] = step.column_valve_id;
             step_json["pump_speed"] = step.flow_rate;
+            if (mix) {
+                step_json["mix_reagent"] = mix_reagent_b(step.reagent_valve_id);
+                step_json["mix_percent"] = 100.0f - step.ramp_end_flow * 100.0f / protocol::kMixShareScale;
+            } else if (step.ramp_end_flow != 0) {
+                step_json["end_pump_speed"] = decode_ramp_end_flow(step.ramp_end_flow);
+            }
             step_json["duration_ms"] = (uint32_t)(step.duration * 1000.0f);
         }
     }
 
-    String output;
-    serializeJson(doc, output);
-    request->send(200, "application/json", output);
+    send_json(request, arena, doc);
 }
 
 /**
  * @brief Zwraca aktualną konfigurację reagentów w formacie JSON.
  */
 void handle_get_reagent_config(AsyncWebServerRequest *request) {
-    DynamicJsonDocument doc(1024);
+    RequestArena* arena = acquire_request_arena(request);
+    if (arena == nullptr) {
+        return;
+    }
+    ArenaJsonDocument doc(1024, {arena});
     JsonObject reagents_obj = doc.to<JsonObject>();
     
     for (int i = 0; i < Program::kMaxReagents; i++) {
-        reagents_obj[String(i + 1)] = String(program.reagents[i]);
+        char key[4];
+        snprintf(key, sizeof(key), "%d", i + 1);
+        reagents_obj[key] = program.reagents[i]; // char[] - ArduinoJson kopiuje do areny
     }
     
-    String output;
-    serializeJson(doc, output);
-    request->send(200, "application/json", output);
+    send_json(request, arena, doc);
 }
 
 /**
@@ -195,40 +279,120 @@ void handle_get_reagent_config(AsyncWebServerRequest *request) {
  */
 void handle_save_reagent_config(AsyncWebServerRequest *request) {
     if (request->hasParam("config", true)) {
-        String config_json = request->getParam("config", true)->value();
+        const String& config_json = request->getParam("config", true)->value();
+        RequestArena* arena = acquire_request_arena(request);
+        if (arena == nullptr) {
+            return;
+        }
         
-        DynamicJsonDocument doc(1024);
+        ArenaJsonDocument doc(1024, {arena});
         DeserializationError error = deserializeJson(doc, config_json);
         
         if (error) {
-            request->send(400, "text/plain", "Invalid JSON");
+            send_text(request, 400, "Invalid JSON");
             return;
         }
         
         // Aktualizuj nazwy reagentów
         for (int i = 0; i < Program::kMaxReagents; i++) {
-            String key = String(i + 1);
+            char key[4];
+            snprintf(key, sizeof(key), "%d", i + 1);
             if (doc.containsKey(key)) {
-                String reagent_name = doc[key].as<String>();
-                strncpy(program.reagents[i], reagent_name.c_str(), Program::kMaxReagentNameLen - 1);
+                const char *reagent_name = doc[key] | "";
+                strncpy(program.reagents[i], reagent_name, Program::kMaxReagentNameLen - 1);
                 program.reagents[i][Program::kMaxReagentNameLen - 1] = '\0'; // Zapewnij null-termination
             }
         }
         
         // Zapisz do pliku
         if (program.saveReagentConfigToFile()) {
-            request->send(200, "text/plain", "Reagent configuration saved successfully");
+            send_text(request, 200, "Reagent configuration saved successfully");
         } else {
-            request->send(500, "text/plain", "Failed to save reagent configuration");
+            send_text(request, 500, "Failed to save reagent configuration");
         }
     } else {
-        request->send(400, "text/plain", "Missing config parameter");
+        send_text(request, 400, "Missing config parameter");
     }
 }
 
+/**
+ * @brief Zwraca statystyki zadań FreeRTOS (udział CPU, zapas stosu) i sterty.
+ */
+void handle_get_task_diagnostics(AsyncWebServerRequest *request) {
+    HeapDiagnostics heap;
+    TaskDiagnostics tasks[kMaxDiagTasks];
+    int n = system_diagnostics.get(&heap, tasks, 0, kMaxDiagTasks);
+    RequestArena* arena = acquire_request_arena(request);
+    if (arena == nullptr) {
+        return;
+    }
+
+    ArenaJsonDocument doc(4096, {arena});
+    JsonObject heap_json = doc.createNestedObject("heap");
+    heap_json["free_bytes"] = heap.free_bytes;
+    heap_json["largest_free_block"] = heap.largest_free_block;
+    heap_json["min_free_bytes"] = heap.min_free_bytes;
+    heap_json["fragmentation"] = heap.fragmentation;
+
+    JsonArray tasks_array = doc.createNestedArray("tasks");
+    for (int i = 0; i < n; i++) {
+        JsonObject task_json = tasks_array.createNestedObject();
+        task_json["name"] = (const char*)tasks[i].name;
+        task_json["cpu_percent"] = tasks[i].cpu_permille / 10.0f;
+        task_json["priority"] = tasks[i].priority;
+        task_json["state"] = tasks[i].state;
+        task_json["stack_high_water"] = tasks[i].stack_high_water;
+    }
+
+    // Areny zapytań WWW: największe zajęcie i odmowy, gdy wszystkie były zajęte
+    JsonObject arenas_json = doc.createNestedObject("request_arenas");
+    arenas_json["size"] = kRequestArenaSize;
+    arenas_json["count"] = kRequestArenas;
+    arenas_json["in_use"] = request_arenas.in_use();
+    arenas_json["high_water"] = request_arenas.high_water();
+    arenas_json["busy_rejects"] = request_arenas.busy_rejects();
+
+    send_json(request, arena, doc);
+}
+/**
+ * @brief Zwraca podsumowanie dziennika przebiegów programu zapisanego na flash.
+ */
+void handle_get_run_log_info(AsyncWebServerRequest *request) {
+    RequestArena* arena = acquire_request_arena(request);
+    if (arena == nullptr) {
+        return;
+    }
+    ArenaJsonDocument doc(256, {arena});
+    doc["records"] = run_log.record_count();
+    doc["record_size"] = sizeof(RunLogRecord);
+    doc["dropped_records"] = run_log.dropped_records();
+    doc["first_segment"] = run_log.first_segment();
+    doc["last_segment"] = run_log.last_segment();
+
+    send_json(request, arena, doc);
+}
+
+/**
+ * @brief Wysyła cały dziennik przebiegów (rekordy RunLogRecord, od najstarszego) jako dane binarne.
+ */
+void handle_get_run_log(AsyncWebServerRequest *request) {
+    AsyncWebServerResponse *response = request->beginChunkedResponse("application/octet-stream",
+        [](uint8_t *buffer, size_t max_len, size_t index) -> size_t {
+            int max_records = max_len / sizeof(RunLogRecord);
+            if (max_records > kRunLogRecordsPerBlock) {
+                max_records = kRunLogRecordsPerBlock;
+            }
+            RunLogRecord records[kRunLogRecordsPerBlock];
+            int n = run_log.read_records(index / sizeof(RunLogRecord), records, max_records);
+            memcpy(buffer, records, n * sizeof(RunLogRecord));
+            return n * sizeof(RunLogRecord);
+        });
+    response->addHeader("Content-Disposition", "attachment; filename=runlog.bin");
+    request->send(response);
+}
 
 void handle_not_found(AsyncWebServerRequest *request) {
-    request->send(404, "text/plain", "Not found");
+    send_text(request, 404, "Not found");
 }
 
 /**
@@ -259,6 +423,13 @@ void setup_web_server() {
     server.on("/api/reagent-config/get", HTTP_GET, handle_get_reagent_config);
     server.on("/api/reagent-config/save", HTTP_POST, handle_save_reagent_config);
 
+    // Diagnostyka
+    server.on("/api/diag/tasks", HTTP_GET, handle_get_task_diagnostics);
+
+    // Dziennik przebiegów programu
+    server.on("/api/runlog/info", HTTP_GET, handle_get_run_log_info);
+    server.on("/api/runlog/get", HTTP_GET, handle_get_run_log);
+
     // --- Jawne serwowanie plików interfejsu ---
     server.on("/", HTTP_GET, [](AsyncWebServerRequest *request){
         request->send(LittleFS, "/index.html", "text/html");
@@ -1,8 +1,9 @@
+import math
 import yaml
-import struct
 from dataclasses import dataclass
 from typing import Dict, List, Union, Optional
 from enum import Enum
+import protocol
 
 class CommandType(Enum):
     FLUSH = "flush"
@@ -16,6 +17,52 @@ class ProgramStep:
     flow_rate: float
     volume: float # mL, use float infinity for unlimited volume
     duration: float # seconds, use float infinity for unlimited time
+    end_flow_rate: Optional[float] = None # mL/min reached at the end of duration (linear ramp), None for constant flow
+    mix_reagent_valve_id: Optional[int] = None # second reagent, time-sliced with reagent_valve_id through the reagent valve
+    mix_share: float = 0.0 # share of the mix reagent in the delivered volume, 0-1
+
+    def flow_at(self, t: float) -> float:
+        """Flow rate (mL/min) t seconds into the step"""
+        if not has_ramp(self.end_flow_rate, self.duration):
+            return self.flow_rate
+        return self.flow_rate + (self.end_flow_rate - self.flow_rate) * min(1.0, t / self.duration)
+
+    def time_to_volume(self) -> float:
+        """Seconds until volume is delivered, inf if duration ends the step first (or never)"""
+        return time_to_volume(self.flow_rate, self.end_flow_rate, self.duration, self.volume)
+
+
+def encode_ramp_end_flow(end_flow_rate: Optional[float]) -> int:
+    """ProgramStep.ramp_end_flow of the device format; 0 is constant flow"""
+    if end_flow_rate is None:
+        return 0
+    limit = (protocol.RAMP_FLOW_OFFSET - 1) / protocol.RAMP_FLOW_SCALE
+    return protocol.RAMP_FLOW_OFFSET + round(max(-limit, min(limit, end_flow_rate)) * protocol.RAMP_FLOW_SCALE)
+
+
+def decode_ramp_end_flow(ramp_end_flow: int) -> Optional[float]:
+    if ramp_end_flow == 0:
+        return None
+    return (ramp_end_flow - protocol.RAMP_FLOW_OFFSET) / protocol.RAMP_FLOW_SCALE
+
+
+def has_ramp(end_flow_rate: Optional[float], duration: float) -> bool:
+    # The ramp runs over duration; without a finite one the start flow rate is kept
+    return end_flow_rate is not None and not math.isinf(duration) and duration > 0
+
+
+def time_to_volume(flow_rate: float, end_flow_rate: Optional[float], duration: float, volume: float) -> float:
+    """Seconds until volume (mL) is delivered at a constant or linearly ramped flow rate (mL/min)"""
+    if math.isinf(volume):
+        return math.inf
+    c = volume * 60.0
+    k = (end_flow_rate - flow_rate) / (2 * duration) if has_ramp(end_flow_rate, duration) else 0.0
+    # Smallest positive root of k t^2 + flow_rate t - c = 0, in the form that is stable for k -> 0
+    disc = flow_rate * flow_rate + 4 * k * c
+    if disc < 0 or flow_rate + math.sqrt(disc) <= 0:
+        return math.inf
+    t = 2 * c / (flow_rate + math.sqrt(disc))
+    return t if k == 0 or t <= duration else math.inf
 
 @dataclass
 class FlushStep:
@@ -25,6 +72,9 @@ class FlushStep:
     flow_rate: float
     volume: Optional[str] = None  # e.g., "20ml"
     duration: Optional[str] = None    # e.g., "20m"
+    end_flow_rate: Optional[str] = None  # e.g., "4ml/min": ramp from flow_rate over duration
+    mix_reagent: Optional[str] = None  # e.g., "reagent_b": mixed into reagent by valve time-slicing
+    mix_percent: float = 0.0           # share of mix_reagent, e.g. 70
 
 @dataclass
 class SleepStep:
@@ -40,11 +90,11 @@ class Program:
 
 class ProgramConverter:
     """Converts YAML programs to device-compatible format"""
-    max_steps_per_block = 5
-    max_reagents = 6
-    max_columns = 6
-    max_reagent_name_len = 40
-    max_column_name_len = 40
+    max_steps_per_block = protocol.MAX_PROGRAM_STEPS_PER_BLOCK
+    max_reagents = protocol.MAX_REAGENTS
+    max_columns = protocol.MAX_COLUMNS
+    max_reagent_name_len = protocol.MAX_NAME_LEN
+    max_column_name_len = protocol.MAX_NAME_LEN
     
     def __init__(self):
         self.reagent_map = {}
@@ -69,7 +119,10 @@ class ProgramConverter:
                     column=flush_data['column'],
                     flow_rate=flush_data['flow_rate'],
                     volume=flush_data.get('volume'),
-                    duration=flush_data.get('duration')
+                    duration=flush_data.get('duration'),
+                    end_flow_rate=flush_data.get('end_flow_rate'),
+                    mix_reagent=flush_data.get('mix_reagent'),
+                    mix_percent=float(str(flush_data.get('mix_percent', 0)).rstrip('%'))
                 )
                 steps.append(step)
             elif 'sleep' in step_data:
@@ -189,13 +242,18 @@ class ProgramConverter:
                 # Parse duration and volume
                 duration = ProgramConverter._parse_time(step.duration) if step.duration else float('inf')
                 volume = ProgramConverter._parse_volume(step.volume) if step.volume else float('inf')
+                end_flow_rate = ProgramConverter._parse_flow_rate(str(step.end_flow_rate)) if step.end_flow_rate is not None else None
+                mix_valve = ProgramConverter._get_reagent_valve(step.mix_reagent, reagents) if step.mix_reagent else None
                 
                 device_step = ProgramStep(
                     reagent_valve_id=reagent_valve,
                     column_valve_id=column_valve,
                     flow_rate=pump_cmd,
                     duration=duration,
-                    volume=volume
+                    volume=volume,
+                    end_flow_rate=end_flow_rate,
+                    mix_reagent_valve_id=mix_valve,
+                    mix_share=step.mix_percent / 100.0
                 )
                 device_steps.append(device_step)
                 
@@ -214,6 +272,28 @@ class ProgramConverter:
         
         return device_steps
     
+    @staticmethod
+    def pack_step(step: ProgramStep) -> bytes:
+        reagent = step.reagent_valve_id
+        param = encode_ramp_end_flow(step.end_flow_rate)
+        if step.mix_reagent_valve_id is not None:
+            # Mixing steps carry the share of the first reagent where ramps carry the end flow rate
+            if step.end_flow_rate is not None:
+                raise ValueError("a step cannot both ramp its flow rate and mix reagents")
+            reagent = protocol.MIX_STEP_FLAG | step.mix_reagent_valve_id << 3 | step.reagent_valve_id
+            param = round(min(1.0, max(0.0, 1.0 - step.mix_share)) * protocol.MIX_SHARE_SCALE)
+        return protocol.PROGRAM_STEP.pack(reagent, step.column_valve_id, param, step.flow_rate, step.volume, step.duration)
+
+    @staticmethod
+    def unpack_step(record) -> ProgramStep:
+        """ProgramStep from a PROGRAM_STEP record"""
+        if record.reagent_valve_id != 0xff and record.reagent_valve_id & protocol.MIX_STEP_FLAG:
+            return ProgramStep(record.reagent_valve_id & 0x07, record.column_valve_id, record.flow_rate, record.volume,
+                               record.duration, mix_reagent_valve_id=(record.reagent_valve_id >> 3) & 0x07,
+                               mix_share=1.0 - record.ramp_end_flow / protocol.MIX_SHARE_SCALE)
+        return ProgramStep(record.reagent_valve_id, record.column_valve_id, record.flow_rate, record.volume,
+                           record.duration, end_flow_rate=decode_ramp_end_flow(record.ramp_end_flow))
+
     def convert_to_raw_bytes(self, program: Program) -> List[bytes]:
         """Convert program to raw bytes for device transmission. The data is split into blocks."""
         device_steps = program.steps
@@ -222,16 +302,7 @@ class ProgramConverter:
         raw_data = b''
         block_idx = 0
         for step in device_steps:
-            # Pack as little-endian: reagent_valve_id(1), column_valve_id(1), flow_rate(4), duration(4), volume(4)
-            step_bytes = struct.pack('<BBBBfff',
-                                   step.reagent_valve_id,
-                                   step.column_valve_id,
-                                   0,
-                                   0,
-                                   step.flow_rate,
-                                   step.volume,
-                                   step.duration)
-            raw_data += step_bytes
+            raw_data += self.pack_step(step)
             block_idx += 1
             if block_idx == self.max_steps_per_block:
                 raw_data_blocks.append(raw_data)
@@ -245,17 +316,8 @@ class ProgramConverter:
         """Convert raw bytes to program"""
         steps = []
         for block in raw_data:
-            for i in range(0, len(block), 16):  # Each step is 16 bytes
-                step_bytes = block[i:i+16]
-                if len(step_bytes) == 16:
-                    step = struct.unpack('<BBBBfff', step_bytes)
-                    steps.append(ProgramStep(
-                        reagent_valve_id=step[0],
-                        column_valve_id=step[1],
-                        flow_rate=step[4],
-                        volume=step[5],
-                        duration=step[6]
-                    ))
+            for step in protocol.PROGRAM_STEP.iter_unpack(block):
+                steps.append(self.unpack_step(step))
         return Program(reagents=reagents, columns=columns, steps=steps)
     
     def print_program_details(self, program: Program):
@@ -0,0 +1,190 @@
+"""Generated by protocol/codegen.py from protocol/protocol.yaml. Do not edit."""
+
+import struct
+from collections import namedtuple
+from enum import IntEnum
+
+START_SEQUENCE = b'\x21\x37'
+
+MAX_REAGENTS = 6
+MAX_COLUMNS = 6
+MAX_NAME_LEN = 40
+MAX_PROGRAM_STEPS_PER_BLOCK = 5
+DIAG_TASK_NAME_LEN = 12
+FRAMING_START_SEQUENCE = 0
+FRAMING_COBS = 1
+FRAMING_COBS_TAGGED = 2
+MAX_STREAM_STEPS_PER_FRAME = 15
+UNDERRUN_HOLD = 0
+UNDERRUN_STOP = 1
+STREAM_IDLE = 0
+STREAM_RUNNING = 1
+STREAM_HOLDING = 2
+STREAM_FINISHED = 3
+STREAM_STOPPED = 4
+RAMP_FLOW_OFFSET = 32768
+RAMP_FLOW_SCALE = 1000
+MIX_STEP_FLAG = 128
+MIX_SHARE_SCALE = 10000
+AUTOTUNE_IDLE = 0
+AUTOTUNE_RUNNING = 1
+AUTOTUNE_DONE = 2
+AUTOTUNE_FAILED = 3
+JITTER_SOURCE_PUMP = 0
+JITTER_SOURCE_VALVE = 1
+JITTER_SOURCE_CONTROL = 2
+STEP_TIMER_ESP_TIMER = 0
+STEP_TIMER_HARDWARE = 1
+PULSATION_BINS = 32
+PULSATION_OFFSET = 32768
+PULSATION_SCALE = 10000
+PULSATION_MAX_CORRECTION = 5000
+
+
+class Command(IntEnum):
+    PING = 0
+    SET_VALVES = 1
+    SET_PUMP = 2
+    GET_WEIGHT = 3
+    INIT_PROGRAM_WRITE = 4
+    WRITE_PROGRAM_BLOCK = 5
+    EXECUTE_PROGRAM = 6
+    READ_PROGRAM_BLOCK = 7
+    GET_PROGRAM_LENGTH = 8
+    GET_REAGENTS = 9
+    GET_COLUMNS = 10
+    SET_REAGENTS = 11
+    SET_COLUMNS = 12
+    ABORT_PROGRAM = 13
+    GET_DEVICE_STATE = 14
+    TARE_WEIGHT_SENSOR = 15
+    GET_TASK_DIAGNOSTICS = 16
+    GET_TRANSITION_STATS = 17
+    READ_RUN_LOG = 18
+    GET_COMMAND_STATS = 19
+    SET_FRAMING = 20
+    START_STREAM = 21
+    STREAM_STEPS = 22
+    END_STREAM = 23
+    GET_MIX_STATS = 24
+    GET_CHANNEL_STATES = 25
+    SET_CHANNEL_VALVES = 26
+    SET_CHANNEL_PUMP = 27
+    GET_VALVE_STATS = 28
+    AUTOTUNE_VALVE = 29
+    GET_STEP_JITTER = 30
+    SET_PULSATION = 31
+    GET_PULSATION = 32
+
+
+class Layout:
+    """A fixed-size record. unpack() and iter_unpack() read straight from bytes,
+    bytearray or memoryview at an offset, without slicing copies."""
+
+    def __init__(self, name, fmt, fields):
+        self.name = name
+        self.struct = struct.Struct(fmt)
+        self.size = self.struct.size
+        self.fields = fields
+        self.record = namedtuple(name, fields)
+
+    def unpack(self, buffer, offset=0):
+        return self.record._make(self.struct.unpack_from(buffer, offset))
+
+    def iter_unpack(self, buffer, offset=0):
+        """Records from offset to the end of buffer; a trailing partial record is ignored"""
+        view = memoryview(buffer)[offset:]
+        view = view[:len(view) - len(view) % self.size]
+        return (self.record._make(values) for values in self.struct.iter_unpack(view))
+
+    def pack(self, *args, **kwargs):
+        if kwargs:
+            return self.struct.pack(*self.record(*args, **kwargs))
+        return self.struct.pack(*args)
+
+    def pack_into(self, buffer, offset, *args):
+        self.struct.pack_into(buffer, offset, *args)
+
+
+class CommandSpec:
+    def __init__(self, command, request, request_items, response, response_items):
+        self.command = command
+        self.request = request
+        self.request_items = request_items
+        self.response = response
+        self.response_items = response_items
+
+
+ACK = Layout('Ack', '<B', ('code',))
+VALVE_COMMAND = Layout('ValveCommand', '<BB', ('reagent_valve_id', 'column_valve_id'))
+PUMP_COMMAND = Layout('PumpCommand', '<ff', ('pump_cmd', 'acceleration'))
+PROGRAM_STEP = Layout('ProgramStep', '<BBHfff', ('reagent_valve_id', 'column_valve_id', 'ramp_end_flow', 'flow_rate', 'volume', 'duration'))
+PROGRAM_BLOCK_REQUEST = Layout('ProgramBlockRequest', '>HH', ('first_step', 'n_steps'))
+PROGRAM_LENGTH = Layout('ProgramLength', '>HH', ('length', 'max_length'))
+REAGENT_NAMES = Layout('ReagentNames', '<240s', ('names',))
+COLUMN_NAMES = Layout('ColumnNames', '<240s', ('names',))
+TARE_REQUEST = Layout('TareRequest', '<B', ('channel',))
+DEVICE_STATE = Layout('DeviceState', '<ffHBBBBBBBBB1x', ('pump_speed', 'pump_volume', 'program_step_idx', 'device_state', 'reagent_valve_position', 'reagent_valve_state', 'column_valve_position', 'column_valve_state', 'running', 'program_step_progress', 'num_pumps', 'num_valves'))
+CHANNEL_VALVE_COMMAND = Layout('ChannelValveCommand', '<BBB', ('channel', 'reagent_valve_id', 'column_valve_id'))
+CHANNEL_PUMP_COMMAND = Layout('ChannelPumpCommand', '<B3xff', ('channel', 'pump_cmd', 'acceleration'))
+CHANNEL_STATES_SUMMARY = Layout('ChannelStatesSummary', '<BBB1x', ('num_channels', 'num_pumps', 'num_valves'))
+CHANNEL_STATE = Layout('ChannelState', '<ffBBBBBBBB', ('pump_speed', 'pump_volume', 'device_state', 'reagent_valve_position', 'reagent_valve_state', 'column_valve_position', 'column_valve_state', 'pump', 'reagent_valve', 'column_valve'))
+VALVE_REQUEST = Layout('ValveRequest', '<B', ('valve',))
+VALVE_STATS = Layout('ValveStats', '<BBBBIIIiHHI', ('valve', 'autotune_state', 'autotune_valve', 'autotune_trials', 'home_passes', 'drift_events', 'missed_homes', 'last_drift', 'min_step_time', 'max_step_time', 'smoothness_factor'))
+STEP_JITTER_REQUEST = Layout('StepJitterRequest', '<B', ('reset',))
+STEP_JITTER_SUMMARY = Layout('StepJitterSummary', '<BBBBI', ('num_records', 'control_core', 'network_core', 'step_timer', 'late_threshold_us'))
+STEP_JITTER_RECORD = Layout('StepJitterRecord', '<BBB1xIfII', ('source', 'axis', 'core', 'samples', 'mean_us', 'max_us', 'late'))
+PULSATION_REQUEST = Layout('PulsationRequest', '<B', ('pump',))
+SET_PULSATION_REQUEST = Layout('SetPulsationRequest', '<BBH', ('pump', 'enabled', 'phase'))
+PULSATION_TABLE = Layout('PulsationTable', '<BBB1xHHH', ('pump', 'enabled', 'num_bins', 'steps_per_revolution', 'phase', 'rotor_position'))
+PULSATION_BIN = Layout('PulsationBin', '<H', ('delay',))
+TASK_DIAGNOSTICS_REQUEST = Layout('TaskDiagnosticsRequest', '<B', ('first_task',))
+HEAP_DIAGNOSTICS = Layout('HeapDiagnostics', '<IIIBB2x', ('free_bytes', 'largest_free_block', 'min_free_bytes', 'fragmentation', 'num_tasks'))
+TASK_DIAGNOSTICS = Layout('TaskDiagnostics', '<12sHBBI', ('name', 'cpu_permille', 'priority', 'state', 'stack_high_water'))
+TRANSITION_STATS = Layout('TransitionStats', '<IIII', ('last_transition_ms', 'last_overlap_ms', 'total_overlap_ms', 'transitions'))
+RUN_LOG_REQUEST = Layout('RunLogRequest', '>I', ('first_record',))
+RUN_LOG_RECORD = Layout('RunLogRecord', '<BBHIIff', ('type', 'flags', 'step_idx', 'run_id', 'time_ms', 'volume', 'overshoot'))
+SET_FRAMING_REQUEST = Layout('SetFramingRequest', '<B', ('framing',))
+STREAM_START_REQUEST = Layout('StreamStartRequest', '<B', ('underrun_policy',))
+STREAM_STEPS_REQUEST = Layout('StreamStepsRequest', '<I', ('first_step',))
+STREAM_STATUS = Layout('StreamStatus', '<BBHIII', ('state', 'underrun_policy', 'credits', 'received', 'started', 'underruns'))
+MIX_STATS = Layout('MixStats', '<BBB1xffIII', ('active', 'reagent_a', 'reagent_b', 'target_share_a', 'achieved_share_a', 'steps_a', 'steps_b', 'switches'))
+COMMAND_STATS_REQUEST = Layout('CommandStatsRequest', '<B', ('first_command',))
+COMMAND_STATS_SUMMARY = Layout('CommandStatsSummary', '<B3xI', ('num_commands', 'unknown_commands'))
+COMMAND_STATS_RECORD = Layout('CommandStatsRecord', '<B3xIIIII', ('command_id', 'calls', 'errors', 'min_us', 'avg_us', 'max_us'))
+
+COMMANDS = {
+    Command.PING: CommandSpec(Command.PING, None, None, ACK, None),
+    Command.SET_VALVES: CommandSpec(Command.SET_VALVES, VALVE_COMMAND, None, ACK, None),
+    Command.SET_PUMP: CommandSpec(Command.SET_PUMP, PUMP_COMMAND, None, ACK, None),
+    Command.GET_WEIGHT: CommandSpec(Command.GET_WEIGHT, None, None, ACK, None),
+    Command.INIT_PROGRAM_WRITE: CommandSpec(Command.INIT_PROGRAM_WRITE, None, None, ACK, None),
+    Command.WRITE_PROGRAM_BLOCK: CommandSpec(Command.WRITE_PROGRAM_BLOCK, None, PROGRAM_STEP, ACK, None),
+    Command.EXECUTE_PROGRAM: CommandSpec(Command.EXECUTE_PROGRAM, None, None, ACK, None),
+    Command.READ_PROGRAM_BLOCK: CommandSpec(Command.READ_PROGRAM_BLOCK, PROGRAM_BLOCK_REQUEST, None, None, PROGRAM_STEP),
+    Command.GET_PROGRAM_LENGTH: CommandSpec(Command.GET_PROGRAM_LENGTH, None, None, PROGRAM_LENGTH, None),
+    Command.GET_REAGENTS: CommandSpec(Command.GET_REAGENTS, None, None, REAGENT_NAMES, None),
+    Command.GET_COLUMNS: CommandSpec(Command.GET_COLUMNS, None, None, COLUMN_NAMES, None),
+    Command.SET_REAGENTS: CommandSpec(Command.SET_REAGENTS, REAGENT_NAMES, None, ACK, None),
+    Command.SET_COLUMNS: CommandSpec(Command.SET_COLUMNS, COLUMN_NAMES, None, ACK, None),
+    Command.ABORT_PROGRAM: CommandSpec(Command.ABORT_PROGRAM, None, None, ACK, None),
+    Command.GET_DEVICE_STATE: CommandSpec(Command.GET_DEVICE_STATE, None, None, DEVICE_STATE, None),
+    Command.TARE_WEIGHT_SENSOR: CommandSpec(Command.TARE_WEIGHT_SENSOR, TARE_REQUEST, None, ACK, None),
+    Command.GET_TASK_DIAGNOSTICS: CommandSpec(Command.GET_TASK_DIAGNOSTICS, TASK_DIAGNOSTICS_REQUEST, None, HEAP_DIAGNOSTICS, TASK_DIAGNOSTICS),
+    Command.GET_TRANSITION_STATS: CommandSpec(Command.GET_TRANSITION_STATS, None, None, TRANSITION_STATS, None),
+    Command.READ_RUN_LOG: CommandSpec(Command.READ_RUN_LOG, RUN_LOG_REQUEST, None, None, RUN_LOG_RECORD),
+    Command.GET_COMMAND_STATS: CommandSpec(Command.GET_COMMAND_STATS, COMMAND_STATS_REQUEST, None, COMMAND_STATS_SUMMARY, COMMAND_STATS_RECORD),
+    Command.SET_FRAMING: CommandSpec(Command.SET_FRAMING, SET_FRAMING_REQUEST, None, ACK, None),
+    Command.START_STREAM: CommandSpec(Command.START_STREAM, STREAM_START_REQUEST, None, STREAM_STATUS, None),
+    Command.STREAM_STEPS: CommandSpec(Command.STREAM_STEPS, STREAM_STEPS_REQUEST, PROGRAM_STEP, STREAM_STATUS, None),
+    Command.END_STREAM: CommandSpec(Command.END_STREAM, None, None, STREAM_STATUS, None),
+    Command.GET_MIX_STATS: CommandSpec(Command.GET_MIX_STATS, None, None, MIX_STATS, None),
+    Command.GET_CHANNEL_STATES: CommandSpec(Command.GET_CHANNEL_STATES, None, None, CHANNEL_STATES_SUMMARY, CHANNEL_STATE),
+    Command.SET_CHANNEL_VALVES: CommandSpec(Command.SET_CHANNEL_VALVES, CHANNEL_VALVE_COMMAND, None, ACK, None),
+    Command.SET_CHANNEL_PUMP: CommandSpec(Command.SET_CHANNEL_PUMP, CHANNEL_PUMP_COMMAND, None, ACK, None),
+    Command.GET_VALVE_STATS: CommandSpec(Command.GET_VALVE_STATS, VALVE_REQUEST, None, VALVE_STATS, None),
+    Command.AUTOTUNE_VALVE: CommandSpec(Command.AUTOTUNE_VALVE, VALVE_REQUEST, None, ACK, None),
+    Command.GET_STEP_JITTER: CommandSpec(Command.GET_STEP_JITTER, STEP_JITTER_REQUEST, None, STEP_JITTER_SUMMARY, STEP_JITTER_RECORD),
+    Command.SET_PULSATION: CommandSpec(Command.SET_PULSATION, SET_PULSATION_REQUEST, PULSATION_BIN, ACK, None),
+    Command.GET_PULSATION: CommandSpec(Command.GET_PULSATION, PULSATION_REQUEST, None, PULSATION_TABLE, PULSATION_BIN),
+}
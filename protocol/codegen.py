@@ -0,0 +1,392 @@
+#!/usr/bin/env python3
+"""
+Generates the protocol codecs from protocol/protocol.yaml:
+
+  include/protocol.h  packed views / writers over frame data, command ids,
+                      the command dispatch table and layout checks against
+                      the firmware structs
+  protocol.py         command ids and struct-based layouts for the host tools
+
+usage: python protocol/codegen.py [--check]
+
+With --check nothing is written; the exit status is 1 if a generated file is
+out of date with the schema.
+"""
+
+import argparse
+import os
+import sys
+
+import yaml
+
+ROOT = os.path.join(os.path.dirname(os.path.abspath(__file__)), '..')
+SCHEMA = os.path.join(ROOT, 'protocol', 'protocol.yaml')
+CPP_OUTPUT = os.path.join(ROOT, 'include', 'protocol.h')
+PY_OUTPUT = os.path.join(ROOT, 'protocol.py')
+
+HEADER_NOTE = "Generated by protocol/codegen.py from protocol/protocol.yaml. Do not edit."
+
+# type: (size, C++ type, struct format character)
+TYPES = {
+    'u8': (1, 'uint8_t', 'B'),
+    'u16': (2, 'uint16_t', 'H'),
+    'u32': (4, 'uint32_t', 'I'),
+    'i32': (4, 'int32_t', 'i'),
+    'f32': (4, 'float', 'f'),
+}
+
+
+class Field:
+    def __init__(self, spec, offset, constants):
+        self.name = spec['name']
+        self.type = spec['type']
+        self.offset = offset
+        if self.type in ('bytes', 'pad'):
+            self.size = evaluate(spec['len'], constants)
+        elif self.type in TYPES:
+            self.size = TYPES[self.type][0]
+        else:
+            raise ValueError(f"unknown field type {self.type}")
+
+    @property
+    def cpp_type(self):
+        return TYPES[self.type][1]
+
+    def struct_format(self):
+        if self.type == 'bytes':
+            return f"{self.size}s"
+        if self.type == 'pad':
+            return f"{self.size}x"
+        return TYPES[self.type][2]
+
+
+class Layout:
+    def __init__(self, name, spec, constants):
+        self.name = name
+        self.endian = spec.get('endian', 'little')
+        self.cpp_struct = spec.get('cpp_struct')
+        self.fields = []
+        offset = 0
+        for field_spec in spec['fields']:
+            field = Field(field_spec, offset, constants)
+            if self.endian == 'big' and field.type == 'f32':
+                raise ValueError(f"{name}.{field.name}: big endian floats are not supported")
+            self.fields.append(field)
+            offset += field.size
+        self.size = offset
+
+    @property
+    def data_fields(self):
+        return [f for f in self.fields if f.type != 'pad']
+
+    def struct_format(self):
+        return ('>' if self.endian == 'big' else '<') + ''.join(f.struct_format() for f in self.fields)
+
+
+class Command:
+    def __init__(self, spec, layouts):
+        self.id = spec['id']
+        self.name = spec['name']
+        for key in ('request', 'request_items', 'response', 'response_items'):
+            layout = spec.get(key)
+            if layout is not None and layout not in layouts:
+                raise ValueError(f"{self.name}: unknown layout {layout}")
+            setattr(self, key, layouts[layout] if layout else None)
+
+
+def evaluate(expression, constants):
+    """Sizes are integers or products of schema constants, e.g. max_reagents * max_name_len"""
+    if isinstance(expression, int):
+        return expression
+    value = 1
+    for term in str(expression).split('*'):
+        term = term.strip()
+        value *= int(term) if term.isdigit() else constants[term]
+    return value
+
+
+def load_schema(path=SCHEMA):
+    with open(path, 'r') as file:
+        schema = yaml.safe_load(file)
+    constants = schema.get('constants', {})
+    layouts = {name: Layout(name, spec, constants) for name, spec in schema['layouts'].items()}
+    commands = sorted((Command(spec, layouts) for spec in schema['commands']), key=lambda c: c.id)
+    ids = [c.id for c in commands]
+    if len(set(ids)) != len(ids):
+        raise ValueError("duplicate command id")
+    return constants, layouts, commands
+
+
+def camel(name):
+    return ''.join(part.capitalize() for part in name.split('_'))
+
+
+# --- C++ ---
+
+def cpp_layout(layout):
+    load = 'load_be' if layout.endian == 'big' else 'load_le'
+    store = 'store_be' if layout.endian == 'big' else 'store_le'
+    size = f"{layout.size} byte{'s' if layout.size != 1 else ''}"
+    lines = [f"// {layout.name}: {size}, {layout.endian} endian",
+             f"class {layout.name}View {{",
+             "  public:",
+             f"    static constexpr size_t kSize = {layout.size};",
+             f"    explicit {layout.name}View(const uint8_t* data) : data_(data) {{}}"]
+    for f in layout.data_fields:
+        if f.type == 'bytes':
+            lines.append(f"    const uint8_t* {f.name}() const {{ return data_ + {f.offset}; }} // {f.size} bytes")
+        else:
+            lines.append(f"    {f.cpp_type} {f.name}() const {{ return {load}<{f.cpp_type}>(data_ + {f.offset}); }}")
+    lines += ["  private:",
+              "    const uint8_t* data_;",
+              "};",
+              "",
+              f"class {layout.name}Writer {{",
+              "  public:",
+              f"    static constexpr size_t kSize = {layout.size};",
+              f"    explicit {layout.name}Writer(uint8_t* data) : data_(data) {{}}"]
+    for f in layout.data_fields:
+        if f.type == 'bytes':
+            lines.append(f"    uint8_t* {f.name}() {{ return data_ + {f.offset}; }} // {f.size} bytes")
+        else:
+            lines.append(f"    void set_{f.name}({f.cpp_type} value) {{ {store}<{f.cpp_type}>(data_ + {f.offset}, value); }}")
+    for f in layout.fields:
+        if f.type == 'pad':
+            lines.append(f"    void clear_{f.name}() {{ memset(data_ + {f.offset}, 0, {f.size}); }}")
+    lines += ["  private:",
+              "    uint8_t* data_;",
+              "};",
+              ""]
+    return lines
+
+
+def cpp_layout_checks(layouts):
+    checks = []
+    for layout in layouts.values():
+        if not layout.cpp_struct:
+            continue
+        s = layout.cpp_struct
+        checks.append(f"  static_assert(sizeof({s}) == protocol::{layout.name}View::kSize, "
+                      f"\"{s} does not match the {layout.name} layout\");")
+        for f in layout.data_fields:
+            checks.append(f"  static_assert(offsetof({s}, {f.name}) == {f.offset}, \"{s}::{f.name} offset\");")
+    return " \\\n".join(["#define PROTOCOL_ASSERT_LAYOUTS()"] + checks)
+
+
+def generate_cpp(constants, layouts, commands):
+    n_ids = commands[-1].id + 1
+    out = [f"// {HEADER_NOTE}",
+           "#ifndef PROTOCOL_H",
+           "#define PROTOCOL_H",
+           "",
+           "#include <stddef.h>",
+           "#include <stdint.h>",
+           "#include <string.h>",
+           "",
+           "namespace protocol {",
+           ""]
+    for name, value in constants.items():
+        out.append(f"constexpr int k{camel(name)} = {value};")
+    out += ["",
+            "enum CommandId : uint8_t {"]
+    for c in commands:
+        out.append(f"  CMD_{c.name.upper()} = {c.id},")
+    out += ["};",
+            f"constexpr int kNumCommandIds = {n_ids};",
+            "",
+            "// Unaligned little-endian access: both the ESP32 and the hosts are little-endian, and a",
+            "// fixed-size memcpy compiles to plain loads and stores (no library call, no struct copy).",
+            "template <typename T>",
+            "inline T load_le(const uint8_t* p) {",
+            "  T value;",
+            "  memcpy(&value, p, sizeof(T));",
+            "  return value;",
+            "}",
+            "",
+            "template <typename T>",
+            "inline void store_le(uint8_t* p, T value) {",
+            "  memcpy(p, &value, sizeof(T));",
+            "}",
+            "",
+            "template <typename T>",
+            "inline T load_be(const uint8_t* p) {",
+            "  T value = 0;",
+            "  for (size_t i = 0; i < sizeof(T); i++) {",
+            "    value = (T)((value << 8) | p[i]);",
+            "  }",
+            "  return value;",
+            "}",
+            "",
+            "template <typename T>",
+            "inline void store_be(uint8_t* p, T value) {",
+            "  for (size_t i = 0; i < sizeof(T); i++) {",
+            "    p[sizeof(T) - 1 - i] = (uint8_t)(value >> (8 * i));",
+            "  }",
+            "}",
+            ""]
+    for layout in layouts.values():
+        out += cpp_layout(layout)
+
+    request_sizes = ['0'] * n_ids
+    request_item_sizes = ['0'] * n_ids
+    for c in commands:
+        request_sizes[c.id] = str(c.request.size) if c.request else '0'
+        request_item_sizes[c.id] = str(c.request_items.size) if c.request_items else '0'
+    table = [f"  {{{i}, 0, nullptr}}," for i in range(n_ids)]
+    for c in commands:
+        table[c.id] = f"  {{CMD_{c.name.upper()}, {c.request.size if c.request else 0}, &Handlers::on_{c.name}}},"
+    out += ["// Fixed part of each request's data, by command id",
+            f"constexpr int kRequestSize[kNumCommandIds] = {{{', '.join(request_sizes)}}};",
+            "// Size of the records repeated after the fixed part, 0 if there are none",
+            f"constexpr int kRequestItemSize[kNumCommandIds] = {{{', '.join(request_item_sizes)}}};",
+            "",
+            "enum DispatchResult : uint8_t {",
+            "  DISPATCH_OK,",
+            "  DISPATCH_UNKNOWN_COMMAND,",
+            "  DISPATCH_SHORT_REQUEST,  // less data than the fixed part of the request, handler not called",
+            "};",
+            "",
+            "// A handler is only called with at least min_length bytes of request data",
+            "template <typename Handlers>",
+            "struct CommandDescriptor {",
+            "  uint8_t id;",
+            "  uint16_t min_length;",
+            "  void (Handlers::*handler)(const uint8_t* data, int length);",
+            "};",
+            "",
+            "// Indexed by command id, unassigned ids have no handler",
+            "template <typename Handlers>",
+            "constexpr CommandDescriptor<Handlers> kCommandTable[kNumCommandIds] = {"]
+    out += table
+    out += ["};",
+            "",
+            "// Calls handlers.on_<command>(data, length) through kCommandTable",
+            "template <typename Handlers>",
+            "DispatchResult dispatch_command(Handlers& handlers, uint8_t command_id, const uint8_t* data, int length) {",
+            "  if (command_id >= kNumCommandIds || kCommandTable<Handlers>[command_id].handler == nullptr) {",
+            "    return DISPATCH_UNKNOWN_COMMAND;",
+            "  }",
+            "  const CommandDescriptor<Handlers>& command = kCommandTable<Handlers>[command_id];",
+            "  if (length < command.min_length) {",
+            "    return DISPATCH_SHORT_REQUEST;",
+            "  }",
+            "  (handlers.*command.handler)(data, length);",
+            "  return DISPATCH_OK;",
+            "}",
+            "",
+            "} // namespace protocol",
+            "",
+            "// Expand where the firmware structs are visible to check them against the schema layouts",
+            cpp_layout_checks(layouts),
+            "",
+            "#endif // PROTOCOL_H",
+            ""]
+    return "\n".join(out)
+
+
+# --- Python ---
+
+PY_RUNTIME = '''
+class Layout:
+    """A fixed-size record. unpack() and iter_unpack() read straight from bytes,
+    bytearray or memoryview at an offset, without slicing copies."""
+
+    def __init__(self, name, fmt, fields):
+        self.name = name
+        self.struct = struct.Struct(fmt)
+        self.size = self.struct.size
+        self.fields = fields
+        self.record = namedtuple(name, fields)
+
+    def unpack(self, buffer, offset=0):
+        return self.record._make(self.struct.unpack_from(buffer, offset))
+
+    def iter_unpack(self, buffer, offset=0):
+        """Records from offset to the end of buffer; a trailing partial record is ignored"""
+        view = memoryview(buffer)[offset:]
+        view = view[:len(view) - len(view) % self.size]
+        return (self.record._make(values) for values in self.struct.iter_unpack(view))
+
+    def pack(self, *args, **kwargs):
+        if kwargs:
+            return self.struct.pack(*self.record(*args, **kwargs))
+        return self.struct.pack(*args)
+
+    def pack_into(self, buffer, offset, *args):
+        self.struct.pack_into(buffer, offset, *args)
+
+
+class CommandSpec:
+    def __init__(self, command, request, request_items, response, response_items):
+        self.command = command
+        self.request = request
+        self.request_items = request_items
+        self.response = response
+        self.response_items = response_items
+'''
+
+
+def generate_py(constants, layouts, commands):
+    out = [f'"""{HEADER_NOTE}"""',
+           "",
+           "import struct",
+           "from collections import namedtuple",
+           "from enum import IntEnum",
+           "",
+           "START_SEQUENCE = b'\\x21\\x37'",
+           ""]
+    for name, value in constants.items():
+        out.append(f"{name.upper()} = {value}")
+    out += ["", "", "class Command(IntEnum):"]
+    for c in commands:
+        out.append(f"    {c.name.upper()} = {c.id}")
+    out.append("")
+    out += PY_RUNTIME.split("\n")
+    out.append("")
+    for layout in layouts.values():
+        fields = ", ".join(f"'{f.name}'" for f in layout.data_fields)
+        trailing = "," if len(layout.data_fields) == 1 else ""
+        var = ''.join('_' + ch if ch.isupper() and i else ch for i, ch in enumerate(layout.name)).upper()
+        out.append(f"{var} = Layout('{layout.name}', '{layout.struct_format()}', ({fields}{trailing}))")
+    out += ["", "COMMANDS = {"]
+    for c in commands:
+        def ref(layout):
+            if layout is None:
+                return "None"
+            return ''.join('_' + ch if ch.isupper() and i else ch for i, ch in enumerate(layout.name)).upper()
+        out.append(f"    Command.{c.name.upper()}: CommandSpec(Command.{c.name.upper()}, {ref(c.request)}, "
+                   f"{ref(c.request_items)}, {ref(c.response)}, {ref(c.response_items)}),")
+    out += ["}", ""]
+    return "\n".join(out)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Generate protocol codecs from protocol/protocol.yaml")
+    parser.add_argument('--check', action='store_true', help="only check that the generated files are up to date")
+    args = parser.parse_args()
+
+    constants, layouts, commands = load_schema()
+    outputs = {CPP_OUTPUT: generate_cpp(constants, layouts, commands),
+               PY_OUTPUT: generate_py(constants, layouts, commands)}
+    stale = []
+    for path, content in outputs.items():
+        current = None
+        if os.path.exists(path):
+            with open(path, 'r') as file:
+                current = file.read()
+        if current == content:
+            continue
+        stale.append(os.path.relpath(path, ROOT))
+        if not args.check:
+            with open(path, 'w') as file:
+                file.write(content)
+    if args.check and stale:
+        print(f"out of date with protocol/protocol.yaml: {', '.join(stale)}", file=sys.stderr)
+        return 1
+    for path in stale:
+        print(f"generated {path}")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
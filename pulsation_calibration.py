@@ -0,0 +1,220 @@
+#!/usr/bin/env python3
+"""
+Pulsation compensation tables of the pumps (see include/pulsation_compensation.h).
+
+usage: python pulsation_calibration.py learn /dev/ttyACM0 --balance /dev/ttyUSB0 [--pump 0] [--flow 2.0] [-o table.json] [--apply]
+       python pulsation_calibration.py apply /dev/ttyACM0 table.json [--pump 0] [--phase STEPS | --align --balance /dev/ttyUSB0]
+       python pulsation_calibration.py show /dev/ttyACM0 [--pump 0]
+       python pulsation_calibration.py off /dev/ttyACM0 [--pump 0]
+
+learn pumps at constant flow with the compensation off, reads the mass from a
+balance that streams its readings as text lines (e.g. "   12.345 g"; set it to
+its fastest rate and least filtering) and polls the pump's rotor position, both
+timestamped on this host. The mass moved per step, averaged over the steps of
+each bin of rotor positions, relative to the mean, gives the bin's correction:
+steps that move more liquid are taken more slowly.
+
+The rotor has no index sensor, so rotor positions count steps since the device
+booted and a learned table has phase 0 in that boot only. After a restart,
+apply a stored table with --align: a short learn run finds the shift at which
+the stored table matches the pulsation best, so a long, well averaged learn run
+can be kept across restarts.
+"""
+
+import argparse
+import bisect
+import json
+import re
+import sys
+import threading
+import time
+from typing import List, Optional, Sequence, Tuple
+
+from device_connection import DeviceConnection
+from protocol import PULSATION_BINS, PULSATION_SCALE, PULSATION_MAX_CORRECTION
+
+NUMBER = re.compile(rb'[-+]?\d+(?:\.\d+)?')
+
+
+def unwrap(positions: Sequence[Tuple[float, int]], steps_per_revolution: int) -> List[Tuple[float, int]]:
+    """Rotor positions (modulo a revolution) as steps since the first sample; the pump turns forward
+    by less than half a revolution between polls"""
+    unwrapped = []
+    total = 0
+    for i, (t, position) in enumerate(positions):
+        if i > 0:
+            total += (position - positions[i - 1][1]) % steps_per_revolution
+        unwrapped.append((t, total))
+    return unwrapped
+
+
+def learn_corrections(masses: Sequence[Tuple[float, float]], positions: Sequence[Tuple[float, int]],
+                      steps_per_revolution: int, bins: int = PULSATION_BINS) -> List[int]:
+    """Corrections (1/PULSATION_SCALE of the step delay) from balance readings (t, mass) and rotor
+    position polls (t, position), with the rotor position 0 at the start of the first bin"""
+    start = positions[0][1]
+    track = unwrap(positions, steps_per_revolution)
+    steps_per_bin = steps_per_revolution // bins
+    mass_per_bin = [0.0] * bins
+    steps_in_bin = [0] * bins
+
+    times = [t for t, _ in track]
+
+    def steps_at(t: float) -> Optional[float]:
+        i = bisect.bisect_right(times, t)
+        if i == 0 or i == len(track):
+            return track[-1][1] if i == len(track) and t == times[-1] else None
+        (t0, p0), (t1, p1) = track[i - 1], track[i]
+        return p0 + (p1 - p0) * (t - t0) / (t1 - t0)
+
+    samples = [(steps_at(t), mass) for t, mass in masses]
+    samples = [(p, mass) for p, mass in samples if p is not None]
+    # The mass delta between two readings is spread evenly over the steps taken in between
+    for (p0, m0), (p1, m1) in zip(samples, samples[1:]):
+        first, last = round(p0), round(p1)
+        if last <= first:
+            continue
+        per_step = (m1 - m0) / (last - first)
+        for step in range(first, last):
+            b = (start + step) % steps_per_revolution // steps_per_bin
+            mass_per_bin[b] += per_step
+            steps_in_bin[b] += 1
+    if min(steps_in_bin) == 0:
+        raise ValueError("the run did not cover every bin, pump longer")
+    per_step = [m / n for m, n in zip(mass_per_bin, steps_in_bin)]
+    mean = sum(per_step) / bins
+    if mean <= 0:
+        raise ValueError("the balance saw no flow")
+    return balanced([round((v / mean - 1) * PULSATION_SCALE) for v in per_step])
+
+
+def balanced(corrections: List[int]) -> List[int]:
+    """Clipped to PULSATION_MAX_CORRECTION and adding up to zero, as the device requires: the remainder
+    goes to the bins with most room"""
+    corrections = [max(-PULSATION_MAX_CORRECTION, min(PULSATION_MAX_CORRECTION, c)) for c in corrections]
+    remainder = sum(corrections)
+    while remainder != 0:
+        sign = 1 if remainder > 0 else -1
+        i = min(range(len(corrections)), key=lambda i: sign * corrections[i])
+        share = sign * min(abs(remainder), PULSATION_MAX_CORRECTION + sign * corrections[i])
+        corrections[i] -= share
+        remainder -= share
+    return corrections
+
+
+def align_phase(stored: Sequence[int], fresh: Sequence[int], steps_per_revolution: int) -> int:
+    """Phase (steps) at which stored, learned in another boot, lines up with fresh, learned now with phase 0"""
+    bins = len(stored)
+    best = max(range(bins), key=lambda shift: sum(stored[i] * fresh[(i + shift) % bins] for i in range(bins)))
+    return best * steps_per_revolution // bins
+
+
+class Balance:
+    """Readings of a balance streaming text lines, timestamped on arrival"""
+
+    def __init__(self, port: str, baudrate: int, lag: float):
+        import serial
+        self.serial = serial.Serial(port, baudrate, timeout=0.5)
+        self.lag = lag
+        self.readings: List[Tuple[float, float]] = []
+        self._stop = threading.Event()
+        self._thread = threading.Thread(target=self._run, daemon=True)
+
+    def _run(self):
+        while not self._stop.is_set():
+            line = self.serial.readline()
+            t = time.monotonic() - self.lag
+            match = NUMBER.search(line)
+            if match:
+                self.readings.append((t, float(match.group())))
+
+    def __enter__(self):
+        self.serial.reset_input_buffer()
+        self._thread.start()
+        return self
+
+    def __exit__(self, *exc):
+        self._stop.set()
+        self._thread.join()
+        self.serial.close()
+
+
+def learn(conn: DeviceConnection, args) -> List[int]:
+    """Pump args.seconds at args.flow with the compensation off (pump index = channel index) and learn the table"""
+    table = conn.get_pulsation(args.pump)
+    conn.set_pulsation(args.pump, [0] * PULSATION_BINS, 0, enabled=False)
+    positions = []
+    with Balance(args.balance, args.balance_baud, args.balance_lag_ms / 1000.0) as balance:
+        conn.channel_pump_command(args.pump, args.flow, 10.0)
+        try:
+            time.sleep(1.0)  # up to speed
+            start = time.monotonic()
+            while time.monotonic() - start < args.seconds:
+                positions.append((time.monotonic(), conn.get_pulsation(args.pump)['rotor_position']))
+                time.sleep(args.poll_interval)
+        finally:
+            conn.channel_pump_command(args.pump, 0.0, 10.0)
+        readings = [r for r in balance.readings if positions[0][0] <= r[0] <= positions[-1][0]]
+    return learn_corrections(readings, positions, table['steps_per_revolution'])
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Learn, load or show the pulsation compensation of a pump")
+    parser.add_argument('action', choices=['learn', 'apply', 'show', 'off'])
+    parser.add_argument('port', help="device serial port")
+    parser.add_argument('table', nargs='?', help="apply: table file written by learn -o")
+    parser.add_argument('--pump', type=int, default=0)
+    parser.add_argument('--flow', type=float, default=2.0, help="learn: mL/min")
+    parser.add_argument('--seconds', type=float, default=120.0, help="learn: time at constant flow")
+    parser.add_argument('--poll-interval', type=float, default=0.02, help="learn: rotor position polls, s")
+    parser.add_argument('--balance', help="balance serial port")
+    parser.add_argument('--balance-baud', type=int, default=9600)
+    parser.add_argument('--balance-lag-ms', type=float, default=0.0, help="delay of the balance's readings")
+    parser.add_argument('--phase', type=int, help="apply: phase of the table in this boot, steps")
+    parser.add_argument('--align', action='store_true', help="apply: find the phase with a short learn run")
+    parser.add_argument('--apply', action='store_true', help="learn: load the table into the device")
+    parser.add_argument('-o', '--output', help="learn: write the table to this file")
+    args = parser.parse_args()
+
+    conn = DeviceConnection(args.port)
+    conn.open()
+    try:
+        if args.action == 'show':
+            print(json.dumps(conn.get_pulsation(args.pump), indent=2))
+        elif args.action == 'off':
+            table = conn.get_pulsation(args.pump)
+            return 0 if conn.set_pulsation(args.pump, table['corrections'], table['phase'], enabled=False) else 1
+        elif args.action == 'learn':
+            if not args.balance:
+                parser.error("learn needs --balance")
+            corrections = learn(conn, args)
+            print(json.dumps({'corrections': corrections}))
+            if args.output:
+                with open(args.output, 'w') as file:
+                    json.dump({'corrections': corrections, 'learned': time.strftime('%Y-%m-%d %H:%M:%S')}, file)
+            if args.apply and not conn.set_pulsation(args.pump, corrections, 0):
+                print("the device refused the table", file=sys.stderr)
+                return 1
+        elif args.action == 'apply':
+            if not args.table:
+                parser.error("apply needs a table file")
+            with open(args.table) as file:
+                corrections = json.load(file)['corrections']
+            phase = args.phase or 0
+            if args.align:
+                if not args.balance:
+                    parser.error("--align needs --balance")
+                args.seconds = min(args.seconds, 20.0)
+                steps_per_revolution = conn.get_pulsation(args.pump)['steps_per_revolution']
+                phase = align_phase(corrections, learn(conn, args), steps_per_revolution)
+                print(f"phase: {phase} steps")
+            if not conn.set_pulsation(args.pump, corrections, phase):
+                print("the device refused the table", file=sys.stderr)
+                return 1
+    finally:
+        conn.close()
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
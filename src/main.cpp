@@ -9,6 +9,15 @@
 #include "connection.h"
 #include "wifi_setup.h"
 #include "web_server.h"
+#include "task_diagnostics.h"
+#include "run_log.h"
+#include "status_cache.h"
+#include "valve_autotune.h"
+#include "core_affinity.h"
+#include "step_jitter.h"
+#ifndef LEGACY_CORE_LAYOUT
+#include "step_timer.h"
+#endif
 
 SerialConnection connection;
 Program program;
@@ -17,29 +26,117 @@ ProgramExecutor program_executor(&program);
 
 TaskHandle_t Task_Communication_Handle = NULL;
 TaskHandle_t Task_DeviceControlLoop_Handle = NULL;
+TaskHandle_t Task_Diagnostics_Handle = NULL;
+TaskHandle_t Task_RunLog_Handle = NULL;
+TaskHandle_t Task_Expander_Handle = NULL;
 
-esp_timer_handle_t pump_step_timer_handle = nullptr;
-esp_timer_handle_t reagent_valve_step_timer_handle = nullptr;
-esp_timer_handle_t column_valve_step_timer_handle = nullptr;
+#ifdef LEGACY_CORE_LAYOUT
+// Jeden timer esp_timer na każdą oś z DeviceConfig; arg to indeks osi. Wywołania
+// przychodzą z zadania esp_timer na Rdzeniu 0, razem z Wi-Fi
+esp_timer_handle_t pump_step_timer_handles[kMaxPumps] = {nullptr};
+esp_timer_handle_t valve_step_timer_handles[kMaxValves] = {nullptr};
+int64_t pump_step_due_us[kMaxPumps] = {0};
+int64_t valve_step_due_us[kMaxValves] = {0};
 
 static void IRAM_ATTR pump_step_timer_callback(void* arg) {
-  uint32_t next_delay = device.pump.step();
-  esp_timer_start_once(pump_step_timer_handle, next_delay);
+  uint32_t i = (uint32_t)arg;
+  int64_t now = esp_timer_get_time();
+  pump_step_jitter[i].record(now > pump_step_due_us[i] ? now - pump_step_due_us[i] : 0);
+  uint32_t next_delay = step_pump_axis(i);
+  pump_step_due_us[i] = now + next_delay;
+  esp_timer_start_once(pump_step_timer_handles[i], next_delay);
 }
 
-static void IRAM_ATTR reagent_valve_step_timer_callback(void* arg) {
-  uint32_t next_delay = device.reagent_valve.update();
-  esp_timer_start_once(reagent_valve_step_timer_handle, next_delay);
+static void IRAM_ATTR valve_step_timer_callback(void* arg) {
+  uint32_t i = (uint32_t)arg;
+  int64_t now = esp_timer_get_time();
+  valve_step_jitter[i].record(now > valve_step_due_us[i] ? now - valve_step_due_us[i] : 0);
+  uint32_t next_delay = update_valve_axis(i);
+  valve_step_due_us[i] = now + next_delay;
+  esp_timer_start_once(valve_step_timer_handles[i], next_delay);
 }
 
-static void IRAM_ATTR column_valve_step_timer_callback(void* arg) {
-  uint32_t next_delay = device.column_valve.update();
-  esp_timer_start_once(column_valve_step_timer_handle, next_delay);
+static void start_step_timers() {
+  for (uint8_t i = 0; i < device.num_pumps(); i++) {
+    esp_timer_create_args_t pump_timer_args = {
+      .callback = &pump_step_timer_callback,
+      .arg = (void*)(uint32_t)i,
+      .name = "pump_step_timer"
+    };
+    esp_timer_create(&pump_timer_args, &pump_step_timer_handles[i]);
+    pump_step_due_us[i] = esp_timer_get_time() + 10000;
+    esp_timer_start_once(pump_step_timer_handles[i], 10000);
+  }
+  for (uint8_t i = 0; i < device.num_valves(); i++) {
+    esp_timer_create_args_t valve_timer_args = {
+      .callback = &valve_step_timer_callback,
+      .arg = (void*)(uint32_t)i,
+      .name = "valve_step_timer"
+    };
+    esp_timer_create(&valve_timer_args, &valve_step_timer_handles[i]);
+    valve_step_due_us[i] = esp_timer_get_time() + 10000;
+    esp_timer_start_once(valve_step_timer_handles[i], 10000);
+  }
+}
+#else
+// Sprzętowe timery krokowe: po jednym na pompę, jeden wspólny dla zaworów.
+// Przerwania trafiają na rdzeń, który je uzbraja - tu Rdzeń sterowania (patrz core_affinity.h)
+StepTimer pump_step_timers[kMaxPumps];
+StepTimer valve_step_timer;
+
+static void start_step_timers() {
+  const timer_group_t pump_groups[kMaxPumps] = {TIMER_GROUP_0, TIMER_GROUP_0};
+  const timer_idx_t pump_timers[kMaxPumps] = {TIMER_0, TIMER_1};
+  for (uint8_t i = 0; i < device.num_pumps(); i++) {
+    pump_step_timers[i].begin(pump_groups[i], pump_timers[i], &step_pump_axis, i, 1, &pump_step_jitter[i], 10000);
+  }
+  valve_step_timer.begin(TIMER_GROUP_1, TIMER_0, &update_valve_axis, 0, device.num_valves(), valve_step_jitter, 10000);
 }
+#endif
 
-// Zadanie do obsługi komunikacji (Serial) - uruchamiane na Rdzeniu 1
+// Kroki pomp przy stałej prędkości z LEDC, liczone przez PCNT (pulse_output.h): timer krokowy pompy
+// przerywa wtedy tylko raz na okres pętli sterującej, a rampy nadal idą programowo
+PulseOutput pump_pulse_outputs[kMaxPumps];
+
+// Próg PCNT: pompa kanału 0 osiągnęła objętość kroku programu - budzi pętlę sterującą przed taktem
+static void IRAM_ATTR on_step_volume_reached() {
+  BaseType_t woken = pdFALSE;
+  vTaskNotifyGiveFromISR(Task_DeviceControlLoop_Handle, &woken);
+  portYIELD_FROM_ISR(woken);
+}
+
+static void start_pulse_outputs() {
+  for (uint8_t i = 0; i < device.num_pumps(); i++) {
+    PumpAxis* pump = device.pump_axis(i);
+    pump_pulse_outputs[i].begin(pump->step_pin(), (ledc_timer_t)(LEDC_TIMER_0 + i), (ledc_channel_t)(LEDC_CHANNEL_0 + i),
+                                (pcnt_unit_t)(PCNT_UNIT_0 + i), pump == &device.pump ? &on_step_volume_reached : nullptr);
+    pump->attach_pulse_output(&pump_pulse_outputs[i]);
+  }
+}
+
+#ifdef IO_EXPANDER
+// Zmiana wejścia ekspandera (INTA/INTB): odczyt przez I2C robi Task_Expander, nie przerwanie
+static void IRAM_ATTR expander_interrupt() {
+  io_expander.on_interrupt();
+  BaseType_t woken = pdFALSE;
+  vTaskNotifyGiveFromISR(Task_Expander_Handle, &woken);
+  portYIELD_FROM_ISR(woken);
+}
+
+// Obsługa ekspandera I/O - Rdzeń sterowania, bo steruje liniami zaworów. Wejścia zaraz po przerwaniu, wyjścia
+// (zbuforowane w rejestrach cienia) co najwyżej 1 ms po zmianie, jedną transmisją I2C
+void Task_Expander(void *pvParameters) {
+  while (1) {
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(1));
+    io_expander.service();
+    io_expander.flush();
+  }
+}
+#endif
+
+// Zadanie do obsługi komunikacji (Serial) - na Rdzeniu sieci (kNetworkCore), z dala od sterowania.
+// receive_packet() śpi, gdy UART jest pusty, więc IDLE0 (watchdog) i zadania o priorytecie 0 dostają czas
 void Task_Communication(void *pvParameters) {
-  connection.init();
   while (1) {
     handle_communication(connection, program, program_loader, program_executor);
     // Dajemy szansę innym zadaniom na tym rdzeniu (np. web server)
@@ -47,46 +144,68 @@ void Task_Communication(void *pvParameters) {
   }
 }
 
-// Główne zadanie sterujące logiką urządzenia - uruchamiane na Rdzeniu 0
+// Główne zadanie sterujące logiką urządzenia - na Rdzeniu sterowania (kControlCore).
+// Timery krokowe i PCNT uzbrajane stąd, więc ich przerwania też są na tym rdzeniu
 void Task_DeviceControlLoop(void *pvParameters) {
-  device.pump.enable();
-  
-  esp_timer_create_args_t pump_timer_args = {
-    .callback = &pump_step_timer_callback,
-    .arg = nullptr,
-    .name = "pump_step_timer"
-  };
-  esp_timer_create(&pump_timer_args, &pump_step_timer_handle);
-  esp_timer_start_once(pump_step_timer_handle, 10000);
-
-  esp_timer_create_args_t reagent_valve_timer_args = {
-    .callback = &reagent_valve_step_timer_callback,
-    .arg = nullptr,
-    .name = "reagent_valve_step_timer"
-  };
-  esp_timer_create(&reagent_valve_timer_args, &reagent_valve_step_timer_handle);
-  esp_timer_start_once(reagent_valve_step_timer_handle, 10000);
-
-  esp_timer_create_args_t column_valve_timer_args = {
-    .callback = &column_valve_step_timer_callback,
-    .arg = nullptr,
-    .name = "column_valve_step_timer"
-  };
-  esp_timer_create(&column_valve_timer_args, &column_valve_step_timer_handle);
-  esp_timer_start_once(column_valve_step_timer_handle, 10000);
+  for (uint8_t i = 0; i < device.num_pumps(); i++) {
+    device.pump_axis(i)->enable();
+  }
+  start_pulse_outputs();
+  start_step_timers();
 
+  TickType_t last_wake = xTaskGetTickCount();
+  int64_t last_tick_us = esp_timer_get_time();
   while (1) {
     // Kluczowe operacje sterujące w jednej pętli
-    device.pump.update_speed(); 
+    device.update_speed();
     device.update();
     handle_execution(program, program_executor);
-    
-    vTaskDelay(pdMS_TO_TICKS(10));
+    valve_autotuner.update(device, program_executor.is_running()); // przerywany, gdy program zajmie zawory
+    status_cache.update(device); // odpowiedzi statusu renderowane raz na takt, nie na zapytanie
+
+    // Stały okres 10 ms niezależnie od czasu pracy pętli; odchyłka okresu do statystyk.
+    // Powiadomienie z progu PCNT (objętość kroku) kończy krok od razu, bez czekania na takt:
+    // wtedy tylko wykonawca programu i FSM kanałów, bez ramp (update_speed liczy na stały okres)
+    TickType_t next_wake = last_wake + pdMS_TO_TICKS(10);
+    TickType_t now_ticks;
+    while ((int32_t)(next_wake - (now_ticks = xTaskGetTickCount())) > 0) {
+      if (ulTaskNotifyTake(pdTRUE, next_wake - now_ticks) > 0) {
+        handle_execution(program, program_executor);
+        device.update();
+      }
+    }
+    last_wake = next_wake;
+    int64_t now = esp_timer_get_time();
+    control_tick_jitter.record(abs((int32_t)(now - last_tick_us - 10000)));
+    last_tick_us = now;
   }
 }
 
+// Okresowe próbkowanie statystyk zadań i sterty - niski priorytet, Rdzeń sieci
+void Task_Diagnostics(void *pvParameters) {
+  while (1) {
+    system_diagnostics.sample();
+    vTaskDelay(pdMS_TO_TICKS(kDiagSamplePeriodMs));
+  }
+}
+
+// Zapis dziennika przebiegów na flash w paczkach, poza pętlą sterującą - Rdzeń sieci
+void Task_RunLog(void *pvParameters) {
+  unsigned long last_flush = millis();
+  while (1) {
+    bool force = millis() - last_flush >= kRunLogFlushPeriodMs;
+    run_log.flush(force);
+    valve_autotuner.persist(); // profil zaworu do NVS po zakończonym strojeniu
+    if (force) {
+      run_log.compact(); // najstarsze segmenty ponad limit -> archiwum podsumowań przebiegów
+      last_flush = millis();
+    }
+    vTaskDelay(pdMS_TO_TICKS(100));
+  }
+}
 
 void setup() {
+  Serial.setTxBufferSize(kUartTxBufferSize); // przed begin(): sterownik UART przyjmuje rozmiar bufora TX tylko przy instalacji
   Serial.begin(115200);
 
   if(!LittleFS.begin(true)){
@@ -94,9 +213,29 @@ void setup() {
       return;
   }
   
+#ifdef IO_EXPANDER
+  // Ekspander przed osiami: ich linie enable i krańcówek mogą być na nim
+  Wire.begin(kExpanderSdaPin, kExpanderSclPin, 400000);
+  if (!io_expander.begin(Wire)) {
+    Serial.println("MCP23017 I/O expander not responding");
+  }
+  xTaskCreatePinnedToCore(
+    Task_Expander,
+    "Task_Expander",
+    2048,
+    NULL,
+    3, // Wyżej niż komunikacja: wyjścia ekspandera sterują zaworami
+    &Task_Expander_Handle,
+    kControlCore);
+  pinMode(kExpanderIntPin, INPUT);
+  attachInterrupt(digitalPinToInterrupt(kExpanderIntPin), expander_interrupt, FALLING);
+#endif
+
   device.initialize();
+  valve_profile_store.apply(device); // profile prędkości zaworów ze strojenia, jeśli zapisane
   program.loadFromFile();
   program.loadReagentConfigFromFile();
+  run_log.begin();
 
   setup_wifi();
   setup_web_server();
@@ -112,7 +251,7 @@ void setup() {
   }
 
 
-  // Przypisanie zadań do odpowiednich rdzeni
+  // Przypisanie zadań do rdzeni - patrz core_affinity.h
   xTaskCreatePinnedToCore(
     Task_Communication,
     "Task_Communication",
@@ -120,7 +259,7 @@ void setup() {
     NULL,
     1, // Priorytet 1
     &Task_Communication_Handle,
-    1); // <-- Uruchom na Rdzeniu 1 (dla komunikacji)
+    kNetworkCore); // <-- Komunikacja razem z Wi-Fi i serwerem WWW
 
   xTaskCreatePinnedToCore(
     Task_DeviceControlLoop,
@@ -129,7 +268,25 @@ void setup() {
     NULL,
     2, // Wyższy priorytet 2 dla pętli sterującej
     &Task_DeviceControlLoop_Handle,
-    0); // <-- Uruchom na Rdzeniu 0 (dla sterowania w czasie rzeczywistym)
+    kControlCore); // <-- Rdzeń bez Wi-Fi (dla sterowania w czasie rzeczywistym)
+
+  xTaskCreatePinnedToCore(
+    Task_Diagnostics,
+    "Task_Diagnostics",
+    4096,
+    NULL,
+    0, // Najniższy priorytet, tylko statystyki
+    &Task_Diagnostics_Handle,
+    kNetworkCore);
+
+  xTaskCreatePinnedToCore(
+    Task_RunLog,
+    "Task_RunLog",
+    4096,
+    NULL,
+    0,
+    &Task_RunLog_Handle,
+    kNetworkCore); // zapisy na flash poza rdzeniem sterowania
 }
 
 void loop() {